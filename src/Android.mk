@@ -16,7 +16,7 @@ HEAD_COMMIT = `git rev-parse --short HEAD`
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := iodine
-LOCAL_SRC_FILES := tun.c dns.c read.c encoding.c login.c base32.c base64.c base64u.c base128.c md5.c common.c iodine.c client.c util.c
+LOCAL_SRC_FILES := tun.c dns.c read.c encoding.c login.c base32.c base64.c base64u.c base128.c md5.c common.c compress.c vj.c bundle.c window.c timer.c iodine.c client.c util.c congest.c resolver.c
 LOCAL_CFLAGS    := -c -DANDROID -DLINUX -DIFCONFIGPATH=\"/system/bin/\" -Wall -DGITREVISION=\"$(HEAD_COMMIT)\"
 LOCAL_LDLIBS    := -lz
 
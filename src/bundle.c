@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "bundle.h"
+
+int
+bundle_add(char *buf, unsigned long *len, unsigned long size,
+	   const char *part, unsigned long partlen, int compressed)
+/* Append part to the bundle of len bytes in buf, which is started if
+   len is 0. Returns -1 if part is empty, too large, or does not fit
+   in size bytes. */
+{
+	unsigned char *p = (unsigned char *) buf + *len;
+	unsigned long need = 2 + partlen;
+
+	if (*len == 0)
+		need++;
+	if (partlen == 0 || partlen > BUNDLE_PART_MAX || *len + need > size)
+		return -1;
+
+	if (*len == 0)
+		*p++ = BUNDLE_TYPE;
+	p[0] = (compressed ? 0x80 : 0) | (partlen >> 8);
+	p[1] = partlen & 0xff;
+	memcpy(p + 2, part, partlen);
+	*len += need;
+	return 0;
+}
+
+int
+bundle_is(const char *data, unsigned long len)
+/* Whether uncompressed tunnel packet data is a bundle */
+{
+	return len > 0 && data[0] == BUNDLE_TYPE;
+}
+
+int
+bundle_next(char *buf, unsigned long len, unsigned long *off,
+	    char **part, unsigned long *partlen, int *compressed)
+/* Get the part at *off of the bundle in buf, start with *off = 0.
+   Returns 1 and moves *off to the next part, 0 at the end and -1
+   if the bundle is broken. */
+{
+	unsigned char *p;
+
+	if (*off == 0)
+		*off = 1;
+	if (*off >= len)
+		return 0;
+	if (*off + 2 > len)
+		return -1;
+
+	p = (unsigned char *) buf + *off;
+	*compressed = p[0] >> 7;
+	*partlen = ((p[0] & 0x7f) << 8) | p[1];
+	if (*partlen == 0 || *off + 2 + *partlen > len)
+		return -1;
+	*part = buf + *off + 2;
+	*off += 2 + *partlen;
+	return 1;
+}
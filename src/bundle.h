@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+/* Several tun packets sent as one tunnel packet, so that a burst of
+   small packets shares DNS queries, see doc/proto_00000503.txt.
+
+   A bundle starts with a byte that no tun packet or header compressed
+   packet (see vj.h) starts with. Each part follows with 2 bytes length,
+   the top bit set if the part is compressed on its own. */
+
+#define BUNDLE_TYPE 0x02
+#define BUNDLE_PART_MAX 0x7fff
+#define BUNDLE_MAX 2048		/* client stops adding packets here */
+
+int bundle_add(char *buf, unsigned long *len, unsigned long size,
+	       const char *part, unsigned long partlen, int compressed);
+int bundle_is(const char *data, unsigned long len);
+int bundle_next(char *buf, unsigned long len, unsigned long *off,
+		char **part, unsigned long *partlen, int *compressed);
+
+#endif /* __BUNDLE_H__ */
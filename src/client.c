@@ -16,6 +16,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -46,11 +47,18 @@
 #endif
 
 #include "common.h"
+#include "compress.h"
 #include "encoding.h"
 #include "dns.h"
 #include "login.h"
 #include "tun.h"
 #include "version.h"
+#include "vj.h"
+#include "bundle.h"
+#include "window.h"
+#include "timer.h"
+#include "congest.h"
+#include "resolver.h"
 #include "client.h"
 
 static void handshake_lazyoff(int dns_fd);
@@ -58,8 +66,10 @@ static void handshake_lazyoff(int dns_fd);
 static int running;
 static const char *password;
 
-static struct sockaddr_storage nameserv;
-static int nameserv_len;
+/* Resolvers the queries are striped over */
+static struct sockaddr_storage nameserv[RESOLVER_MAX];
+static int nameserv_len[RESOLVER_MAX];
+static struct resolvers resolvers;
 static struct sockaddr_storage raw_serv;
 static int raw_serv_len;
 static const char *topdomain;
@@ -72,14 +82,15 @@ static struct packet inpkt;
 int outchunkresent = 0;
 
 /* My userid at the server */
-static char userid;
+static int userid;
 static char userid_char;		/* used when sending (lowercase) */
 static char userid_char2;		/* also accepted when receiving (uppercase) */
 
-/* DNS id for next packet */
+/* DNS ids of the latest queries */
 static uint16_t chunkid;
 static uint16_t chunkid_prev;
 static uint16_t chunkid_prev2;
+static uint16_t lastid;		/* last one handed out, also to copies */
 
 /* The encoder used for data packets
  * Defaults to Base32, can be changed after handshake */
@@ -102,6 +113,53 @@ static long send_query_sendcnt = -1;
 static long send_query_recvcnt = 0;
 static int hostname_maxlen = 0xFF;
 
+/* Compression of tunneled packets, switched in handshake */
+static const struct compressor *upcomp = &zlib_ops;
+static int uplevel = 9;
+static const struct compressor *downcomp = &zlib_ops;
+static int downlevel = 9;
+static struct compress_stream *zstream;	/* used over DNS, not in raw mode */
+static const struct compress_dict *dict;
+static int hdrcomp;			/* TCP/IP header compression */
+static struct vj_comp vjcomp;		/* upstream */
+static struct vj_decomp vjdecomp;	/* downstream */
+static int bundle;			/* several packets in one */
+
+/* Windows of fragments in flight, switched in handshake. In window mode
+   inpkt only reassembles, its seqno and fragment carry the fragment
+   number acked. outpkt is cut into upwin, which keeps its own copies. */
+static int downwindow;			/* 0: one fragment at a time */
+static struct window_in downwin;
+static char downfrags[WINDOW_IN_SIZE(WINDOW_FRAG_MAX)];
+static int downinflight;		/* queries the server may still answer */
+static int polltarget;			/* lazy mode: queries to keep there */
+static int upwindow;
+static struct window_out upwin;
+static char upfrags[WINDOW_MAX][WINDOW_UPFRAG_MAX + 2];	/* or parity */
+static int fec;				/* data fragments per parity fragment */
+
+/* Queries in flight, the pace of pings and the round trip time, over DNS.
+   Upstream fragments not acked within the retransmit timeout go again. */
+static struct congest congest;
+
+/* Hedging: the latest query that should be answered at once goes again,
+   to another nameserver or from another port, when its answer is later
+   than most. The first answer to either copy is used. */
+static int hedge;			/* switched on with -Q */
+static int hedge_fd = -1;		/* the other port, with one nameserver */
+static int hedging;			/* in the tunnel loop */
+static char hedge_name[256];		/* query to hedge, "" if none */
+static int hedge_which;			/* nameserver it went to */
+static uint64_t hedge_sent;		/* ms */
+static uint16_t hedge_id;
+static uint16_t hedge_id2;		/* of the copy, 0 if not sent */
+static uint16_t copy_id;		/* last copy sent, stays after the */
+static uint16_t copy_of;		/* next query, and the query it copies */
+static int hedge_answered;
+static unsigned long hedges;
+static unsigned long hedges_won;	/* copies answered before the query */
+static volatile sig_atomic_t print_stats;
+
 void
 client_init()
 {
@@ -113,6 +171,7 @@ client_init()
 	chunkid = ((unsigned int) rand()) & 0xFFFF;
 	chunkid_prev = 0;
 	chunkid_prev2 = 0;
+	lastid = chunkid;
 
 	outpkt.len = 0;
 	outpkt.seqno = 0;
@@ -129,17 +188,31 @@ client_stop()
 	running = 0;
 }
 
+void
+client_request_stats()
+/* Print the query statistics from the tunnel loop; signal safe */
+{
+	print_stats = 1;
+}
+
 enum connection
 client_get_conn()
 {
 	return conn;
 }
 
-void
-client_set_nameserver(struct sockaddr_storage *addr, int addrlen)
+int
+client_add_nameserver(struct sockaddr_storage *addr, int addrlen)
+/* Returns -1 if there are too many already */
 {
-	memcpy(&nameserv, addr, addrlen);
-	nameserv_len = addrlen;
+	int n = resolvers.count;
+
+	if (n >= RESOLVER_MAX)
+		return -1;
+	memcpy(&nameserv[n], addr, addrlen);
+	nameserv_len[n] = addrlen;
+	resolver_init(&resolvers, n + 1);
+	return 0;
 }
 
 void
@@ -217,6 +290,79 @@ client_set_lazymode(int lazy_mode)
 	lazymode = lazy_mode;
 }
 
+int
+client_set_compression(const char *spec)
+/* "up[:level][,down[:level]]", one compressor is used both ways.
+   Returns 0 on success. */
+{
+	char up[32];
+	const char *comma;
+	size_t len;
+
+	comma = strchr(spec, ',');
+	len = comma ? comma - spec : strlen(spec);
+	if (len >= sizeof(up))
+		return -1;
+	memcpy(up, spec, len);
+	up[len] = 0;
+
+	if (compressor_parse(up, &upcomp, &uplevel))
+		return -1;
+	if (comma)
+		return compressor_parse(comma + 1, &downcomp, &downlevel);
+
+	downcomp = upcomp;
+	downlevel = uplevel;
+	return 0;
+}
+
+void
+client_set_hdrcomp(int on)
+{
+	hdrcomp = on;
+}
+
+void
+client_set_bundle(int on)
+{
+	bundle = on;
+}
+
+void
+client_set_window(int size)
+/* Same size for both directions */
+{
+	downwindow = MAX(0, MIN(size, WINDOW_MAX));
+	upwindow = downwindow;
+}
+
+void
+client_set_fec(int group)
+/* One parity fragment per group data fragments, 0 for none */
+{
+	fec = MAX(0, MIN(group, WINDOW_MAX));
+}
+
+void
+client_set_hedge(int on, int fd)
+/* Send late queries again; fd is the other port to send them from
+   with one nameserver, or -1 */
+{
+	hedge = on;
+	hedge_fd = fd;
+}
+
+int
+client_set_dict(const char *spec)
+/* "builtin" or a file name */
+{
+	if (!strcmp(spec, "builtin"))
+		dict = compress_dict_builtin();
+	else
+		dict = compress_dict_load(spec);
+	return dict ? 0 : -1;
+}
+
 void
 client_set_hostname_maxlen(int i)
 {
@@ -230,21 +376,25 @@ client_get_raw_addr()
 	return format_addr(&raw_serv, raw_serv_len);
 }
 
+static uint16_t
+next_id(void)
+{
+	lastid += 7727;
+	if (lastid == 0)
+		/* 0 is used as "no-query" in iodined.c */
+		lastid = 7727;
+	return lastid;
+}
+
 static void
-send_query(int fd, char *hostname)
+send_query_id(int fd, char *hostname, int which, uint16_t id)
+/* Send a query with id for hostname to nameserver which */
 {
 	char packet[4096];
 	struct query q;
 	size_t len;
 
-	chunkid_prev2 = chunkid_prev;
-	chunkid_prev = chunkid;
-	chunkid += 7727;
-	if (chunkid == 0)
-		/* 0 is used as "no-query" in iodined.c */
-		chunkid = 7727;
-
-	q.id = chunkid;
+	q.id = id;
 	q.type = do_qtype;
 
 	len = dns_encode(packet, sizeof(packet), &q, QR_QUERY, hostname, strlen(hostname));
@@ -257,7 +407,21 @@ send_query(int fd, char *hostname)
 	fprintf(stderr, "  Sendquery: id %5d name[0] '%c'\n", q.id, hostname[0]);
 #endif
 
-	sendto(fd, packet, len, 0, (struct sockaddr*)&nameserv, nameserv_len);
+	sendto(fd, packet, len, 0, (struct sockaddr*)&nameserv[which],
+	       nameserv_len[which]);
+	congest_sent(&congest, q.id, clock_ms());
+	resolver_sent(&resolvers, which, q.id, clock_ms());
+}
+
+static uint16_t
+send_query_to(int fd, char *hostname, int which)
+/* Send a query for hostname to nameserver which, returns its id */
+{
+	chunkid_prev2 = chunkid_prev;
+	chunkid_prev = chunkid;
+	chunkid = next_id();
+
+	send_query_id(fd, hostname, which, chunkid);
 
 	/* There are DNS relays that time out quickly but don't send anything
 	   back on timeout.
@@ -289,6 +453,94 @@ send_query(int fd, char *hostname)
 			}
 		}
 	}
+	return chunkid;
+}
+
+static void
+send_query(int fd, char *hostname)
+{
+	int which;
+	uint16_t id;
+
+	which = resolver_pick(&resolvers);
+	id = send_query_to(fd, hostname, which);
+
+	/* In lazy mode the server holds polls, only data gets an answer
+	   (to this or an earlier query) right away */
+	if (hedging && (!lazymode || hostname[0] == userid_char) &&
+	    strlen(hostname) < sizeof(hedge_name)) {
+		strcpy(hedge_name, hostname);
+		hedge_which = which;
+		hedge_sent = clock_ms();
+		hedge_id = id;
+		hedge_id2 = 0;
+		hedge_answered = 0;
+	}
+}
+
+static long
+hedge_wait(void)
+/* ms until the latest query goes again, -1 if it does not */
+{
+	long waited;
+
+	if (!hedging || !hedge_name[0] || hedge_id2 || hedge_answered)
+		return -1;
+	if (resolvers.count < 2 && hedge_fd < 0)
+		return -1;
+	waited = clock_ms() - hedge_sent;
+	if (waited >= congest_hedge(&congest))
+		return 0;
+	return congest_hedge(&congest) - waited;
+}
+
+static void
+send_hedge(int dns_fd)
+/* Send the latest query again, another way than the first time. The
+   copy gets an id of its own, but stays out of chunkid and the lazy
+   mode answer counts: its answer counts as one to the query. */
+{
+	int which;
+
+	which = resolver_other(&resolvers, hedge_which);
+	if (which == hedge_which && hedge_fd >= 0)
+		dns_fd = hedge_fd;
+	hedge_id2 = next_id();
+	copy_id = hedge_id2;
+	copy_of = hedge_id;
+	send_query_id(dns_fd, hedge_name, which, hedge_id2);
+	hedges++;
+}
+
+static uint16_t
+query_id(uint16_t id)
+/* The query that the answer id is for: id itself, or the query it is
+   a copy of */
+{
+	if (copy_id && id == copy_id)
+		return copy_of;
+	return id;
+}
+
+static int
+hedge_late(uint16_t id)
+/* Whether the answer id is to a hedged query that was answered already */
+{
+	if (!hedge_name[0])
+		return 0;
+	if (id == hedge_id || (hedge_id2 && id == hedge_id2)) {
+		if (hedge_answered)
+			return 1;
+		hedge_answered = 1;
+		if (id == hedge_id2)
+			hedges_won++;
+		return 0;
+	}
+	/* In lazy mode the server answers an earlier query when the
+	   latest one arrives */
+	if (lazymode && !hedge_id2)
+		hedge_name[0] = 0;
+	return 0;
 }
 
 static void
@@ -305,7 +557,7 @@ send_raw(int fd, char *buf, int buflen, int user, int cmd)
 	}
 
 	len += RAW_HDR_LEN;
-	packet[RAW_HDR_CMD] = cmd | (user & 0x0F);
+	RAW_HDR_SET_CMD(packet, cmd, user);
 
 	sendto(fd, packet, len, 0, (struct sockaddr*)&raw_serv, sizeof(raw_serv));
 }
@@ -313,7 +565,8 @@ send_raw(int fd, char *buf, int buflen, int user, int cmd)
 static void
 send_raw_data(int dns_fd)
 {
-	send_raw(dns_fd, outpkt.data, outpkt.len, userid, RAW_HDR_CMD_DATA);
+	send_raw(dns_fd, outpkt.data, outpkt.len, userid,
+		 RAW_HDR_CMD_DATA | (outpkt.compressed ? RAW_HDR_COMPRESSED : 0));
 	outpkt.len = 0;
 }
 
@@ -335,70 +588,187 @@ static inline int is_sending(void)
 	return (outpkt.len != 0);
 }
 
-static void
-send_chunk(int fd)
+static int
+send_data(int fd, const char *data, int len, int seqno, int fragment,
+	  int last, int compressed)
+/* Send a data query with as much of data as fits, where data ends the
+   packet if last is set. Returns the number of bytes sent. */
 {
 	char buf[4096];
-	int avail;
+	int sentlen;
 	int code;
-	char *p;
 	static int datacmc = 0;
 	char *datacmcchars = "abcdefghijklmnopqrstuvwxyz0123456789";
 
-	p = outpkt.data;
-	p += outpkt.offset;
-	avail = outpkt.len - outpkt.offset;
-
 	/* Note: must be same, or smaller than send_fragsize_probe() */
-	outpkt.sentlen = build_hostname(buf + 5, sizeof(buf) - 5, p, avail,
-					topdomain, dataenc, hostname_maxlen);
+	sentlen = build_hostname(buf + 8, sizeof(buf) - 8, data, len,
+				 topdomain, dataenc, hostname_maxlen);
 
 	/* Build upstream data header (see doc/proto_xxxxxxxx.txt) */
 
-	buf[0] = userid_char;		/* First byte is hex userid */
+	buf[0] = userid_char;		/* First byte is hex upper 4 bits of userid */
+	buf[1] = b32_5to8(userid & 31);	/* Second byte is lower 5 bits of userid */
 
-	code = ((outpkt.seqno & 7) << 2) | ((outpkt.fragment & 15) >> 2);
-	buf[1] = b32_5to8(code); /* Second byte is 3 bits seqno, 2 upper bits fragment count */
+	code = ((seqno & 7) << 2) | ((fragment & 15) >> 2);
+	buf[2] = b32_5to8(code); /* Third byte is 3 bits seqno, 2 upper bits fragment count */
 
-	code = ((outpkt.fragment & 3) << 3) | (inpkt.seqno & 7);
-	buf[2] = b32_5to8(code); /* Third byte is 2 bits lower fragment count, 3 bits downstream packet seqno */
+	code = ((fragment & 3) << 3) | (inpkt.seqno & 7);
+	buf[3] = b32_5to8(code); /* Fourth byte is 2 bits lower fragment count, 3 bits downstream packet seqno */
 
-	code = ((inpkt.fragment & 15) << 1) | (outpkt.sentlen == avail);
-	buf[3] = b32_5to8(code); /* Fourth byte is 4 bits downstream fragment count, 1 bit last frag flag */
+	code = ((inpkt.fragment & 15) << 1) | (last && sentlen == len);
+	buf[4] = b32_5to8(code); /* Fifth byte is 4 bits downstream fragment count, 1 bit last frag flag */
 
-	buf[4] = datacmcchars[datacmc];	/* Fifth byte is data-CMC */
+	buf[5] = datacmcchars[datacmc];	/* Sixth byte is data-CMC */
 	datacmc++;
 	if (datacmc >= 36)
 		datacmc = 0;
 
+	code = ((compressed & 1) << 4) | (compress_stream_broken(zstream) << 3);
+	buf[6] = b32_5to8(code); /* Seventh byte is 1 bit compression flag, 1 bit stream restart, 3 bits unused */
+
+	/* End the label here, data is dotified on its own and may fill
+	   a whole label */
+	buf[7] = '.';
+
 #if 0
 	fprintf(stderr, "  Send: down %d/%d up %d/%d, %d bytes\n",
-		inpkt.seqno, inpkt.fragment, outpkt.seqno, outpkt.fragment,
-		outpkt.sentlen);
+		inpkt.seqno, inpkt.fragment, seqno, fragment, sentlen);
 #endif
 
 	send_query(fd, buf);
+	downinflight++;
+	return sentlen;
+}
+
+static void
+send_chunk(int fd)
+{
+	outpkt.sentlen = send_data(fd, outpkt.data + outpkt.offset,
+				   outpkt.len - outpkt.offset, outpkt.seqno,
+				   outpkt.fragment, 1, outpkt.compressed);
+}
+
+static void
+upwin_fill(void)
+/* Cut outpkt into the upstream window while it has room */
+{
+	char buf[4096];
+	static const char room[WINDOW_UPFRAG_MAX + WINDOW_FEC_OVERHEAD];
+	int fragsize;
+	char *frag;
+	int last;
+	int len;
+
+	/* As much as one query takes, see send_data(), with room for what
+	   FEC adds */
+	fragsize = build_hostname(buf, sizeof(buf), room, sizeof(room),
+				  topdomain, dataenc, hostname_maxlen);
+	if (upwin.fec)
+		fragsize -= WINDOW_FEC_OVERHEAD;
+	fragsize = MIN(fragsize, WINDOW_UPFRAG_MAX);
+
+	for (;;) {
+		if (window_out_parity(&upwin)) {
+			frag = upfrags[window_out_seq(&upwin) & (WINDOW_MAX - 1)];
+			window_out_add_parity(&upwin, frag);
+		}
+		if (outpkt.len <= 0 || !window_out_space(&upwin))
+			break;
+
+		len = MIN(fragsize, outpkt.len - outpkt.offset);
+		last = (outpkt.offset + len == outpkt.len);
+
+		frag = upfrags[window_out_seq(&upwin) & (WINDOW_MAX - 1)];
+		memcpy(frag, outpkt.data + outpkt.offset, len);
+		window_out_add(&upwin, frag, 0, len, outpkt.compressed, last);
+
+		outpkt.offset += len;
+		if (last) {
+			outpkt.offset = 0;
+			outpkt.len = 0;
+		}
+	}
+}
+
+static int
+upwin_send(int fd, int timeout)
+/* Send the upstream fragments that are due, returns how many.
+   After a timeout one goes even with the congestion window full,
+   as its answer is what opens the window again. */
+{
+	char buf[WINDOW_UPFRAG_MAX + WINDOW_FEC_OVERHEAD];
+	struct window_frag *f;
+	int sent = 0;
+	int seq;
+	int len;
+
+	upwin_fill();
+	while (((timeout && sent == 0) || congest_room(&congest) > 0) &&
+	       (f = window_out_next(&upwin, clock_ms(), congest_rto(&congest),
+				    &seq))) {
+		len = window_out_copy(&upwin, f, buf);
+		send_data(fd, buf, len, seq >> 4, seq & 15, f->last,
+			  f->compressed);
+		sent++;
+	}
+	return sent;
+}
+
+static int
+upwin_ack(int next, unsigned bitmap)
+/* Acks from the server for the upstream window, returns how many
+   fragments are done */
+{
+	struct window_frag frag;
+	int done = 0;
+
+	window_out_ack(&upwin, next, bitmap);
+	while (window_out_pop(&upwin, &frag))
+		done++;
+	return done;
+}
+
+static void
+ping_soon(int ms)
+/* Ping after ms unless something else goes first, see client_tunnel() */
+{
+	if (ms < 1)
+		ms = 1;
+	if (!send_ping_soon || send_ping_soon > ms)
+		send_ping_soon = ms;
 }
 
 static void
 send_ping(int fd)
 {
 	if (conn == CONN_DNS_NULL) {
-		char data[4];
+		char data[7];
+		unsigned bitmap;
+		int len = 5;
 
-		data[0] = userid;
-		data[1] = ((inpkt.seqno & 7) << 4) | (inpkt.fragment & 15);
-		data[2] = (rand_seed >> 8) & 0xff;
-		data[3] = (rand_seed >> 0) & 0xff;
+		data[0] = ((userid >> 8) & 0x01) | (compress_stream_broken(zstream) << 7);
+		data[1] = userid & 0xff;
+		data[2] = ((inpkt.seqno & 7) << 4) | (inpkt.fragment & 15);
+		data[3] = (rand_seed >> 8) & 0xff;
+		data[4] = (rand_seed >> 0) & 0xff;
 
 		rand_seed++;
 
+		if (downwindow) {
+			/* Fragments we have beyond the one acked */
+			bitmap = window_in_bitmap(&downwin);
+			data[5] = (bitmap >> 8) & 0xff;
+			data[6] = bitmap & 0xff;
+			len = 7;
+		}
+
 #if 0
 		fprintf(stderr, "  Send: down %d/%d         (ping)\n",
 			inpkt.seqno, inpkt.fragment);
 #endif
 
-		send_packet(fd, 'p', data, sizeof(data));
+		send_packet(fd, 'p', data, len);
+		downinflight++;
 	} else {
 		send_raw(fd, NULL, 0, userid, RAW_HDR_CMD_PING);
 	}
@@ -541,6 +911,54 @@ dns_namedec(char *outdata, int outdatalen, char *buf, int buflen)
 	return 0;
 }
 
+static void
+write_tun_packet(int tun_fd, char *data, unsigned long len)
+/* Restore compressed TCP/IP headers before writing to tun */
+{
+	char buf[64*1024];
+	unsigned long buflen;
+
+	if (hdrcomp) {
+		buflen = sizeof(buf);
+		switch (vj_uncompress(&vjdecomp, buf, &buflen, data, len)) {
+		case 1:
+			write_tun(tun_fd, buf, buflen);
+			return;
+		case -1:
+			return;
+		}
+	}
+	write_tun(tun_fd, data, len);
+}
+
+static void
+write_tun_payload(int tun_fd, char *data, unsigned long len)
+/* Write uncompressed downstream packet to tun, each part if it is a bundle */
+{
+	char buf[64*1024];
+	unsigned long buflen;
+	unsigned long partlen;
+	unsigned long off = 0;
+	char *part;
+	int compressed;
+
+	if (!bundle || !bundle_is(data, len)) {
+		write_tun_packet(tun_fd, data, len);
+		return;
+	}
+
+	while (bundle_next(data, len, &off, &part, &partlen, &compressed) > 0) {
+		if (!compressed) {
+			write_tun_packet(tun_fd, part, partlen);
+			continue;
+		}
+		buflen = sizeof(buf);
+		if (uncompress_packet(downcomp, conn == CONN_DNS_NULL ? zstream : NULL,
+				      dict, buf, &buflen, part, partlen) == 0)
+			write_tun_packet(tun_fd, buf, buflen);
+	}
+}
+
 static int
 read_dns_withq(int dns_fd, int tun_fd, char *buf, int buflen, struct query *q)
 /* FIXME: tun_fd needed for raw handling */
@@ -638,9 +1056,13 @@ read_dns_withq(int dns_fd, int tun_fd, char *buf, int buflen, struct query *q)
 		if (RAW_HDR_GET_CMD(data) != RAW_HDR_CMD_DATA) return 0;
 
 		r -= RAW_HDR_LEN;
+		if (!RAW_HDR_GET_COMPRESSED(data)) {
+			write_tun_payload(tun_fd, &data[RAW_HDR_LEN], r);
+			return 0;
+		}
 		datalen = sizeof(buf);
-		if (uncompress((uint8_t*)buf, &datalen, (uint8_t*) &data[RAW_HDR_LEN], r) == Z_OK) {
-			write_tun(tun_fd, buf, datalen);
+		if (uncompress_packet(downcomp, NULL, dict, buf, &datalen, &data[RAW_HDR_LEN], r) == 0) {
+			write_tun_payload(tun_fd, buf, datalen);
 		}
 
 		/* don't process any further */
@@ -731,14 +1153,47 @@ handshake_waitdns(int dns_fd, char *buf, int buflen, char c1, char c2, int timeo
 	return -1;
 }
 
+static char *
+hdrcomp_packet(char *buf, unsigned long size, unsigned long *len,
+	       char *in, unsigned long inlen)
+/* Returns tun packet in, or its header compressed version put in buf */
+{
+	*len = size;
+	if (hdrcomp && vj_compress(&vjcomp, buf, len, in, inlen) == 1)
+		return buf;
+	*len = inlen;
+	return in;
+}
+
+static int
+tun_ready(int tun_fd)
+/* Whether another packet can be read from tun right away */
+{
+	struct timeval tv;
+	fd_set fds;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(tun_fd, &fds);
+	return select(tun_fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
 static int
 tunnel_tun(int tun_fd, int dns_fd)
 {
 	unsigned long outlen;
 	unsigned long inlen;
+	unsigned long bundlelen;
 	char out[64*1024];
 	char in[64*1024];
+	char hdrbuf[64*1024];
+	char bundlebuf[BUNDLE_MAX + 64*1024];
+	char *data;
 	ssize_t read;
+	ssize_t more;
+	int packets;
+	int compressed;
 
 	if ((read = read_tun(tun_fd, in, sizeof(in))) <= 0)
 		return -1;
@@ -748,9 +1203,35 @@ tunnel_tun(int tun_fd, int dns_fd)
 	if (is_sending())
 		return -1;
 
+	data = hdrcomp_packet(hdrbuf, sizeof(hdrbuf), &inlen, in, read);
+
+	/* Take along the packets already waiting in tun. Not in raw mode,
+	   where each packet is a datagram of its own anyway and a bundle
+	   larger than the tun MTU may not get through unfragmented. */
+	packets = 1;
+	bundlelen = 0;
+	while (bundle && conn == CONN_DNS_NULL && bundle_add(bundlebuf, &bundlelen, sizeof(bundlebuf),
+				    data, inlen, 0) == 0 &&
+	       bundlelen < BUNDLE_MAX && tun_ready(tun_fd)) {
+		if ((more = read_tun(tun_fd, in, sizeof(in))) <= 0)
+			break;
+		packets++;
+		data = hdrcomp_packet(hdrbuf, sizeof(hdrbuf), &inlen, in, more);
+	}
+	if (packets > 1) {
+		/* A last packet too large for the bundle is lost, which
+		   only happens with a tun MTU the server did not set */
+		data = bundlebuf;
+		inlen = bundlelen;
+	}
+
 	outlen = sizeof(out);
-	inlen = read;
-	compress2((uint8_t*)out, &outlen, (uint8_t*)in, inlen, 9);
+	compressed = compress_packet(upcomp, conn == CONN_DNS_NULL ? zstream : NULL,
+				     dict, uplevel, out, &outlen, data, inlen);
+	if (compressed < 0) {
+		vj_comp_init(&vjcomp, 0);
+		return -1;
+	}
 
 	memcpy(outpkt.data, out, MIN(outlen, sizeof(outpkt.data)));
 	outpkt.sentlen = 0;
@@ -758,10 +1239,14 @@ tunnel_tun(int tun_fd, int dns_fd)
 	outpkt.seqno = (outpkt.seqno + 1) & 7;
 	outpkt.len = outlen;
 	outpkt.fragment = 0;
+	outpkt.compressed = compressed;
 	outchunkresent = 0;
 
 	if (conn == CONN_DNS_NULL) {
-		send_chunk(dns_fd);
+		if (upwindow)
+			upwin_send(dns_fd, 0);
+		else
+			send_chunk(dns_fd);
 
 		send_ping_soon = 0;
 	} else {
@@ -772,7 +1257,50 @@ tunnel_tun(int tun_fd, int dns_fd)
 }
 
 static int
-tunnel_dns(int tun_fd, int dns_fd)
+window_fragment(int tun_fd, char *buf, int read)
+/* Store downstream fragment in window mode and write the packets it
+   completes to tun. Returns 1 if the fragment was new. */
+{
+	char out[64*1024];
+	unsigned long outlen;
+	unsigned long len;
+	int compressed;
+	int last;
+	char *data;
+	int fraglen;
+	int ret;
+
+	ret = window_in_put(&downwin, (buf[1] >> 1) & 127, buf + 2, read - 2,
+			    (buf[0] >> 7) & 1, buf[1] & 1);
+
+	while (window_in_get(&downwin, &data, &fraglen, &compressed, &last)) {
+		len = MIN(fraglen, sizeof(inpkt.data) - inpkt.len);
+		memcpy(&inpkt.data[inpkt.len], data, len);
+		inpkt.len += len;
+		if (!last)
+			continue;
+
+		if (!compressed) {
+			write_tun_payload(tun_fd, inpkt.data, inpkt.len);
+		} else {
+			outlen = sizeof(out);
+			if (uncompress_packet(downcomp, zstream, dict, out, &outlen,
+					      inpkt.data, inpkt.len) == 0) {
+				write_tun_payload(tun_fd, out, outlen);
+			}
+		}
+		inpkt.len = 0;
+	}
+
+	inpkt.seqno = (downwin.next >> 4) & 7;
+	inpkt.fragment = downwin.next & 15;
+	return ret;
+}
+
+static int
+tunnel_dns(int tun_fd, int dns_fd, int read_fd)
+/* Handle an answer that came in on read_fd, further queries go out on
+   dns_fd */
 {
 	static long packrecv = 0;
 	static long packrecv_oos = 0;
@@ -781,18 +1309,37 @@ tunnel_dns(int tun_fd, int dns_fd)
 	int up_ack_fragment;
 	int new_down_seqno;
 	int new_down_fragment;
+	unsigned up_ack_bitmap = 0;
+	int acked;
 	struct query q;
 	unsigned long datalen;
 	char buf[64*1024];
 	int read;
+	int timed;
 	int send_something_now = 0;
 
 	memset(q.name, 0, sizeof(q.name));
-	read = read_dns_withq(dns_fd, tun_fd, buf, sizeof(buf), &q);
+	q.rcode = NOERROR;
+	read = read_dns_withq(read_fd, tun_fd, buf, sizeof(buf), &q);
 
 	if (conn != CONN_DNS_NULL)
 		return 1;  /* everything already done */
 
+	/* In lazy mode the server holds pings until it has something to
+	   send, so only data in answer to our latest query tells how long
+	   the round trip takes */
+	timed = read >= 0 && (!lazymode ||
+			      (query_id(q.id) == chunkid && read > (upwindow ? 4 : 2)));
+	if (read < 0 && q.rcode == SERVFAIL) {
+		congest_servfail(&congest);
+		resolver_servfail(&resolvers, q.id);
+	} else if (read >= 0 || q.rcode != NOERROR) {
+		congest_answered(&congest, q.id, clock_ms(), timed);
+		resolver_answered(&resolvers, q.id, clock_ms(), timed);
+		if (hedge_late(q.id))
+			return -1;	/* the other copy was first */
+	}
+
 #if 0
 	fprintf(stderr, "				Recv: id %5d name[0]='%c'\n",
 		q.id, q.name[0]);
@@ -802,16 +1349,16 @@ tunnel_dns(int tun_fd, int dns_fd)
 	   replies from fragsize probes etc. However a sequence of those,
 	   mostly 1 sec apart, will continuously break the >=2-second select
 	   timeout, which means we won't send a proper ping for a while.
-	   So make select a bit faster, <1sec. */
+	   So make select faster. */
 	if (q.name[0] != 'P' && q.name[0] != 'p' &&
 	    q.name[0] != userid_char && q.name[0] != userid_char2) {
-		send_ping_soon = 700;
+		ping_soon(congest_backoff(&congest));
 		return -1;	/* nothing done */
 	}
 
 	if (read < 2) {
 		/* Maybe SERVFAIL etc. Send ping to get things back in order,
-		   but wait a bit to prevent fast ping-pong loops. */
+		   but back off to prevent fast ping-pong loops. */
 
 		if (read < 0)
 			write_dns_error(&q, 0);
@@ -842,7 +1389,7 @@ tunnel_dns(int tun_fd, int dns_fd)
 			fprintf(stderr, "   q=%c id %5d 1-byte illegal \"QMEM\" reply\n", q.name[0], q.id);
 #endif
 
-		send_ping_soon = 900;
+		ping_soon(congest_backoff(&congest));
 		return -1;	/* nothing done */
 	}
 
@@ -864,6 +1411,20 @@ tunnel_dns(int tun_fd, int dns_fd)
 	up_ack_seqno = (buf[0] >> 4) & 7;
 	up_ack_fragment = buf[0] & 15;
 
+	if (upwindow && read >= 4) {
+		/* Take out the upstream fragments the server has */
+		up_ack_bitmap = ((buf[2] & 0xff) << 8) | (buf[3] & 0xff);
+		memmove(&buf[2], &buf[4], read - 4);
+		read -= 2;
+	} else if (upwindow) {
+		read = 2;
+	}
+
+	if (read == 2 && (buf[0] & 0x80)) {
+		/* No data, the server asks for a new upstream stream */
+		compress_stream_restart(zstream);
+	}
+
 #if 0
 	fprintf(stderr, "				Recv: id %5d down %d/%d up %d/%d, %d bytes\n",
 		q.id, new_down_seqno, new_down_fragment, up_ack_seqno,
@@ -872,7 +1433,7 @@ tunnel_dns(int tun_fd, int dns_fd)
 
 	/* Downstream data traffic */
 
-	if (read > 2 && new_down_seqno != inpkt.seqno &&
+	if (!downwindow && read > 2 && new_down_seqno != inpkt.seqno &&
 	    recent_seqno(inpkt.seqno, new_down_seqno)) {
 		/* This is the previous seqno, or a bit earlier.
 		   Probably out-of-sequence dupe due to unreliable
@@ -883,13 +1444,15 @@ tunnel_dns(int tun_fd, int dns_fd)
 		   (why??), server will re-send and drop a few times and
 		   eventually everything will work again. */
 		read = 2;
-		send_ping_soon = 500;
+		ping_soon(congest_backoff(&congest));
 		/* Still process upstream ack, if any */
 	}
 
 	if (!(packrecv & 0x1000000))
 		packrecv++;
 	send_query_recvcnt++;  /* overflow doesn't matter */
+	if (downinflight > 0)
+		downinflight--;
 
 	/* Don't process any non-recent stuff any further.
 	   No need to remember more than 3 ids: in practice any older replies
@@ -897,8 +1460,10 @@ tunnel_dns(int tun_fd, int dns_fd)
 	   have, it has become useless in the mean time.
 	   Actually, ever since iodined is replying to both the original query
 	   and the last dupe, this hardly triggers any more.
+	   In window mode, replies to any query carry numbered fragments.
 	 */
-	if (q.id != chunkid && q.id != chunkid_prev && q.id != chunkid_prev2) {
+	if (!downwindow && query_id(q.id) != chunkid &&
+	    query_id(q.id) != chunkid_prev && query_id(q.id) != chunkid_prev2) {
 		packrecv_oos++;
 #if 0
 		fprintf(stderr, "   q=%c Packs received = %8ld  Out-of-sequence = %8ld\n", q.name[0], packrecv, packrecv_oos);
@@ -928,14 +1493,12 @@ tunnel_dns(int tun_fd, int dns_fd)
 
 	/* In lazy mode, we shouldn't get much replies to our most-recent
 	   query, only during heavy data transfer. Since this means the server
-	   doesn't have any packets left, send one relatively fast (but not
-	   too fast, to avoid runaway ping-pong loops..) */
-	if (q.id == chunkid && lazymode) {
-		if (!send_ping_soon || send_ping_soon > 900)
-			send_ping_soon = 900;
-	}
+	   doesn't have any packets left, send one relatively fast (but
+	   backing off, to avoid runaway ping-pong loops..) */
+	if (query_id(q.id) == chunkid && lazymode)
+		ping_soon(congest_backoff(&congest));
 
-	if (read == 2 && new_down_seqno != inpkt.seqno &&
+	if (!downwindow && read == 2 && new_down_seqno != inpkt.seqno &&
 	    !recent_seqno(inpkt.seqno, new_down_seqno)) {
 		/* This is a seqno that we didn't see yet, but it has
 		   no data any more. Possible since iodined will send
@@ -946,10 +1509,33 @@ tunnel_dns(int tun_fd, int dns_fd)
 		inpkt.seqno = new_down_seqno;
 		inpkt.fragment = new_down_fragment;
 		inpkt.len = 0;
-		send_ping_soon = 500;
+		ping_soon(congest_backoff(&congest));
 	}
 
-	while (read > 2) {
+	if (downwindow && read > 2) {
+		/* Ack anything with data, also duplicates since the server
+		   may have missed our ack. While new fragments come in,
+		   add a query until the server holds one per window slot.
+		   In lazy mode it keeps them until it has data, so poll
+		   with more of them while bursts keep filling them. */
+		if (window_fragment(tun_fd, buf, read)) {
+			if (!lazymode && downinflight + 1 < downwindow &&
+			    congest_room(&congest) > 1)
+				send_ping(dns_fd);
+			if (lazymode)
+				polltarget = MIN(polltarget + 1, downwindow);
+			while (lazymode && downinflight + 1 < polltarget &&
+			       congest_room(&congest) > 1)
+				send_ping(dns_fd);
+		}
+		send_something_now = 1;
+	} else if (downwindow && lazymode && read == 2 && polltarget > 1 &&
+		   !is_sending() && upwin.count == 0) {
+		/* The server had nothing for a query it held, keep fewer */
+		polltarget--;
+	}
+
+	while (!downwindow && read > 2) {
 	/* "if" with easy exit */
 
 		if (new_down_seqno != inpkt.seqno) {
@@ -969,14 +1555,14 @@ tunnel_dns(int tun_fd, int dns_fd)
 			/* Same packet but duplicate fragment, ignore.
 			   If the server didn't get our ack for it, the next
 			   ping or chunk will do that. */
-			send_ping_soon = 500;
+			ping_soon(congest_backoff(&congest));
 			break;
 		} else if (new_down_fragment > inpkt.fragment + 1) {
 			/* Quite impossible. We missed a fragment, but the
 			   server got our ack for it and is sending the next
 			   fragment already. Don't handle it but let server
 			   re-send and drop. */
-			send_ping_soon = 500;
+			ping_soon(congest_backoff(&congest));
 			break;
 		}
 		inpkt.fragment = new_down_fragment;
@@ -990,11 +1576,17 @@ tunnel_dns(int tun_fd, int dns_fd)
 		inpkt.len += datalen;
 
 		if (buf[1] & 1) { /* If last fragment flag is set */
-			/* Uncompress packet and send to tun */
-			/* RE-USES buf[] */
-			datalen = sizeof(buf);
-			if (uncompress((uint8_t*)buf, &datalen, (uint8_t*) inpkt.data, inpkt.len) == Z_OK) {
-				write_tun(tun_fd, buf, datalen);
+			/* Uncompress packet if compression flag is set,
+			   and send to tun */
+			if (!(buf[0] & 0x80)) {
+				write_tun_payload(tun_fd, inpkt.data, inpkt.len);
+			} else {
+				/* RE-USES buf[] */
+				datalen = sizeof(buf);
+				if (uncompress_packet(downcomp, zstream, dict, buf, &datalen,
+						      inpkt.data, inpkt.len) == 0) {
+					write_tun_payload(tun_fd, buf, datalen);
+				}
 			}
 			inpkt.len = 0;
 			/* Keep .seqno and .fragment as is, so that we won't
@@ -1003,10 +1595,9 @@ tunnel_dns(int tun_fd, int dns_fd)
 
 		/* Send anything to ack the received seqno/frag, and get more */
 		if (inpkt.len == 0) {
-			/* was last frag; wait just a trifle because our
-			   tun will probably return TCP-ack immediately.
-			   5msec = 200 DNSreq/sec */
-			send_ping_soon = 5;
+			/* was last frag; wait for the pacing, our tun
+			   will probably return TCP-ack meanwhile */
+			ping_soon(congest_wait(&congest, clock_ms()));
 		} else {
 			/* server certainly has more data */
 			send_something_now = 1;
@@ -1020,7 +1611,17 @@ tunnel_dns(int tun_fd, int dns_fd)
 
 	/* Upstream data traffic */
 
-	if (is_sending()) {
+	if (upwindow) {
+		acked = upwin_ack((up_ack_seqno << 4) | up_ack_fragment, up_ack_bitmap);
+		if (upwin_send(dns_fd, 0)) {
+			/* Data queries ack and poll as well */
+			send_ping_soon = 0;
+			send_something_now = 0;
+		} else if (acked && upwin.count == 0) {
+			/* All sent and acked, prime the server like below */
+			ping_soon(congest_wait(&congest, clock_ms()));
+		}
+	} else if (is_sending()) {
 		/* already checked read>=2 */
 #if 0
 		fprintf(stderr, "Got ack for %d,%d - expecting %d,%d - id=%d cur=%d prev=%d prev2=%d\n",
@@ -1047,10 +1648,8 @@ tunnel_dns(int tun_fd, int dns_fd)
 				   But since the server often still has a
 				   query and we can expect a TCP-ack returned
 				   from our tun device quickly in many cases,
-				   don't be too fast.
-				   20msec still is 50 DNSreq/second... */
-				if (!send_ping_soon || send_ping_soon > 20)
-					send_ping_soon = 20;
+				   don't be faster than the pacing. */
+				ping_soon(congest_wait(&congest, clock_ms()));
 			} else {
 				/* More to send */
 				outpkt.fragment++;
@@ -1067,8 +1666,11 @@ tunnel_dns(int tun_fd, int dns_fd)
 	}
 
 
-	/* Send ping if we didn't send anything yet */
-	if (send_something_now) {
+	/* Send ping if we didn't send anything yet, when the pacing
+	   allows */
+	if (send_something_now && congest_wait(&congest, clock_ms())) {
+		ping_soon(congest_wait(&congest, clock_ms()));
+	} else if (send_something_now) {
 		send_ping(dns_fd);
 		send_ping_soon = 0;
 	}
@@ -1076,31 +1678,91 @@ tunnel_dns(int tun_fd, int dns_fd)
 	return read;
 }
 
+void
+client_print_stats()
+{
+	const struct resolver *res;
+	int i;
+
+	fprintf(stderr, "Queries: %lu sent, %lu answered, %lu lost, %lu SERVFAIL; "
+		"window %d.%02d (threshold %d), %d in flight, "
+		"%lu answers/s, pacing %lu us; "
+		"RTT %lu ms (deviation %lu), timeout %d ms; "
+		"%u fragments rebuilt from parity; "
+		"%lu hedged (%lu answered first), after %d ms\n",
+		congest.sent, congest.answered, congest.lost, congest.servfail,
+		congest.cwnd / CONGEST_ONE,
+		(congest.cwnd % CONGEST_ONE) * 100 / CONGEST_ONE,
+		congest.ssthresh / CONGEST_ONE, congest.inflight,
+		congest.rate, congest.pace_us,
+		congest.srtt_us / 1000, congest.rttvar_us / 1000, congest.rto,
+		downwin.rebuilt, hedges, hedges_won, congest_hedge(&congest));
+	for (i = 0; resolvers.count > 1 && i < resolvers.count; i++) {
+		res = &resolvers.r[i];
+		fprintf(stderr, "Resolver %s: %lu sent, %lu answered, "
+			"%lu missed; health %d%%, RTT %lu ms\n",
+			format_addr(&nameserv[i], nameserv_len[i]),
+			res->sent, res->answered, res->missed,
+			res->health * 100 / RESOLVER_ONE, res->srtt_us / 1000);
+	}
+}
+
 int
 client_tunnel(int tun_fd, int dns_fd)
 {
 	struct timeval tv;
 	fd_set fds;
+	long soon;
+	long hedgewait;
 	int rv;
 	int i;
 
 	rv = 0;
 	lastdownstreamtime = time(NULL);
 	send_query_sendcnt = 0;  /* start counting now */
+	clock_update();
+	congest_init(&congest, clock_ms());
+	resolver_forget(&resolvers);
+	hedging = hedge;
 
 	while (running) {
+		clock_update();
+		/* Queries not answered by now, even ones the server held,
+		   went astray and count against their resolver */
+		resolver_expire(&resolvers, clock_ms(),
+				(lazymode ? selecttimeout * 1000 : 0) +
+				2 * congest_rto(&congest));
+		if (print_stats) {
+			print_stats = 0;
+			client_print_stats();
+		}
 		tv.tv_sec = selecttimeout;
 		tv.tv_usec = 0;
 
-		if (is_sending()) {
+		if ((is_sending() || upwin.count > 0) &&
+		    congest_rto(&congest) < selecttimeout * 1000) {
 			/* fast timeout for retransmits */
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
+			tv.tv_sec = congest_rto(&congest) / 1000;
+			tv.tv_usec = (congest_rto(&congest) % 1000) * 1000;
+		}
+
+		soon = send_ping_soon;
+		if (soon) {
+			tv.tv_sec = soon / 1000;
+			tv.tv_usec = (soon % 1000) * 1000;
 		}
 
-		if (send_ping_soon) {
-			tv.tv_sec = 0;
-			tv.tv_usec = send_ping_soon * 1000;
+		hedgewait = hedge_wait();
+		if (hedgewait == 0) {
+			send_hedge(dns_fd);
+			hedgewait = -1;
+		}
+		if (hedgewait > 0 &&
+		    hedgewait < tv.tv_sec * 1000 + tv.tv_usec / 1000) {
+			tv.tv_sec = hedgewait / 1000;
+			tv.tv_usec = (hedgewait % 1000) * 1000;
+		} else {
+			hedgewait = -1;
 		}
 
 		FD_ZERO(&fds);
@@ -1114,8 +1776,10 @@ client_tunnel(int tun_fd, int dns_fd)
 			FD_SET(tun_fd, &fds);
 		}
 		FD_SET(dns_fd, &fds);
+		if (hedge_fd >= 0)
+			FD_SET(hedge_fd, &fds);
 
-		i = select(MAX(tun_fd, dns_fd) + 1, &fds, NULL, NULL, &tv);
+		i = select(MAX(MAX(tun_fd, dns_fd), hedge_fd) + 1, &fds, NULL, NULL, &tv);
 
  		if (lastdownstreamtime + 60 < time(NULL)) {
  			warnx("No downstream data received in 60 seconds, shutting down.");
@@ -1125,12 +1789,32 @@ client_tunnel(int tun_fd, int dns_fd)
 		if (running == 0)
 			break;
 
+		if (i < 0 && errno == EINTR)
+			continue;	/* client_request_stats() */
 		if (i < 0)
 			err(1, "select");
 
+		if (i == 0 && hedgewait > 0)
+			continue;	/* time to hedge, not a timeout */
+
 		if (i == 0) {
 			/* timeout */
-			if (is_sending()) {
+			/* Whatever the server did not answer is lost,
+			   and nothing is coming that needs more polls.
+			   Not so if we only waited for a ping to go. */
+			if (!soon) {
+				clock_update();
+				congest_timeout(&congest, lazymode ?
+						MAX(polltarget, 1) : 0);
+				downinflight = 0;
+				polltarget = 1;
+			}
+			if (upwindow && upwin.count > 0) {
+				/* Fragments not acked in time go again */
+				clock_update();
+				if (!upwin_send(dns_fd, 1))
+					send_ping(dns_fd);
+			} else if (is_sending()) {
 				/* Re-send current fragment; either frag
 				   or ack probably dropped somewhere.
 				   But problem: no cache-miss-counter,
@@ -1147,6 +1831,8 @@ client_tunnel(int tun_fd, int dns_fd)
 					outpkt.len = 0;
 					outpkt.sentlen = 0;
 					outchunkresent = 0;
+					compress_stream_restart(zstream);
+					vj_comp_init(&vjcomp, 0);
 
 					send_ping(dns_fd);
 				}
@@ -1166,9 +1852,11 @@ client_tunnel(int tun_fd, int dns_fd)
 				   If chunk sent, sets send_ping_soon=0. */
 			}
 			if (FD_ISSET(dns_fd, &fds)) {
-				if (tunnel_dns(tun_fd, dns_fd) <= 0)
+				if (tunnel_dns(tun_fd, dns_fd, dns_fd) <= 0)
 					continue;
 			}
+			if (hedge_fd >= 0 && FD_ISSET(hedge_fd, &fds))
+				tunnel_dns(tun_fd, dns_fd, hedge_fd);
 		}
 	}
 
@@ -1178,14 +1866,15 @@ client_tunnel(int tun_fd, int dns_fd)
 static void
 send_login(int fd, char *login, int len)
 {
-	char data[19];
+	char data[20];
 
 	memset(data, 0, sizeof(data));
-	data[0] = userid;
-	memcpy(&data[1], login, MIN(len, 16));
+	data[0] = (userid >> 8) & 0xff;
+	data[1] = userid & 0xff;
+	memcpy(&data[2], login, MIN(len, 16));
 
-	data[17] = (rand_seed >> 8) & 0xff;
-	data[18] = (rand_seed >> 0) & 0xff;
+	data[18] = (rand_seed >> 8) & 0xff;
+	data[19] = (rand_seed >> 0) & 0xff;
 
 	rand_seed++;
 
@@ -1207,16 +1896,19 @@ send_fragsize_probe(int fd, int fragsize)
 	rand_seed++;
 
 	/* Note: must either be same, or larger, than send_chunk() */
-	build_hostname(buf + 5, sizeof(buf) - 5, probedata, sizeof(probedata),
+	build_hostname(buf + 8, sizeof(buf) - 8, probedata, sizeof(probedata),
 		       topdomain, dataenc, hostname_maxlen);
 
 	fragsize &= 2047;
 
 	buf[0] = 'r'; /* Probe downstream fragsize packet */
-	buf[1] = b32_5to8((userid << 1) | ((fragsize >> 10) & 1));
-	buf[2] = b32_5to8((fragsize >> 5) & 31);
-	buf[3] = b32_5to8(fragsize & 31);
-	buf[4] = 'd'; /* dummy to match send_chunk() */
+	buf[1] = b32_5to8((userid >> 4) & 31);
+	buf[2] = b32_5to8(((userid & 15) << 1) | ((fragsize >> 10) & 1));
+	buf[3] = b32_5to8((fragsize >> 5) & 31);
+	buf[4] = b32_5to8(fragsize & 31);
+	buf[5] = 'd'; /* dummies to match send_chunk() */
+	buf[6] = 'd';
+	buf[7] = '.';
 
 	send_query(fd, buf);
 }
@@ -1224,13 +1916,14 @@ send_fragsize_probe(int fd, int fragsize)
 static void
 send_set_downstream_fragsize(int fd, int fragsize)
 {
-	char data[5];
+	char data[6];
 
-	data[0] = userid;
-	data[1] = (fragsize & 0xff00) >> 8;
-	data[2] = (fragsize & 0x00ff);
-	data[3] = (rand_seed >> 8) & 0xff;
-	data[4] = (rand_seed >> 0) & 0xff;
+	data[0] = (userid >> 8) & 0xff;
+	data[1] = userid & 0xff;
+	data[2] = (fragsize & 0xff00) >> 8;
+	data[3] = (fragsize & 0x00ff);
+	data[4] = (rand_seed >> 8) & 0xff;
+	data[5] = (rand_seed >> 0) & 0xff;
 
 	rand_seed++;
 
@@ -1255,15 +1948,159 @@ send_version(int fd, uint32_t version)
 	send_packet(fd, 'v', data, sizeof(data));
 }
 
+static void
+b32_userid(char *buf, int userid)
+/* Put userid as two Base32 chars */
+{
+	buf[0] = b32_5to8((userid >> 5) & 31);
+	buf[1] = b32_5to8(userid & 31);
+}
+
 static void
 send_ip_request(int fd, int userid)
 {
-	char buf[512] = "i____.";
-	buf[1] = b32_5to8(userid);
+	char buf[512] = "i_____.";
+	b32_userid(&buf[1], userid);
+
+	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_raw_udp_login(int dns_fd, int userid, int seed)
+{
+	char buf[16];
+	login_calculate(buf, 16, password, seed + 1);
+
+	send_raw(dns_fd, buf, sizeof(buf), userid, RAW_HDR_CMD_LOGIN);
+}
+
+static void
+send_upenctest(int fd, const char *s)
+/* NOTE: String may be at most 63-4=59 chars to fit in 1 dns chunk. */
+{
+	char buf[512] = "z___";
+
+	buf[1] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[2] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[3] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, s, 512);
+	strncat(buf, ".", 512);
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_downenctest(int fd, char downenc, int variant, char *s, int slen)
+/* Note: content/handling of s is not defined yet. */
+{
+	char buf[512] = "y_____.";
+
+	buf[1] = tolower(downenc);
+	buf[2] = b32_5to8(variant);
+
+	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_codec_switch(int fd, int userid, int bits)
+{
+	char buf[512] = "s______.";
+	b32_userid(&buf[1], userid);
+	buf[3] = b32_5to8(bits);
+
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+
+static void
+send_downenc_switch(int fd, int userid)
+{
+	char buf[512] = "o______.";
+	b32_userid(&buf[1], userid);
+	buf[3] = tolower(downenc);
+
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_compression_switch(int fd, int userid)
+{
+	char buf[512] = "o_________.";
+	b32_userid(&buf[1], userid);
+
+	buf[3] = 'c';
+	buf[4] = upcomp->id;
+	buf[5] = downcomp->id;
+	buf[6] = b32_5to8(downlevel - COMPRESS_LEVEL_MIN);
+
+	buf[7] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[8] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[9] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_compression_query(int fd, int userid)
+{
+	char buf[512] = "o______.";
+	b32_userid(&buf[1], userid);
+
+	buf[3] = 'q';
+
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
+	rand_seed++;
+
+	strncat(buf, topdomain, 512 - strlen(buf));
+	send_query(fd, buf);
+}
+
+static void
+send_dict_switch(int fd, int userid)
+{
+	char buf[512] = "o_____________.";
+	int i;
+
+	b32_userid(&buf[1], userid);
 
-	buf[2] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[3] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[4] = b32_5to8((rand_seed ) & 0x1f);
+	buf[3] = 'd';
+	/* 32 bit id in 7 Base32 chars */
+	for (i = 0; i < 7; i++)
+		buf[4 + i] = b32_5to8((dict->id >> (30 - 5 * i)) & 0x1f);
+
+	buf[11] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[12] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[13] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
 	strncat(buf, topdomain, 512 - strlen(buf));
@@ -1271,43 +2108,33 @@ send_ip_request(int fd, int userid)
 }
 
 static void
-send_raw_udp_login(int dns_fd, int userid, int seed)
+send_hdrcomp_switch(int fd, int userid)
 {
-	char buf[16];
-	login_calculate(buf, 16, password, seed + 1);
+	char buf[512] = "o______.";
+	b32_userid(&buf[1], userid);
 
-	send_raw(dns_fd, buf, sizeof(buf), userid, RAW_HDR_CMD_LOGIN);
-}
-
-static void
-send_upenctest(int fd, const char *s)
-/* NOTE: String may be at most 63-4=59 chars to fit in 1 dns chunk. */
-{
-	char buf[512] = "z___";
+	buf[3] = 'h';
 
-	buf[1] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[2] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[3] = b32_5to8((rand_seed ) & 0x1f);
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
-	strncat(buf, s, 512);
-	strncat(buf, ".", 512);
 	strncat(buf, topdomain, 512 - strlen(buf));
 	send_query(fd, buf);
 }
 
 static void
-send_downenctest(int fd, char downenc, int variant, char *s, int slen)
-/* Note: content/handling of s is not defined yet. */
+send_bundle_switch(int fd, int userid)
 {
-	char buf[512] = "y_____.";
+	char buf[512] = "o______.";
+	b32_userid(&buf[1], userid);
 
-	buf[1] = tolower(downenc);
-	buf[2] = b32_5to8(variant);
+	buf[3] = 'b';
 
-	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
 	strncat(buf, topdomain, 512 - strlen(buf));
@@ -1315,32 +2142,36 @@ send_downenctest(int fd, char downenc, int variant, char *s, int slen)
 }
 
 static void
-send_codec_switch(int fd, int userid, int bits)
+send_window_switch(int fd, int userid)
 {
-	char buf[512] = "s_____.";
-	buf[1] = b32_5to8(userid);
-	buf[2] = b32_5to8(bits);
+	char buf[512] = "o________.";
+	b32_userid(&buf[1], userid);
 
-	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	buf[3] = 'w';
+	buf[4] = b32_5to8(downwindow);
+	buf[5] = b32_5to8(upwindow);
+
+	buf[6] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[7] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[8] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
 	strncat(buf, topdomain, 512 - strlen(buf));
 	send_query(fd, buf);
 }
 
-
 static void
-send_downenc_switch(int fd, int userid)
+send_fec_switch(int fd, int userid)
 {
-	char buf[512] = "o_____.";
-	buf[1] = b32_5to8(userid);
-	buf[2] = tolower(downenc);
+	char buf[512] = "o_______.";
+	b32_userid(&buf[1], userid);
 
-	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	buf[3] = 'f';
+	buf[4] = b32_5to8(fec);
+
+	buf[5] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[6] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[7] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
 	strncat(buf, topdomain, 512 - strlen(buf));
@@ -1350,17 +2181,17 @@ send_downenc_switch(int fd, int userid)
 static void
 send_lazy_switch(int fd, int userid)
 {
-	char buf[512] = "o_____.";
-	buf[1] = b32_5to8(userid);
+	char buf[512] = "o______.";
+	b32_userid(&buf[1], userid);
 
 	if (lazymode)
-		buf[2] = 'l';
+		buf[3] = 'l';
 	else
-		buf[2] = 'i';
+		buf[3] = 'i';
 
-	buf[3] = b32_5to8((rand_seed >> 10) & 0x1f);
-	buf[4] = b32_5to8((rand_seed >> 5) & 0x1f);
-	buf[5] = b32_5to8((rand_seed ) & 0x1f);
+	buf[4] = b32_5to8((rand_seed >> 10) & 0x1f);
+	buf[5] = b32_5to8((rand_seed >> 5) & 0x1f);
+	buf[6] = b32_5to8((rand_seed ) & 0x1f);
 	rand_seed++;
 
 	strncat(buf, topdomain, 512 - strlen(buf));
@@ -1389,11 +2220,11 @@ handshake_version(int dns_fd, int *seed)
 					((in[6] & 0xff) << 8) |
 					((in[7] & 0xff)));
 
-			if (strncmp("VACK", in, 4) == 0) {
+			if (strncmp("VACK", in, 4) == 0 && read >= 10) {
 				*seed = payload;
-				userid = in[8];
-				userid_char = hex[userid & 15];
-				userid_char2 = hex2[userid & 15];
+				userid = ((in[8] & 0xff) << 8) | (in[9] & 0xff);
+				userid_char = hex[(userid >> 5) & 15];
+				userid_char2 = hex2[(userid >> 5) & 15];
 
 				fprintf(stderr, "Version ok, both using protocol v 0x%08x. You are user #%d\n",
 					PROTOCOL_VERSION, userid);
@@ -2104,6 +2935,362 @@ codec_revert:
 	fprintf(stderr, "Falling back to downstream codec Base32\n");
 }
 
+static int
+use_server_compression(char *in, int read)
+/* Take over the compressors from a "up/down:level" reply. Returns 0 if
+   it was one. */
+{
+	const struct compressor *up;
+	const struct compressor *down;
+	char *slash;
+	char *colon;
+	char *end;
+	int level;
+
+	in[read] = 0; /* zero terminate */
+	slash = strchr(in, '/');
+	colon = strchr(in, ':');
+	if (!slash || !colon || colon < slash)
+		return -1;
+	*slash = 0;
+	*colon = 0;
+	up = compressor_by_name(in);
+	down = compressor_by_name(slash + 1);
+	level = strtol(colon + 1, &end, 10);
+	*slash = '/';
+	*colon = ':';
+	if (!up || !down || colon[1] == 0 || *end != 0)
+		return -1;
+
+	if (up != upcomp)
+		uplevel = up->default_level;
+	upcomp = up;
+	downcomp = down;
+	downlevel = level;
+	/* Server started a new stream as well */
+	if (upcomp->stream || downcomp->stream) {
+		compress_stream_free(zstream);
+		zstream = compress_stream_new();
+		if (!zstream)
+			err(1, "allocating compression stream");
+	}
+	return 0;
+}
+
+static int
+handshake_query_compression(int dns_fd)
+/* Ask which compressors the server uses, after a switch it may or may
+   not have done. Returns 0 if both ends now use its answer. */
+{
+	char in[4096];
+	int i;
+	int read;
+
+	for (i=0; running && i<5 ;i++) {
+
+		send_compression_query(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (use_server_compression(in, read))
+				return -1;
+			fprintf(stderr, "Server uses compression %s\n", in);
+			return 0;
+		}
+
+		fprintf(stderr, "Retrying compression query...\n");
+	}
+	return -1;
+}
+
+static void
+handshake_switch_compression(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching compression to %s upstream, %s level %d downstream\n",
+		upcomp->name, downcomp->name, downlevel);
+	for (i=0; running && i<5 ;i++) {
+
+		send_compression_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto compression_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto compression_revert;
+			} else if (strncmp("BADCODEC", in, 8) == 0) {
+				fprintf(stderr, "Server does not support the selected compression. ");
+				goto compression_revert;
+			}
+			if (use_server_compression(in, read)) {
+				fprintf(stderr, "Server sent an unknown compression. ");
+				goto compression_query;
+			}
+			fprintf(stderr, "Server switched compression to %s\n", in);
+			return;
+		}
+
+		fprintf(stderr, "Retrying compression switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on compression switch. ");
+
+compression_query:
+	/* The server may have switched all the same */
+	fprintf(stderr, "Asking which compression it uses\n");
+	if (handshake_query_compression(dns_fd) == 0 || !running)
+		return;
+	fprintf(stderr, "No reply from server on compression query. ");
+
+compression_revert:
+	fprintf(stderr, "Falling back to zlib compression\n");
+	upcomp = &zlib_ops;
+	uplevel = 9;
+	downcomp = &zlib_ops;
+	downlevel = 9;
+}
+
+static void
+handshake_switch_dict(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching to compression dictionary %08x\n", dict->id);
+	for (i=0; running && i<5 ;i++) {
+
+		send_dict_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto dict_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto dict_revert;
+			} else if (strncmp("BADDICT", in, 7) == 0) {
+				fprintf(stderr, "Server does not know the dictionary. ");
+				goto dict_revert;
+			}
+			fprintf(stderr, "Server switched to the dictionary\n");
+			/* Server started a new stream as well */
+			if (zstream) {
+				compress_stream_free(zstream);
+				zstream = compress_stream_new();
+				if (!zstream)
+					err(1, "allocating compression stream");
+			}
+			return;
+		}
+
+		fprintf(stderr, "Retrying dictionary switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on dictionary switch. ");
+
+dict_revert:
+	fprintf(stderr, "Compressing without dictionary\n");
+	dict = NULL;
+}
+
+static void
+handshake_switch_hdrcomp(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching on TCP/IP header compression\n");
+	for (i=0; running && i<5 ;i++) {
+
+		send_hdrcomp_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto hdrcomp_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto hdrcomp_revert;
+			} else if (strncmp("Headers", in, 7) == 0) {
+				fprintf(stderr, "Server switched on header compression\n");
+				vj_comp_init(&vjcomp, 0);
+				vj_decomp_init(&vjdecomp);
+				return;
+			}
+			fprintf(stderr, "Server does not support header compression. ");
+			goto hdrcomp_revert;
+		}
+
+		fprintf(stderr, "Retrying header compression switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on header compression switch. ");
+
+hdrcomp_revert:
+	fprintf(stderr, "Sending full headers\n");
+	hdrcomp = 0;
+}
+
+static void
+handshake_switch_bundle(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching on packet bundles\n");
+	for (i=0; running && i<5 ;i++) {
+
+		send_bundle_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto bundle_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto bundle_revert;
+			} else if (strncmp("Bundle", in, 6) == 0) {
+				fprintf(stderr, "Server switched on packet bundles\n");
+				return;
+			}
+			fprintf(stderr, "Server does not support packet bundles. ");
+			goto bundle_revert;
+		}
+
+		fprintf(stderr, "Retrying packet bundle switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on packet bundle switch. ");
+
+bundle_revert:
+	fprintf(stderr, "Sending packets one by one\n");
+	bundle = 0;
+}
+
+static void
+handshake_switch_window(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching to windows of %d fragments downstream, %d upstream\n",
+		downwindow, upwindow);
+	for (i=0; running && i<5 ;i++) {
+
+		send_window_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto window_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto window_revert;
+			} else if (read > 7 && strncmp("Window:", in, 7) == 0) {
+				in[MIN(read, sizeof(in) - 1)] = 0; /* zero terminate */
+				if (sscanf(&in[7], "%d/%d", &downwindow, &upwindow) != 2)
+					goto window_revert;
+				fprintf(stderr, "Server switched to windows of %d fragments downstream, %d upstream\n",
+					downwindow, upwindow);
+				window_in_init(&downwin, downfrags, WINDOW_FRAG_MAX);
+				window_out_init(&upwin, upwindow);
+				polltarget = 1;
+				return;
+			}
+			fprintf(stderr, "Server does not support a downstream window. ");
+			goto window_revert;
+		}
+
+		fprintf(stderr, "Retrying window switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on window switch. ");
+
+window_revert:
+	fprintf(stderr, "Sending one fragment at a time\n");
+	downwindow = 0;
+	upwindow = 0;
+}
+
+static void
+handshake_switch_fec(int dns_fd)
+{
+	char in[4096];
+	int i;
+	int read;
+
+	fprintf(stderr, "Switching to one parity fragment per %d data fragments\n",
+		fec);
+	for (i=0; running && i<5 ;i++) {
+
+		send_fec_switch(dns_fd, userid);
+
+		read = handshake_waitdns(dns_fd, in, sizeof(in), 'o', 'O', i+1);
+
+		if (read > 0) {
+			if (strncmp("BADLEN", in, 6) == 0) {
+				fprintf(stderr, "Server got bad message length. ");
+				goto fec_revert;
+			} else if (strncmp("BADIP", in, 5) == 0) {
+				fprintf(stderr, "Server rejected sender IP address. ");
+				goto fec_revert;
+			} else if (read > 4 && strncmp("FEC:", in, 4) == 0) {
+				in[MIN(read, sizeof(in) - 1)] = 0; /* zero terminate */
+				if (sscanf(&in[4], "%d", &fec) != 1)
+					goto fec_revert;
+				fec = MAX(0, MIN(fec, WINDOW_MAX));
+				fprintf(stderr, "Server switched to one parity fragment per %d data fragments\n",
+					fec);
+				window_out_fec(&upwin, fec);
+				window_in_fec(&downwin, fec > 0);
+				return;
+			}
+			fprintf(stderr, "Server does not support parity fragments. ");
+			goto fec_revert;
+		}
+
+		fprintf(stderr, "Retrying FEC switch...\n");
+	}
+	if (!running)
+		return;
+
+	fprintf(stderr, "No reply from server on FEC switch. ");
+
+fec_revert:
+	fprintf(stderr, "Sending without parity fragments\n");
+	fec = 0;
+}
+
 static void
 handshake_try_lazy(int dns_fd)
 {
@@ -2388,6 +3575,31 @@ client_handshake(int dns_fd, int raw_mode, int autodetect_frag_size, int fragsiz
 		return r;
 	}
 
+	/* Server starts every user on zlib level 9 */
+	if (upcomp != &zlib_ops || downcomp != &zlib_ops || downlevel != 9) {
+		handshake_switch_compression(dns_fd);
+		if (!running)
+			return -1;
+	}
+
+	if (dict) {
+		handshake_switch_dict(dns_fd);
+		if (!running)
+			return -1;
+	}
+
+	if (hdrcomp) {
+		handshake_switch_hdrcomp(dns_fd);
+		if (!running)
+			return -1;
+	}
+
+	if (bundle) {
+		handshake_switch_bundle(dns_fd);
+		if (!running)
+			return -1;
+	}
+
 	if (raw_mode && handshake_raw_udp(dns_fd, seed)) {
 		conn = CONN_RAW_UDP;
 		selecttimeout = 20;
@@ -2448,6 +3660,19 @@ client_handshake(int dns_fd, int raw_mode, int autodetect_frag_size, int fragsiz
 		handshake_set_fragsize(dns_fd, fragsize);
 		if (!running)
 			return -1;
+
+		if (downwindow) {
+			handshake_switch_window(dns_fd);
+			if (!running)
+				return -1;
+		}
+
+		/* Parity fragments need room in windows both ways */
+		if (fec && downwindow >= 2 && upwindow >= 2) {
+			handshake_switch_fec(dns_fd);
+			if (!running)
+				return -1;
+		}
 	}
 
 	return 0;
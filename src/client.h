@@ -20,11 +20,13 @@
 
 void client_init(void);
 void client_stop(void);
+void client_request_stats(void);
+void client_print_stats(void);
 
 enum connection client_get_conn(void);
 const char *client_get_raw_addr(void);
 
-void client_set_nameserver(struct sockaddr_storage *, int);
+int client_add_nameserver(struct sockaddr_storage *, int);
 void client_set_topdomain(const char *cp);
 void client_set_password(const char *cp);
 int client_set_qtype(char *qtype);
@@ -33,6 +35,13 @@ void client_set_downenc(char *encoding);
 void client_set_selecttimeout(int select_timeout);
 void client_set_lazymode(int lazy_mode);
 void client_set_hostname_maxlen(int i);
+int client_set_compression(const char *spec);
+void client_set_hdrcomp(int on);
+void client_set_bundle(int on);
+void client_set_window(int size);
+void client_set_fec(int group);
+void client_set_hedge(int on, int fd);
+int client_set_dict(const char *spec);
 
 int client_handshake(int dns_fd, int raw_mode, int autodetect_frag_size,
 		     int fragsize);
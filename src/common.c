@@ -54,7 +54,7 @@
 #include "common.h"
 
 /* The raw header used when not using DNS protocol */
-const unsigned char raw_header[RAW_HDR_LEN] = { 0x10, 0xd1, 0x9e, 0x00 };
+const unsigned char raw_header[RAW_HDR_LEN] = { 0x10, 0xd1, 0x9e, 0x00, 0x00 };
 
 /* daemon(3) exists only in 4.4BSD or later, and in GNU libc */
 #if !defined(ANDROID) && !defined(WINDOWS32) && !(defined(BSD) && (BSD >= 199306)) && !defined(__GLIBC__)
@@ -115,7 +115,7 @@ check_superuser(void)
 char *
 format_addr(struct sockaddr_storage *sockaddr, int sockaddr_len)
 {
-	static char dst[INET6_ADDRSTRLEN + 1];
+	static __thread char dst[INET6_ADDRSTRLEN + 1];
 
 	memset(dst, 0, sizeof(dst));
 	if (sockaddr->ss_family == AF_INET && sockaddr_len >= sizeof(struct sockaddr_in)) {
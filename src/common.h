@@ -18,18 +18,29 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
-/* Last byte of raw header is the command */
-#define RAW_HDR_LEN 4
+/* After the ident comes the command, sharing its byte with the
+   compression flag and the upper 4 bits of the user id, and then the
+   lower 8 bits of the user id */
+#define RAW_HDR_LEN 5
 #define RAW_HDR_IDENT_LEN 3
 #define RAW_HDR_CMD 3
+#define RAW_HDR_USR 4
 #define RAW_HDR_CMD_LOGIN 0x10
 #define RAW_HDR_CMD_DATA  0x20
 #define RAW_HDR_CMD_PING  0x30
 
-#define RAW_HDR_CMD_MASK  0xF0
+#define RAW_HDR_COMPRESSED 0x80	/* data payload is compressed */
+
+#define RAW_HDR_CMD_MASK  0x70
 #define RAW_HDR_USR_MASK  0x0F
 #define RAW_HDR_GET_CMD(x) ((x)[RAW_HDR_CMD] & RAW_HDR_CMD_MASK)
-#define RAW_HDR_GET_USR(x) ((x)[RAW_HDR_CMD] & RAW_HDR_USR_MASK)
+#define RAW_HDR_GET_COMPRESSED(x) ((x)[RAW_HDR_CMD] & RAW_HDR_COMPRESSED)
+#define RAW_HDR_GET_USR(x) ((((x)[RAW_HDR_CMD] & RAW_HDR_USR_MASK) << 8) | \
+			    ((x)[RAW_HDR_USR] & 0xFF))
+#define RAW_HDR_SET_CMD(x, cmd, usr) do { \
+		(x)[RAW_HDR_CMD] = (cmd) | (((usr) >> 8) & RAW_HDR_USR_MASK); \
+		(x)[RAW_HDR_USR] = (usr) & 0xFF; \
+	} while (0)
 extern const unsigned char raw_header[RAW_HDR_LEN];
 
 #ifdef WINDOWS32
@@ -81,6 +92,7 @@ struct packet
 	char data[64*1024];	/* The data */
 	char seqno;		/* The packet sequence number */
 	char fragment;		/* Fragment index */
+	char compressed;	/* Data is compressed */
 };
 
 struct query {
@@ -0,0 +1,942 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#ifdef HAVE_LZ4_ATTACH
+#define LZ4_STATIC_LINKING_ONLY
+#define LZ4_HC_STATIC_LINKING_ONLY
+#endif
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "common.h"
+#include "compress.h"
+#include "md5.h"
+
+static int
+nocompress_compress(char *out, unsigned long *outlen,
+		    const char *in, unsigned long inlen, int level,
+		    const struct compress_dict *dict)
+{
+	if (inlen > *outlen)
+		return -1;
+	memcpy(out, in, inlen);
+	*outlen = inlen;
+	return 0;
+}
+
+static int
+nocompress_uncompress(char *out, unsigned long *outlen,
+		      const char *in, unsigned long inlen,
+		      const struct compress_dict *dict)
+{
+	return nocompress_compress(out, outlen, in, inlen, 0, dict);
+}
+
+const struct compressor nocompress_ops = {
+	"none", 'n', 0, 0, 0,
+	nocompress_compress, nocompress_uncompress
+};
+
+static int
+zlib_compress(char *out, unsigned long *outlen,
+	      const char *in, unsigned long inlen, int level,
+	      const struct compress_dict *dict)
+{
+	uLongf len = *outlen;
+	z_stream z;
+	int ret;
+
+	if (!dict) {
+		if (compress2((Bytef *) out, &len, (const Bytef *) in, inlen, level) != Z_OK)
+			return -1;
+		*outlen = len;
+		return 0;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit(&z, level) != Z_OK)
+		return -1;
+	deflateSetDictionary(&z, (const Bytef *) dict->data, dict->len);
+	z.next_in = (Bytef *) in;
+	z.avail_in = inlen;
+	z.next_out = (Bytef *) out;
+	z.avail_out = *outlen;
+	ret = deflate(&z, Z_FINISH);
+	*outlen = z.total_out;
+	deflateEnd(&z);
+	return ret == Z_STREAM_END ? 0 : -1;
+}
+
+static int
+zlib_uncompress(char *out, unsigned long *outlen,
+		const char *in, unsigned long inlen,
+		const struct compress_dict *dict)
+{
+	uLongf len = *outlen;
+	z_stream z;
+	int ret;
+
+	if (!dict) {
+		if (uncompress((Bytef *) out, &len, (const Bytef *) in, inlen) != Z_OK)
+			return -1;
+		*outlen = len;
+		return 0;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK)
+		return -1;
+	z.next_in = (Bytef *) in;
+	z.avail_in = inlen;
+	z.next_out = (Bytef *) out;
+	z.avail_out = *outlen;
+	ret = inflate(&z, Z_FINISH);
+	if (ret == Z_NEED_DICT) {
+		/* Fails if the packet names another dictionary */
+		if (inflateSetDictionary(&z, (const Bytef *) dict->data, dict->len) == Z_OK)
+			ret = inflate(&z, Z_FINISH);
+	}
+	*outlen = z.total_out;
+	inflateEnd(&z);
+	return ret == Z_STREAM_END ? 0 : -1;
+}
+
+const struct compressor zlib_ops = {
+	"zlib", 'z', 1, 9, 9,
+	zlib_compress, zlib_uncompress
+};
+
+/* Same as zlib where there is no stream, like in raw mode */
+const struct compressor zstream_ops = {
+	"zstream", 'y', 1, 9, 6,
+	zlib_compress, zlib_uncompress, 1
+};
+
+struct compress_stream {
+	z_stream def;
+	z_stream inf;
+	char def_init;
+	char inf_init;
+	char restart;		/* start over with next compressed packet */
+	char broken;		/* lost packets, waiting for the sender to restart */
+	int def_level;
+	int def_seq;
+	int inf_seq;		/* next expected, -1 before a restart */
+};
+
+/* Sync flush ends each packet with an empty stored block, which is
+   left out on the wire and put back before inflating */
+static const unsigned char sync_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+struct compress_stream *
+compress_stream_new(void)
+/* zlib state is allocated on first use, only one half is used on
+   each end of a direction */
+{
+	struct compress_stream *st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	st->restart = 1;
+	st->inf_seq = -1;
+	return st;
+}
+
+void
+compress_stream_free(struct compress_stream *st)
+{
+	if (!st)
+		return;
+	if (st->def_init)
+		deflateEnd(&st->def);
+	if (st->inf_init)
+		inflateEnd(&st->inf);
+	free(st);
+}
+
+void
+compress_stream_restart(struct compress_stream *st)
+/* A compressed packet was lost on the way, or the other end asked
+   for it: the next packet is compressed without history */
+{
+	if (st)
+		st->restart = 1;
+}
+
+int
+compress_stream_broken(const struct compress_stream *st)
+/* Returns 1 if received packets were dropped since the last restart */
+{
+	return st && st->broken;
+}
+
+static int
+stream_compress(struct compress_stream *st, const struct compress_dict *dict,
+		int level, char *out, unsigned long *outlen,
+		const char *in, unsigned long inlen)
+{
+	unsigned long len;
+
+	if (*outlen < 1 + sizeof(sync_tail))
+		return -1;
+
+	if (!st->def_init) {
+		if (deflateInit2(&st->def, level, Z_DEFLATED, -COMPRESS_STREAM_WBITS,
+				 COMPRESS_STREAM_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+			return -1;
+		st->def_init = 1;
+		st->def_level = level;
+		st->restart = 1;
+	}
+	if (st->restart) {
+		deflateReset(&st->def);
+		if (dict)
+			deflateSetDictionary(&st->def, (const Bytef *) dict->data, dict->len);
+		st->def_seq = 0;
+	}
+
+	st->def.next_out = (Bytef *) out + 1;
+	st->def.avail_out = *outlen - 1;
+	if (level != st->def_level) {
+		/* Nothing is pending after the last sync flush */
+		if (deflateParams(&st->def, level, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto fail;
+		st->def_level = level;
+	}
+	st->def.next_in = (Bytef *) in;
+	st->def.avail_in = inlen;
+	if (deflate(&st->def, Z_SYNC_FLUSH) != Z_OK ||
+	    st->def.avail_in != 0 || st->def.avail_out == 0)
+		goto fail;
+
+	len = *outlen - st->def.avail_out;
+	if (len < 1 + sizeof(sync_tail) ||
+	    memcmp(out + len - sizeof(sync_tail), sync_tail, sizeof(sync_tail)))
+		goto fail;
+	*outlen = len - sizeof(sync_tail);
+
+	out[0] = (st->restart ? COMPRESS_STREAM_RESTART : 0) | st->def_seq;
+	st->def_seq = (st->def_seq + 1) & 0x7f;
+	st->restart = 0;
+	return 0;
+fail:
+	/* Partly fed, the other end can't follow */
+	st->restart = 1;
+	return -1;
+}
+
+static int
+stream_inflate(struct compress_stream *st, const unsigned char *in, unsigned long inlen)
+{
+	int ret;
+
+	st->inf.next_in = (Bytef *) in;
+	st->inf.avail_in = inlen;
+	ret = inflate(&st->inf, Z_SYNC_FLUSH);
+	/* Z_BUF_ERROR when there was nothing to do */
+	if ((ret != Z_OK && ret != Z_BUF_ERROR) || st->inf.avail_in != 0)
+		return -1;
+	if (st->inf.avail_out == 0)
+		return -1;	/* may have more, packet too big */
+	return 0;
+}
+
+static int
+stream_uncompress(struct compress_stream *st, const struct compress_dict *dict,
+		  char *out, unsigned long *outlen,
+		  const char *in, unsigned long inlen)
+{
+	int seq;
+
+	if (inlen < 1)
+		return -1;
+
+	seq = in[0] & 0x7f;
+	if (in[0] & COMPRESS_STREAM_RESTART) {
+		if (!st->inf_init) {
+			if (inflateInit2(&st->inf, -COMPRESS_STREAM_WBITS) != Z_OK)
+				return -1;
+			st->inf_init = 1;
+		}
+		inflateReset(&st->inf);
+		if (dict)
+			inflateSetDictionary(&st->inf, (const Bytef *) dict->data, dict->len);
+		st->inf_seq = seq;
+		st->broken = 0;
+	}
+	if (seq != st->inf_seq)
+		goto fail;
+
+	st->inf.next_out = (Bytef *) out;
+	st->inf.avail_out = *outlen;
+	if (stream_inflate(st, (const unsigned char *) in + 1, inlen - 1) ||
+	    stream_inflate(st, sync_tail, sizeof(sync_tail)))
+		goto fail;
+
+	*outlen -= st->inf.avail_out;
+	st->inf_seq = (seq + 1) & 0x7f;
+	return 0;
+fail:
+	st->inf_seq = -1;
+	st->broken = 1;
+	return -1;
+}
+
+static struct compress_dict builtin_dict;
+static struct compress_dict loaded_dicts[COMPRESS_DICTS];
+static int loaded_dict_count;
+
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+/* LZ4 and zstd state primed with a dictionary, built the first time it
+   is needed and then shared by all threads. Where the level is part of
+   it, there is one for each level used. Each thread compresses in
+   contexts of its own, kept between packets. */
+#define DICT_LEVELS (COMPRESS_LEVEL_MAX - COMPRESS_LEVEL_MIN + 1)
+
+static struct dict_state {
+#ifdef HAVE_LZ4
+	LZ4_stream_t *lz4;
+	LZ4_streamHC_t *lz4hc[DICT_LEVELS];
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CDict *cdict[DICT_LEVELS];
+	ZSTD_DDict *ddict;
+#endif
+} dict_states[1 + COMPRESS_DICTS];
+
+static struct dict_state *
+dict_state(const struct compress_dict *dict)
+{
+	if (dict == &builtin_dict)
+		return &dict_states[0];
+	return &dict_states[1 + (dict - loaded_dicts)];
+}
+
+static int
+dict_state_set(void *slot, void *made)
+/* Stores made at slot unless another thread got there first. Returns 0
+   if it did, then made is to be freed and slot read again. */
+{
+	void *expected = NULL;
+
+	return __atomic_compare_exchange_n((void **) slot, &expected, made, 0,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+#ifdef HAVE_LZ4
+static __thread LZ4_stream_t *lz4_work;
+static __thread LZ4_streamHC_t *lz4hc_work;
+
+static LZ4_stream_t *
+lz4_dict_stream(const struct compress_dict *dict)
+{
+	struct dict_state *ds = dict_state(dict);
+	LZ4_stream_t *stream;
+
+	stream = __atomic_load_n(&ds->lz4, __ATOMIC_ACQUIRE);
+	if (stream)
+		return stream;
+	stream = LZ4_createStream();
+	if (!stream)
+		return NULL;
+	LZ4_loadDict(stream, dict->data, dict->len);
+	if (!dict_state_set(&ds->lz4, stream)) {
+		LZ4_freeStream(stream);
+		stream = __atomic_load_n(&ds->lz4, __ATOMIC_ACQUIRE);
+	}
+	return stream;
+}
+
+static LZ4_streamHC_t *
+lz4hc_dict_stream(const struct compress_dict *dict, int level)
+{
+	struct dict_state *ds = dict_state(dict);
+	LZ4_streamHC_t **slot = &ds->lz4hc[level - COMPRESS_LEVEL_MIN];
+	LZ4_streamHC_t *stream;
+
+	stream = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (stream)
+		return stream;
+	stream = LZ4_createStreamHC();
+	if (!stream)
+		return NULL;
+	LZ4_resetStreamHC_fast(stream, level);
+	LZ4_loadDictHC(stream, dict->data, dict->len);
+	if (!dict_state_set(slot, stream)) {
+		LZ4_freeStreamHC(stream);
+		stream = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	}
+	return stream;
+}
+
+static int
+lz4_compress(char *out, unsigned long *outlen,
+	     const char *in, unsigned long inlen, int level,
+	     const struct compress_dict *dict)
+{
+	LZ4_streamHC_t *hc;
+	LZ4_stream_t *fast;
+	int len;
+
+	/* Levels below 1 are LZ4 acceleration, above 2 use LZ4HC. With a
+	   dictionary, the stream it was loaded into is attached to the
+	   reset work stream and only read from, so the dictionary is
+	   neither loaded nor copied for each packet. Builds of liblz4
+	   without the attach functions get a copy of the stream, still
+	   cheaper than loading the dictionary again. */
+	if (level > 2) {
+		if (!lz4hc_work && !(lz4hc_work = LZ4_createStreamHC()))
+			return -1;
+		if (dict) {
+			if (!(hc = lz4hc_dict_stream(dict, level)))
+				return -1;
+#ifdef HAVE_LZ4_ATTACH
+			LZ4_resetStreamHC_fast(lz4hc_work, level);
+			LZ4_attach_HC_dictionary(lz4hc_work, hc);
+#else
+			memcpy(lz4hc_work, hc, sizeof(*lz4hc_work));
+#endif
+			len = LZ4_compress_HC_continue(lz4hc_work, in, out, inlen, *outlen);
+		} else {
+			len = LZ4_compress_HC_extStateHC(lz4hc_work, in, out, inlen,
+							 *outlen, level);
+		}
+	} else {
+		if (!lz4_work && !(lz4_work = LZ4_createStream()))
+			return -1;
+		if (dict) {
+			if (!(fast = lz4_dict_stream(dict)))
+				return -1;
+#ifdef HAVE_LZ4_ATTACH
+			LZ4_resetStream_fast(lz4_work);
+			LZ4_attach_dictionary(lz4_work, fast);
+#else
+			memcpy(lz4_work, fast, sizeof(*lz4_work));
+#endif
+			len = LZ4_compress_fast_continue(lz4_work, in, out, inlen, *outlen,
+							 level < 1 ? 1 - level : 1);
+		} else {
+			len = LZ4_compress_fast_extState(lz4_work, in, out, inlen, *outlen,
+							 level < 1 ? 1 - level : 1);
+		}
+	}
+	if (len <= 0)
+		return -1;
+	*outlen = len;
+	return 0;
+}
+
+static int
+lz4_uncompress(char *out, unsigned long *outlen,
+	       const char *in, unsigned long inlen,
+	       const struct compress_dict *dict)
+{
+	int len;
+
+	if (dict)
+		len = LZ4_decompress_safe_usingDict(in, out, inlen, *outlen,
+						    dict->data, dict->len);
+	else
+		len = LZ4_decompress_safe(in, out, inlen, *outlen);
+	if (len < 0)
+		return -1;
+	*outlen = len;
+	return 0;
+}
+
+const struct compressor lz4_ops = {
+	"lz4", '4', COMPRESS_LEVEL_MIN, 12, 1,
+	lz4_compress, lz4_uncompress
+};
+#endif
+
+#ifdef HAVE_ZSTD
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+
+static ZSTD_CDict *
+zstd_cdict(const struct compress_dict *dict, int level)
+{
+	struct dict_state *ds = dict_state(dict);
+	ZSTD_CDict **slot = &ds->cdict[level - COMPRESS_LEVEL_MIN];
+	ZSTD_CDict *cdict;
+
+	cdict = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (cdict)
+		return cdict;
+	cdict = ZSTD_createCDict(dict->data, dict->len, level);
+	if (!cdict)
+		return NULL;
+	if (!dict_state_set(slot, cdict)) {
+		ZSTD_freeCDict(cdict);
+		cdict = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	}
+	return cdict;
+}
+
+static ZSTD_DDict *
+zstd_ddict(const struct compress_dict *dict)
+{
+	struct dict_state *ds = dict_state(dict);
+	ZSTD_DDict *ddict;
+
+	ddict = __atomic_load_n(&ds->ddict, __ATOMIC_ACQUIRE);
+	if (ddict)
+		return ddict;
+	ddict = ZSTD_createDDict(dict->data, dict->len);
+	if (!ddict)
+		return NULL;
+	if (!dict_state_set(&ds->ddict, ddict)) {
+		ZSTD_freeDDict(ddict);
+		ddict = __atomic_load_n(&ds->ddict, __ATOMIC_ACQUIRE);
+	}
+	return ddict;
+}
+
+static int
+zstd_compress(char *out, unsigned long *outlen,
+	      const char *in, unsigned long inlen, int level,
+	      const struct compress_dict *dict)
+{
+	ZSTD_CDict *cdict;
+	size_t len;
+
+	if (!zstd_cctx && !(zstd_cctx = ZSTD_createCCtx()))
+		return -1;
+	if (dict) {
+		if (!(cdict = zstd_cdict(dict, level)))
+			return -1;
+		len = ZSTD_compress_usingCDict(zstd_cctx, out, *outlen, in, inlen, cdict);
+	} else {
+		len = ZSTD_compressCCtx(zstd_cctx, out, *outlen, in, inlen, level);
+	}
+	if (ZSTD_isError(len))
+		return -1;
+	*outlen = len;
+	return 0;
+}
+
+static int
+zstd_uncompress(char *out, unsigned long *outlen,
+		const char *in, unsigned long inlen,
+		const struct compress_dict *dict)
+{
+	ZSTD_DDict *ddict;
+	size_t len;
+
+	if (!zstd_dctx && !(zstd_dctx = ZSTD_createDCtx()))
+		return -1;
+	if (dict) {
+		if (!(ddict = zstd_ddict(dict)))
+			return -1;
+		len = ZSTD_decompress_usingDDict(zstd_dctx, out, *outlen, in, inlen, ddict);
+	} else {
+		len = ZSTD_decompressDCtx(zstd_dctx, out, *outlen, in, inlen);
+	}
+	if (ZSTD_isError(len))
+		return -1;
+	*outlen = len;
+	return 0;
+}
+
+/* Negative levels are the zstd fast modes */
+const struct compressor zstd_ops = {
+	"zstd", 's', COMPRESS_LEVEL_MIN, 19, 3,
+	zstd_compress, zstd_uncompress
+};
+#endif
+
+static const struct compressor *compressors[] = {
+	&nocompress_ops,
+	&zlib_ops,
+	&zstream_ops,
+#ifdef HAVE_LZ4
+	&lz4_ops,
+#endif
+#ifdef HAVE_ZSTD
+	&zstd_ops,
+#endif
+	NULL
+};
+
+/* Built-in dictionary: byte patterns common in tunneled IPv4 traffic.
+   Deflate finds close matches cheaper, so the most frequent ones, the
+   tun and IP/TCP headers, come last. */
+static const char builtin_dict_data[] =
+	/* HTTP */
+	"HTTP/1.1 200 OK\r\nDate: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+	"Server: nginx\r\nContent-Type: text/html; charset=UTF-8\r\n"
+	"Content-Length: Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n"
+	"Cache-Control: no-cache, max-age=0\r\nLast-Modified: ETag: \"\r\n"
+	"Content-Encoding: gzip\r\nVary: Accept-Encoding\r\nLocation: https://\r\n"
+	"GET / HTTP/1.1\r\nHost: www.\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) "
+	"AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate, br\r\n"
+	"Cookie: Referer: http://www..com/index.html\r\n\r\n"
+	/* SSH */
+	"SSH-2.0-OpenSSH_9.6\r\n"
+	"curve25519-sha256,ecdh-sha2-nistp256,diffie-hellman-group14-sha256,"
+	"ssh-ed25519,rsa-sha2-512,rsa-sha2-256,chacha20-poly1305@openssh.com,"
+	"aes128-ctr,aes256-gcm@openssh.com,umac-64-etm@openssh.com,hmac-sha2-256,"
+	"none,zlib@openssh.com"
+	/* DNS queries and answers inside the tunnel */
+	"\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x03www\x06google\x03" "com\x00\x00\x01\x00\x01"
+	"\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00\xc0\x0c\x00\x01\x00\x01\x00\x00\x01\x2c\x00\x04"
+	/* TLS: client hello with common extensions, records */
+	"\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03"
+	"\x00\x20\x13\x01\x13\x02\x13\x03\xc0\x2b\xc0\x2f\xc0\x2c\xc0\x30\xcc\xa9\xcc\xa8"
+	"\x01\x00\x01\x93\x00\x00\x00\x10\x00\x0e\x00\x00\x0b"
+	"\x00\x17\x00\x00\xff\x01\x00\x01\x00\x00\x0a\x00\x08\x00\x06\x00\x1d\x00\x17\x00\x18"
+	"\x00\x0b\x00\x02\x01\x00\x00\x23\x00\x00\x00\x10\x00\x0e\x00\x0c\x02h2\x08http/1.1"
+	"\x00\x0d\x00\x14\x00\x12\x04\x03\x08\x04\x04\x01\x05\x03\x08\x05\x05\x01\x08\x06\x06\x01"
+	"\x00\x2b\x00\x05\x04\x03\x04\x03\x03\x00\x2d\x00\x02\x01\x01"
+	"\x00\x33\x00\x26\x00\x24\x00\x1d\x00\x20"
+	"\x16\x03\x03\x00\x7a\x02\x00\x00\x76\x03\x03\x14\x03\x03\x00\x01\x01"
+	"\x15\x03\x03\x00\x02\x02\x00\x17\x03\x03\x00\x17\x03\x03\x01\x17\x03\x03"
+	/* ICMP echo, UDP over IPv4 */
+	"\x00\x00\x08\x00\x45\x00\x00\x54\x00\x00\x40\x00\x40\x01\x08\x00"
+	"\x00\x00\x08\x00\x45\x00\x00\x3c\x00\x00\x40\x00\x40\x11\x00\x35"
+	/* TCP over IPv4: SYN options, then data and ACKs with timestamps */
+	"\x00\x00\x08\x00\x45\x00\x00\x3c\x00\x00\x40\x00\x40\x06"
+	"\xa0\x02\xfa\xf0\x00\x00\x00\x00\x02\x04\x05\xb4\x04\x02\x08\x0a"
+	"\x00\x00\x00\x00\x00\x00\x00\x00\x01\x03\x03\x07"
+	"\x00\x00\x08\x00\x45\x00\x05\xdc\x00\x00\x40\x00\x40\x06\x00\x00\x80\x18\x01\xf5"
+	"\x00\x00\x01\x01\x08\x0a\x00\x00\x08\x00\x45\x00\x00\x34\x00\x00\x40\x00\x40\x06"
+	"\x00\x00\x80\x10\x01\xf5\x00\x00\x01\x01\x08\x0a"
+	"\x00\x00\x08\x00\x45\x00\x00\x34\x00\x00\x40\x00\x40\x06";
+
+static uint32_t
+dict_id(const char *data, unsigned long len)
+{
+	md5_state_t ctx;
+	md5_byte_t digest[16];
+
+	md5_init(&ctx);
+	md5_append(&ctx, (const md5_byte_t *) data, len);
+	md5_finish(&ctx, digest);
+	return ((uint32_t) digest[0] << 24) | (digest[1] << 16) |
+		(digest[2] << 8) | digest[3];
+}
+
+const struct compress_dict *
+compress_dict_builtin(void)
+{
+	if (!builtin_dict.data) {
+		/* Without the terminating zero */
+		builtin_dict.len = sizeof(builtin_dict_data) - 1;
+		builtin_dict.id = dict_id(builtin_dict_data, builtin_dict.len);
+		builtin_dict.data = builtin_dict_data;
+	}
+	return &builtin_dict;
+}
+
+const struct compress_dict *
+compress_dict_load(const char *file)
+/* Read a dictionary, like one trained with "zstd --train", and make it
+   known to compress_dict_by_id(). Returns NULL on failure. */
+{
+	struct compress_dict *dict;
+	char *data;
+	FILE *f;
+	long len;
+
+	if (loaded_dict_count >= COMPRESS_DICTS) {
+		warnx("%s: too many dictionaries (max %d)", file, COMPRESS_DICTS);
+		return NULL;
+	}
+
+	f = fopen(file, "rb");
+	if (!f) {
+		warn("%s", file);
+		return NULL;
+	}
+	data = malloc(COMPRESS_DICT_MAX + 1);
+	if (!data) {
+		fclose(f);
+		warnx("%s: out of memory", file);
+		return NULL;
+	}
+	len = fread(data, 1, COMPRESS_DICT_MAX + 1, f);
+	fclose(f);
+	if (len <= 0 || len > COMPRESS_DICT_MAX) {
+		warnx("%s: dictionary must be 1 to %d bytes", file, COMPRESS_DICT_MAX);
+		free(data);
+		return NULL;
+	}
+
+	dict = &loaded_dicts[loaded_dict_count++];
+	dict->data = data;
+	dict->len = len;
+	dict->id = dict_id(data, len);
+	return dict;
+}
+
+const struct compress_dict *
+compress_dict_by_id(uint32_t id)
+{
+	int i;
+
+	if (compress_dict_builtin()->id == id)
+		return &builtin_dict;
+	for (i = 0; i < loaded_dict_count; i++) {
+		if (loaded_dicts[i].id == id)
+			return &loaded_dicts[i];
+	}
+	return NULL;
+}
+
+const struct compressor *
+compressor_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; compressors[i]; i++) {
+		if (!strcasecmp(name, compressors[i]->name))
+			return compressors[i];
+	}
+	return NULL;
+}
+
+const struct compressor *
+compressor_by_id(char id)
+{
+	int i;
+
+	for (i = 0; compressors[i]; i++) {
+		if (tolower(id) == compressors[i]->id)
+			return compressors[i];
+	}
+	return NULL;
+}
+
+int
+compressor_level(const struct compressor *comp, int level)
+/* Returns level limited to what comp supports */
+{
+	if (level < comp->min_level)
+		return comp->min_level;
+	if (level > comp->max_level)
+		return comp->max_level;
+	return level;
+}
+
+int
+compressor_parse(const char *spec, const struct compressor **comp, int *level)
+/* Parse "name[:level]". Returns 0 on success. */
+{
+	char name[16];
+	const char *colon;
+	char *end;
+	size_t len;
+
+	colon = strchr(spec, ':');
+	len = colon ? colon - spec : strlen(spec);
+	if (len >= sizeof(name))
+		return -1;
+	memcpy(name, spec, len);
+	name[len] = 0;
+
+	*comp = compressor_by_name(name);
+	if (!*comp)
+		return -1;
+
+	*level = (*comp)->default_level;
+	if (colon) {
+		*level = strtol(colon + 1, &end, 10);
+		if (colon[1] == 0 || *end != 0 ||
+		    *level < COMPRESS_LEVEL_MIN || *level > COMPRESS_LEVEL_MAX)
+			return -1;
+		*level = compressor_level(*comp, *level);
+	}
+	return 0;
+}
+
+static int
+incompressible(const char *in, unsigned long len)
+/* Guess from a sample of the bytes if data is already compressed or
+   encrypted. Returns 1 if the bytes look random. */
+{
+	unsigned short count[256];
+	unsigned long step;
+	unsigned long sum;
+	unsigned long i;
+	int n;
+
+	if (len < COMPRESS_SAMPLE_MIN)
+		return 0;
+
+	memset(count, 0, sizeof(count));
+	step = len / COMPRESS_SAMPLE_MIN;
+	for (i = 0, n = 0; n < COMPRESS_SAMPLE_MIN; i += step, n++)
+		count[(unsigned char) in[i]]++;
+
+	/* Sum of squared counts is about 2n for random bytes, compressible
+	   data has fewer distinct values and gives much more. */
+	sum = 0;
+	for (i = 0; i < 256; i++)
+		sum += count[i] * count[i];
+
+	return sum < 3 * COMPRESS_SAMPLE_MIN;
+}
+
+int
+compress_packet(const struct compressor *comp, struct compress_stream *st,
+		const struct compress_dict *dict, int level, char *out,
+		unsigned long *outlen, const char *in, unsigned long inlen)
+/* Compress in if that makes it smaller, otherwise copy it as is. st is
+   used with stream compressors, NULL where packets may get lost unseen.
+   dict is the preset dictionary, or NULL.
+   Returns 1 if out is compressed, 0 if not, -1 if out is too small. */
+{
+	unsigned long len;
+
+	if (comp != &nocompress_ops && !incompressible(in, inlen)) {
+		len = *outlen;
+		if (comp->stream && st) {
+			/* Once fed to the stream it must be sent, even
+			   if it grew by a few bytes */
+			if (stream_compress(st, dict, level, out, &len, in, inlen) == 0) {
+				*outlen = len;
+				return 1;
+			}
+		} else if (comp->compress(out, &len, in, inlen, level, dict) == 0 && len < inlen) {
+			*outlen = len;
+			return 1;
+		}
+	}
+
+	if (inlen > *outlen)
+		return -1;
+	memcpy(out, in, inlen);
+	*outlen = inlen;
+	return 0;
+}
+
+int
+uncompress_packet(const struct compressor *comp, struct compress_stream *st,
+		  const struct compress_dict *dict, char *out,
+		  unsigned long *outlen, const char *in, unsigned long inlen)
+/* Undo compress_packet() for a packet with the compressed flag, with the
+   same st and dict. Returns 0 on success. */
+{
+	if (comp->stream && st)
+		return stream_uncompress(st, dict, out, outlen, in, inlen);
+	return comp->uncompress(out, outlen, in, inlen, dict);
+}
+
+void
+compress_ctl_init(struct compress_ctl *ctl, const struct compressor *comp,
+		  int level, uint64_t now)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->min_level = comp->min_level;
+	ctl->max_level = level;
+	ctl->level = level;
+	ctl->start = now;
+}
+
+void
+compress_ctl_compressed(struct compress_ctl *ctl, unsigned long len,
+			unsigned long outlen, unsigned long us, int backlog)
+/* Account for one packet compressed from len to outlen bytes, with
+   backlog packets waiting for the link */
+{
+	ctl->comp_bytes += len;
+	ctl->comp_out += outlen;
+	ctl->comp_us += us;
+	if (backlog > ctl->backlog)
+		ctl->backlog = backlog;
+}
+
+void
+compress_ctl_acked(struct compress_ctl *ctl, unsigned long len)
+/* Account for len bytes of packet data delivered over the link */
+{
+	ctl->acked += len;
+}
+
+int
+compress_ctl_need(const struct compress_ctl *ctl)
+/* Percent of a CPU needed to keep the link busy at the current level */
+{
+	if (ctl->comp_rate == 0)
+		return 0;
+	/* The link carries compressed bytes */
+	return (uint64_t) ctl->link_rate * ctl->ratio / ctl->comp_rate;
+}
+
+int
+compress_ctl_update(struct compress_ctl *ctl, uint64_t now, int budget, int cpu_used)
+/* budget and cpu_used (by all compression) are in percent of a CPU.
+   Returns 1 if ctl->level was changed. */
+{
+	uint64_t elapsed;
+	int level;
+	int need;
+
+	elapsed = now - ctl->start;
+	if (elapsed < COMPRESS_CTL_INTERVAL)
+		return 0;
+
+	/* Smooth with weight 1/2, rates change quickly with the level */
+	ctl->link_rate = (ctl->link_rate + ctl->acked * 1000 / elapsed) / 2;
+	if (ctl->comp_us > 0) {
+		ctl->comp_rate = (ctl->comp_rate +
+				  (uint64_t) ctl->comp_bytes * 1000000 / ctl->comp_us) / 2;
+	}
+	if (ctl->comp_out > 0) {
+		ctl->ratio = (ctl->ratio +
+			      (uint64_t) ctl->comp_bytes * 100 / ctl->comp_out) / 2;
+	}
+	need = compress_ctl_need(ctl);
+
+	level = ctl->level;
+	if (cpu_used > budget || need > budget)
+		level--;
+	else if (ctl->backlog > 0 && need * 2 <= budget)
+		level++;	/* bytes are expensive, spend CPU on them */
+	if (level < ctl->min_level)
+		level = ctl->min_level;
+	if (level > ctl->max_level)
+		level = ctl->max_level;
+
+	ctl->backlog = 0;
+	ctl->acked = 0;
+	ctl->comp_bytes = 0;
+	ctl->comp_out = 0;
+	ctl->comp_us = 0;
+	ctl->start = now;
+
+	if (level == ctl->level)
+		return 0;
+	ctl->level = level;
+	return 1;
+}
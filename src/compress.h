@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdint.h>
+
+/* Compression of tunneled packets. Which compressor is used in each
+   direction is negotiated per user with the 'O' option command, see
+   doc/proto_00000503.txt. */
+
+/* Preset dictionary, primes the compressor with data that small packets
+   are likely to repeat. Chosen per user with the 'O' option command by
+   its id. */
+struct compress_dict {
+	uint32_t id;		/* first 4 bytes of the MD5 of data */
+	unsigned long len;
+	const char *data;
+};
+
+#define COMPRESS_DICT_MAX (64*1024)	/* zlib uses only the last 32 KB */
+#define COMPRESS_DICTS 8		/* loaded from files */
+
+const struct compress_dict *compress_dict_builtin(void);
+const struct compress_dict *compress_dict_load(const char *file);
+const struct compress_dict *compress_dict_by_id(uint32_t id);
+
+struct compressor {
+	const char name[8];
+	char id;		/* used in 'O' option command */
+	int min_level;
+	int max_level;
+	int default_level;
+
+	/* Both return 0 on success, *outlen is the space in out on entry.
+	   dict is the preset dictionary, or NULL. */
+	int (*compress)(char *out, unsigned long *outlen,
+			const char *in, unsigned long inlen, int level,
+			const struct compress_dict *dict);
+	int (*uncompress)(char *out, unsigned long *outlen,
+			  const char *in, unsigned long inlen,
+			  const struct compress_dict *dict);
+
+	/* Compresses against earlier packets through a compress_stream
+	   where the link delivers packets in order; compress and
+	   uncompress above are used elsewhere */
+	int stream;
+};
+
+/* Levels sent in the 'O' option command must be in this range */
+#define COMPRESS_LEVEL_MIN (-10)
+#define COMPRESS_LEVEL_MAX 21
+
+extern const struct compressor nocompress_ops;
+extern const struct compressor zlib_ops;
+extern const struct compressor zstream_ops;
+#ifdef HAVE_LZ4
+extern const struct compressor lz4_ops;
+#endif
+#ifdef HAVE_ZSTD
+extern const struct compressor zstd_ops;
+#endif
+
+/* Packets at least this long are sampled to see if compressing pays off */
+#define COMPRESS_SAMPLE_MIN 256
+
+/* Deflate state kept across the packets of a session, one stream for
+   each direction: packets are compressed with a sync flush at the end
+   and prefixed with a byte holding a restart flag and a 7 bit sequence
+   number. The receiver drops packets after a gap until the sender
+   restarts the stream. */
+#define COMPRESS_STREAM_RESTART 0x80
+#define COMPRESS_STREAM_WBITS 14	/* 16 KB history */
+#define COMPRESS_STREAM_MEMLEVEL 7
+
+struct compress_stream;
+
+struct compress_stream *compress_stream_new(void);
+void compress_stream_free(struct compress_stream *st);
+void compress_stream_restart(struct compress_stream *st);
+int compress_stream_broken(const struct compress_stream *st);
+
+const struct compressor *compressor_by_name(const char *name);
+const struct compressor *compressor_by_id(char id);
+int compressor_level(const struct compressor *comp, int level);
+int compressor_parse(const char *spec, const struct compressor **comp, int *level);
+int compress_packet(const struct compressor *comp, struct compress_stream *st,
+		    const struct compress_dict *dict, int level, char *out,
+		    unsigned long *outlen, const char *in, unsigned long inlen);
+int uncompress_packet(const struct compressor *comp, struct compress_stream *st,
+		      const struct compress_dict *dict, char *out,
+		      unsigned long *outlen, const char *in, unsigned long inlen);
+
+/* Adaptive compression level. The level moves one step per interval
+   between the compressor's lowest level and the one asked for: down
+   when compressing uses more CPU than the budget, up when packets wait
+   for the link and the CPU needed to keep the link busy at the higher
+   level fits the budget. */
+
+#define COMPRESS_CTL_INTERVAL 500	/* ms between level changes */
+
+struct compress_ctl {
+	int level;			/* level to use now */
+	int min_level;
+	int max_level;			/* level asked for */
+	int backlog;			/* most packets waiting this interval */
+	unsigned long acked;		/* bytes over the link this interval */
+	unsigned long comp_bytes;	/* bytes compressed this interval */
+	unsigned long comp_out;		/* what they were compressed to */
+	unsigned long comp_us;		/* time spent on it */
+	unsigned long link_rate;	/* bytes/s over the link, smoothed */
+	unsigned long comp_rate;	/* bytes/s compressed at level, smoothed */
+	unsigned long ratio;		/* 100 * bytes in per byte out, smoothed */
+	uint64_t start;			/* ms, start of interval */
+};
+
+void compress_ctl_init(struct compress_ctl *ctl, const struct compressor *comp,
+		       int level, uint64_t now);
+void compress_ctl_compressed(struct compress_ctl *ctl, unsigned long len,
+			     unsigned long outlen, unsigned long us, int backlog);
+void compress_ctl_acked(struct compress_ctl *ctl, unsigned long len);
+int compress_ctl_need(const struct compress_ctl *ctl);
+int compress_ctl_update(struct compress_ctl *ctl, uint64_t now, int budget, int cpu_used);
+
+#endif /* __COMPRESS_H__ */
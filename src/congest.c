@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "congest.h"
+
+static void
+congest_cut(struct congest *c)
+/* Halve the window, once per window of answers */
+{
+	if (c->since_cut < c->cwnd / CONGEST_ONE)
+		return;
+
+	c->ssthresh = c->cwnd / 2;
+	if (c->ssthresh < CONGEST_ONE)
+		c->ssthresh = CONGEST_ONE;
+	c->cwnd = c->ssthresh;
+	c->since_cut = 0;
+}
+
+static void
+congest_slow(struct congest *c)
+/* Space out the queries further, see congest.h */
+{
+	unsigned long pace;
+
+	pace = CONGEST_PACE_MAX;
+	if (c->rate > 0)
+		pace = 1000000 / c->rate;
+	if (c->pace_us && pace < c->pace_us * 2)
+		pace = c->pace_us * 2;
+	if (pace > CONGEST_PACE_MAX)
+		pace = CONGEST_PACE_MAX;
+	c->pace_us = pace;
+}
+
+static void
+congest_percentile(struct congest *c, unsigned long sample_us)
+/* Keep the sample, and the 90th percentile of the ones kept */
+{
+	unsigned long sorted[CONGEST_SAMPLES];
+	unsigned long v;
+	int n;
+	int i;
+	int j;
+
+	c->samples[c->sample_at] = sample_us;
+	c->sample_at = (c->sample_at + 1) % CONGEST_SAMPLES;
+	if (c->nsamples < CONGEST_SAMPLES)
+		c->nsamples++;
+	n = c->nsamples;
+
+	/* Insertion sort, there are few */
+	for (i = 0; i < n; i++) {
+		v = c->samples[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	c->p90_us = sorted[(n * 9 + 9) / 10 - 1];
+}
+
+static void
+congest_rtt(struct congest *c, unsigned long sample_us)
+/* Take a round trip sample, and set the timeout from it */
+{
+	unsigned long delta;
+	unsigned long rto;
+
+	if (sample_us == 0)
+		sample_us = 1;	/* answered within the clock tick */
+
+	if (c->srtt_us == 0) {
+		c->srtt_us = sample_us;
+		c->rttvar_us = sample_us / 2;
+	} else {
+		delta = sample_us > c->srtt_us ?
+			sample_us - c->srtt_us : c->srtt_us - sample_us;
+		/* Weights 1/4 and 1/8, as in RFC 6298 */
+		c->rttvar_us = c->rttvar_us - c->rttvar_us / 4 + delta / 4;
+		c->srtt_us = c->srtt_us - c->srtt_us / 8 + sample_us / 8;
+	}
+	congest_percentile(c, sample_us);
+
+	rto = (c->srtt_us + 4 * c->rttvar_us + 999) / 1000;
+	if (rto < CONGEST_RTO_MIN)
+		rto = CONGEST_RTO_MIN;
+	if (rto > CONGEST_RTO_MAX)
+		rto = CONGEST_RTO_MAX;
+	c->rto = rto;
+}
+
+void
+congest_init(struct congest *c, uint64_t now)
+{
+	memset(c, 0, sizeof(*c));
+	c->cwnd = CONGEST_INIT * CONGEST_ONE;
+	c->ssthresh = CONGEST_MAX * CONGEST_ONE;
+	c->since_cut = CONGEST_MAX;	/* the first cut may come at once */
+	c->start = now;
+	c->rto = CONGEST_RTO_INIT;
+}
+
+void
+congest_sent(struct congest *c, uint16_t id, uint64_t now)
+{
+	uint64_t now_us = now * 1000;
+
+	c->ids[id % CONGEST_IDS].id = id;
+	c->ids[id % CONGEST_IDS].pending = 1;
+	c->ids[id % CONGEST_IDS].sent = now;
+
+	c->sent++;
+	c->inflight++;
+	if (c->next_us < now_us)
+		c->next_us = now_us;
+	c->next_us += c->pace_us;
+}
+
+void
+congest_answered(struct congest *c, uint16_t id, uint64_t now, int timed)
+/* timed: the server answered id as soon as it got it, so the time
+   since it was sent is a round trip */
+{
+	uint64_t elapsed;
+	uint64_t rtt;
+
+	if (c->ids[id % CONGEST_IDS].pending &&
+	    c->ids[id % CONGEST_IDS].id == id) {
+		/* Only the first answer, duplicates are not timed */
+		c->ids[id % CONGEST_IDS].pending = 0;
+		rtt = now - c->ids[id % CONGEST_IDS].sent;
+		if (timed && (c->srtt_us == 0 || rtt <= (uint64_t) c->rto))
+			congest_rtt(c, rtt * 1000);
+	}
+
+	c->answered++;
+	c->answers++;
+	if (c->since_cut < CONGEST_MAX)
+		c->since_cut++;
+	c->fails = 0;
+	if (c->inflight > 0)
+		c->inflight--;
+
+	if (c->cwnd < c->ssthresh)
+		c->cwnd += CONGEST_ONE;
+	else
+		c->cwnd += CONGEST_ONE * CONGEST_ONE / c->cwnd;
+	if (c->cwnd > CONGEST_MAX * CONGEST_ONE)
+		c->cwnd = CONGEST_MAX * CONGEST_ONE;
+
+	c->pace_us -= c->pace_us / 8;
+	if (c->pace_us < CONGEST_PACE_MIN)
+		c->pace_us = 0;
+
+	elapsed = now - c->start;
+	if (elapsed < CONGEST_INTERVAL)
+		return;
+
+	/* Intervals with few answers were idle, not limited by the path,
+	   and say nothing about the rate it can take */
+	if (c->answers >= CONGEST_SAMPLE_MIN && elapsed < 4 * CONGEST_INTERVAL) {
+		/* Smooth with weight 1/2, like the compression control */
+		c->rate = (c->rate + c->answers * 1000 / elapsed) / 2;
+		if (c->rate == 0)
+			c->rate = 1;
+	}
+	c->answers = 0;
+	c->start = now;
+}
+
+void
+congest_servfail(struct congest *c)
+/* The resolver gave up on a query or refused it, likely rate limiting */
+{
+	c->servfail++;
+	c->fails++;
+	if (c->inflight > 0)
+		c->inflight--;
+	congest_cut(c);
+	congest_slow(c);
+}
+
+void
+congest_timeout(struct congest *c, int held)
+/* Nothing came back for a while: queries in flight are lost, except
+   for held ones that the server may keep waiting for data */
+{
+	int lost;
+
+	lost = c->inflight - held;
+	if (lost > 0) {
+		c->lost += lost;
+		c->fails++;
+		congest_cut(c);
+		if (c->pace_us)
+			congest_slow(c);
+		/* Back off until the next sample */
+		c->rto *= 2;
+		if (c->rto > CONGEST_RTO_MAX)
+			c->rto = CONGEST_RTO_MAX;
+	}
+	c->inflight = 0;
+}
+
+int
+congest_room(const struct congest *c)
+/* How many more queries may be in flight */
+{
+	int room = c->cwnd / CONGEST_ONE - c->inflight;
+
+	return room > 0 ? room : 0;
+}
+
+int
+congest_wait(const struct congest *c, uint64_t now)
+/* ms until a query that is not answering anything may go */
+{
+	uint64_t now_us = now * 1000;
+
+	if (c->next_us <= now_us)
+		return 0;
+	return (c->next_us - now_us + 999) / 1000;
+}
+
+int
+congest_backoff(const struct congest *c)
+/* ms to wait before polling again after an error or a useless reply,
+   doubling with each failure since the last answer */
+{
+	int ms;
+	int fails;
+
+	ms = c->pace_us / 1000;
+	if (ms < c->srtt_us / 1000)
+		ms = c->srtt_us / 1000;
+	if (ms < CONGEST_BACKOFF_MIN)
+		ms = CONGEST_BACKOFF_MIN;
+	for (fails = c->fails; fails > 0 && ms < CONGEST_BACKOFF_MAX; fails--)
+		ms *= 2;
+	if (ms > CONGEST_BACKOFF_MAX)
+		ms = CONGEST_BACKOFF_MAX;
+	return ms;
+}
+
+int
+congest_rto(const struct congest *c)
+/* ms to wait for an answer before sending again */
+{
+	return c->rto;
+}
+
+int
+congest_hedge(const struct congest *c)
+/* ms to wait for an answer before sending the query again elsewhere:
+   most answers come sooner. The retransmit timeout until there are
+   enough samples. */
+{
+	int ms;
+
+	if (c->nsamples < CONGEST_SAMPLE_MIN)
+		return c->rto;
+	ms = (c->p90_us + 999) / 1000;
+	if (ms < CONGEST_HEDGE_MIN)
+		ms = CONGEST_HEDGE_MIN;
+	if (ms > c->rto)
+		ms = c->rto;
+	return ms;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CONGEST_H__
+#define __CONGEST_H__
+
+#include <stdint.h>
+
+/* Congestion control for the client's stream of DNS queries. The window
+   of queries in flight grows by one per answer in slow start and by one
+   per window of answers after that, and is halved (at most once per
+   window) on SERVFAIL replies and queries that went unanswered. Queries
+   the client sends on its own, without an answer to react to, are paced
+   once the resolver answers SERVFAIL: spaced at the rate answers came in,
+   twice as far on each further SERVFAIL or loss, and closer again by an
+   eighth with every answer. Without trouble there is no pacing, as the
+   answer rate mostly shows how much there was to send.
+
+   The round trip time is estimated from queries answered as soon as they
+   reached the server, in the way of TCP: a smoothed RTT and its mean
+   deviation, with the retransmit timeout at RTT + 4 * deviation, doubled
+   on every loss until the next sample. Samples longer than the timeout
+   are taken to be queries the server held after all, and left out.
+   The 90th percentile of the last samples tells when an answer is late
+   enough to send the query again elsewhere. */
+
+#define CONGEST_ONE 256		/* fixed point unit of cwnd */
+#define CONGEST_INIT 4		/* queries in flight at first */
+#define CONGEST_MAX 64
+#define CONGEST_INTERVAL 500	/* ms, answer rate samples */
+#define CONGEST_SAMPLE_MIN 4	/* answers for a sample to count */
+#define CONGEST_PACE_MIN 1000	/* us, less is no pacing */
+#define CONGEST_PACE_MAX 200000
+#define CONGEST_BACKOFF_MIN 50	/* ms before polling again after errors,
+				   or one RTT if longer */
+#define CONGEST_BACKOFF_MAX 2000
+#define CONGEST_RTO_INIT 1000	/* ms, retransmit timeout before samples */
+#define CONGEST_RTO_MIN 200
+#define CONGEST_RTO_MAX 4000
+#define CONGEST_IDS 64		/* send times kept, a power of 2 */
+#define CONGEST_SAMPLES 32	/* RTT samples for the percentile */
+#define CONGEST_HEDGE_MIN 20	/* ms, no sooner than this */
+
+struct congest {
+	int cwnd;		/* queries in flight allowed, * CONGEST_ONE */
+	int ssthresh;		/* slow start while cwnd is below */
+	int inflight;		/* sent and not answered or given up */
+	int fails;		/* SERVFAILs and losses since last answer */
+	int since_cut;		/* answers since cwnd was last cut */
+	unsigned long rate;	/* answers/s, smoothed */
+	unsigned long pace_us;	/* between paced queries, 0: no pacing */
+	uint64_t next_us;	/* when the next paced query may go */
+	unsigned long answers;	/* this interval */
+	uint64_t start;		/* ms, start of interval */
+	unsigned long srtt_us;	/* smoothed RTT, 0: no sample yet */
+	unsigned long rttvar_us;	/* mean deviation of the RTT */
+	int rto;		/* ms, retransmit timeout */
+	unsigned long samples[CONGEST_SAMPLES];	/* us, latest RTTs */
+	int nsamples;		/* kept, up to CONGEST_SAMPLES */
+	int sample_at;		/* where the next one goes */
+	unsigned long p90_us;	/* 90th percentile of samples */
+	struct {
+		uint16_t id;
+		int pending;
+		uint64_t sent;	/* ms */
+	} ids[CONGEST_IDS];	/* sent queries, by id % CONGEST_IDS */
+	/* Totals, for inspection */
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long lost;
+	unsigned long servfail;
+};
+
+void congest_init(struct congest *c, uint64_t now);
+void congest_sent(struct congest *c, uint16_t id, uint64_t now);
+void congest_answered(struct congest *c, uint16_t id, uint64_t now, int timed);
+void congest_servfail(struct congest *c);
+void congest_timeout(struct congest *c, int held);
+int congest_room(const struct congest *c);
+int congest_wait(const struct congest *c, uint64_t now);
+int congest_backoff(const struct congest *c);
+int congest_rto(const struct congest *c);
+int congest_hedge(const struct congest *c);
+
+#endif /* __CONGEST_H__ */
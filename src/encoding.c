@@ -26,8 +26,8 @@ int build_hostname(char *buf, size_t buflen, const char *data,
 	size_t space;
 	char *b;
 
-	space = MIN((size_t)maxlen, buflen) - strlen(topdomain) - 8;
-	/* 8 = 5 max header length + 1 dot before topdomain + 2 safety */
+	space = MIN((size_t)maxlen, buflen) - strlen(topdomain) - 10;
+	/* 10 = 8 max header length + 1 dot before topdomain + 1 safety */
 
 	if (!encoder->places_dots)
 		space -= (space / 57); /* space for dots */
@@ -14,16 +14,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "fw_query.h"
 
-static struct fw_query fwq[FW_QUERY_CACHE_SIZE];
+static struct fw_query *fwq;
+static int fwq_size;
 static int fwq_ix;
 
-void fw_query_init()
+int fw_query_init(int size)
+/* (Re)allocate cache for size queries. Returns 0 on success. */
 {
-	memset(fwq, 0, sizeof(struct fw_query) * FW_QUERY_CACHE_SIZE);
+	free(fwq);
+	fwq = calloc(size, sizeof(struct fw_query));
+	if (!fwq) {
+		fwq_size = 0;
+		return -1;
+	}
+	fwq_size = size;
 	fwq_ix = 0;
+	return 0;
 }
 
 void fw_query_put(struct fw_query *fw_query)
@@ -31,7 +41,7 @@ void fw_query_put(struct fw_query *fw_query)
 	memcpy(&(fwq[fwq_ix]), fw_query, sizeof(struct fw_query));
 
 	++fwq_ix;
-	if (fwq_ix >= FW_QUERY_CACHE_SIZE)
+	if (fwq_ix >= fwq_size)
 		fwq_ix = 0;
 }
 
@@ -40,7 +50,7 @@ void fw_query_get(unsigned short query_id, struct fw_query **fw_query)
 	int i;
 
 	*fw_query = NULL;
-	for (i = 0; i < FW_QUERY_CACHE_SIZE; i++) {
+	for (i = 0; i < fwq_size; i++) {
 		if (fwq[i].id == query_id) {
 			*fw_query = &(fwq[i]);
 			return;
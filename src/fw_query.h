@@ -25,7 +25,8 @@
 #include <sys/socket.h>
 #endif
 
-#define FW_QUERY_CACHE_SIZE 16
+#define FW_QUERY_CACHE_SIZE 16	/* default */
+#define FW_QUERY_CACHE_MAX 65536
 
 struct fw_query {
 	struct sockaddr_storage addr;
@@ -33,7 +34,7 @@ struct fw_query {
 	unsigned short id;
 };
 
-void fw_query_init(void);
+int fw_query_init(int size);
 void fw_query_put(struct fw_query *fw_query);
 void fw_query_get(unsigned short query_id, struct fw_query **fw_query);
 
@@ -61,6 +61,14 @@ sighandler(int sig)
 	client_stop();
 }
 
+#ifndef WINDOWS32
+static void
+statshandler(int sig)
+{
+	client_request_stats();
+}
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 /* mark as no return to help some compilers to avoid warnings
  * about use of uninitialized variables */
@@ -73,7 +81,9 @@ static void help(FILE *stream, bool verbose)
 	fprintf(stream, "iodine IP over DNS tunneling client\n\n"
 	                "Usage: %s [-46fhrv] [-u user] [-t chrootdir] [-d device] [-P password]\n"
 			"              [-m maxfragsize] [-M maxlen] [-T type] [-O enc] [-L 0|1] [-I sec]\n"
-			"              [-z context] [-F pidfile] [nameserver] topdomain\n", __progname);
+			"              [-C comp] [-Y dictionary] [-H 0|1] [-B 0|1] [-W window]\n"
+			"              [-E fec] [-Q 0|1] [-z context] [-F pidfile]\n"
+			"              [nameserver] topdomain\n", __progname);
 
 	if (!verbose)
 		exit(2);
@@ -89,6 +99,15 @@ static void help(FILE *stream, bool verbose)
 			"  -m max size of downstream fragments (default: autodetect)\n"
 			"  -M max size of upstream hostnames (~100-255, default: 255)\n"
 			"  -r to skip raw UDP mode attempt\n"
+			"  -C compression up[:level][,down[:level]]: none, zlib, zstream,\n"
+			"     lz4 or zstd if built in, zstd allows negative levels (default: zlib:9)\n"
+			"  -Y compression dictionary: builtin, or a file the server also has\n"
+			"  -H 1: compress TCP/IP headers (default). 0: don't\n"
+			"  -B 1: send waiting packets together (default). 0: one by one\n"
+			"  -W fragments in flight each way (1-16, default 8), 0: one at a time\n"
+			"  -E data fragments per parity fragment (1-16), 0: none (default)\n"
+			"  -Q 1: send late queries again, to another nameserver or from another\n"
+			"     port. 0: don't (default)\n"
 			"  -P password used for authentication (max 32 chars will be used)\n\n"
 			"Other options:\n"
 			"  -v to print version info and exit\n"
@@ -99,7 +118,8 @@ static void help(FILE *stream, bool verbose)
 			"  -d device to set tunnel device name\n"
 			"  -z context, to apply specified SELinux context after initialization\n"
 			"  -F pidfile to write pid to a file\n\n"
-			"nameserver is the IP number/hostname of the relaying nameserver. If absent,\n"
+			"nameserver is the IP number/hostname of the relaying nameserver, or a comma\n"
+			"           separated list of them to spread the queries over. If absent,\n"
 			"           /etc/resolv.conf is used\n"
 			"topdomain is the FQDN that is delegated to the tunnel endpoint.\n");
 
@@ -142,6 +162,12 @@ int main(int argc, char **argv)
 	int retval;
 	int raw_mode;
 	int lazymode;
+	int hdrcomp;
+	int bundle;
+	int window;
+	int fec;
+	int hedge;
+	int hedge_fd;
 	int selecttimeout;
 	int hostname_maxlen;
 #ifdef OPENBSD
@@ -150,6 +176,10 @@ int main(int argc, char **argv)
 	struct sockaddr_storage nameservaddr;
 	int nameservaddr_len;
 	int nameserv_family;
+	struct sockaddr_storage addr;
+	int addrlen;
+	int nameservs;
+	char *host;
 
 	nameserv_host = NULL;
 	topdomain = NULL;
@@ -171,6 +201,12 @@ int main(int argc, char **argv)
 	retval = 0;
 	raw_mode = 1;
 	lazymode = 1;
+	hdrcomp = 1;
+	bundle = 1;
+	window = 8;
+	fec = 0;
+	hedge = 0;
+	hedge_fd = -1;
 	selecttimeout = 4;
 	hostname_maxlen = 0xFF;
 	nameserv_family = AF_UNSPEC;
@@ -190,7 +226,7 @@ int main(int argc, char **argv)
 		__progname++;
 #endif
 
-	while ((choice = getopt(argc, argv, "46vfhru:t:d:R:P:m:M:F:T:O:L:I:")) != -1) {
+	while ((choice = getopt(argc, argv, "46vfhru:t:d:R:P:m:M:F:T:O:L:I:C:Y:H:B:W:E:Q:")) != -1) {
 		switch(choice) {
 		case '4':
 			nameserv_family = AF_INET;
@@ -266,6 +302,35 @@ int main(int argc, char **argv)
 			if (!lazymode)
 				selecttimeout = 1;
 			break;
+		case 'C':
+			if (client_set_compression(optarg)) {
+				warnx("Bad or unavailable compression '%s'", optarg);
+				usage();
+				/* NOTREACHED */
+			}
+			break;
+		case 'Y':
+			if (client_set_dict(optarg)) {
+				warnx("Bad compression dictionary '%s'", optarg);
+				usage();
+				/* NOTREACHED */
+			}
+			break;
+		case 'H':
+			hdrcomp = atoi(optarg) ? 1 : 0;
+			break;
+		case 'B':
+			bundle = atoi(optarg) ? 1 : 0;
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 'E':
+			fec = atoi(optarg);
+			break;
+		case 'Q':
+			hedge = atoi(optarg) ? 1 : 0;
+			break;
 		case 'I':
 			selecttimeout = atoi(optarg);
 			if (selecttimeout < 1)
@@ -303,12 +368,29 @@ int main(int argc, char **argv)
 	}
 
 	if (nameserv_host) {
-		nameservaddr_len = get_addr(nameserv_host, DNS_PORT, nameserv_family, 0, &nameservaddr);
-		if (nameservaddr_len < 0) {
-			errx(1, "Cannot lookup nameserver '%s': %s ",
-				nameserv_host, gai_strerror(nameservaddr_len));
+		/* A list to stripe the queries over, all of the first
+		   one's address family for the one socket */
+		nameservs = 0;
+		nameserv_host = strdup(nameserv_host);
+		for (host = strtok(nameserv_host, ","); host; host = strtok(NULL, ",")) {
+			addrlen = get_addr(host, DNS_PORT, nameserv_family, 0, &addr);
+			if (addrlen < 0) {
+				errx(1, "Cannot lookup nameserver '%s': %s ",
+					host, gai_strerror(addrlen));
+			}
+			if (client_add_nameserver(&addr, addrlen) < 0)
+				errx(1, "Too many nameservers given");
+			if (nameservs++ == 0) {
+				memcpy(&nameservaddr, &addr, addrlen);
+				nameservaddr_len = addrlen;
+				nameserv_family = addr.ss_family;
+			}
+		}
+		if (nameservs == 0) {
+			warnx("No nameserver given\n");
+			usage();
+			/* NOTREACHED */
 		}
-		client_set_nameserver(&nameservaddr, nameservaddr_len);
 	} else {
 		warnx("No nameserver found - not connected to any network?\n");
 		usage();
@@ -323,6 +405,10 @@ int main(int argc, char **argv)
 
 	client_set_selecttimeout(selecttimeout);
 	client_set_lazymode(lazymode);
+	client_set_hdrcomp(hdrcomp);
+	client_set_bundle(bundle);
+	client_set_window(window);
+	client_set_fec(fec);
 	client_set_topdomain(topdomain);
 	client_set_hostname_maxlen(hostname_maxlen);
 
@@ -353,16 +439,34 @@ int main(int argc, char **argv)
 		retval = 1;
 		goto cleanup2;
 	}
+	/* With one nameserver, late queries go again from another port */
+	if (hedge && nameservs == 1 &&
+	    (hedge_fd = open_dns_from_host(NULL, 0, nameservaddr.ss_family, AI_PASSIVE)) < 0) {
+		retval = 1;
+		goto cleanup2;
+	}
 #ifdef OPENBSD
-	if (rtable > 0)
+	if (rtable > 0) {
 		socket_setrtable(dns_fd, rtable);
+		if (hedge_fd >= 0)
+			socket_setrtable(hedge_fd, rtable);
+	}
 #endif
+	client_set_hedge(hedge, hedge_fd);
 
 	signal(SIGINT, sighandler);
 	signal(SIGTERM, sighandler);
+#ifndef WINDOWS32
+	signal(SIGUSR1, statshandler);
+#endif
 
-	fprintf(stderr, "Sending DNS queries for %s to %s\n",
-		topdomain, format_addr(&nameservaddr, nameservaddr_len));
+	if (nameservs > 1)
+		fprintf(stderr, "Sending DNS queries for %s to %s and %d more nameservers\n",
+			topdomain, format_addr(&nameservaddr, nameservaddr_len),
+			nameservs - 1);
+	else
+		fprintf(stderr, "Sending DNS queries for %s to %s\n",
+			topdomain, format_addr(&nameservaddr, nameservaddr_len));
 
 	if (client_handshake(dns_fd, raw_mode, autodetect_frag_size, max_downstream_frag_size)) {
 		retval = 1;
@@ -402,6 +506,8 @@ int main(int argc, char **argv)
 	client_tunnel(tun_fd, dns_fd);
 
 cleanup2:
+	if (hedge_fd >= 0)
+		close_dns(hedge_fd);
 	close_dns(dns_fd);
 	close_tun(tun_fd);
 cleanup1:
@@ -49,9 +49,30 @@
 #include <syslog.h>
 #endif
 
+#ifdef LINUX
+#define USE_EPOLL
+#define USE_MMSG
+#define USE_WORKERS
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_LIBURING
+#include <poll.h>
+#include <liburing.h>
+#endif
+
 #include "dns.h"
+#include "compress.h"
 #include "encoding.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "user.h"
+#include "vj.h"
+#include "bundle.h"
+#include "window.h"
 #include "login.h"
 #include "tun.h"
 #include "fw_query.h"
@@ -68,6 +89,8 @@ WSADATA wsa_data;
 
 #define PASSWORD_ENV_VAR "IODINED_PASS"
 
+#define WORKERS_MAX 16
+
 #if defined IP_RECVDSTADDR
 # define DSTADDR_SOCKOPT IP_RECVDSTADDR
 # define dstaddr(x) ((struct in_addr *) CMSG_DATA(x))
@@ -80,11 +103,40 @@ WSADATA wsa_data;
 #define IPV6_RECVPKTINFO IPV6_PKTINFO
 #endif
 
+enum io_engine {
+	IO_ENGINE_DEFAULT,
+	IO_ENGINE_SELECT,
+	IO_ENGINE_EPOLL,
+	IO_ENGINE_URING,
+};
+
 static int running = 1;
 static char *topdomain;
 static char password[33];
 static int created_users;
 
+/* Answer q_sendrealsoon after this many ms, unless data came first.
+   Clients won't be sending new data until we send our ack, so don't keep
+   them waiting long. This only triggers at final upstream fragments, which
+   is about once per eight requests during heavy upstream traffic.
+   20msec: ~8 packs every 1/50sec = ~400 DNSreq/sec,
+   or ~1200bytes every 1/50sec = ~0.5 Mbit/sec upstream */
+#define REALSOON_DELAY 20
+
+/* In lazy mode, answer a waiting query after this many ms even without
+   data, before relays give up on it. */
+#define LAZY_HOLD_DELAY 5000
+
+/* With a downstream window, send a fragment again if it was not acked
+   after this many ms. Fragments that later ones overtook go sooner. */
+#define WINDOW_RESEND 1000
+
+static __thread struct dnsfd *server_dns_fds;	/* for timer callbacks */
+static struct timer idle_timer;
+static uint64_t max_idle_ms;
+static int busy_users;		/* users with their idle timer pending, atomic */
+static int idle_waited;		/* startup wait of -i is over, atomic */
+
 static int check_ip;
 static int my_mtu;
 static in_addr_t my_ip;
@@ -95,6 +147,16 @@ static in_addr_t ns_ip;
 static int bind_port;
 static int debug;
 
+/* CPU time for compressing tun packets, in percent of one CPU. Levels
+   are lowered when it is used up, see compress_ctl_update(). With -w,
+   each worker has this much for its own users. */
+static int compress_budget = 50;
+static __thread struct {
+	uint64_t start;		/* ms */
+	uint64_t us;		/* spent compressing since start */
+	int used;		/* percent of a CPU in the last second */
+} compress_cpu;
+
 #if !defined(BSD) && !defined(__GLIBC__)
 static char *__progname;
 #else
@@ -110,9 +172,242 @@ struct dnsfd {
 	int v6fd;
 };
 
+#ifndef USE_MMSG
 static int read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q);
+#endif
+static int decode_query(char *packet, int len, int fd, struct dnsfd *dns_fds,
+			int tun_fd, void *msg, struct query *q);
+static int raw_decode(char *packet, int len, struct query *q, int dns_fd,
+		      struct dnsfd *dns_fds, int tun_fd);
+static void handle_dns_query(int tun_fd, int dns_fd, struct dnsfd *dns_fds, int bind_fd,
+			     struct query *q);
 static void write_dns(int fd, struct query *q, const char *data, int datalen, char downenc);
-static void handle_full_packet(int tun_fd, struct dnsfd *dns_fds, int userid);
+static void handle_full_packet(int tun_fd, struct dnsfd *dns_fds, int userid,
+			       struct compress_stream *st);
+static int send_tun_packet(struct dnsfd *dns_fds, int userid, char *in, int len);
+static int user_worker(int userid);
+
+#ifdef USE_MMSG
+/* Batched DNS socket I/O: each wakeup reads up to DNS_BATCH datagrams
+   with one recvmmsg(), and all replies produced while handling them are
+   sent with one sendmmsg() per socket at the end. Each worker has its
+   own buffers. */
+#define DNS_BATCH 16
+#define DNS_TX_BATCH (4 * DNS_BATCH)	/* a query can cause several replies */
+#define DNS_TX_SLOT 4096		/* larger replies are sent directly */
+
+static __thread struct {
+	struct mmsghdr msgs[DNS_BATCH];
+	struct iovec iov[DNS_BATCH];
+	struct sockaddr_storage from[DNS_BATCH];
+	char control[DNS_BATCH][CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	char data[DNS_BATCH][64*1024];
+} dns_rx;
+
+static __thread struct {
+	int active;
+	int count;
+	int fd[DNS_TX_BATCH];
+	struct mmsghdr msgs[DNS_TX_BATCH];
+	struct iovec iov[DNS_TX_BATCH];
+	struct sockaddr_storage to[DNS_TX_BATCH];
+	char data[DNS_TX_BATCH][DNS_TX_SLOT];
+} dns_tx;
+
+static void
+dns_tx_flush(void)
+{
+	int start;
+	int end;
+	int r;
+
+	for (start = 0; start < dns_tx.count; start = end) {
+		/* sendmmsg() works on one socket, so send runs of same fd */
+		for (end = start + 1; end < dns_tx.count &&
+		     dns_tx.fd[end] == dns_tx.fd[start]; end++)
+			;
+
+		while (start < end) {
+			r = sendmmsg(dns_tx.fd[start], &dns_tx.msgs[start], end - start, 0);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR)
+					continue;
+				warn("sendmmsg");
+				break;
+			}
+			start += r;
+		}
+	}
+	dns_tx.count = 0;
+}
+#endif
+
+#ifdef HAVE_LIBURING
+/* io_uring I/O engine (-e uring). DNS sockets use multishot recvmsg with
+   a provided buffer ring, one tun read is kept posted while users can
+   take data, and replies and tun writes are queued as submissions that
+   are sent together with the next io_uring_submit(). Each worker has a
+   ring of its own. */
+
+#define URING_ENTRIES 256
+#define URING_BGID 1			/* provided buffer group */
+#define URING_BUFS 32			/* must be power of 2 */
+#define URING_BUF_LEN (64*1024)
+#define URING_TX_SLOTS 64
+#define URING_TX_LEN 4096		/* larger packets are sent directly */
+
+/* user_data: operation in high 32 bits, fd or slot in low 32 bits */
+#define URING_DATA(op, idx) (((uint64_t) (op) << 32) | (uint32_t) (idx))
+#define URING_OP(data) ((int) ((data) >> 32))
+#define URING_IDX(data) ((int) ((data) & 0xffffffff))
+
+enum uring_op {
+	URING_RECV,
+	URING_SEND,
+	URING_TUN_READ,
+	URING_TUN_WRITE,
+	URING_POLL,
+};
+
+static __thread struct {
+	int active;
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	struct msghdr recv_msg;		/* template for multishot receives */
+	int tun_busy;
+	char tun_buf[64*1024];
+	int tx_busy[URING_TX_SLOTS];
+	struct msghdr tx_msg[URING_TX_SLOTS];
+	struct iovec tx_iov[URING_TX_SLOTS];
+	struct sockaddr_storage tx_to[URING_TX_SLOTS];
+	char tx_data[URING_TX_SLOTS][URING_TX_LEN];
+} uring;
+
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&uring.ring);
+	if (!sqe) {
+		/* submission queue full, push it to the kernel and retry */
+		io_uring_submit(&uring.ring);
+		sqe = io_uring_get_sqe(&uring.ring);
+	}
+	return sqe;
+}
+
+static int
+uring_tx_slot(void)
+{
+	int i;
+
+	for (i = 0; i < URING_TX_SLOTS; i++) {
+		if (!uring.tx_busy[i])
+			return i;
+	}
+	return -1;
+}
+
+static int
+uring_send(int fd, const char *buf, int len, struct sockaddr_storage *to, socklen_t tolen)
+/* Returns 0 if queued, -1 if caller should send it directly */
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if (len > URING_TX_LEN || (i = uring_tx_slot()) < 0)
+		return -1;
+	if (!(sqe = uring_get_sqe()))
+		return -1;
+
+	memcpy(uring.tx_data[i], buf, len);
+	memcpy(&uring.tx_to[i], to, tolen);
+	uring.tx_iov[i].iov_base = uring.tx_data[i];
+	uring.tx_iov[i].iov_len = len;
+	memset(&uring.tx_msg[i], 0, sizeof(uring.tx_msg[i]));
+	uring.tx_msg[i].msg_name = &uring.tx_to[i];
+	uring.tx_msg[i].msg_namelen = tolen;
+	uring.tx_msg[i].msg_iov = &uring.tx_iov[i];
+	uring.tx_msg[i].msg_iovlen = 1;
+
+	io_uring_prep_sendmsg(sqe, fd, &uring.tx_msg[i], 0);
+	io_uring_sqe_set_data64(sqe, URING_DATA(URING_SEND, i));
+	/* Not linked to the next submission: a failed send would cancel
+	   everything linked after it, and UDP keeps no order anyway */
+	uring.tx_busy[i] = 1;
+	return 0;
+}
+
+static int
+uring_tun_write(int tun_fd, char *data, int len)
+/* Returns 0 if queued, -1 if caller should use write_tun() */
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if (len > URING_TX_LEN || (i = uring_tx_slot()) < 0)
+		return -1;
+	if (!(sqe = uring_get_sqe()))
+		return -1;
+
+	memcpy(uring.tx_data[i], data, len);
+	/* Same header as write_tun() uses on Linux: IPv4 ethertype */
+	uring.tx_data[i][0] = 0x00;
+	uring.tx_data[i][1] = 0x00;
+	uring.tx_data[i][2] = 0x08;
+	uring.tx_data[i][3] = 0x00;
+
+	io_uring_prep_write(sqe, tun_fd, uring.tx_data[i], len, 0);
+	io_uring_sqe_set_data64(sqe, URING_DATA(URING_TUN_WRITE, i));
+	uring.tx_busy[i] = 1;
+	return 0;
+}
+#endif /* HAVE_LIBURING */
+
+static int
+send_reply(int fd, const char *buf, int len, struct sockaddr_storage *to, socklen_t tolen)
+/* Send packet to client; queued if a batch is being handled */
+{
+#ifdef HAVE_LIBURING
+	if (uring.active && uring_send(fd, buf, len, to, tolen) == 0)
+		return len;
+#endif
+#ifdef USE_MMSG
+	if (dns_tx.active && len <= DNS_TX_SLOT) {
+		int i;
+
+		if (dns_tx.count >= DNS_TX_BATCH)
+			dns_tx_flush();
+
+		i = dns_tx.count++;
+		memcpy(dns_tx.data[i], buf, len);
+		memcpy(&dns_tx.to[i], to, tolen);
+		dns_tx.fd[i] = fd;
+		dns_tx.iov[i].iov_base = dns_tx.data[i];
+		dns_tx.iov[i].iov_len = len;
+		memset(&dns_tx.msgs[i], 0, sizeof(dns_tx.msgs[i]));
+		dns_tx.msgs[i].msg_hdr.msg_name = &dns_tx.to[i];
+		dns_tx.msgs[i].msg_hdr.msg_namelen = tolen;
+		dns_tx.msgs[i].msg_hdr.msg_iov = &dns_tx.iov[i];
+		dns_tx.msgs[i].msg_hdr.msg_iovlen = 1;
+		return len;
+	}
+#endif
+	return sendto(fd, buf, len, 0, (struct sockaddr *) to, tolen);
+}
+
+static void
+send_tun(int tun_fd, char *data, int len)
+/* Write packet to tun device; queued if io_uring is in use */
+{
+#ifdef HAVE_LIBURING
+	if (uring.active && uring_tun_write(tun_fd, data, len) == 0)
+		return;
+#endif
+	write_tun(tun_fd, data, len);
+}
 
 static int
 get_dns_fd(struct dnsfd *fds, struct sockaddr_storage *addr)
@@ -206,10 +501,11 @@ static int check_user_and_ip(int userid, struct query *q)
 	if (userid < 0 || userid >= created_users ) {
 		return 1;
 	}
-	if (!users[userid].active || users[userid].disabled) {
+	/* Users of other workers are not ours to touch */
+	if (user_worker(userid) != user_worker(-1)) {
 		return 1;
 	}
-	if (users[userid].last_pkt + 60 < time(NULL)) {
+	if (!users[userid].active || users[userid].disabled) {
 		return 1;
 	}
 
@@ -241,6 +537,13 @@ static int check_user_and_ip(int userid, struct query *q)
 	return 1;
 }
 
+static int b32_userid(const char *buf)
+/* User id sent as two Base32 chars */
+{
+	return (b32_8to5((unsigned char) buf[0]) << 5) |
+		b32_8to5((unsigned char) buf[1]);
+}
+
 /* This checks that user has passed normal (non-raw) login challenge */
 static int check_authenticated_user_and_ip(int userid, struct query *q)
 {
@@ -267,53 +570,163 @@ static void send_raw(int fd, char *buf, int buflen, int user, int cmd, struct qu
 	}
 
 	len += RAW_HDR_LEN;
-	packet[RAW_HDR_CMD] = cmd | (user & 0x0F);
+	RAW_HDR_SET_CMD(packet, cmd, user);
 
 	if (debug >= 2) {
 		fprintf(stderr, "TX-raw: client %s, cmd %d, %d bytes\n",
 			format_addr(&q->from, q->fromlen), cmd, len);
 	}
 
-	sendto(fd, packet, len, 0, (struct sockaddr *) &q->from, q->fromlen);
+	send_reply(fd, packet, len, &q->from, q->fromlen);
+}
+
+
+static struct compress_stream *down_stream(int userid)
+/* Compression stream towards userid if its compressor has one. Not in
+   raw mode, where packets can get lost without us knowing. */
+{
+	if (users[userid].conn != CONN_DNS_NULL)
+		return NULL;
+	return users[userid].zstream;
+}
+
+static int upstream_broken(int userid)
+/* Whether the compression stream from userid lost packets; replies
+   without data then ask the client to restart it */
+{
+	if (users[userid].conn != CONN_DNS_NULL)
+		return 0;
+	return compress_stream_broken(users[userid].zstream);
+}
+
+static void downstream_lost(int userid)
+/* A packet towards userid was dropped, or the user missed one */
+{
+	compress_stream_restart(users[userid].zstream);
+	user_reset_hdrcomp(userid);
 }
 
+static int hdrcomp_packet(int userid, char *out, unsigned long *outlen,
+			  const char *in, int len)
+/* Compress TCP/IP headers of tun packet for userid if it asked for that.
+   Only called by whoever reads tun, which owns users[].vjdown.
+   Returns 1 if out was filled, see vj_compress(). */
+{
+	struct vj_comp *c = users[userid].vjdown;
+	unsigned gen;
+
+	if (!__atomic_load_n(&users[userid].hdrcomp, __ATOMIC_ACQUIRE))
+		return 0;
+	gen = __atomic_load_n(&users[userid].vjgen, __ATOMIC_ACQUIRE);
+	if (c->gen != gen)
+		vj_comp_init(c, gen);
+	return vj_compress(c, out, outlen, in, len);
+}
 
-static void start_new_outpacket(int userid, char *data, int datalen)
-/* Copies data to .outpacket and resets all counters.
-   data is expected to be compressed already. */
+static void start_new_outpacket(int userid, char *data, int datalen, int compressed)
+/* Makes the pktbuf data the new .outpacket and resets all counters.
+   Takes over the reference to data, which is already compressed
+   if that paid off (see compress_packet()). */
 {
-	datalen = MIN(datalen, sizeof(users[userid].outpacket.data));
-	memcpy(users[userid].outpacket.data, data, datalen);
+	pktbuf_put(users[userid].outpacket.data);
+	users[userid].outpacket.data = data;
 	users[userid].outpacket.len = datalen;
+	users[userid].outpacket.compressed = compressed;
 	users[userid].outpacket.offset = 0;
 	users[userid].outpacket.sentlen = 0;
 	users[userid].outpacket.seqno = (users[userid].outpacket.seqno + 1) & 7;
 	users[userid].outpacket.fragment = 0;
 	users[userid].outfragresent = 0;
+	user_update_pending(userid);
 }
 
 #ifdef OUTPACKETQ_LEN
 
-static int save_to_outpacketq(int userid, char *data, int datalen)
-/* Find space in outpacket-queue and store data (expected compressed already).
+static int bundle_to_outpacketq(int userid, char *data, int datalen, int compressed)
+/* Add pktbuf data to the last packet in the queue if the user takes
+   bundles and both fit in one downstream fragment. The reference to
+   data is taken over if this returns 1. */
+{
+	struct user_packet *last;
+	unsigned long need;
+	unsigned long len;
+	char *buf;
+	int fill;
+
+	if (!users[userid].bundle || users[userid].outpacketq_filled <= 0)
+		return 0;
+
+	fill = users[userid].outpacketq_nexttouse +
+	       users[userid].outpacketq_filled - 1;
+	if (fill >= outpacketq_len)
+		fill -= outpacketq_len;
+	last = &users[userid].outpacketq[fill];
+
+	if (!last->compressed && bundle_is(last->data, last->len))
+		need = last->len + 2 + datalen;
+	else
+		need = 1 + 2 + last->len + 2 + datalen;
+	if (need > users[userid].fragsize)
+		return 0;
+
+	/* The queued data may be shared with a forwarding user */
+	buf = pktbuf_get(need);
+	if (!buf)
+		return 0;
+	len = 0;
+	if (!last->compressed && bundle_is(last->data, last->len)) {
+		memcpy(buf, last->data, last->len);
+		len = last->len;
+	} else if (bundle_add(buf, &len, need, last->data, last->len, last->compressed) < 0) {
+		pktbuf_put(buf);
+		return 0;
+	}
+	if (bundle_add(buf, &len, need, data, datalen, compressed) < 0) {
+		pktbuf_put(buf);
+		return 0;
+	}
+
+	pktbuf_put(last->data);
+	pktbuf_put(data);
+	last->data = buf;
+	last->len = len;
+	last->compressed = 0;
+
+	if (debug >= 3)
+		fprintf(stderr, "    Qbundle, now %d bytes\n", last->len);
+
+	return 1;
+}
+
+static int save_to_outpacketq(int userid, char *data, int datalen, int compressed)
+/* Find space in outpacket-queue and store pktbuf data (compressed already
+   if compressed is set), in a bundle with the last queued packet if it
+   fits. The reference to data is taken over, also when it is dropped.
    Returns: 1 = okay, 0 = no space. */
 {
 	int fill;
 
-	if (users[userid].outpacketq_filled >= OUTPACKETQ_LEN)
+	if (bundle_to_outpacketq(userid, data, datalen, compressed))
+		return 1;
+
+	if (users[userid].outpacketq_filled >= outpacketq_len) {
 		/* no space */
+		pktbuf_put(data);
+		downstream_lost(userid);
 		return 0;
+	}
 
 	fill = users[userid].outpacketq_nexttouse +
 	       users[userid].outpacketq_filled;
-	if (fill >= OUTPACKETQ_LEN)
-		fill -= OUTPACKETQ_LEN;
+	if (fill >= outpacketq_len)
+		fill -= outpacketq_len;
 
-	datalen = MIN(datalen, sizeof(users[userid].outpacketq[fill].data));
-	memcpy(users[userid].outpacketq[fill].data, data, datalen);
+	users[userid].outpacketq[fill].data = data;
 	users[userid].outpacketq[fill].len = datalen;
+	users[userid].outpacketq[fill].compressed = compressed;
 
 	users[userid].outpacketq_filled++;
+	user_update_pending(userid);
 
 	if (debug >= 3)
 		fprintf(stderr, "    Qstore, now %d\n",
@@ -335,13 +748,17 @@ static int get_from_outpacketq(int userid)
 	use = users[userid].outpacketq_nexttouse;
 
 	start_new_outpacket(userid, users[userid].outpacketq[use].data,
-			    users[userid].outpacketq[use].len);
+			    users[userid].outpacketq[use].len,
+			    users[userid].outpacketq[use].compressed);
+	users[userid].outpacketq[use].data = NULL;
+	users[userid].outpacketq[use].len = 0;
 
 	use++;
-	if (use >= OUTPACKETQ_LEN)
+	if (use >= outpacketq_len)
 		use = 0;
 	users[userid].outpacketq_nexttouse = use;
 	users[userid].outpacketq_filled--;
+	user_update_pending(userid);
 
 	if (debug >= 3)
 		fprintf(stderr, "    Qget, now %d\n",
@@ -378,7 +795,7 @@ static void save_to_dnscache(int userid, struct query *q, char *answer, int answ
 		return;  /* can't store this */
 
 	fill = users[userid].dnscache_lastfilled + 1;
-	if (fill >= DNSCACHE_LEN)
+	if (fill >= dnscache_len)
 		fill = 0;
 
 	memcpy(&(users[userid].dnscache_q[fill]), q, sizeof(struct query));
@@ -396,11 +813,11 @@ static int answer_from_dnscache(int dns_fd, int userid, struct query *q)
 	int i;
 	int use;
 
-	for (i = 0; i < DNSCACHE_LEN ; i++) {
+	for (i = 0; i < dnscache_len ; i++) {
 		/* Try cache most-recent-first */
 		use = users[userid].dnscache_lastfilled - i;
 		if (use < 0)
-			use += DNSCACHE_LEN;
+			use += dnscache_len;
 
 		if (users[userid].dnscache_q[use].id == 0)
 			continue;
@@ -451,7 +868,7 @@ static inline void save_to_qmem_pingordata(int userid, struct query *q)
 {
 	/* Our CMC is a bit more than the "official" CMC; we store 4 bytes
 	   just because we can, and because it may prevent some false matches.
-	   For ping, we save the 4 decoded bytes: userid + seq/frag + CMC.
+	   For ping, we save 4 decoded bytes: low userid byte + seq/frag + CMC.
 	   For data, we save the 4 _un_decoded chars in lowercase: seq/frag's
 	   + 1 char CMC; that last char is non-Base32.
 	 */
@@ -472,16 +889,16 @@ static inline void save_to_qmem_pingordata(int userid, struct query *q)
 		   lost now... Note: b32 directly, we want no undotify here! */
 		i = base32_ops.decode(cmc, &cmcsize, q->name + 1, (cp - q->name) - 1);
 
-		if (i < 4)
+		if (i < 5)
 			return;	 /* illegal ping; shouldn't happen */
 
 		save_to_qmem(users[userid].qmemping_cmc,
-			     users[userid].qmemping_type, QMEMPING_LEN,
+			     users[userid].qmemping_type, qmemping_len,
 			     &users[userid].qmemping_lastfilled,
-			     (void *) cmc, q->type);
+			     (void *) (cmc + 1), q->type);
 	} else {
 		/* Data packet, hopefully not illegal */
-		if (strlen(q->name) < 5)
+		if (strlen(q->name) < 6)
 			return;
 
 		/* We store CMC in lowercase; if routing via multiple parallel
@@ -490,13 +907,13 @@ static inline void save_to_qmem_pingordata(int userid, struct query *q)
 		   Data-header is always base32, so case-swap won't hurt.
 		 */
 		for (i = 0; i < 4; i++)
-			if (q->name[i+1] >= 'A' && q->name[i+1] <= 'Z')
-				cmc[i] = q->name[i+1] + ('a' - 'A');
+			if (q->name[i+2] >= 'A' && q->name[i+2] <= 'Z')
+				cmc[i] = q->name[i+2] + ('a' - 'A');
 			else
-				cmc[i] = q->name[i+1];
+				cmc[i] = q->name[i+2];
 
 		save_to_qmem(users[userid].qmemdata_cmc,
-			     users[userid].qmemdata_type, QMEMDATA_LEN,
+			     users[userid].qmemdata_type, qmemdata_len,
 			     &users[userid].qmemdata_lastfilled,
 			     (void *) cmc, q->type);
 	}
@@ -542,16 +959,159 @@ static inline int answer_from_qmem_data(int dns_fd, int userid,
 	int i;
 
 	for (i = 0; i < 4; i++)
-		if (q->name[i+1] >= 'A' && q->name[i+1] <= 'Z')
-			cmc[i] = q->name[i+1] + ('a' - 'A');
+		if (q->name[i+2] >= 'A' && q->name[i+2] <= 'Z')
+			cmc[i] = q->name[i+2] + ('a' - 'A');
 		else
-			cmc[i] = q->name[i+1];
+			cmc[i] = q->name[i+2];
 
 	return answer_from_qmem(dns_fd, q, users[userid].qmemdata_cmc,
-				users[userid].qmemdata_type, QMEMDATA_LEN,
+				users[userid].qmemdata_type, qmemdata_len,
 				(void *) cmc);
 }
 
+static void send_downstream(int dns_fd, int userid, struct query *q,
+			    char *pkt, int len)
+/* Answer q with the downstream packet pkt, and remember the answer */
+{
+	write_dns(dns_fd, q, pkt, len, users[userid].downenc);
+
+	if (q->id2 != 0) {
+		q->id = q->id2;
+		q->fromlen = q->fromlen2;
+		memcpy(&(q->from), &(q->from2), q->fromlen2);
+		if (debug >= 1)
+			fprintf(stderr, "OUT  again to last duplicate\n");
+		write_dns(dns_fd, q, pkt, len, users[userid].downenc);
+	}
+
+	save_to_qmem_pingordata(userid, q);
+
+#ifdef DNSCACHE_LEN
+	save_to_dnscache(userid, q, pkt, len);
+#endif
+
+	q->id = 0;			/* this query is used */
+}
+
+static int downstream_header(int userid, char *pkt, int compressed, int byte1)
+/* Fill in the downstream data header for userid, returns its length */
+{
+	unsigned bitmap;
+
+	/* First byte is 1 bit compression flag, 3 bits upstream seqno, 4 bits upstream fragment */
+	pkt[0] = ((compressed & 1) << 7) |
+		((users[userid].inpacket.seqno & 7) << 4) |
+		(users[userid].inpacket.fragment & 15);
+	pkt[1] = byte1;
+	if (!users[userid].upwindow)
+		return 2;
+
+	/* Upstream fragments we have beyond the one acked */
+	bitmap = window_in_bitmap(users[userid].upwin);
+	pkt[2] = (bitmap >> 8) & 0xff;
+	pkt[3] = bitmap & 0xff;
+	return 4;
+}
+
+static int window_fill_parity(struct window_out *w)
+/* Put in the parity fragment that is due, if any. Returns 0 if
+   there was no buffer for it. */
+{
+	char *parity;
+	int len;
+
+	len = window_out_parity(w);
+	if (!len)
+		return 1;
+	parity = pktbuf_get(len);
+	if (!parity)
+		return 0;
+	window_out_add_parity(w, parity);
+	return 1;
+}
+
+static void window_fill(int userid)
+/* Cut the packets waiting for userid into the window while it has
+   room. Fragments hold their own reference to the packet data. */
+{
+	struct user_packet *p = &users[userid].outpacket;
+	struct window_out *w = users[userid].downwin;
+	int fragsize;
+	int len;
+	int last;
+
+	/* With header, and with FEC room for parity fragments */
+	fragsize = MIN(users[userid].fragsize, WINDOW_FRAG_MAX - 4);
+	if (w->fec)
+		fragsize -= WINDOW_FEC_OVERHEAD;
+
+	while (window_fill_parity(w) && p->len > 0 && window_out_space(w)) {
+		len = MIN(fragsize, p->len - p->offset);
+		last = (p->offset + len == p->len);
+		window_out_add(w, pktbuf_ref(p->data),
+			       p->offset, len, p->compressed, last);
+		p->offset += len;
+		if (last) {
+			user_packet_release(p);
+#ifdef OUTPACKETQ_LEN
+			get_from_outpacketq(userid);
+#endif
+		}
+	}
+}
+
+static int downstream_pending(int userid)
+/* Whether there is data to answer a query from userid with */
+{
+	struct window_out *w = users[userid].downwin;
+
+	if (!w->size)
+		return users[userid].outpacket.len > 0;
+	return (users[userid].outpacket.len > 0 && window_out_space(w)) ||
+		window_out_pending(w, clock_ms(), WINDOW_RESEND);
+}
+
+static int send_window_chunk(int dns_fd, int userid, struct query *q)
+/* send_chunk_or_dataless() for users with a downstream window: sends
+   the fragment that is due, or a dataless packet.
+   Returns 1 if there is more to send right away. */
+{
+	struct window_out *w = users[userid].downwin;
+	struct window_frag *f;
+	char pkt[WINDOW_FRAG_MAX];
+	int datalen = 0;
+	int compressed = 0;
+	int last = 0;
+	int hdrlen;
+	int seq;
+
+	window_fill(userid);
+	f = window_out_next(w, clock_ms(), WINDOW_RESEND, &seq);
+	if (f) {
+		compressed = f->compressed;
+		last = f->last;
+	} else {
+		/* Dataless, the number is only a hint and C asks for a
+		   stream restart */
+		seq = window_out_seq(w);
+		compressed = upstream_broken(userid);
+	}
+
+	/* Second byte is 7 bits fragment number, 1 bit last flag */
+	hdrlen = downstream_header(userid, pkt, compressed, ((seq & 127) << 1) | (last & 1));
+	if (f)
+		datalen = window_out_copy(w, f, &pkt[hdrlen]);
+
+	if (debug >= 1) {
+		fprintf(stderr, "OUT  %s %d (last=%d, sent %d), %d bytes, window %d/%d, to user %d\n",
+			f && f->parity ? "parity" : "frag", seq, last,
+			f ? f->sent : 0, datalen, w->count, w->size, userid);
+	}
+	send_downstream(dns_fd, userid, q, pkt, datalen + hdrlen);
+
+	return downstream_pending(userid);
+}
+
 /* Sends current fragment to user, or dataless packet if there is no
    current fragment available (-> normal "quiet" ping reply).
    Does not update anything, except:
@@ -566,13 +1126,17 @@ static int send_chunk_or_dataless(int dns_fd, int userid, struct query *q)
 	char pkt[4096];
 	int datalen = 0;
 	int last = 0;
+	int hdrlen;
+
+	if (users[userid].downwin->size)
+		return send_window_chunk(dns_fd, userid, q);
 
 	/* If re-sent too many times, drop entire packet */
 	if (users[userid].outpacket.len > 0 &&
 	    users[userid].outfragresent > 5) {
-		users[userid].outpacket.len = 0;
-		users[userid].outpacket.offset = 0;
-		users[userid].outpacket.sentlen = 0;
+		user_packet_release(&users[userid].outpacket);
+		user_update_pending(userid);
+		downstream_lost(userid);
 		users[userid].outfragresent = 0;
 
 #ifdef OUTPACKETQ_LEN
@@ -583,9 +1147,8 @@ static int send_chunk_or_dataless(int dns_fd, int userid, struct query *q)
 
 	if (users[userid].outpacket.len > 0) {
 		datalen = MIN(users[userid].fragsize, users[userid].outpacket.len - users[userid].outpacket.offset);
-		datalen = MIN(datalen, sizeof(pkt)-2);
+		datalen = MIN(datalen, sizeof(pkt)-4);
 
-		memcpy(&pkt[2], users[userid].outpacket.data + users[userid].outpacket.offset, datalen);
 		users[userid].outpacket.sentlen = datalen;
 		last = (users[userid].outpacket.len == users[userid].outpacket.offset + datalen);
 
@@ -594,42 +1157,27 @@ static int send_chunk_or_dataless(int dns_fd, int userid, struct query *q)
 
 	/* Build downstream data header (see doc/proto_xxxxxxxx.txt) */
 
-	/* First byte is 1 bit compression flag, 3 bits upstream seqno, 4 bits upstream fragment */
-	pkt[0] = (1<<7) | ((users[userid].inpacket.seqno & 7) << 4) |
-		(users[userid].inpacket.fragment & 15);
-	/* Second byte is 3 bits downstream seqno, 4 bits downstream fragment, 1 bit last flag */
-	pkt[1] = ((users[userid].outpacket.seqno & 7) << 5) |
-		((users[userid].outpacket.fragment & 15) << 1) | (last & 1);
+	/* Second byte is 3 bits downstream seqno, 4 bits downstream fragment, 1 bit last flag.
+	   Without data, C asks for a stream restart. */
+	hdrlen = downstream_header(userid, pkt, datalen > 0 ?
+				   users[userid].outpacket.compressed : upstream_broken(userid),
+				   ((users[userid].outpacket.seqno & 7) << 5) |
+				   ((users[userid].outpacket.fragment & 15) << 1) | (last & 1));
+	if (datalen > 0)
+		memcpy(&pkt[hdrlen], users[userid].outpacket.data + users[userid].outpacket.offset, datalen);
 
 	if (debug >= 1) {
 		fprintf(stderr, "OUT  pkt seq# %d, frag %d (last=%d), offset %d, fragsize %d, total %d, to user %d\n",
 			users[userid].outpacket.seqno & 7, users[userid].outpacket.fragment & 15,
 			last, users[userid].outpacket.offset, datalen, users[userid].outpacket.len, userid);
 	}
-	write_dns(dns_fd, q, pkt, datalen + 2, users[userid].downenc);
-
-	if (q->id2 != 0) {
-		q->id = q->id2;
-		q->fromlen = q->fromlen2;
-		memcpy(&(q->from), &(q->from2), q->fromlen2);
-		if (debug >= 1)
-			fprintf(stderr, "OUT  again to last duplicate\n");
-		write_dns(dns_fd, q, pkt, datalen + 2, users[userid].downenc);
-	}
-
-	save_to_qmem_pingordata(userid, q);
-
-#ifdef DNSCACHE_LEN
-	save_to_dnscache(userid, q, pkt, datalen + 2);
-#endif
-
-	q->id = 0;			/* this query is used */
+	send_downstream(dns_fd, userid, q, pkt, datalen + hdrlen);
 
 	if (datalen > 0 && datalen == users[userid].outpacket.len) {
 		/* Whole packet was sent in one chunk, dont wait for ack */
-		users[userid].outpacket.len = 0;
-		users[userid].outpacket.offset = 0;
-		users[userid].outpacket.sentlen = 0;
+		compress_ctl_acked(&users[userid].downctl, datalen);
+		user_packet_release(&users[userid].outpacket);
+		user_update_pending(userid);
 		users[userid].outfragresent = 0;
 
 #ifdef OUTPACKETQ_LEN
@@ -645,42 +1193,139 @@ static int send_chunk_or_dataless(int dns_fd, int userid, struct query *q)
 	return 0;	/* don't call us again */
 }
 
-static int tunnel_tun(int tun_fd, struct dnsfd *dns_fds)
+static void
+compress_account(int userid, unsigned long len, unsigned long outlen, unsigned long us)
+/* Feed the compression level controller of userid after compressing
+   len bytes of a packet to outlen in us microseconds */
 {
-	unsigned long outlen;
-	struct ip *header;
-	char out[64*1024];
-	char in[64*1024];
-	int userid;
-	int read;
+	struct compress_ctl *ctl;
+	uint64_t now;
+	int backlog = 0;
+
+	now = clock_ms();
+	compress_cpu.us += us;
+	if (now - compress_cpu.start >= 1000) {
+		compress_cpu.used = compress_cpu.us / (10 * (now - compress_cpu.start));
+		compress_cpu.us = 0;
+		compress_cpu.start = now;
+	}
 
-	if ((read = read_tun(tun_fd, in, sizeof(in))) <= 0)
-		return 0;
+	ctl = &users[userid].downctl;
+#ifdef OUTPACKETQ_LEN
+	backlog = users[userid].outpacketq_filled;
+#endif
+	compress_ctl_compressed(ctl, len, outlen, us, backlog);
+	backlog = ctl->backlog;
+	if (!compress_ctl_update(ctl, now, compress_budget, compress_cpu.used))
+		return;
 
-	/* find target ip in packet, in is padded with 4 bytes TUN header */
-	header = (struct ip*) (in + 4);
-	userid = find_user_by_ip(header->ip_dst.s_addr);
-	if (userid < 0)
-		return 0;
+	__atomic_store_n(&users[userid].downlevel, ctl->level, __ATOMIC_RELAXED);
+	if (debug >= 1) {
+		fprintf(stderr, "Compression level %d for user %d (backlog %d, link %lu B/s, "
+			"need %d%% cpu, used %d%%)\n", ctl->level, userid, backlog,
+			ctl->link_rate, compress_ctl_need(ctl), compress_cpu.used);
+	}
+}
 
-	outlen = sizeof(out);
-	compress2((uint8_t*)out, &outlen, (uint8_t*)in, read, 9);
+static void held_timer_update(int userid)
+/* Keep qheld_timer at the deadline of the oldest held query */
+{
+	uint64_t expires = user_held_expires(userid);
+
+	if (expires)
+		timer_set(&users[userid].qheld_timer, expires);
+	else
+		timer_del(&users[userid].qheld_timer);
+}
+
+static void hold_older_query(struct dnsfd *dns_fds, int userid)
+/* users[].q must make room for a new query, but there is no data to
+   answer it with. Keep it as well, so that data coming later can go out
+   on several queries at once; if too many are held, answer the oldest.
+   Only for users with user_held_max() > 0. */
+{
+	struct query old;
+	uint64_t expires;
+
+	expires = clock_ms();
+	if (timer_pending(&users[userid].q_timer))
+		expires = users[userid].q_timer.expires;
+	if (user_hold_query(userid, &users[userid].q, expires) < 0 &&
+	    user_next_held(userid, &old)) {
+		send_chunk_or_dataless(get_dns_fd(dns_fds, &old.from), userid, &old);
+		user_hold_query(userid, &users[userid].q, expires);
+	}
+	users[userid].q.id = 0;
+	held_timer_update(userid);
+}
+
+static void answer_held_queries(struct dnsfd *dns_fds, int userid)
+/* Send what is waiting for userid on the held queries, oldest first */
+{
+	struct query q;
+
+	while (downstream_pending(userid) && user_next_held(userid, &q))
+		send_chunk_or_dataless(get_dns_fd(dns_fds, &q.from), userid, &q);
+	held_timer_update(userid);
+}
+
+static int held_duplicate(int userid, struct query *q)
+/* Like the check against users[].q: remember a retry of a held query
+   so that the answer goes to both. Returns 1 if q was one. */
+{
+	struct tun_user *u = &users[userid];
+	struct query *h;
+	int i;
+
+	for (i = 0; i < u->qheld_count; i++) {
+		h = &u->qheld[(u->qheld_first + i) % qheld_len].q;
+		if (q->type == h->type && !strcmp(q->name, h->name)) {
+			h->id2 = q->id;
+			h->fromlen2 = q->fromlen;
+			memcpy(&h->from2, &q->from, q->fromlen);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+dispatch_tun_packet(struct dnsfd *dns_fds, int userid, char *out, unsigned long outlen,
+		    int compressed)
+/* Queue packet from tun, compressed for userid if compressed is set,
+   towards the user */
+{
+	char *buf;
 
 	if (users[userid].conn == CONN_DNS_NULL) {
+		buf = pktbuf_get(outlen);
+		if (!buf) {
+			downstream_lost(userid);
+			return 0;
+		}
+		memcpy(buf, out, outlen);
+
 #ifdef OUTPACKETQ_LEN
 		/* If a packet is being sent, try storing the new one in the queue.
 		   If the queue is full, drop the packet. TCP will hopefully notice
 		   and reduce the packet rate. */
 		if (users[userid].outpacket.len > 0) {
-			save_to_outpacketq(userid, out, outlen);
+			save_to_outpacketq(userid, buf, outlen, compressed);
 			return 0;
 		}
 #endif
 
-		start_new_outpacket(userid, out, outlen);
+		start_new_outpacket(userid, buf, outlen, compressed);
 
-		/* Start sending immediately if query is waiting */
-		if (users[userid].q_sendrealsoon.id != 0) {
+		/* With a full window, the next ack sends it */
+		if (!downstream_pending(userid))
+			return outlen;
+
+		/* Start sending immediately if queries are waiting */
+		answer_held_queries(dns_fds, userid);
+		if (!downstream_pending(userid)) {
+			/* held queries took it all */
+		} else if (users[userid].q_sendrealsoon.id != 0) {
 			int dns_fd = get_dns_fd(dns_fds, &users[userid].q_sendrealsoon.from);
 			send_chunk_or_dataless(dns_fd, userid, &users[userid].q_sendrealsoon);
 		} else if (users[userid].q.id != 0) {
@@ -691,26 +1336,529 @@ static int tunnel_tun(int tun_fd, struct dnsfd *dns_fds)
 		return outlen;
 	} else { /* CONN_RAW_UDP */
 		int dns_fd = get_dns_fd(dns_fds, &users[userid].q.from);
-		send_raw(dns_fd, out, outlen, userid, RAW_HDR_CMD_DATA, &users[userid].q);
+		send_raw(dns_fd, out, outlen, userid,
+			 RAW_HDR_CMD_DATA | (compressed ? RAW_HDR_COMPRESSED : 0),
+			 &users[userid].q);
+		/* No acks in raw mode, the link takes what we send */
+		compress_ctl_acked(&users[userid].downctl, outlen);
 		return outlen;
 	}
 }
 
-typedef enum {
-	VERSION_ACK,
-	VERSION_NACK,
-	VERSION_FULL
-} version_ack_t;
+#ifdef USE_WORKERS
+/* With -w, users are handled by one or more workers, and a separate
+   thread reads and compresses packets from the tun device, which is the
+   most CPU heavy part of the server. Worker n owns the users whose
+   number is n modulo the number of workers: only it touches their state,
+   timers and packet buffers. The main thread is worker 0.
+
+   Each worker has DNS sockets of its own, bound to the same address with
+   SO_REUSEPORT, so that the kernel spreads queries over them. A query or
+   raw packet for a user of another worker is handed to that worker, as
+   is a packet that one user sends to another; queries for no user are
+   handled where they came in. Packets from tun go to the worker of the
+   user they are for. All of this goes through single-producer
+   single-consumer rings: one from the tun thread to each worker, and one
+   from each worker to each other one. Upstream packets are still
+   uncompressed and written to tun by the worker of the user sending. */
+
+#define TUN_RING_LEN 64		/* must be power of 2 */
+#define HANDOFF_RING_LEN 32	/* must be power of 2 */
+
+enum ring_type {
+	RING_TUN,		/* packet from tun */
+	RING_QUERY,		/* DNS query for handle_dns_query() */
+	RING_RAW,		/* raw UDP packet for raw_decode() */
+	RING_PACKET,		/* uncompressed packet from another user */
+};
 
-static void send_version_response(int fd, version_ack_t ack, uint32_t payload,
-				  int userid, struct query *q)
-{
-	char out[9];
+struct ring_slot {
+	int type;
+	in_addr_t dst;			/* RING_TUN and RING_PACKET */
+	const struct compressor *comp;	/* RING_TUN: what data was compressed with */
+	const struct compress_dict *dict;
+	int compressed;			/* -1: left to the worker */
+	unsigned long inlen;
+	unsigned long us;		/* time compressing took */
+	struct query q;			/* RING_QUERY and RING_RAW */
+	int hops;			/* RING_QUERY: workers that had no free user */
+	unsigned long len;
+	char *data;			/* pktbuf of ring_size bytes */
+};
 
-	switch (ack) {
-	case VERSION_ACK:
-		strncpy(out, "VACK", sizeof(out));
-		break;
+struct ring {
+	unsigned head;		/* next slot to read, written by consumer */
+	unsigned tail;		/* next slot to fill, written by producer */
+	unsigned len;
+	struct ring_slot *slots;
+};
+
+struct worker {
+	int id;
+	pthread_t thread;
+	struct dnsfd dns_fds;
+	int bind_fd;		/* worker 0 only */
+	struct ring tun;	/* from the tun thread */
+	int wake_fd;		/* eventfd, signalled when tun packets are queued */
+	int space_fd;		/* eventfd, signalled when a full tun ring is read */
+	struct ring *from;	/* handed over by each other worker */
+	int queue_fd;		/* eventfd, signalled when something is handed over */
+};
+
+static struct worker *workers;
+static int worker_count;
+static int worker_tun_fd;
+static enum io_engine worker_engine;
+static unsigned long ring_size;	/* of slot data, fits any packet within MTU
+				   and any raw packet */
+static __thread struct worker *this_worker;
+static __thread int query_hops;	/* of the RING_QUERY being handled */
+
+static struct ring_slot *
+ring_slot_free(struct ring *r)
+/* Producer: the slot to fill next, NULL if the ring is full. Sequentially
+   consistent with the consumer's store of head, see tun_ring_drain(). */
+{
+	if (r->tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) >= r->len)
+		return NULL;
+	return &r->slots[r->tail & (r->len - 1)];
+}
+
+static void
+ring_push(struct ring *r)
+/* Producer: hand over the slot from ring_slot_free() */
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+}
+
+static struct ring_slot *
+ring_slot_used(struct ring *r)
+/* Consumer: the oldest filled slot, NULL if the ring is empty */
+{
+	if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->slots[r->head & (r->len - 1)];
+}
+
+static void
+ring_pop(struct ring *r)
+/* Consumer: done with the slot from ring_slot_used() */
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		warn("worker wakeup");
+}
+
+static void
+workers_wake(void)
+/* Get all workers to look at running again */
+{
+	int i;
+
+	for (i = 0; i < worker_count; i++)
+		wake(workers[i].queue_fd);
+}
+
+static int
+user_worker(int userid)
+/* Worker owning userid, the running one for no user */
+{
+	if (userid < 0)
+		return this_worker ? this_worker->id : 0;
+	return worker_count ? userid % worker_count : 0;
+}
+
+static struct ring_slot *
+handoff_slot(int to, int type)
+/* Slot to hand something over to worker to in, NULL if that is the
+   running one. A ring that is full drops it, like the socket would
+   have if the worker had been reading it itself. */
+{
+	struct ring_slot *slot;
+
+	if (!this_worker || to == this_worker->id)
+		return NULL;
+	slot = ring_slot_free(&workers[to].from[this_worker->id]);
+	if (slot) {
+		slot->type = type;
+	} else if (debug >= 1) {
+		fprintf(stderr, "Worker %d is behind, dropping what worker %d has for it\n",
+			to, this_worker->id);
+	}
+	return slot;
+}
+
+static void
+handoff_push(int to)
+{
+	ring_push(&workers[to].from[this_worker->id]);
+	wake(workers[to].queue_fd);
+}
+
+static int
+handoff_query(int to, struct query *q, int hops)
+/* Returns 1 if q is for worker to and not the running one */
+{
+	struct ring_slot *slot;
+
+	if (!this_worker || to == this_worker->id)
+		return 0;
+	if ((slot = handoff_slot(to, RING_QUERY))) {
+		memcpy(&slot->q, q, sizeof(*q));
+		slot->hops = hops;
+		handoff_push(to);
+	}
+	return 1;
+}
+
+static int
+handoff_forward(struct query *q)
+/* Queries forwarded with -b all go through worker 0, which has the
+   socket and the forward query cache. Returns 1 if handed over. */
+{
+	if (!this_worker || !workers[0].bind_fd)
+		return 0;
+	return handoff_query(0, q, 0);
+}
+
+static int
+worker_find_user(void)
+/* Free user of the running worker, -1 if it has none */
+{
+	if (!this_worker)
+		return find_available_user(0, 1);
+	return find_available_user(this_worker->id, worker_count);
+}
+
+static int
+handoff_version(struct query *q)
+/* The running worker has no free user for q, try the next one.
+   Returns 0 if all were tried. */
+{
+	if (!this_worker || query_hops + 1 >= worker_count)
+		return 0;
+	return handoff_query((this_worker->id + 1) % worker_count, q, query_hops + 1);
+}
+
+static int
+handoff_raw(int to, char *packet, int len, struct query *q)
+/* Returns 1 if the raw packet is for worker to and not the running one */
+{
+	struct ring_slot *slot;
+
+	if (!this_worker || to == this_worker->id)
+		return 0;
+	if (len <= ring_size && (slot = handoff_slot(to, RING_RAW))) {
+		memcpy(slot->data, packet, len);
+		slot->len = len;
+		memcpy(&slot->q, q, sizeof(*q));
+		handoff_push(to);
+	}
+	return 1;
+}
+
+static int
+handoff_packet(in_addr_t dst, char *packet, int len)
+/* Returns 1 if the packet is for a user of another worker */
+{
+	struct ring_slot *slot;
+	int to;
+
+	to = user_worker(user_slot_by_ip(dst));
+	if (!this_worker || to == this_worker->id)
+		return 0;
+	if (len <= ring_size && (slot = handoff_slot(to, RING_PACKET))) {
+		slot->dst = dst;
+		memcpy(slot->data, packet, len);
+		slot->len = len;
+		handoff_push(to);
+	}
+	return 1;
+}
+
+static void *
+tun_thread(void *arg)
+{
+	char in[64*1024];
+	char hdrbuf[64*1024];
+	struct ring_slot *slot;
+	struct worker *w;
+	struct ip *header;
+	unsigned long hdrlen;
+	uint64_t dummy;
+	uint64_t start;
+	in_addr_t dst;
+	char *data;
+	int userid;
+	int level;
+	int len;
+
+	(void) arg;
+
+	for (;;) {
+		len = read_tun(worker_tun_fd, in, sizeof(in));
+		if (len <= 0) {
+			if (len < 0 && errno != EINTR && errno != EAGAIN) {
+				warn("read tun");
+				usleep(100000);
+			}
+			continue;
+		}
+		if (len > ring_size)
+			continue;	/* larger than the MTU allows */
+
+		/* find target ip in packet, in is padded with 4 bytes TUN header */
+		header = (struct ip*) (in + 4);
+		dst = header->ip_dst.s_addr;
+		userid = user_slot_by_ip(dst);
+		if (userid < 0)
+			continue;
+		w = &workers[user_worker(userid)];
+
+		/* With one worker, wait for it if the ring is full, which
+		   leaves the packets queued in the tun device. With more,
+		   a worker that is behind must not hold up the others, so
+		   its packet is dropped as the tun device would. */
+		while (!(slot = ring_slot_free(&w->tun))) {
+			if (worker_count > 1)
+				break;
+			if (read(w->space_fd, &dummy, sizeof(dummy)) < 0 && errno != EINTR)
+				err(1, "tun ring wait");
+		}
+		if (!slot)
+			continue;
+
+		slot->type = RING_TUN;
+		slot->dst = dst;
+		data = in;
+		hdrlen = sizeof(hdrbuf);
+		if (hdrcomp_packet(userid, hdrbuf, &hdrlen, in, len)) {
+			data = hdrbuf;
+			len = hdrlen;
+		}
+
+		/* Compressor may change under us, the worker checks it */
+		slot->comp = __atomic_load_n(&users[userid].downcomp, __ATOMIC_ACQUIRE);
+		level = __atomic_load_n(&users[userid].downlevel, __ATOMIC_RELAXED);
+		slot->dict = __atomic_load_n(&users[userid].dict, __ATOMIC_ACQUIRE);
+		if (slot->comp->stream) {
+			/* Stream state belongs to the worker, which also
+			   has to compress packets in sending order */
+			memcpy(slot->data, data, len);
+			slot->len = len;
+			slot->compressed = -1;
+		} else {
+			slot->len = ring_size;
+			start = clock_us();
+			slot->compressed = compress_packet(slot->comp, NULL, slot->dict,
+							   compressor_level(slot->comp, level),
+							   slot->data, &slot->len, data, len);
+			if (slot->compressed < 0) {
+				user_reset_hdrcomp(userid);
+				continue;
+			}
+			slot->inlen = len;
+			slot->us = clock_us() - start;
+		}
+
+		ring_push(&w->tun);
+		wake(w->wake_fd);
+	}
+
+	return NULL;
+}
+
+static int
+tun_ring_drain(struct dnsfd *dns_fds)
+{
+	struct worker *w = this_worker;
+	struct ring_slot *slot;
+	uint64_t dummy;
+	int userid;
+	int n;
+
+	if (read(w->wake_fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+		warn("read tun ring");
+
+	for (n = 0; n < TUN_RING_LEN; n++) {
+		/* Same flow control as when reading tun directly */
+		if (all_users_waiting_to_send())
+			break;
+		if (!(slot = ring_slot_used(&w->tun)))
+			break;
+
+		userid = find_user_by_ip(slot->dst);
+		if (userid < 0) {
+			/* gone */
+		} else if (slot->compressed < 0) {
+			send_tun_packet(dns_fds, userid, slot->data, slot->len);
+		} else if (slot->comp == users[userid].downcomp &&
+			   slot->dict == users[userid].dict) {
+			dispatch_tun_packet(dns_fds, userid, slot->data, slot->len,
+					    slot->compressed);
+			compress_account(userid, slot->inlen, slot->len, slot->us);
+		} else {
+			downstream_lost(userid);
+		}
+
+		ring_pop(&w->tun);
+		/* The ring was full before this slot was freed, so the tun
+		   thread may be waiting. tail is loaded again, not taken from
+		   before the slot was read: the thread may have filled the
+		   ring since, and would then wait for a wakeup that never
+		   came. */
+		if (__atomic_load_n(&w->tun.tail, __ATOMIC_SEQ_CST) - w->tun.head >= TUN_RING_LEN - 1)
+			wake(w->space_fd);
+	}
+
+	/* Packets left behind: keep wake_fd readable for next round */
+	if (ring_slot_used(&w->tun))
+		wake(w->wake_fd);
+
+	return n;
+}
+
+static void
+worker_queue_drain(int tun_fd, struct dnsfd *dns_fds, int bind_fd)
+/* Handle what other workers handed over */
+{
+	struct worker *w = this_worker;
+	struct ring_slot *slot;
+	uint64_t dummy;
+	int userid;
+	int i;
+	int n;
+
+	if (read(w->queue_fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+		warn("read worker queue");
+
+	dns_tx.active = 1;
+	for (i = 0; i < worker_count; i++) {
+		if (i == w->id)
+			continue;
+		for (n = 0; n < HANDOFF_RING_LEN && (slot = ring_slot_used(&w->from[i])); n++) {
+			switch (slot->type) {
+			case RING_QUERY:
+				query_hops = slot->hops;
+				handle_dns_query(tun_fd, get_dns_fd(dns_fds, &slot->q.from),
+						 dns_fds, bind_fd, &slot->q);
+				query_hops = 0;
+				break;
+			case RING_RAW:
+				raw_decode(slot->data, slot->len, &slot->q,
+					   get_dns_fd(dns_fds, &slot->q.from), dns_fds, tun_fd);
+				break;
+			case RING_PACKET:
+				userid = find_user_by_ip(slot->dst);
+				if (userid < 0)
+					send_tun(tun_fd, slot->data, slot->len);
+				else
+					send_tun_packet(dns_fds, userid, slot->data, slot->len);
+				break;
+			}
+			ring_pop(&w->from[i]);
+		}
+		if (ring_slot_used(&w->from[i]))
+			wake(w->queue_fd);
+	}
+	dns_tx_flush();
+	dns_tx.active = 0;
+}
+#else
+static int user_worker(int userid) { return 0; }
+static int handoff_query(int to, struct query *q, int hops) { return 0; }
+static int handoff_forward(struct query *q) { return 0; }
+static int worker_find_user(void) { return find_available_user(0, 1); }
+static int handoff_version(struct query *q) { return 0; }
+static int handoff_raw(int to, char *packet, int len, struct query *q) { return 0; }
+static int handoff_packet(in_addr_t dst, char *packet, int len) { return 0; }
+static void workers_wake(void) { }
+static void worker_queue_drain(int tun_fd, struct dnsfd *dns_fds, int bind_fd) { }
+#endif /* USE_WORKERS */
+
+static int
+send_tun_packet(struct dnsfd *dns_fds, int userid, char *in, int len)
+/* Compress and send packet from tun, after header compression */
+{
+	unsigned long outlen;
+	char out[64*1024];
+	uint64_t start;
+	int compressed;
+	int ret;
+
+	outlen = sizeof(out);
+	start = clock_us();
+	compressed = compress_packet(users[userid].downcomp, down_stream(userid),
+				     users[userid].dict, users[userid].downlevel,
+				     out, &outlen, in, len);
+	if (compressed < 0) {
+		downstream_lost(userid);
+		return 0;
+	}
+
+	ret = dispatch_tun_packet(dns_fds, userid, out, outlen, compressed);
+	compress_account(userid, len, outlen, clock_us() - start);
+	return ret;
+}
+
+static int
+handle_tun_packet(struct dnsfd *dns_fds, char *in, int len)
+{
+	unsigned long hdrlen;
+	struct ip *header;
+	char hdrbuf[64*1024];
+	int userid;
+
+	/* find target ip in packet, in is padded with 4 bytes TUN header */
+	header = (struct ip*) (in + 4);
+	userid = find_user_by_ip(header->ip_dst.s_addr);
+	if (userid < 0)
+		return 0;
+
+	hdrlen = sizeof(hdrbuf);
+	if (hdrcomp_packet(userid, hdrbuf, &hdrlen, in, len))
+		return send_tun_packet(dns_fds, userid, hdrbuf, hdrlen);
+	return send_tun_packet(dns_fds, userid, in, len);
+}
+
+static int tunnel_tun(int tun_fd, struct dnsfd *dns_fds)
+{
+	char in[64*1024];
+	int read;
+
+#ifdef USE_WORKERS
+	if (this_worker)
+		return tun_ring_drain(dns_fds);
+#endif
+
+	if ((read = read_tun(tun_fd, in, sizeof(in))) <= 0)
+		return 0;
+
+	return handle_tun_packet(dns_fds, in, read);
+}
+
+typedef enum {
+	VERSION_ACK,
+	VERSION_NACK,
+	VERSION_FULL
+} version_ack_t;
+
+static void send_version_response(int fd, version_ack_t ack, uint32_t payload,
+				  int userid, struct query *q)
+{
+	char out[10];
+
+	switch (ack) {
+	case VERSION_ACK:
+		strncpy(out, "VACK", sizeof(out));
+		break;
 	case VERSION_NACK:
 		strncpy(out, "VNAK", sizeof(out));
 		break;
@@ -723,17 +1871,40 @@ static void send_version_response(int fd, version_ack_t ack, uint32_t payload,
 	out[5] = ((payload >> 16) & 0xff);
 	out[6] = ((payload >> 8) & 0xff);
 	out[7] = ((payload) & 0xff);
-	out[8] = userid & 0xff;
+	out[8] = (userid >> 8) & 0xff;
+	out[9] = userid & 0xff;
 
 	write_dns(fd, q, out, sizeof(out), users[userid].downenc);
 }
 
+static void process_window_ack(int userid, int next, unsigned bitmap)
+/* Acks for a downstream window: next is the fragment the user waits for,
+   bitmap the ones after it that it has, see window_out_ack() */
+{
+	struct window_frag frag;
+
+	window_out_ack(users[userid].downwin, next, bitmap);
+	while (window_out_pop(users[userid].downwin, &frag)) {
+		if (!frag.parity)
+			compress_ctl_acked(&users[userid].downctl, frag.len);
+		pktbuf_put(frag.data);
+	}
+}
+
 /* Process acks from downstream fragments.
    After this, .offset and .fragment are updated (if ack correct),
    or .len is set to zero when all is done.
+   With a window, the seqno and fragment fields hold the next fragment
+   number and only pings carry a bitmap.
 */
-static void process_downstream_ack(int userid, int down_seq, int down_frag)
+static void process_downstream_ack(int userid, int down_seq, int down_frag,
+				   unsigned bitmap)
 {
+	if (users[userid].downwin->size) {
+		process_window_ack(userid, (down_seq << 4) | down_frag, bitmap);
+		return;
+	}
+
 	if (users[userid].outpacket.len <= 0)
 		/* No packet to apply acks to */
 		return;
@@ -752,8 +1923,9 @@ static void process_downstream_ack(int userid, int down_seq, int down_frag)
 
 	/* Is packet done? */
 	if (users[userid].outpacket.offset >= users[userid].outpacket.len) {
-		users[userid].outpacket.len = 0;
-		users[userid].outpacket.offset = 0;
+		compress_ctl_acked(&users[userid].downctl, users[userid].outpacket.len);
+		user_packet_release(&users[userid].outpacket);
+		user_update_pending(userid);
 		users[userid].outpacket.fragment--;	/* unneeded ++ above */
 		/* ^keep last seqno/frag, are always returned on pings */
 		/* users[userid].outfragresent = 0; already above */
@@ -765,92 +1937,318 @@ static void process_downstream_ack(int userid, int down_seq, int down_frag)
 	}
 }
 
+static void queue_realsoon(int userid)
+/* Answer q_sendrealsoon soon, if tun or dns doesn't do it first */
+{
+	timer_set(&users[userid].realsoon_timer, clock_ms() + REALSOON_DELAY);
+}
+
 static void
-handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query *q, int domain_len)
+idle_shutdown(void)
 {
-	struct in_addr tempip;
-	char in[512];
-	char logindata[16];
-	char out[64*1024];
-	char unpacked[64*1024];
-	char *tmp[2];
-	int userid;
-	int read;
+	fprintf(stderr, "Idling since too long, shutting down...\n");
+	running = 0;
+	workers_wake();
+}
 
-	userid = -1;
+static void
+user_idle_expire(void *arg)
+/* Nothing came from the user for max_idle_ms, shut down if it was the
+   last one and the startup wait is over */
+{
+	struct tun_user *user = arg;
 
-	/* Everything here needs at least two chars in the name */
-	if (domain_len < 2)
+	/* Timer is only moved when it fires, not on every packet */
+	if (user->last_pkt + max_idle_ms > user->idle.expires) {
+		timer_set(&user->idle, user->last_pkt + max_idle_ms);
 		return;
+	}
+	/* Sequentially consistent with idle_expire(), so that one of us
+	   sees both the last user gone and the startup wait over */
+	if (__atomic_sub_fetch(&busy_users, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&idle_waited, __ATOMIC_SEQ_CST))
+		idle_shutdown();
+}
 
-	memcpy(in, q->name, MIN(domain_len, sizeof(in)));
+static void
+idle_expire(void *arg)
+/* max_idle_ms after startup */
+{
+	__atomic_store_n(&idle_waited, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&busy_users, __ATOMIC_SEQ_CST) == 0)
+		idle_shutdown();
+}
 
-	if(in[0] == 'V' || in[0] == 'v') {
-		int version = 0;
+static void
+user_seen(int userid)
+/* A packet came from userid */
+{
+	users[userid].last_pkt = clock_ms();
+	if (max_idle_ms && !timer_pending(&users[userid].idle)) {
+		__atomic_add_fetch(&busy_users, 1, __ATOMIC_SEQ_CST);
+		timer_set(&users[userid].idle, users[userid].last_pkt + max_idle_ms);
+	}
+}
 
-		read = unpack_data(unpacked, sizeof(unpacked), &(in[1]), domain_len - 1, &base32_ops);
-		/* Version greeting, compare and send ack/nak */
-		if (read > 4) {
-			/* Received V + 32bits version */
-			version = (((unpacked[0] & 0xff) << 24) |
-					   ((unpacked[1] & 0xff) << 16) |
-					   ((unpacked[2] & 0xff) << 8) |
-					   ((unpacked[3] & 0xff)));
-		}
+static void hold_query(int userid)
+/* New query stored in users[].q; don't hold it forever in lazy mode */
+{
+	if (users[userid].lazy)
+		timer_set(&users[userid].q_timer, clock_ms() + LAZY_HOLD_DELAY);
+}
 
-		if (version == PROTOCOL_VERSION) {
-			userid = find_available_user();
-			if (userid >= 0) {
-				int i;
+static void
+set_compression(int dns_fd, struct query *q, int userid, char *in, int domain_len)
+/* 'O' option 'C': compressor upstream, compressor and level downstream */
+{
+	const struct compressor *up;
+	const struct compressor *down;
+	char reply[64];
+	int level;
+	int len;
 
-				users[userid].seed = rand();
-				/* Store remote IP number */
-				memcpy(&(users[userid].host), &(q->from), q->fromlen);
-				users[userid].hostlen = q->fromlen;
+	if (domain_len < 7) { /* example: "O01CzsD" */
+		write_dns(dns_fd, q, "BADLEN", 6, 'T');
+		return;
+	}
 
-				memcpy(&(users[userid].q), q, sizeof(struct query));
-				users[userid].encoder = &base32_ops;
-				users[userid].downenc = 'T';
-				send_version_response(dns_fd, VERSION_ACK, users[userid].seed, userid, q);
-				syslog(LOG_INFO, "accepted version for user #%d from %s",
+	up = compressor_by_id(in[4]);
+	down = compressor_by_id(in[5]);
+	if (!up || !down) {
+		write_dns(dns_fd, q, "BADCODEC", 8, users[userid].downenc);
+		return;
+	}
+	level = compressor_level(down, b32_8to5(in[6]) + COMPRESS_LEVEL_MIN);
+
+	/* Asked again after a lost reply, keep the streams going */
+	if (up != users[userid].upcomp || down != users[userid].downcomp ||
+	    level != users[userid].downctl.max_level)
+		user_switch_compression(userid, up, down, level);
+	len = snprintf(reply, sizeof(reply), "%s/%s:%d", up->name, down->name, level);
+	write_dns(dns_fd, q, reply, len, users[userid].downenc);
+}
+
+static void
+send_compression(int dns_fd, struct query *q, int userid)
+/* 'O' option 'Q': which compressors the user has now */
+{
+	char reply[64];
+	int len;
+
+	len = snprintf(reply, sizeof(reply), "%s/%s:%d", users[userid].upcomp->name,
+		       users[userid].downcomp->name, users[userid].downctl.max_level);
+	write_dns(dns_fd, q, reply, len, users[userid].downenc);
+}
+
+static void
+set_dict(int dns_fd, struct query *q, int userid, char *in, int domain_len)
+/* 'O' option 'D': preset dictionary for both directions by id */
+{
+	const struct compress_dict *dict;
+	char reply[16];
+	uint32_t id;
+	int len;
+	int i;
+
+	if (domain_len < 11) { /* example: "O01Dabcdefg" */
+		write_dns(dns_fd, q, "BADLEN", 6, 'T');
+		return;
+	}
+
+	id = 0;
+	for (i = 4; i < 11; i++)
+		id = (id << 5) | b32_8to5(in[i]);
+	dict = compress_dict_by_id(id);
+	if (!dict) {
+		write_dns(dns_fd, q, "BADDICT", 7, users[userid].downenc);
+		return;
+	}
+
+	user_switch_dict(userid, dict);
+	len = snprintf(reply, sizeof(reply), "%08x", dict->id);
+	write_dns(dns_fd, q, reply, len, users[userid].downenc);
+}
+
+static void
+inpacket_add(int userid, const char *data, int len)
+/* Append upstream fragment to the user's inpacket. If it can't be
+   stored, the packet is dropped when complete instead of being passed
+   on without it. */
+{
+	struct user_packet *p = &users[userid].inpacket;
+	char *buf;
+
+	if (p->dropped)
+		return;
+	if (p->offset + len > USER_PACKET_LEN ||
+	    !(buf = pktbuf_grow(p->data, p->offset, p->offset + len))) {
+		p->dropped = 1;
+		return;
+	}
+	p->data = buf;
+	memcpy(p->data + p->offset, data, len);
+	p->len += len;
+	p->offset += len;
+}
+
+static int
+upstream_window_put(int tun_fd, struct dnsfd *dns_fds, int userid, int seq,
+		    int last, int compressed, char *data, int len)
+/* Store an upstream fragment from a user that sends with a window, and
+   pass on the packets it completes. Returns 1 if the fragment was new. */
+{
+	struct user_packet *p = &users[userid].inpacket;
+	int fragcompressed;
+	int fraglast;
+	char *frag;
+	int fraglen;
+	int ret;
+
+	ret = window_in_put(users[userid].upwin, seq, data, len, compressed, last);
+
+	while (window_in_get(users[userid].upwin, &frag, &fraglen,
+			     &fragcompressed, &fraglast)) {
+		inpacket_add(userid, frag, fraglen);
+		p->compressed = fragcompressed;
+		if (fraglast)
+			handle_full_packet(tun_fd, dns_fds, userid, users[userid].zstream);
+	}
+
+	/* Acks carry the next fragment number in the seqno and fragment */
+	p->seqno = (users[userid].upwin->next >> 4) & 7;
+	p->fragment = users[userid].upwin->next & 15;
+	return ret;
+}
+
+static void
+set_window(int dns_fd, struct query *q, int userid, char *in, int domain_len)
+/* 'O' option 'W': window sizes downstream and upstream, 0 to go without */
+{
+	char reply[16];
+	int down;
+	int up;
+	int len;
+
+	if (domain_len < 6) { /* example: "O01Wii" */
+		write_dns(dns_fd, q, "BADLEN", 6, 'T');
+		return;
+	}
+
+	down = MIN(b32_8to5(in[4]), WINDOW_MAX);
+	up = MIN(b32_8to5(in[5]), WINDOW_MAX);
+	user_switch_window(userid, down, up);
+	len = snprintf(reply, sizeof(reply), "Window:%d/%d", down, up);
+	write_dns(dns_fd, q, reply, len, users[userid].downenc);
+}
+
+static void
+set_fec(int dns_fd, struct query *q, int userid, char *in, int domain_len)
+/* 'O' option 'F': data fragments per parity fragment, 0 for none */
+{
+	char reply[16];
+	int fec;
+	int len;
+
+	if (domain_len < 5) { /* example: "O01Fi" */
+		write_dns(dns_fd, q, "BADLEN", 6, 'T');
+		return;
+	}
+
+	fec = MIN(b32_8to5(in[4]), WINDOW_MAX);
+	if (user_switch_fec(userid, fec)) {
+		write_dns(dns_fd, q, "BADCODEC", 8, users[userid].downenc);
+		return;
+	}
+	len = snprintf(reply, sizeof(reply), "FEC:%d", fec);
+	write_dns(dns_fd, q, reply, len, users[userid].downenc);
+}
+
+static void
+handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query *q, int domain_len)
+{
+	struct in_addr tempip;
+	char in[512];
+	char logindata[16];
+	char out[64*1024];
+	char unpacked[64*1024];
+	char *tmp[2];
+	int userid;
+	int read;
+
+	userid = -1;
+
+	/* Everything here needs at least two chars in the name */
+	if (domain_len < 2)
+		return;
+
+	memcpy(in, q->name, MIN(domain_len, sizeof(in)));
+
+	if(in[0] == 'V' || in[0] == 'v') {
+		int version = 0;
+
+		read = unpack_data(unpacked, sizeof(unpacked), &(in[1]), domain_len - 1, &base32_ops);
+		/* Version greeting, compare and send ack/nak */
+		if (read > 4) {
+			/* Received V + 32bits version */
+			version = (((unpacked[0] & 0xff) << 24) |
+					   ((unpacked[1] & 0xff) << 16) |
+					   ((unpacked[2] & 0xff) << 8) |
+					   ((unpacked[3] & 0xff)));
+		}
+
+		if (version == PROTOCOL_VERSION) {
+			userid = worker_find_user();
+			if (userid >= 0) {
+				int i;
+
+				user_seen(userid);
+
+				users[userid].seed = rand();
+				/* Store remote IP number */
+				memcpy(&(users[userid].host), &(q->from), q->fromlen);
+				users[userid].hostlen = q->fromlen;
+
+				memcpy(&(users[userid].q), q, sizeof(struct query));
+				users[userid].encoder = &base32_ops;
+				users[userid].downenc = 'T';
+				user_switch_compression(userid, &zlib_ops, &zlib_ops, zlib_ops.default_level);
+				user_switch_dict(userid, NULL);
+				user_switch_hdrcomp(userid, 0);
+				users[userid].bundle = 0;
+				user_switch_window(userid, 0, 0);
+				send_version_response(dns_fd, VERSION_ACK, users[userid].seed, userid, q);
+				syslog(LOG_INFO, "accepted version for user #%d from %s",
 					userid, format_addr(&q->from, q->fromlen));
 				users[userid].q.id = 0;
 				users[userid].q.id2 = 0;
 				users[userid].q_sendrealsoon.id = 0;
 				users[userid].q_sendrealsoon.id2 = 0;
-				users[userid].q_sendrealsoon_new = 0;
-				users[userid].outpacket.len = 0;
-				users[userid].outpacket.offset = 0;
-				users[userid].outpacket.sentlen = 0;
+				user_release_packets(userid);
 				users[userid].outpacket.seqno = 0;
 				users[userid].outpacket.fragment = 0;
 				users[userid].outfragresent = 0;
-				users[userid].inpacket.len = 0;
-				users[userid].inpacket.offset = 0;
 				users[userid].inpacket.seqno = 0;
 				users[userid].inpacket.fragment = 0;
 				users[userid].fragsize = 100; /* very safe */
 				users[userid].conn = CONN_DNS_NULL;
 				users[userid].lazy = 0;
-#ifdef OUTPACKETQ_LEN
-				users[userid].outpacketq_nexttouse = 0;
-				users[userid].outpacketq_filled = 0;
-#endif
 #ifdef DNSCACHE_LEN
 				{
-					for (i = 0; i < DNSCACHE_LEN; i++) {
+					for (i = 0; i < dnscache_len; i++) {
 					        users[userid].dnscache_q[i].id = 0;
 					        users[userid].dnscache_answerlen[i] = 0;
 					}
 				}
 				users[userid].dnscache_lastfilled = 0;
 #endif
-				for (i = 0; i < QMEMPING_LEN; i++)
+				for (i = 0; i < qmemping_len; i++)
 				        users[userid].qmemping_type[i] = T_UNSET;
 				users[userid].qmemping_lastfilled = 0;
-				for (i = 0; i < QMEMDATA_LEN; i++)
+				for (i = 0; i < qmemdata_len; i++)
 				        users[userid].qmemdata_type[i] = T_UNSET;
 				users[userid].qmemdata_lastfilled = 0;
+			} else if (handoff_version(q)) {
+				/* the next worker may have space */
 			} else {
 				/* No space for another user */
 				send_version_response(dns_fd, VERSION_FULL, created_users, 0, q);
@@ -865,13 +2263,13 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		return;
 	} else if(in[0] == 'L' || in[0] == 'l') {
 		read = unpack_data(unpacked, sizeof(unpacked), &(in[1]), domain_len - 1, &base32_ops);
-		if (read < 17) {
+		if (read < 18) {
 			write_dns(dns_fd, q, "BADLEN", 6, 'T');
 			return;
 		}
 
 		/* Login phase, handle auth */
-		userid = unpacked[0];
+		userid = ((unpacked[0] & 0xff) << 8) | (unpacked[1] & 0xff);
 
 		if (check_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
@@ -879,10 +2277,10 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 				userid, format_addr(&q->from, q->fromlen));
 			return;
 		} else {
-			users[userid].last_pkt = time(NULL);
+			user_seen(userid);
 			login_calculate(logindata, 16, password, users[userid].seed);
 
-			if (read >= 18 && (memcmp(logindata, unpacked+1, 16) == 0)) {
+			if (read >= 19 && (memcmp(logindata, unpacked+2, 16) == 0)) {
 				/* Store login ok */
 				users[userid].authenticated = 1;
 
@@ -913,7 +2311,12 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		char reply[17];
 		int length;
 
-		userid = b32_8to5(in[1]);
+		if (domain_len < 3) {
+			write_dns(dns_fd, q, "BADLEN", 6, 'T');
+			return;
+		}
+
+		userid = b32_userid(&in[1]);
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
@@ -948,19 +2351,19 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		int codec;
 		const struct encoder *enc;
 
-		if (domain_len < 3) { /* len at least 3, example: "S15" */
+		if (domain_len < 4) { /* len at least 4, example: "S015" */
 			write_dns(dns_fd, q, "BADLEN", 6, 'T');
 			return;
 		}
 
-		userid = b32_8to5(in[1]);
+		userid = b32_userid(&in[1]);
 
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
 		}
 
-		codec = b32_8to5(in[2]);
+		codec = b32_8to5(in[3]);
 
 		switch (codec) {
 		case 5: /* 5 bits per byte = base32 */
@@ -989,19 +2392,19 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		}
 		return;
 	} else if(in[0] == 'O' || in[0] == 'o') {
-		if (domain_len < 3) { /* len at least 3, example: "O1T" */
+		if (domain_len < 4) { /* len at least 4, example: "O01T" */
 			write_dns(dns_fd, q, "BADLEN", 6, 'T');
 			return;
 		}
 
-		userid = b32_8to5(in[1]);
+		userid = b32_userid(&in[1]);
 
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
 		}
 
-		switch (in[2]) {
+		switch (in[3]) {
 		case 'T':
 		case 't':
 			users[userid].downenc = 'T';
@@ -1037,6 +2440,41 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			users[userid].lazy = 0;
 			write_dns(dns_fd, q, "Immediate", 9, users[userid].downenc);
 			break;
+		case 'C':
+		case 'c':
+			set_compression(dns_fd, q, userid, in, domain_len);
+			break;
+		case 'D':
+		case 'd':
+			set_dict(dns_fd, q, userid, in, domain_len);
+			break;
+		case 'Q':
+		case 'q':
+			send_compression(dns_fd, q, userid);
+			break;
+		case 'H':
+		case 'h':
+			user_switch_hdrcomp(userid, 1);
+			write_dns(dns_fd, q, "Headers", 7, users[userid].downenc);
+			break;
+		case 'W':
+		case 'w':
+			set_window(dns_fd, q, userid, in, domain_len);
+			break;
+		case 'F':
+		case 'f':
+			set_fec(dns_fd, q, userid, in, domain_len);
+			break;
+		case 'B':
+		case 'b':
+			/* Parts of a bundle are at most BUNDLE_PART_MAX */
+			if (my_mtu + 4 > BUNDLE_PART_MAX) {
+				write_dns(dns_fd, q, "BADCODEC", 8, users[userid].downenc);
+				break;
+			}
+			users[userid].bundle = 1;
+			write_dns(dns_fd, q, "Bundle", 6, users[userid].downenc);
+			break;
 		default:
 			write_dns(dns_fd, q, "BADCODEC", 8, users[userid].downenc);
 			break;
@@ -1123,13 +2561,13 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		}
 
 		/* Downstream fragsize probe packet */
-		userid = (b32_8to5(in[1]) >> 1) & 15;
+		userid = (b32_userid(&in[1]) >> 1) & 511;
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
 		}
 
-		req_frag_size = ((b32_8to5(in[1]) & 1) << 10) | ((b32_8to5(in[2]) & 31) << 5) | (b32_8to5(in[3]) & 31);
+		req_frag_size = ((b32_8to5(in[2]) & 1) << 10) | ((b32_8to5(in[3]) & 31) << 5) | (b32_8to5(in[4]) & 31);
 		if (req_frag_size < 2 || req_frag_size > 2047) {
 			write_dns(dns_fd, q, "BADFRAG", 7, users[userid].downenc);
 		} else {
@@ -1152,29 +2590,30 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 
 		read = unpack_data(unpacked, sizeof(unpacked), &(in[1]), domain_len - 1, &base32_ops);
 
-		if (read < 3) {
+		if (read < 4) {
 			write_dns(dns_fd, q, "BADLEN", 6, 'T');
 			return;
 		}
 
 		/* Downstream fragsize packet */
-		userid = unpacked[0];
+		userid = ((unpacked[0] & 0xff) << 8) | (unpacked[1] & 0xff);
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
 		}
 
-		max_frag_size = ((unpacked[1] & 0xff) << 8) | (unpacked[2] & 0xff);
+		max_frag_size = ((unpacked[2] & 0xff) << 8) | (unpacked[3] & 0xff);
 		if (max_frag_size < 2) {
 			write_dns(dns_fd, q, "BADFRAG", 7, users[userid].downenc);
 		} else {
 			users[userid].fragsize = max_frag_size;
-			write_dns(dns_fd, q, &unpacked[1], 2, users[userid].downenc);
+			write_dns(dns_fd, q, &unpacked[2], 2, users[userid].downenc);
 		}
 		return;
 	} else if(in[0] == 'P' || in[0] == 'p') {
 		int dn_seq;
 		int dn_frag;
+		unsigned bitmap;
 		int didsend = 0;
 
 		/* We can't handle id=0, that's "no packet" to us. So drop
@@ -1187,16 +2626,20 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			return;
 
 		read = unpack_data(unpacked, sizeof(unpacked), &(in[1]), domain_len - 1, &base32_ops);
-		if (read < 4)
+		if (read < 5)
 			return;
 
 		/* Ping packet, store userid */
-		userid = unpacked[0];
+		userid = ((unpacked[0] & 0x01) << 8) | (unpacked[1] & 0xff);
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
 			return; /* illegal id */
 		}
 
+		/* Client lost track of the compression stream */
+		if (unpacked[0] & 0x80)
+			downstream_lost(userid);
+
 #ifdef DNSCACHE_LEN
 		/* Check if cached */
 		if (answer_from_dnscache(dns_fd, userid, q))
@@ -1205,8 +2648,8 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 
 		/* Check if duplicate (and not in full dnscache any more) */
 		if (answer_from_qmem(dns_fd, q, users[userid].qmemping_cmc,
-				     users[userid].qmemping_type, QMEMPING_LEN,
-				     (void *) unpacked))
+				     users[userid].qmemping_type, qmemping_len,
+				     (void *) (unpacked + 1)))
 			return;
 
 		/* Check if duplicate of waiting queries; impatient DNS relays
@@ -1231,6 +2674,14 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			return;
 		}
 
+		if (held_duplicate(userid, q)) {
+			if (debug >= 2) {
+				fprintf(stderr, "PING pkt from user %d = dupe of held query, remembering\n",
+					userid);
+			}
+			return;
+		}
+
 		if (users[userid].q_sendrealsoon.id != 0 &&
 		    q->type == users[userid].q_sendrealsoon.type &&
 		    !strcmp(q->name, users[userid].q_sendrealsoon.name)) {
@@ -1247,15 +2698,19 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			return;
 		}
 
-		dn_seq = unpacked[1] >> 4;
-		dn_frag = unpacked[1] & 15;
+		dn_seq = (unpacked[2] >> 4) & 7;
+		dn_frag = unpacked[2] & 15;
+		/* With a window, which fragments after that one it has */
+		bitmap = 0;
+		if (read >= 7)
+			bitmap = ((unpacked[5] & 0xff) << 8) | (unpacked[6] & 0xff);
 
 		if (debug >= 1) {
 			fprintf(stderr, "PING pkt from user %d, ack for downstream %d/%d\n",
 				userid, dn_seq, dn_frag);
 		}
 
-		process_downstream_ack(userid, dn_seq, dn_frag);
+		process_downstream_ack(userid, dn_seq, dn_frag, bitmap);
 
 		if (debug >= 3) {
 			fprintf(stderr, "PINGret (if any) will ack upstream %d/%d\n",
@@ -1269,12 +2724,20 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			send_chunk_or_dataless(dns_fd, userid, &users[userid].q_sendrealsoon);
 		}
 
+		/* Held queries are older than q, so they go first */
+		answer_held_queries(dns_fds, userid);
+
 		/* We need to store a new query, so if there still is an
 		   earlier query waiting, always send a reply to finish it.
 		   May contain new downstream data if the ping had a new ack.
 		   Otherwise, may also be re-sending old data.
-		   (This is duplicate data if we had q_sendrealsoon above.) */
-		if (users[userid].q.id != 0) {
+		   (This is duplicate data if we had q_sendrealsoon above.)
+		   With a downstream window, keep it instead when there is
+		   nothing to send; the client polls with several queries. */
+		if (users[userid].q.id != 0 && !downstream_pending(userid) &&
+		    user_held_max(userid) > 0) {
+			hold_older_query(dns_fds, userid);
+		} else if (users[userid].q.id != 0) {
 			didsend = 1;
 			if (send_chunk_or_dataless(dns_fd, userid, &users[userid].q) == 1)
 				/* new packet from queue, send immediately */
@@ -1283,25 +2746,26 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 
 		/* Save new query and time info */
 		memcpy(&(users[userid].q), q, sizeof(struct query));
-		users[userid].last_pkt = time(NULL);
+		user_seen(userid);
+		hold_query(userid);
 
 		/* If anything waiting and we didn't already send above, send
 		   it now. And always send immediately if we're not lazy
 		   (then above won't have sent at all). */
-		if ((!didsend && users[userid].outpacket.len > 0) ||
+		if ((!didsend && downstream_pending(userid)) ||
 		    !users[userid].lazy)
 			send_chunk_or_dataless(dns_fd, userid, &users[userid].q);
 
 	} else if((in[0] >= '0' && in[0] <= '9')
 			|| (in[0] >= 'a' && in[0] <= 'f')
 			|| (in[0] >= 'A' && in[0] <= 'F')) {
-		int up_seq, up_frag, dn_seq, dn_frag, lastfrag;
+		int up_seq, up_frag, dn_seq, dn_frag, lastfrag, compressed;
 		int upstream_ok = 1;
 		int didsend = 0;
 		int code = -1;
 
-		/* Need 5char header + >=1 char data */
-		if (domain_len < 6)
+		/* Need 7char header and dot + >=1 char data */
+		if (domain_len < 9)
 			return;
 
 		/* We can't handle id=0, that's "no packet" to us. So drop
@@ -1320,7 +2784,7 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 		if ((in[0] >= 'A' && in[0] <= 'F'))
 			code = in[0] - 'A' + 10;
 
-		userid = code;
+		userid = (code << 5) | b32_8to5((unsigned char) in[1]);
 		/* Check user and sending ip number */
 		if (check_authenticated_user_and_ip(userid, q) != 0) {
 			write_dns(dns_fd, q, "BADIP", 5, 'T');
@@ -1359,6 +2823,14 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			return;
 		}
 
+		if (held_duplicate(userid, q)) {
+			if (debug >= 2) {
+				fprintf(stderr, "IN   pkt from user %d = dupe of held query, remembering\n",
+					userid);
+			}
+			return;
+		}
+
 		if (users[userid].q_sendrealsoon.id != 0 &&
 		    q->type == users[userid].q_sendrealsoon.type &&
 		    !strcmp(q->name, users[userid].q_sendrealsoon.name)) {
@@ -1377,15 +2849,32 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 
 
 		/* Decode data header */
-		up_seq = (b32_8to5(in[1]) >> 2) & 7;
-		up_frag = ((b32_8to5(in[1]) & 3) << 2) | ((b32_8to5(in[2]) >> 3) & 3);
-		dn_seq = (b32_8to5(in[2]) & 7);
-		dn_frag = b32_8to5(in[3]) >> 1;
-		lastfrag = b32_8to5(in[3]) & 1;
-
-		process_downstream_ack(userid, dn_seq, dn_frag);
-
-		if (up_seq == users[userid].inpacket.seqno &&
+		up_seq = (b32_8to5(in[2]) >> 2) & 7;
+		up_frag = ((b32_8to5(in[2]) & 3) << 2) | ((b32_8to5(in[3]) >> 3) & 3);
+		dn_seq = (b32_8to5(in[3]) & 7);
+		dn_frag = b32_8to5(in[4]) >> 1;
+		lastfrag = b32_8to5(in[4]) & 1;
+		/* in[5] is data-CMC */
+		compressed = (b32_8to5(in[6]) >> 4) & 1;
+		if (b32_8to5(in[6]) & 8)
+			downstream_lost(userid);
+
+		process_downstream_ack(userid, dn_seq, dn_frag, 0);
+
+		if (users[userid].upwindow) {
+			/* Fragment number in the seqno and fragment bits,
+			   in any order */
+			read = unpack_data(unpacked, sizeof(unpacked), &(in[8]), domain_len - 8,
+					   users[userid].encoder);
+			upstream_ok = upstream_window_put(tun_fd, dns_fds, userid,
+							  (up_seq << 4) | up_frag, lastfrag,
+							  compressed, unpacked, read);
+			if (debug >= 1) {
+				fprintf(stderr, "IN   frag %d (last=%d, %s), %d bytes, from user %d\n",
+					(up_seq << 4) | up_frag, lastfrag,
+					upstream_ok ? "new" : "dropped", read, userid);
+			}
+		} else if (up_seq == users[userid].inpacket.seqno &&
 			up_frag <= users[userid].inpacket.fragment) {
 			/* Got repeated old packet _with data_, probably
 			   because client didn't receive our ack. So re-send
@@ -1415,8 +2904,7 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 			/* Forget any old packet, even if incomplete */
 			users[userid].inpacket.seqno = up_seq;
 			users[userid].inpacket.fragment = up_frag;
-			users[userid].inpacket.len = 0;
-			users[userid].inpacket.offset = 0;
+			user_packet_release(&users[userid].inpacket);
 		} else {
 			/* seq is same, frag is higher; don't care about
 			   missing fragments, TCP checksum will fail */
@@ -1429,488 +2917,1237 @@ handle_null_request(int tun_fd, int dns_fd, struct dnsfd *dns_fds, struct query
 				users[userid].inpacket.seqno, users[userid].inpacket.fragment);
 		}
 
-		if (upstream_ok) {
+		if (upstream_ok && !users[userid].upwindow) {
 			/* decode with this user's encoding */
-			read = unpack_data(unpacked, sizeof(unpacked), &(in[5]), domain_len - 5,
+			read = unpack_data(unpacked, sizeof(unpacked), &(in[8]), domain_len - 8,
 					   users[userid].encoder);
+			users[userid].inpacket.compressed = compressed;
 
 			/* copy to packet buffer, update length */
-			read = MIN(read, sizeof(users[userid].inpacket.data) - users[userid].inpacket.offset);
-			memcpy(users[userid].inpacket.data + users[userid].inpacket.offset, unpacked, read);
-			users[userid].inpacket.len += read;
-			users[userid].inpacket.offset += read;
+			if (read > 0)
+				inpacket_add(userid, unpacked, read);
+
+			if (debug >= 1) {
+				fprintf(stderr, "IN   pkt seq# %d, frag %d (last=%d), fragsize %d, total %d, from user %d\n",
+					up_seq, up_frag, lastfrag, read, users[userid].inpacket.len, userid);
+			}
+		}
+
+		if (upstream_ok && lastfrag && !users[userid].upwindow) { /* packet is complete */
+			handle_full_packet(tun_fd, dns_fds, userid, users[userid].zstream);
+		}
+
+		/* Acks may have made room in the window */
+		answer_held_queries(dns_fds, userid);
+
+		/* If there is a query that must be returned real soon, do it.
+		   Includes an ack of the just received upstream fragment,
+		   may contain new data. */
+		if (users[userid].q_sendrealsoon.id != 0) {
+			didsend = 1;
+			if (send_chunk_or_dataless(dns_fd, userid, &users[userid].q_sendrealsoon) == 1)
+				/* new packet from queue, send immediately */
+				didsend = 0;
+		}
+
+		/* If we already have an earlier query waiting, we need to
+		   get rid of it to store the new query.
+		   - If we have new data waiting and not yet sent above,
+		     send immediately.
+		   - If this wasn't the last upstream fragment, then we expect
+		     more, so ack immediately if we didn't already.
+		   - If we are in non-lazy mode, there should be no query
+		     waiting, but if there is, send immediately.
+		   - In all other cases (mostly the last-fragment cases),
+		     we can afford to wait just a tiny little while for the
+		     TCP ack to arrive from our tun. Note that this works best
+		     when there is only one client.
+		 */
+		if (users[userid].q.id != 0) {
+			if ((downstream_pending(userid) && !didsend) ||
+			    (upstream_ok && !lastfrag && !didsend) ||
+			    (!upstream_ok && !didsend) ||
+			    !users[userid].lazy) {
+				didsend = 1;
+				if (send_chunk_or_dataless(dns_fd, userid, &users[userid].q) == 1)
+					/* new packet from queue, send immediately */
+					didsend = 0;
+			} else {
+				memcpy(&(users[userid].q_sendrealsoon),
+				       &(users[userid].q),
+				       sizeof(struct query));
+				queue_realsoon(userid);
+				users[userid].q.id = 0;  /* used */
+				didsend = 1;
+			}
+		}
+
+		/* Save new query and time info */
+		memcpy(&(users[userid].q), q, sizeof(struct query));
+		user_seen(userid);
+		hold_query(userid);
+
+		/* If we still need to ack this upstream frag, do it to keep
+		   upstream flowing.
+		   - If we have new data waiting and not yet sent above,
+		     send immediately.
+		   - If this wasn't the last upstream fragment, then we expect
+		     more, so ack immediately if we didn't already or are
+		     in non-lazy mode.
+		   - If this was the last fragment, and we didn't ack already
+		     or are in non-lazy mode, send the ack after just a tiny
+		     little while so that the TCP ack may have arrived from
+		     our tun device.
+		   - In all other cases, don't send anything now.
+		*/
+		if (downstream_pending(userid) && !didsend)
+			send_chunk_or_dataless(dns_fd, userid, &users[userid].q);
+		else if (!didsend || !users[userid].lazy) {
+			if (upstream_ok && lastfrag) {
+				memcpy(&(users[userid].q_sendrealsoon),
+				       &(users[userid].q),
+				       sizeof(struct query));
+				queue_realsoon(userid);
+				users[userid].q.id = 0;  /* used */
+			} else {
+				send_chunk_or_dataless(dns_fd, userid, &users[userid].q);
+			}
+		}
+	}
+}
+
+static void
+handle_ns_request(int dns_fd, struct query *q)
+/* Mostly identical to handle_a_request() below */
+{
+	char buf[64*1024];
+	int len;
+
+	if (ns_ip != INADDR_ANY) {
+		/* If ns_ip set, overwrite destination addr with it.
+		 * Destination addr will be sent as additional record (A, IN) */
+		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
+		memcpy(&addr->sin_addr, &ns_ip, sizeof(ns_ip));
+	}
+
+	len = dns_encode_ns_response(buf, sizeof(buf), q, topdomain);
+	if (len < 1) {
+		warnx("dns_encode_ns_response doesn't fit");
+		return;
+	}
+
+	if (debug >= 2) {
+		fprintf(stderr, "TX: client %s, type %d, name %s, %d bytes NS reply\n",
+			format_addr(&q->from, q->fromlen), q->type, q->name, len);
+	}
+	if (send_reply(dns_fd, buf, len, &q->from, q->fromlen) <= 0) {
+		warn("ns reply send error");
+	}
+}
+
+static void
+handle_a_request(int dns_fd, struct query *q, int fakeip)
+/* Mostly identical to handle_ns_request() above */
+{
+	char buf[64*1024];
+	int len;
+
+	if (fakeip) {
+		in_addr_t ip = inet_addr("127.0.0.1");
+		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
+		memcpy(&addr->sin_addr, &ip, sizeof(ip));
+
+	} else if (ns_ip != INADDR_ANY) {
+		/* If ns_ip set, overwrite destination addr with it.
+		 * Destination addr will be sent as additional record (A, IN) */
+		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
+		memcpy(&addr->sin_addr, &ns_ip, sizeof(ns_ip));
+	}
+
+	len = dns_encode_a_response(buf, sizeof(buf), q);
+	if (len < 1) {
+		warnx("dns_encode_a_response doesn't fit");
+		return;
+	}
+
+	if (debug >= 2) {
+		fprintf(stderr, "TX: client %s, type %d, name %s, %d bytes A reply\n",
+			format_addr(&q->from, q->fromlen), q->type, q->name, len);
+	}
+	if (send_reply(dns_fd, buf, len, &q->from, q->fromlen) <= 0) {
+		warn("a reply send error");
+	}
+}
+
+static void
+forward_query(int bind_fd, struct query *q)
+{
+	char buf[64*1024];
+	int len;
+	struct fw_query fwq;
+	struct sockaddr_in *myaddr;
+	in_addr_t newaddr;
+
+	len = dns_encode(buf, sizeof(buf), q, QR_QUERY, q->name, strlen(q->name));
+	if (len < 1) {
+		warnx("dns_encode doesn't fit");
+		return;
+	}
+
+	/* Store sockaddr for q->id */
+	memcpy(&(fwq.addr), &(q->from), q->fromlen);
+	fwq.addrlen = q->fromlen;
+	fwq.id = q->id;
+	fw_query_put(&fwq);
+
+	newaddr = inet_addr("127.0.0.1");
+	myaddr = (struct sockaddr_in *) &(q->from);
+	memcpy(&(myaddr->sin_addr), &newaddr, sizeof(in_addr_t));
+	myaddr->sin_port = htons(bind_port);
+
+	if (debug >= 2) {
+		fprintf(stderr, "TX: NS reply \n");
+	}
+
+	if (sendto(bind_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
+		warn("forward query error");
+	}
+}
+
+static int
+tunnel_bind(int bind_fd, struct dnsfd *dns_fds)
+{
+	char packet[64*1024];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	struct fw_query *query;
+	unsigned short id;
+	int dns_fd;
+	int r;
+
+	fromlen = sizeof(struct sockaddr);
+	r = recvfrom(bind_fd, packet, sizeof(packet), 0,
+		(struct sockaddr*)&from, &fromlen);
+
+	if (r <= 0)
+		return 0;
+
+	id = dns_get_id(packet, r);
+
+	if (debug >= 2) {
+		fprintf(stderr, "RX: Got response on query %u from DNS\n", (id & 0xFFFF));
+	}
+
+	/* Get sockaddr from id */
+	fw_query_get(id, &query);
+	if (!query) {
+		if (debug >= 2) {
+			fprintf(stderr, "Lost sender of id %u, dropping reply\n", (id & 0xFFFF));
+		}
+		return 0;
+	}
+
+	if (debug >= 2) {
+		fprintf(stderr, "TX: client %s id %u, %d bytes\n",
+			format_addr(&query->addr, query->addrlen), (id & 0xffff), r);
+	}
+
+	dns_fd = get_dns_fd(dns_fds, &query->addr);
+	if (sendto(dns_fd, packet, r, 0, (const struct sockaddr *) &(query->addr),
+		query->addrlen) <= 0) {
+		warn("forward reply error");
+	}
+
+	return 0;
+}
+
+static int
+query_userid(struct query *q, int domain_len)
+/* The user a query for handle_null_request() is from, -1 if none.
+   Found the same way, but nothing is checked. */
+{
+	char unpacked[2];
+	char in[16];
+	int len;
+	int code;
+
+	if (domain_len < 2)
+		return -1;
+
+	/* unpack_data() changes what it reads */
+	len = MIN(domain_len, sizeof(in));
+	memcpy(in, q->name, len);
+
+	switch (in[0]) {
+	case 'L': case 'l':
+	case 'N': case 'n':
+	case 'P': case 'p':
+		if (unpack_data(unpacked, sizeof(unpacked), &in[1], len - 1, &base32_ops) < 2)
+			return -1;
+		if (in[0] == 'P' || in[0] == 'p')
+			return ((unpacked[0] & 0x01) << 8) | (unpacked[1] & 0xff);
+		return ((unpacked[0] & 0xff) << 8) | (unpacked[1] & 0xff);
+	case 'I': case 'i':
+	case 'S': case 's':
+	case 'O': case 'o':
+		return b32_userid(&in[1]);
+	case 'R': case 'r':
+		return (b32_userid(&in[1]) >> 1) & 511;
+	}
+
+	if (in[0] >= '0' && in[0] <= '9')
+		code = in[0] - '0';
+	else if (in[0] >= 'a' && in[0] <= 'f')
+		code = in[0] - 'a' + 10;
+	else if (in[0] >= 'A' && in[0] <= 'F')
+		code = in[0] - 'A' + 10;
+	else
+		return -1;
+	return (code << 5) | b32_8to5((unsigned char) in[1]);
+}
+
+static void
+handle_dns_query(int tun_fd, int dns_fd, struct dnsfd *dns_fds, int bind_fd, struct query *q)
+{
+	int domain_len;
+	int inside_topdomain = 0;
+
+	if (debug >= 2) {
+		fprintf(stderr, "RX: client %s, type %d, name %s\n",
+			format_addr(&q->from, q->fromlen), q->type, q->name);
+	}
+
+	domain_len = strlen(q->name) - strlen(topdomain);
+	if (domain_len >= 0 && !strcasecmp(q->name + domain_len, topdomain))
+		inside_topdomain = 1;
+	/* require dot before topdomain */
+	if (domain_len >= 1 && q->name[domain_len - 1] != '.')
+		inside_topdomain = 0;
+
+	if (inside_topdomain) {
+		/* This is a query we can handle */
+
+		/* Handle A-type query for ns.topdomain, possibly caused
+		   by our proper response to any NS request */
+		if (domain_len == 3 && q->type == T_A &&
+		    (q->name[0] == 'n' || q->name[0] == 'N') &&
+		    (q->name[1] == 's' || q->name[1] == 'S') &&
+		     q->name[2] == '.') {
+			handle_a_request(dns_fd, q, 0);
+			return;
+		}
+
+		/* Handle A-type query for www.topdomain, for anyone that's
+		   poking around */
+		if (domain_len == 4 && q->type == T_A &&
+		    (q->name[0] == 'w' || q->name[0] == 'W') &&
+		    (q->name[1] == 'w' || q->name[1] == 'W') &&
+		    (q->name[2] == 'w' || q->name[2] == 'W') &&
+		     q->name[3] == '.') {
+			handle_a_request(dns_fd, q, 1);
+			return;
+		}
+
+		switch (q->type) {
+		case T_NULL:
+		case T_PRIVATE:
+		case T_CNAME:
+		case T_A:
+		case T_MX:
+		case T_SRV:
+		case T_TXT:
+			/* encoding is "transparent" here */
+			if (handoff_query(user_worker(query_userid(q, domain_len)), q, 0))
+				break;
+			handle_null_request(tun_fd, dns_fd, dns_fds, q, domain_len);
+			break;
+		case T_NS:
+			handle_ns_request(dns_fd, q);
+			break;
+		default:
+			break;
+		}
+	} else {
+		/* Forward query to other port ? */
+		if (handoff_forward(q)) {
+			/* worker 0 does it */
+		} else if (bind_fd) {
+			forward_query(bind_fd, q);
+		}
+	}
+}
+
+static int
+tunnel_dns(int tun_fd, int dns_fd, struct dnsfd *dns_fds, int bind_fd)
+{
+	struct query q;
+#ifdef USE_MMSG
+	int n;
+	int i;
+
+	for (i = 0; i < DNS_BATCH; i++) {
+		dns_rx.iov[i].iov_base = dns_rx.data[i];
+		dns_rx.iov[i].iov_len = sizeof(dns_rx.data[i]);
+		memset(&dns_rx.msgs[i], 0, sizeof(dns_rx.msgs[i]));
+		dns_rx.msgs[i].msg_hdr.msg_name = &dns_rx.from[i];
+		dns_rx.msgs[i].msg_hdr.msg_namelen = sizeof(dns_rx.from[i]);
+		dns_rx.msgs[i].msg_hdr.msg_iov = &dns_rx.iov[i];
+		dns_rx.msgs[i].msg_hdr.msg_iovlen = 1;
+		dns_rx.msgs[i].msg_hdr.msg_control = dns_rx.control[i];
+		dns_rx.msgs[i].msg_hdr.msg_controllen = sizeof(dns_rx.control[i]);
+	}
+
+	n = recvmmsg(dns_fd, dns_rx.msgs, DNS_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			warn("read dns");
+		return 0;
+	}
+
+	dns_tx.active = 1;
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &dns_rx.msgs[i].msg_hdr;
+
+		memcpy(&q.from, &dns_rx.from[i], msg->msg_namelen);
+		q.fromlen = msg->msg_namelen;
+		if (decode_query(dns_rx.data[i], dns_rx.msgs[i].msg_len, dns_fd,
+				 dns_fds, tun_fd, msg, &q) > 0)
+			handle_dns_query(tun_fd, dns_fd, dns_fds, bind_fd, &q);
+	}
+	dns_tx_flush();
+	dns_tx.active = 0;
+#else
+	if (read_dns(dns_fd, dns_fds, tun_fd, &q) > 0)
+		handle_dns_query(tun_fd, dns_fd, dns_fds, bind_fd, &q);
+#endif
+	return 0;
+}
+
+static void
+realsoon_expire(void *arg)
+/* Send realsoon's if tun or dns didn't already */
+{
+	struct tun_user *user = arg;
+
+	if (user->active && !user->disabled &&
+	    user->q_sendrealsoon.id != 0 &&
+	    user->conn == CONN_DNS_NULL) {
+		int dns_fd = get_dns_fd(server_dns_fds, &user->q_sendrealsoon.from);
+		send_chunk_or_dataless(dns_fd, user - users, &user->q_sendrealsoon);
+	}
+}
+
+static void
+lazy_hold_expire(void *arg)
+/* Lazy mode query waited long enough, answer it even without data */
+{
+	struct tun_user *user = arg;
+
+	if (user->active && !user->disabled &&
+	    user->q.id != 0 &&
+	    user->conn == CONN_DNS_NULL) {
+		int dns_fd = get_dns_fd(server_dns_fds, &user->q.from);
+		send_chunk_or_dataless(dns_fd, user - users, &user->q);
+	}
+}
+
+static void
+held_expire(void *arg)
+/* Held queries waited long enough, answer them even without data */
+{
+	struct tun_user *user = arg;
+	int userid = user - users;
+	struct query q;
+	uint64_t expires;
+
+	while ((expires = user_held_expires(userid)) && expires <= clock_ms()) {
+		user_next_held(userid, &q);
+		if (user->active && !user->disabled &&
+		    user->conn == CONN_DNS_NULL) {
+			int dns_fd = get_dns_fd(server_dns_fds, &q.from);
+			send_chunk_or_dataless(dns_fd, userid, &q);
+		}
+	}
+	held_timer_update(userid);
+}
+
+#ifdef USE_EPOLL
+
+static int
+epoll_watch(int epfd, int op, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+		warn("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+tunnel_epoll(int tun_fd, int tun_wait_fd, struct dnsfd *dns_fds, int bind_fd, int queue_fd)
+/* Same as tunnel_select(), but the file descriptors are registered once
+   instead of rebuilding an fd_set on every wakeup.
+   Returns -1 if epoll is not available, so caller can fall back to select. */
+{
+	struct epoll_event events[8];
+	int epfd;
+	int tun_watched;
+	int want_tun;
+	int timeout;
+	int n;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		warn("epoll_create1");
+		return -1;
+	}
+
+	if ((dns_fds->v4fd >= 0 && epoll_watch(epfd, EPOLL_CTL_ADD, dns_fds->v4fd)) ||
+	    (dns_fds->v6fd >= 0 && epoll_watch(epfd, EPOLL_CTL_ADD, dns_fds->v6fd)) ||
+	    (bind_fd && epoll_watch(epfd, EPOLL_CTL_ADD, bind_fd)) ||
+	    (queue_fd >= 0 && epoll_watch(epfd, EPOLL_CTL_ADD, queue_fd))) {
+		close(epfd);
+		return -1;
+	}
+	tun_watched = 0;
+
+	while (running) {
+		timeout = timers_next(clock_ms(), 10000);
+
+		/* Only touch the tun registration when it actually changes */
+		want_tun = !all_users_waiting_to_send();
+		if (want_tun != tun_watched) {
+			if (epoll_watch(epfd, want_tun ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, tun_wait_fd)) {
+				close(epfd);
+				return 1;
+			}
+			tun_watched = want_tun;
+		}
+
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+		clock_update();
+
+		if (n < 0) {
+			if (errno == EINTR && running)
+				continue;
+			if (running)
+				warn("epoll_wait");
+			close(epfd);
+			return 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == tun_wait_fd) {
+				tunnel_tun(tun_fd, dns_fds);
+			} else if (fd == dns_fds->v4fd || fd == dns_fds->v6fd) {
+				tunnel_dns(tun_fd, fd, dns_fds, bind_fd);
+			} else if (bind_fd && fd == bind_fd) {
+				tunnel_bind(bind_fd, dns_fds);
+			} else if (fd == queue_fd) {
+				worker_queue_drain(tun_fd, dns_fds, bind_fd);
+			}
+		}
+
+		timers_run(clock_ms());
+	}
+
+	close(epfd);
+	return 0;
+}
+
+#endif /* USE_EPOLL */
+
+static int
+tunnel_select(int tun_fd, int tun_wait_fd, struct dnsfd *dns_fds, int bind_fd, int queue_fd)
+{
+	struct timeval tv;
+	fd_set fds;
+	int timeout;
+	int i;
+
+	while (running) {
+		int maxfd;
+
+		/* Sleep until next timer, 10s if none (doesn't really matter) */
+		timeout = timers_next(clock_ms(), 10000);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+
+		FD_ZERO(&fds);
+		maxfd = 0;
 
-			if (debug >= 1) {
-				fprintf(stderr, "IN   pkt seq# %d, frag %d (last=%d), fragsize %d, total %d, from user %d\n",
-					up_seq, up_frag, lastfrag, read, users[userid].inpacket.len, userid);
-			}
+		if (dns_fds->v4fd >= 0) {
+			FD_SET(dns_fds->v4fd, &fds);
+			maxfd = MAX(dns_fds->v4fd, maxfd);
+		}
+		if (dns_fds->v6fd >= 0) {
+			FD_SET(dns_fds->v6fd, &fds);
+			maxfd = MAX(dns_fds->v6fd, maxfd);
 		}
 
-		if (upstream_ok && lastfrag) { /* packet is complete */
-			handle_full_packet(tun_fd, dns_fds, userid);
+		if (bind_fd) {
+			/* wait for replies from real DNS */
+			FD_SET(bind_fd, &fds);
+			maxfd = MAX(bind_fd, maxfd);
 		}
 
-		/* If there is a query that must be returned real soon, do it.
-		   Includes an ack of the just received upstream fragment,
-		   may contain new data. */
-		if (users[userid].q_sendrealsoon.id != 0) {
-			didsend = 1;
-			if (send_chunk_or_dataless(dns_fd, userid, &users[userid].q_sendrealsoon) == 1)
-				/* new packet from queue, send immediately */
-				didsend = 0;
+		if (queue_fd >= 0) {
+			/* handed over by other workers */
+			FD_SET(queue_fd, &fds);
+			maxfd = MAX(queue_fd, maxfd);
 		}
 
-		/* If we already have an earlier query waiting, we need to
-		   get rid of it to store the new query.
-		   - If we have new data waiting and not yet sent above,
-		     send immediately.
-		   - If this wasn't the last upstream fragment, then we expect
-		     more, so ack immediately if we didn't already.
-		   - If we are in non-lazy mode, there should be no query
-		     waiting, but if there is, send immediately.
-		   - In all other cases (mostly the last-fragment cases),
-		     we can afford to wait just a tiny little while for the
-		     TCP ack to arrive from our tun. Note that this works best
-		     when there is only one client.
-		 */
-		if (users[userid].q.id != 0) {
-			if ((users[userid].outpacket.len > 0 && !didsend) ||
-			    (upstream_ok && !lastfrag && !didsend) ||
-			    (!upstream_ok && !didsend) ||
-			    !users[userid].lazy) {
-				didsend = 1;
-				if (send_chunk_or_dataless(dns_fd, userid, &users[userid].q) == 1)
-					/* new packet from queue, send immediately */
-					didsend = 0;
-			} else {
-				memcpy(&(users[userid].q_sendrealsoon),
-				       &(users[userid].q),
-				       sizeof(struct query));
-				users[userid].q_sendrealsoon_new = 1;
-				users[userid].q.id = 0;  /* used */
-				didsend = 1;
-			}
+		/* Don't read from tun if no users can accept data anyway;
+		   tun queue/TCP buffers are larger than our outpacket-queues */
+		if(!all_users_waiting_to_send()) {
+			FD_SET(tun_wait_fd, &fds);
+			maxfd = MAX(tun_wait_fd, maxfd);
 		}
 
-		/* Save new query and time info */
-		memcpy(&(users[userid].q), q, sizeof(struct query));
-		users[userid].last_pkt = time(NULL);
+		i = select(maxfd + 1, &fds, NULL, NULL, &tv);
+		clock_update();
 
-		/* If we still need to ack this upstream frag, do it to keep
-		   upstream flowing.
-		   - If we have new data waiting and not yet sent above,
-		     send immediately.
-		   - If this wasn't the last upstream fragment, then we expect
-		     more, so ack immediately if we didn't already or are
-		     in non-lazy mode.
-		   - If this was the last fragment, and we didn't ack already
-		     or are in non-lazy mode, send the ack after just a tiny
-		     little while so that the TCP ack may have arrived from
-		     our tun device.
-		   - In all other cases, don't send anything now.
-		*/
-		if (users[userid].outpacket.len > 0 && !didsend)
-			send_chunk_or_dataless(dns_fd, userid, &users[userid].q);
-		else if (!didsend || !users[userid].lazy) {
-			if (upstream_ok && lastfrag) {
-				memcpy(&(users[userid].q_sendrealsoon),
-				       &(users[userid].q),
-				       sizeof(struct query));
-				users[userid].q_sendrealsoon_new = 1;
-				users[userid].q.id = 0;  /* used */
-			} else {
-				send_chunk_or_dataless(dns_fd, userid, &users[userid].q);
+		if(i < 0) {
+			if (running)
+				warn("select");
+			return 1;
+		}
+
+		if (i > 0) {
+			if (FD_ISSET(tun_wait_fd, &fds)) {
+				tunnel_tun(tun_fd, dns_fds);
+			}
+			if (dns_fds->v4fd >= 0 && FD_ISSET(dns_fds->v4fd, &fds)) {
+				tunnel_dns(tun_fd, dns_fds->v4fd, dns_fds, bind_fd);
+			}
+			if (dns_fds->v6fd >= 0 && FD_ISSET(dns_fds->v6fd, &fds)) {
+				tunnel_dns(tun_fd, dns_fds->v6fd, dns_fds, bind_fd);
+			}
+			if (FD_ISSET(bind_fd, &fds)) {
+				tunnel_bind(bind_fd, dns_fds);
+			}
+			if (queue_fd >= 0 && FD_ISSET(queue_fd, &fds)) {
+				worker_queue_drain(tun_fd, dns_fds, bind_fd);
 			}
 		}
+
+		timers_run(clock_ms());
 	}
+
+	return 0;
 }
 
-static void
-handle_ns_request(int dns_fd, struct query *q)
-/* Mostly identical to handle_a_request() below */
-{
-	char buf[64*1024];
-	int len;
+#ifdef HAVE_LIBURING
 
-	if (ns_ip != INADDR_ANY) {
-		/* If ns_ip set, overwrite destination addr with it.
-		 * Destination addr will be sent as additional record (A, IN) */
-		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
-		memcpy(&addr->sin_addr, &ns_ip, sizeof(ns_ip));
-	}
+static int
+uring_setup(void)
+{
+	int r;
+	int i;
 
-	len = dns_encode_ns_response(buf, sizeof(buf), q, topdomain);
-	if (len < 1) {
-		warnx("dns_encode_ns_response doesn't fit");
-		return;
+	r = io_uring_queue_init(URING_ENTRIES, &uring.ring, 0);
+	if (r < 0) {
+		errno = -r;
+		warn("io_uring_queue_init");
+		return -1;
 	}
 
-	if (debug >= 2) {
-		fprintf(stderr, "TX: client %s, type %d, name %s, %d bytes NS reply\n",
-			format_addr(&q->from, q->fromlen), q->type, q->name, len);
+	uring.bufs = malloc(URING_BUFS * URING_BUF_LEN);
+	uring.br = io_uring_setup_buf_ring(&uring.ring, URING_BUFS, URING_BGID, 0, &r);
+	if (!uring.bufs || !uring.br) {
+		errno = uring.br ? ENOMEM : -r;
+		warn("io_uring buffer ring");
+		io_uring_queue_exit(&uring.ring);
+		free(uring.bufs);
+		return -1;
 	}
-	if (sendto(dns_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
-		warn("ns reply send error");
+	for (i = 0; i < URING_BUFS; i++) {
+		io_uring_buf_ring_add(uring.br, uring.bufs + i * URING_BUF_LEN,
+			URING_BUF_LEN, i, io_uring_buf_ring_mask(URING_BUFS), i);
 	}
+	io_uring_buf_ring_advance(uring.br, URING_BUFS);
+
+	memset(&uring.recv_msg, 0, sizeof(uring.recv_msg));
+	uring.recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	uring.recv_msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+
+	return 0;
 }
 
 static void
-handle_a_request(int dns_fd, struct query *q, int fakeip)
-/* Mostly identical to handle_ns_request() above */
+uring_arm(int op, int fd)
+/* Start multishot receive or poll on fd */
 {
-	char buf[64*1024];
-	int len;
-
-	if (fakeip) {
-		in_addr_t ip = inet_addr("127.0.0.1");
-		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
-		memcpy(&addr->sin_addr, &ip, sizeof(ip));
+	struct io_uring_sqe *sqe;
 
-	} else if (ns_ip != INADDR_ANY) {
-		/* If ns_ip set, overwrite destination addr with it.
-		 * Destination addr will be sent as additional record (A, IN) */
-		struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
-		memcpy(&addr->sin_addr, &ns_ip, sizeof(ns_ip));
-	}
-
-	len = dns_encode_a_response(buf, sizeof(buf), q);
-	if (len < 1) {
-		warnx("dns_encode_a_response doesn't fit");
+	if (!(sqe = uring_get_sqe())) {
+		warnx("io_uring submission queue full");
 		return;
 	}
-
-	if (debug >= 2) {
-		fprintf(stderr, "TX: client %s, type %d, name %s, %d bytes A reply\n",
-			format_addr(&q->from, q->fromlen), q->type, q->name, len);
-	}
-	if (sendto(dns_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
-		warn("a reply send error");
+	if (op == URING_RECV) {
+		io_uring_prep_recvmsg_multishot(sqe, fd, &uring.recv_msg, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	} else {
+		io_uring_prep_poll_add(sqe, fd, POLLIN);
 	}
+	io_uring_sqe_set_data64(sqe, URING_DATA(op, fd));
 }
 
 static void
-forward_query(int bind_fd, struct query *q)
+uring_arm_tun(int tun_fd)
+/* Post a tun read unless one is. Only one at a time, as reads posted
+   stay posted when all users start waiting, and whatever they read
+   then has nowhere to go. */
 {
-	char buf[64*1024];
-	int len;
-	struct fw_query fwq;
-	struct sockaddr_in *myaddr;
-	in_addr_t newaddr;
+	struct io_uring_sqe *sqe;
 
-	len = dns_encode(buf, sizeof(buf), q, QR_QUERY, q->name, strlen(q->name));
-	if (len < 1) {
-		warnx("dns_encode doesn't fit");
+	if (uring.tun_busy || !(sqe = uring_get_sqe()))
+		return;
+	io_uring_prep_read(sqe, tun_fd, uring.tun_buf, sizeof(uring.tun_buf), 0);
+	io_uring_sqe_set_data64(sqe, URING_DATA(URING_TUN_READ, 0));
+	uring.tun_busy = 1;
+}
+
+static void
+uring_recv(struct io_uring_cqe *cqe, int fd, int tun_fd, struct dnsfd *dns_fds, int bind_fd)
+{
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msg;
+	struct query q;
+	unsigned bid;
+	char *buf;
+
+	if (cqe->res < 0) {
+		if (cqe->res != -ENOBUFS) {
+			errno = -cqe->res;
+			warn("read dns");
+		}
 		return;
 	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
 
-	/* Store sockaddr for q->id */
-	memcpy(&(fwq.addr), &(q->from), q->fromlen);
-	fwq.addrlen = q->fromlen;
-	fwq.id = q->id;
-	fw_query_put(&fwq);
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = uring.bufs + bid * URING_BUF_LEN;
 
-	newaddr = inet_addr("127.0.0.1");
-	myaddr = (struct sockaddr_in *) &(q->from);
-	memcpy(&(myaddr->sin_addr), &newaddr, sizeof(in_addr_t));
-	myaddr->sin_port = htons(bind_port);
+	out = io_uring_recvmsg_validate(buf, cqe->res, &uring.recv_msg);
+	if (out && !(out->flags & MSG_TRUNC) && out->namelen <= sizeof(q.from)) {
+		memcpy(&q.from, io_uring_recvmsg_name(out), out->namelen);
+		q.fromlen = out->namelen;
 
-	if (debug >= 2) {
-		fprintf(stderr, "TX: NS reply \n");
-	}
+		/* let read_destination() walk the received control data */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = (char *) io_uring_recvmsg_name(out) + uring.recv_msg.msg_namelen;
+		msg.msg_controllen = out->controllen;
 
-	if (sendto(bind_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
-		warn("forward query error");
+		if (decode_query(io_uring_recvmsg_payload(out, &uring.recv_msg),
+				 io_uring_recvmsg_payload_length(out, cqe->res, &uring.recv_msg),
+				 fd, dns_fds, tun_fd, &msg, &q) > 0)
+			handle_dns_query(tun_fd, fd, dns_fds, bind_fd, &q);
 	}
+
+	/* give buffer back to the kernel */
+	io_uring_buf_ring_add(uring.br, buf, URING_BUF_LEN, bid,
+		io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(uring.br, 1);
 }
 
 static int
-tunnel_bind(int bind_fd, struct dnsfd *dns_fds)
+tunnel_uring(int tun_fd, int tun_wait_fd, struct dnsfd *dns_fds, int bind_fd, int queue_fd)
+/* Same as tunnel_select(), using io_uring for all socket and tun I/O.
+   Returns -1 if io_uring is not available, so caller can fall back. */
 {
-	char packet[64*1024];
-	struct sockaddr_storage from;
-	socklen_t fromlen;
-	struct fw_query *query;
-	unsigned short id;
-	int dns_fd;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	unsigned n;
+	int tun_polled;
+	int timeout;
 	int r;
 
-	fromlen = sizeof(struct sockaddr);
-	r = recvfrom(bind_fd, packet, sizeof(packet), 0,
-		(struct sockaddr*)&from, &fromlen);
+	if (uring_setup())
+		return -1;
+	uring.active = 1;
 
-	if (r <= 0)
-		return 0;
+	if (dns_fds->v4fd >= 0)
+		uring_arm(URING_RECV, dns_fds->v4fd);
+	if (dns_fds->v6fd >= 0)
+		uring_arm(URING_RECV, dns_fds->v6fd);
+	if (bind_fd)
+		uring_arm(URING_POLL, bind_fd);
+	if (queue_fd >= 0)
+		uring_arm(URING_POLL, queue_fd);
+	tun_polled = 0;
 
-	id = dns_get_id(packet, r);
+	while (running) {
+		timeout = timers_next(clock_ms(), 10000);
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+
+		/* Don't read from tun if no users can accept data anyway */
+		if (!all_users_waiting_to_send()) {
+			if (tun_wait_fd != tun_fd) {
+				/* packets come from tun thread */
+				if (!tun_polled)
+					uring_arm(URING_POLL, tun_wait_fd);
+				tun_polled = 1;
+			} else {
+				uring_arm_tun(tun_fd);
+			}
+		}
 
-	if (debug >= 2) {
-		fprintf(stderr, "RX: Got response on query %u from DNS\n", (id & 0xFFFF));
-	}
+		io_uring_submit(&uring.ring);
 
-	/* Get sockaddr from id */
-	fw_query_get(id, &query);
-	if (!query) {
-		if (debug >= 2) {
-			fprintf(stderr, "Lost sender of id %u, dropping reply\n", (id & 0xFFFF));
+		r = io_uring_wait_cqe_timeout(&uring.ring, &cqe, &ts);
+		clock_update();
+		if (r < 0 && r != -ETIME) {
+			if (r == -EINTR && running)
+				continue;
+			if (running) {
+				errno = -r;
+				warn("io_uring_wait_cqe");
+			}
+			break;
 		}
-		return 0;
-	}
 
-	if (debug >= 2) {
-		fprintf(stderr, "TX: client %s id %u, %d bytes\n",
-			format_addr(&query->addr, query->addrlen), (id & 0xffff), r);
-	}
+		n = 0;
+		io_uring_for_each_cqe(&uring.ring, head, cqe) {
+			int op = URING_OP(cqe->user_data);
+			int idx = URING_IDX(cqe->user_data);
+
+			n++;
+			switch (op) {
+			case URING_RECV:
+				uring_recv(cqe, idx, tun_fd, dns_fds, bind_fd);
+				if (!(cqe->flags & IORING_CQE_F_MORE) && running)
+					uring_arm(URING_RECV, idx);
+				break;
+			case URING_POLL:
+				if (idx == bind_fd) {
+					tunnel_bind(bind_fd, dns_fds);
+					uring_arm(URING_POLL, bind_fd);
+				} else if (idx == queue_fd) {
+					worker_queue_drain(tun_fd, dns_fds, bind_fd);
+					uring_arm(URING_POLL, queue_fd);
+				} else {
+					tunnel_tun(tun_fd, dns_fds);
+					tun_polled = 0;
+				}
+				break;
+			case URING_TUN_READ:
+				if (cqe->res > 0)
+					handle_tun_packet(dns_fds, uring.tun_buf, cqe->res);
+				uring.tun_busy = 0;
+				break;
+			case URING_SEND:
+			case URING_TUN_WRITE:
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					warn(op == URING_SEND ? "sendmsg" : "write_tun");
+				}
+				uring.tx_busy[idx] = 0;
+				break;
+			}
+		}
+		io_uring_cq_advance(&uring.ring, n);
 
-	dns_fd = get_dns_fd(dns_fds, &query->addr);
-	if (sendto(dns_fd, packet, r, 0, (const struct sockaddr *) &(query->addr),
-		query->addrlen) <= 0) {
-		warn("forward reply error");
+		timers_run(clock_ms());
 	}
 
+	uring.active = 0;
+	io_uring_queue_exit(&uring.ring);
 	return 0;
 }
 
+#endif /* HAVE_LIBURING */
+
 static int
-tunnel_dns(int tun_fd, int dns_fd, struct dnsfd *dns_fds, int bind_fd)
+tunnel_loop(int tun_fd, int tun_wait_fd, struct dnsfd *dns_fds, int bind_fd,
+	    int queue_fd, enum io_engine engine)
 {
-	struct query q;
-	int read;
-	int domain_len;
-	int inside_topdomain = 0;
+	if (engine == IO_ENGINE_URING) {
+#ifdef HAVE_LIBURING
+		int r = tunnel_uring(tun_fd, tun_wait_fd, dns_fds, bind_fd, queue_fd);
+		if (r >= 0)
+			return r;
+		warnx("io_uring not available, falling back");
+#else
+		warnx("Not compiled with io_uring support, falling back");
+#endif
+	}
 
-	if ((read = read_dns(dns_fd, dns_fds, tun_fd, &q)) <= 0)
-		return 0;
+#ifdef USE_EPOLL
+	if (engine != IO_ENGINE_SELECT) {
+		int r = tunnel_epoll(tun_fd, tun_wait_fd, dns_fds, bind_fd, queue_fd);
+		if (r >= 0)
+			return r;
+		if (debug >= 1)
+			fprintf(stderr, "Falling back to select() loop\n");
+	}
+#endif
+	return tunnel_select(tun_fd, tun_wait_fd, dns_fds, bind_fd, queue_fd);
+}
 
-	if (debug >= 2) {
-		fprintf(stderr, "RX: client %s, type %d, name %s\n",
-			format_addr(&q.from, q.fromlen), q.type, q.name);
+#ifdef USE_WORKERS
+static void *
+worker_thread(void *arg)
+{
+	this_worker = arg;
+	server_dns_fds = &this_worker->dns_fds;
+	clock_update();
+	timers_init(clock_ms());
+
+	if (tunnel_loop(worker_tun_fd, this_worker->wake_fd, &this_worker->dns_fds,
+			0, this_worker->queue_fd, worker_engine) && running) {
+		/* Nobody else can handle its users, stop it all */
+		warnx("Worker %d failed, shutting down", this_worker->id);
+		running = 0;
+		workers_wake();
+	}
+	return NULL;
+}
+
+static int
+ring_init(struct ring *r, unsigned len)
+{
+	unsigned i;
+
+	r->head = r->tail = 0;
+	r->len = len;
+	r->slots = calloc(len, sizeof(struct ring_slot));
+	if (!r->slots)
+		return -1;
+	/* Never given back, so taking them in this thread is fine */
+	for (i = 0; i < len; i++) {
+		if (!(r->slots[i].data = pktbuf_get(ring_size)))
+			return -1;
 	}
+	return 0;
+}
 
-	domain_len = strlen(q.name) - strlen(topdomain);
-	if (domain_len >= 0 && !strcasecmp(q.name + domain_len, topdomain))
-		inside_topdomain = 1;
-	/* require dot before topdomain */
-	if (domain_len >= 1 && q.name[domain_len - 1] != '.')
-		inside_topdomain = 0;
+static void
+workers_stop(void)
+/* Stop the other workers and wait for them. The tun thread is left,
+   it goes away with the process. */
+{
+	int i;
 
-	if (inside_topdomain) {
-		/* This is a query we can handle */
+	running = 0;
+	workers_wake();
+	for (i = 1; i < worker_count; i++) {
+		if (workers[i].thread)
+			pthread_join(workers[i].thread, NULL);
+	}
+}
 
-		/* Handle A-type query for ns.topdomain, possibly caused
-		   by our proper response to any NS request */
-		if (domain_len == 3 && q.type == T_A &&
-		    (q.name[0] == 'n' || q.name[0] == 'N') &&
-		    (q.name[1] == 's' || q.name[1] == 'S') &&
-		     q.name[2] == '.') {
-			handle_a_request(dns_fd, &q, 0);
-			return 0;
-		}
+static int
+workers_start(int tun_fd, struct dnsfd *dns_fds, int bind_fd, int n,
+	      enum io_engine engine)
+/* Set up n workers, the first being this thread, and start the others
+   and the tun thread. dns_fds has the sockets of each worker.
+   Returns -1 on failure. */
+{
+	const struct encoder *decoders[] = {
+		&base32_ops, &base64_ops, &base64u_ops, &base128_ops
+	};
+	pthread_t thread;
+	sigset_t all, old;
+	char buf[8];
+	size_t len;
+	int r;
+	int i;
+	int j;
 
-		/* Handle A-type query for www.topdomain, for anyone that's
-		   poking around */
-		if (domain_len == 4 && q.type == T_A &&
-		    (q.name[0] == 'w' || q.name[0] == 'W') &&
-		    (q.name[1] == 'w' || q.name[1] == 'W') &&
-		    (q.name[2] == 'w' || q.name[2] == 'W') &&
-		     q.name[3] == '.') {
-			handle_a_request(dns_fd, &q, 1);
-			return 0;
+	workers = calloc(n, sizeof(struct worker));
+	if (!workers) {
+		warnx("Out of memory");
+		return -1;
+	}
+	worker_count = n;
+	worker_tun_fd = tun_fd;
+	worker_engine = engine;
+	/* Room for the raw header, and for upstream data that did not
+	   compress well */
+	ring_size = my_mtu + 4 + RAW_HDR_LEN + 64;
+
+	for (i = 0; i < n; i++) {
+		struct worker *w = &workers[i];
+
+		w->id = i;
+		w->dns_fds = dns_fds[i];
+		w->bind_fd = i == 0 ? bind_fd : 0;
+		w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		w->space_fd = eventfd(0, EFD_CLOEXEC);
+		w->queue_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (w->wake_fd < 0 || w->space_fd < 0 || w->queue_fd < 0) {
+			warn("eventfd");
+			return -1;
 		}
-
-		switch (q.type) {
-		case T_NULL:
-		case T_PRIVATE:
-		case T_CNAME:
-		case T_A:
-		case T_MX:
-		case T_SRV:
-		case T_TXT:
-			/* encoding is "transparent" here */
-			handle_null_request(tun_fd, dns_fd, dns_fds, &q, domain_len);
-			break;
-		case T_NS:
-			handle_ns_request(dns_fd, &q);
-			break;
-		default:
-			break;
+		w->from = calloc(n, sizeof(struct ring));
+		if (!w->from || ring_init(&w->tun, TUN_RING_LEN)) {
+			warnx("Out of memory");
+			return -1;
 		}
-	} else {
-		/* Forward query to other port ? */
-		if (bind_fd) {
-			forward_query(bind_fd, &q);
+		for (j = 0; j < n; j++) {
+			if (j != i && ring_init(&w->from[j], HANDOFF_RING_LEN)) {
+				warnx("Out of memory");
+				return -1;
+			}
 		}
 	}
+
+	/* The decoders build their tables on first use */
+	for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+		len = sizeof(buf);
+		decoders[i]->decode(buf, &len, "aa", 2);
+	}
+
+	this_worker = &workers[0];
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&thread, NULL, tun_thread, NULL);
+	if (!r)
+		pthread_detach(thread);
+	for (i = 1; i < n && !r; i++) {
+		r = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+		if (r)
+			worker_count = i;	/* for workers_stop() */
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		errno = r;
+		warn("pthread_create");
+		workers_stop();
+		return -1;
+	}
+
 	return 0;
 }
+#endif /* USE_WORKERS */
 
 static int
-tunnel(int tun_fd, struct dnsfd *dns_fds, int bind_fd, int max_idle_time)
+tunnel(int tun_fd, struct dnsfd *dns_fds, int bind_fd, int max_idle_time,
+       int nworkers, enum io_engine engine)
+/* dns_fds has the sockets of each of nworkers, or one set without -w */
 {
-	struct timeval tv;
-	fd_set fds;
+	int r;
 	int i;
-	int userid;
-	time_t last_action = time(NULL);
 
-	while (running) {
-		int maxfd;
-		tv.tv_sec = 10;			/* doesn't really matter */
-		tv.tv_usec = 0;
-
-		/* Adjust timeout if there is anything to send realsoon.
-		   Clients won't be sending new data until we send our ack,
-		   so don't keep them waiting long. This only triggers at
-		   final upstream fragments, which is about once per eight
-		   requests during heavy upstream traffic.
-		   20msec: ~8 packs every 1/50sec = ~400 DNSreq/sec,
-		   or ~1200bytes every 1/50sec = ~0.5 Mbit/sec upstream */
-		for (userid = 0; userid < created_users; userid++) {
-			if (users[userid].active && !users[userid].disabled &&
-			    users[userid].last_pkt + 60 > time(NULL)) {
-				users[userid].q_sendrealsoon_new = 0;
-				if (users[userid].q_sendrealsoon.id != 0) {
-					tv.tv_sec = 0;
-					tv.tv_usec = 20000;
-				}
-			}
-		}
+	server_dns_fds = dns_fds;
+	for (i = 0; i < created_users; i++) {
+		timer_init(&users[i].q_timer, lazy_hold_expire, &users[i]);
+		timer_init(&users[i].realsoon_timer, realsoon_expire, &users[i]);
+		timer_init(&users[i].qheld_timer, held_expire, &users[i]);
+		timer_init(&users[i].idle, user_idle_expire, &users[i]);
+	}
 
-		FD_ZERO(&fds);
-		maxfd = 0;
+	if (max_idle_time) {
+		max_idle_ms = (uint64_t) max_idle_time * 1000;
+		timer_init(&idle_timer, idle_expire, NULL);
+		timer_set(&idle_timer, clock_ms() + max_idle_ms);
+	}
 
-		if (dns_fds->v4fd >= 0) {
-			FD_SET(dns_fds->v4fd, &fds);
-			maxfd = MAX(dns_fds->v4fd, maxfd);
-		}
-		if (dns_fds->v6fd >= 0) {
-			FD_SET(dns_fds->v6fd, &fds);
-			maxfd = MAX(dns_fds->v6fd, maxfd);
-		}
+	if (nworkers) {
+#ifdef USE_WORKERS
+		if (workers_start(tun_fd, dns_fds, bind_fd, nworkers, engine))
+			return 1;
+		r = tunnel_loop(tun_fd, workers[0].wake_fd, dns_fds, bind_fd,
+				workers[0].queue_fd, engine);
+		workers_stop();
+		return r;
+#else
+		warnx("Workers not supported on this platform, ignoring -w");
+#endif
+	}
 
-		if (bind_fd) {
-			/* wait for replies from real DNS */
-			FD_SET(bind_fd, &fds);
-			maxfd = MAX(bind_fd, maxfd);
-		}
+	return tunnel_loop(tun_fd, tun_fd, dns_fds, bind_fd, -1, engine);
+}
 
-		/* Don't read from tun if no users can accept data anyway;
-		   tun queue/TCP buffers are larger than our outpacket-queues */
-		if(!all_users_waiting_to_send()) {
-			FD_SET(tun_fd, &fds);
-			maxfd = MAX(tun_fd, maxfd);
-		}
+static char *
+forward_packet_data(int touser, int userid, char *out, unsigned long outlen,
+		    int rebuilt, unsigned long *len, int *compressed)
+/* Returns pktbuf with the packet from userid, compressed the way touser
+   wants it. out is the uncompressed packet, rebuilt is set if it is not
+   all of inpacket (restored headers, or part of a bundle). */
+{
+	char packet[64*1024];
+	uint64_t start;
+	char *buf;
+
+	if (!rebuilt && (!users[userid].inpacket.compressed ||
+	    (users[touser].downcomp == users[userid].upcomp &&
+	     users[touser].dict == users[userid].dict &&
+	     !users[touser].downcomp->stream))) {
+		*len = users[userid].inpacket.len;
+		*compressed = users[userid].inpacket.compressed;
+		return pktbuf_ref(users[userid].inpacket.data);
+	}
 
-		i = select(maxfd + 1, &fds, NULL, NULL, &tv);
+	*len = sizeof(packet);
+	start = clock_us();
+	*compressed = compress_packet(users[touser].downcomp, down_stream(touser),
+				      users[touser].dict, users[touser].downlevel,
+				      packet, len, out, outlen);
+	if (*compressed < 0)
+		return NULL;
+	compress_account(touser, outlen, *len, clock_us() - start);
+	buf = pktbuf_get(*len);
+	if (buf)
+		memcpy(buf, packet, *len);
+	else
+		downstream_lost(touser);
+	return buf;
+}
 
-		if(i < 0) {
-			if (running)
-				warn("select");
-			return 1;
+static void
+route_packet(int tun_fd, struct dnsfd *dns_fds, int userid, char *out,
+	     unsigned long outlen, int rebuilt)
+/* Send uncompressed packet from userid to tun or to the user it is for,
+   see forward_packet_data() for rebuilt */
+{
+	unsigned long len;
+	char hdrbuf[64*1024];
+	struct ip *hdr;
+	char *data;
+	int compressed;
+	int touser;
+	int ret;
+
+	if (users[userid].hdrcomp) {
+		len = sizeof(hdrbuf);
+		ret = vj_uncompress(users[userid].vjup, hdrbuf, &len, out, outlen);
+		if (ret > 0) {
+			out = hdrbuf;
+			outlen = len;
+			rebuilt = 1;
+		} else if (ret < 0) {
+			if (debug >= 1)
+				fprintf(stderr, "Discarded data, bad compressed headers\n");
+			return;
 		}
+	}
 
-		if (i==0) {
-			if (max_idle_time) {
-				/* only trigger the check if that's worth ( ie, no need to loop over if there
-				is something to send */
-				if (last_action + max_idle_time < time(NULL)) {
-					for (userid = 0; userid < created_users; userid++) {
-						last_action = ( users[userid].last_pkt > last_action ) ? users[userid].last_pkt : last_action;
-					}
-					if (last_action + max_idle_time < time(NULL)) {
-						fprintf(stderr, "Idling since too long, shutting down...\n");
-						running = 0;
-					}
+	hdr = (struct ip*) (out + 4);
+	if (handoff_packet(hdr->ip_dst.s_addr, out, outlen))
+		return;
+	touser = find_user_by_ip(hdr->ip_dst.s_addr);
+
+	if (touser == -1) {
+		/* send the uncompressed packet to tun device */
+		send_tun(tun_fd, out, outlen);
+	} else if ((data = forward_packet_data(touser, userid, out, outlen, rebuilt, &len, &compressed))) {
+		/* send the compressed(!) packet to other client */
+		if (users[touser].conn == CONN_DNS_NULL) {
+			if (users[touser].outpacket.len == 0) {
+				start_new_outpacket(touser, data, len, compressed);
+
+				/* Start sending immediately if queries are waiting */
+				answer_held_queries(dns_fds, touser);
+				if (!downstream_pending(touser)) {
+					/* full window, the next ack sends it */
+				} else if (users[touser].q_sendrealsoon.id != 0) {
+					int dns_fd = get_dns_fd(dns_fds, &users[touser].q_sendrealsoon.from);
+					send_chunk_or_dataless(dns_fd, touser, &users[touser].q_sendrealsoon);
+				} else if (users[touser].q.id != 0) {
+					int dns_fd = get_dns_fd(dns_fds, &users[touser].q.from);
+					send_chunk_or_dataless(dns_fd, touser, &users[touser].q);
 				}
+#ifdef OUTPACKETQ_LEN
+			} else {
+				save_to_outpacketq(touser, data, len, compressed);
+#else
+			} else {
+				pktbuf_put(data);
+				downstream_lost(touser);
+#endif
 			}
-		} else {
-			if (FD_ISSET(tun_fd, &fds)) {
-				tunnel_tun(tun_fd, dns_fds);
-			}
-			if (dns_fds->v4fd >= 0 && FD_ISSET(dns_fds->v4fd, &fds)) {
-				tunnel_dns(tun_fd, dns_fds->v4fd, dns_fds, bind_fd);
-			}
-			if (dns_fds->v6fd >= 0 && FD_ISSET(dns_fds->v6fd, &fds)) {
-				tunnel_dns(tun_fd, dns_fds->v6fd, dns_fds, bind_fd);
-			}
-			if (FD_ISSET(bind_fd, &fds)) {
-				tunnel_bind(bind_fd, dns_fds);
-			}
+		} else{ /* CONN_RAW_UDP */
+			int dns_fd = get_dns_fd(dns_fds, &users[touser].q.from);
+			send_raw(dns_fd, data, len, touser,
+				 RAW_HDR_CMD_DATA | (compressed ? RAW_HDR_COMPRESSED : 0),
+				 &users[touser].q);
+			pktbuf_put(data);
 		}
-
-		/* Send realsoon's if tun or dns didn't already */
-		for (userid = 0; userid < created_users; userid++)
-			if (users[userid].active && !users[userid].disabled &&
-			    users[userid].last_pkt + 60 > time(NULL) &&
-			    users[userid].q_sendrealsoon.id != 0 &&
-			    users[userid].conn == CONN_DNS_NULL &&
-			    !users[userid].q_sendrealsoon_new) {
-				int dns_fd = get_dns_fd(dns_fds, &users[userid].q_sendrealsoon.from);
-				send_chunk_or_dataless(dns_fd, userid, &users[userid].q_sendrealsoon);
-			}
 	}
-
-	return 0;
 }
 
 static void
-handle_full_packet(int tun_fd, struct dnsfd *dns_fds, int userid)
+route_bundle(int tun_fd, struct dnsfd *dns_fds, int userid,
+	     struct compress_stream *st, char *data, unsigned long len)
+/* Send on each packet in a bundle from userid */
 {
+	unsigned long partlen;
 	unsigned long outlen;
-	char out[64*1024];
-	int touser;
+	unsigned long off = 0;
+	char buf[64*1024];
+	char *part;
+	int compressed;
 	int ret;
 
-	outlen = sizeof(out);
-	ret = uncompress((uint8_t*)out, &outlen,
-		   (uint8_t*)users[userid].inpacket.data, users[userid].inpacket.len);
+	while ((ret = bundle_next(data, len, &off, &part, &partlen, &compressed)) > 0) {
+		if (!compressed) {
+			route_packet(tun_fd, dns_fds, userid, part, partlen, 1);
+			continue;
+		}
+		outlen = sizeof(buf);
+		if (uncompress_packet(users[userid].upcomp, st, users[userid].dict,
+				      buf, &outlen, part, partlen) == 0)
+			route_packet(tun_fd, dns_fds, userid, buf, outlen, 1);
+	}
+	if (ret < 0 && debug >= 1)
+		fprintf(stderr, "Discarded rest of broken bundle\n");
+}
 
-	if (ret == Z_OK) {
-		struct ip *hdr;
+static void
+handle_full_packet(int tun_fd, struct dnsfd *dns_fds, int userid,
+		   struct compress_stream *st)
+/* st is the user's compression stream if the packet came over DNS */
+{
+	unsigned long outlen;
+	char buf[64*1024];
+	char *out;
+	int ret = 0;
 
-		hdr = (struct ip*) (out + 4);
-		touser = find_user_by_ip(hdr->ip_dst.s_addr);
+	if (users[userid].inpacket.dropped) {
+		if (debug >= 1)
+			fprintf(stderr, "Discarded data, packet did not fit\n");
+		user_packet_release(&users[userid].inpacket);
+		return;
+	}
 
-		if (touser == -1) {
-			/* send the uncompressed packet to tun device */
-			write_tun(tun_fd, out, outlen);
-		} else {
-			/* send the compressed(!) packet to other client */
-			if (users[touser].conn == CONN_DNS_NULL) {
-				if (users[touser].outpacket.len == 0) {
-					start_new_outpacket(touser,
-						users[userid].inpacket.data,
-						users[userid].inpacket.len);
-
-					/* Start sending immediately if query is waiting */
-					if (users[touser].q_sendrealsoon.id != 0) {
-						int dns_fd = get_dns_fd(dns_fds, &users[touser].q_sendrealsoon.from);
-						send_chunk_or_dataless(dns_fd, touser, &users[touser].q_sendrealsoon);
-					} else if (users[touser].q.id != 0) {
-						int dns_fd = get_dns_fd(dns_fds, &users[touser].q.from);
-						send_chunk_or_dataless(dns_fd, touser, &users[touser].q);
-					}
-#ifdef OUTPACKETQ_LEN
-				} else {
-					save_to_outpacketq(touser,
-						users[userid].inpacket.data,
-						users[userid].inpacket.len);
-#endif
-				}
-			} else{ /* CONN_RAW_UDP */
-				int dns_fd = get_dns_fd(dns_fds, &users[touser].q.from);
-				send_raw(dns_fd, users[userid].inpacket.data,
-					 users[userid].inpacket.len, touser,
-					 RAW_HDR_CMD_DATA, &users[touser].q);
-			}
-		}
-	} else {
+	out = users[userid].inpacket.data;
+	outlen = users[userid].inpacket.len;
+	if (users[userid].inpacket.compressed) {
+		out = buf;
+		outlen = sizeof(buf);
+		ret = uncompress_packet(users[userid].upcomp, st, users[userid].dict, out, &outlen,
+			   users[userid].inpacket.data, users[userid].inpacket.len);
+	}
+
+	if (ret != 0) {
 		if (debug >= 1)
-			fprintf(stderr, "Discarded data, uncompress() result: %d\n", ret);
+			fprintf(stderr, "Discarded data, %s uncompress failed%s\n",
+				users[userid].upcomp->name,
+				compress_stream_broken(st) ? ", waiting for stream restart" : "");
+	} else if (users[userid].bundle && bundle_is(out, outlen)) {
+		route_bundle(tun_fd, dns_fds, userid, st, out, outlen);
+	} else {
+		route_packet(tun_fd, dns_fds, userid, out, outlen, 0);
 	}
 
 	/* This packet is done */
-	users[userid].inpacket.len = 0;
-	users[userid].inpacket.offset = 0;
+	user_packet_release(&users[userid].inpacket);
 }
 
 static void
@@ -1923,9 +4160,9 @@ handle_raw_login(char *packet, int len, struct query *q, int fd, int userid)
 	/* can't use check_authenticated_user_and_ip() since IP address will be different,
 	   so duplicate here except IP address */
 	if (userid < 0 || userid >= created_users) return;
+	if (user_worker(userid) != user_worker(-1)) return;
 	if (!users[userid].active || users[userid].disabled) return;
 	if (!users[userid].authenticated) return;
-	if (users[userid].last_pkt + 60 < time(NULL)) return;
 
 	if (debug >= 1) {
 		fprintf(stderr, "IN   login raw, len %d, from user %d\n",
@@ -1936,7 +4173,7 @@ handle_raw_login(char *packet, int len, struct query *q, int fd, int userid)
 	login_calculate(myhash, 16, password, users[userid].seed + 1);
 	if (memcmp(packet, myhash, 16) == 0) {
 		/* Update query and time info for user */
-		users[userid].last_pkt = time(NULL);
+		user_seen(userid);
 		memcpy(&(users[userid].q), q, sizeof(struct query));
 
 		/* Store remote IP number */
@@ -1953,7 +4190,8 @@ handle_raw_login(char *packet, int len, struct query *q, int fd, int userid)
 }
 
 static void
-handle_raw_data(char *packet, int len, struct query *q, struct dnsfd *dns_fds, int tun_fd, int userid)
+handle_raw_data(char *packet, int len, int compressed, struct query *q, struct dnsfd *dns_fds,
+		int tun_fd, int userid)
 {
 	if (check_authenticated_user_and_ip(userid, q) != 0) {
 		return;
@@ -1961,20 +4199,24 @@ handle_raw_data(char *packet, int len, struct query *q, struct dnsfd *dns_fds, i
 	if (!users[userid].authenticated_raw) return;
 
 	/* Update query and time info for user */
-	users[userid].last_pkt = time(NULL);
+	user_seen(userid);
 	memcpy(&(users[userid].q), q, sizeof(struct query));
 
 	/* copy to packet buffer, update length */
-	users[userid].inpacket.offset = 0;
+	user_packet_release(&users[userid].inpacket);
+	users[userid].inpacket.data = pktbuf_get(len);
+	if (!users[userid].inpacket.data)
+		return;
 	memcpy(users[userid].inpacket.data, packet, len);
 	users[userid].inpacket.len = len;
+	users[userid].inpacket.compressed = compressed;
 
 	if (debug >= 1) {
 		fprintf(stderr, "IN   pkt raw, total %d, from user %d\n",
 			users[userid].inpacket.len, userid);
 	}
 
-	handle_full_packet(tun_fd, dns_fds, userid);
+	handle_full_packet(tun_fd, dns_fds, userid, NULL);
 }
 
 static void
@@ -1986,7 +4228,7 @@ handle_raw_ping(struct query *q, int dns_fd, int userid)
 	if (!users[userid].authenticated_raw) return;
 
 	/* Update query and time info for user */
-	users[userid].last_pkt = time(NULL);
+	user_seen(userid);
 	memcpy(&(users[userid].q), q, sizeof(struct query));
 
 	if (debug >= 1) {
@@ -2008,6 +4250,8 @@ raw_decode(char *packet, int len, struct query *q, int dns_fd, struct dnsfd *dns
 	if (memcmp(packet, raw_header, RAW_HDR_IDENT_LEN)) return 0;
 
 	raw_user = RAW_HDR_GET_USR(packet);
+	if (handoff_raw(user_worker(raw_user), packet, len, q))
+		return 1;
 	switch (RAW_HDR_GET_CMD(packet)) {
 	case RAW_HDR_CMD_LOGIN:
 		/* Login challenge */
@@ -2015,7 +4259,8 @@ raw_decode(char *packet, int len, struct query *q, int dns_fd, struct dnsfd *dns
 		break;
 	case RAW_HDR_CMD_DATA:
 		/* Data packet */
-		handle_raw_data(&packet[RAW_HDR_LEN], len - RAW_HDR_LEN, q, dns_fds, tun_fd, raw_user);
+		handle_raw_data(&packet[RAW_HDR_LEN], len - RAW_HDR_LEN, RAW_HDR_GET_COMPRESSED(packet),
+				q, dns_fds, tun_fd, raw_user);
 		break;
 	case RAW_HDR_CMD_PING:
 		/* Keepalive packet */
@@ -2028,9 +4273,68 @@ raw_decode(char *packet, int len, struct query *q, int dns_fd, struct dnsfd *dns
 	return 1;
 }
 
+#ifndef WINDOWS32
+static void
+read_destination(struct msghdr *msg, struct query *q)
+/* Read destination IP address of the query from the control messages */
+{
+	struct cmsghdr *cmsg;
+
+	memset(&q->destination, 0, sizeof(struct sockaddr_storage));
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(msg, cmsg)) {
+
+		if (cmsg->cmsg_level == IPPROTO_IP &&
+			cmsg->cmsg_type == DSTADDR_SOCKOPT) {
+
+			struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
+			addr->sin_family = AF_INET;
+			addr->sin_addr = *dstaddr(cmsg);
+			q->dest_len = sizeof(*addr);
+			break;
+		}
+		if (cmsg->cmsg_level == IPPROTO_IPV6 &&
+			cmsg->cmsg_type == IPV6_PKTINFO) {
+
+			struct in6_pktinfo *pktinfo;
+			struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &q->destination;
+			pktinfo = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+			addr->sin6_family = AF_INET6;
+			memcpy(&addr->sin6_addr, &pktinfo->ipi6_addr, sizeof(struct in6_addr));
+			q->dest_len = sizeof(*addr);
+			break;
+		}
+	}
+}
+#endif
+
 static int
-read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q)
+decode_query(char *packet, int len, int fd, struct dnsfd *dns_fds, int tun_fd,
+	     void *msg, struct query *q)
 /* FIXME: dns_fds and tun_fd are because of raw_decode() below */
+/* q->from must already be set. msg is the struct msghdr the packet was
+   received with, or NULL.
+   Returns length of query name if packet is a DNS query to be handled. */
+{
+	/* TODO do not handle raw packets here! */
+	if (raw_decode(packet, len, q, fd, dns_fds, tun_fd)) {
+		return 0;
+	}
+	if (dns_decode(NULL, 0, q, QR_QUERY, packet, len) < 0) {
+		return 0;
+	}
+
+#ifndef WINDOWS32
+	if (msg)
+		read_destination(msg, q);
+#endif
+
+	return strlen(q->name);
+}
+
+#ifndef USE_MMSG
+static int
+read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q)
 {
 	struct sockaddr_storage from;
 	socklen_t addrlen;
@@ -2040,7 +4344,6 @@ read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q)
 	char control[CMSG_SPACE(sizeof (struct in6_pktinfo))];
 	struct msghdr msg;
 	struct iovec iov;
-	struct cmsghdr *cmsg;
 
 	addrlen = sizeof(struct sockaddr_storage);
 	iov.iov_base = packet;
@@ -2064,44 +4367,11 @@ read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q)
 		memcpy((struct sockaddr*)&q->from, (struct sockaddr*)&from, addrlen);
 		q->fromlen = addrlen;
 
-		/* TODO do not handle raw packets here! */
-		if (raw_decode(packet, r, q, fd, dns_fds, tun_fd)) {
-			return 0;
-		}
-		if (dns_decode(NULL, 0, q, QR_QUERY, packet, r) < 0) {
-			return 0;
-		}
-
 #ifndef WINDOWS32
-		memset(&q->destination, 0, sizeof(struct sockaddr_storage));
-		/* Read destination IP address */
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-
-			if (cmsg->cmsg_level == IPPROTO_IP &&
-				cmsg->cmsg_type == DSTADDR_SOCKOPT) {
-
-				struct sockaddr_in *addr = (struct sockaddr_in *) &q->destination;
-				addr->sin_family = AF_INET;
-				addr->sin_addr = *dstaddr(cmsg);
-				q->dest_len = sizeof(*addr);
-				break;
-			}
-			if (cmsg->cmsg_level == IPPROTO_IPV6 &&
-				cmsg->cmsg_type == IPV6_PKTINFO) {
-
-				struct in6_pktinfo *pktinfo;
-				struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &q->destination;
-				pktinfo = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-				addr->sin6_family = AF_INET6;
-				memcpy(&addr->sin6_addr, &pktinfo->ipi6_addr, sizeof(struct in6_addr));
-				q->dest_len = sizeof(*addr);
-				break;
-			}
-		}
+		return decode_query(packet, r, fd, dns_fds, tun_fd, &msg, q);
+#else
+		return decode_query(packet, r, fd, dns_fds, tun_fd, NULL, q);
 #endif
-
-		return strlen(q->name);
 	} else if (r < 0) {
 		/* Error */
 		warn("read dns");
@@ -2109,13 +4379,14 @@ read_dns(int fd, struct dnsfd *dns_fds, int tun_fd, struct query *q)
 
 	return 0;
 }
+#endif /* !USE_MMSG */
 
 static size_t
 write_dns_nameenc(char *buf, size_t buflen, const char *data, int datalen, char downenc)
 /* Returns #bytes of data that were encoded */
 {
-	static int td1 = 0;
-	static int td2 = 0;
+	static __thread int td1 = 0;
+	static __thread int td2 = 0;
 	size_t space;
 	char *b;
 
@@ -2265,15 +4536,17 @@ write_dns(int fd, struct query *q, const char *data, int datalen, char downenc)
 			format_addr(&q->from, q->fromlen), q->type, q->name, datalen);
 	}
 
-	sendto(fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen);
+	send_reply(fd, buf, len, &q->from, q->fromlen);
 }
 
 static void print_usage(FILE *stream)
 {
-	fprintf(stream, "Usage: %s [-46cDfsv] [-u user] [-t chrootdir] [-d device] [-m mtu]\n"
+	fprintf(stream, "Usage: %s [-46cDfHsv] [-u user] [-t chrootdir] [-d device] [-m mtu]\n"
 			"               [-z context] [-l ipv4 listen address] [-L ipv6 listen address]\n"
 			"               [-p port] [-n external ip] [-b dnsport] [-P password]\n"
-			"               [-F pidfile] [-i max idle time] tunnel_ip[/netmask] topdomain\n",
+			"               [-F pidfile] [-i max idle time] [-e io engine]\n"
+			"               [-M name=value[,...]] [-C percent] [-Y dictionary] [-w workers]\n"
+			"               tunnel_ip[/netmask] topdomain\n",
 			__progname);
 }
 
@@ -2298,6 +4571,16 @@ static void help(FILE *stream)
 			"  -f to keep running in foreground\n"
 			"  -D to increase debug level\n"
 			"     (using -DD in UTF-8 terminal: \"LC_ALL=C luit iodined -DD ...\")\n"
+			"  -w number of threads handling users (max 16), plus one\n"
+			"     that reads and compresses tun packets\n"
+			"  -C percent of a CPU to spend compressing (default 50), the\n"
+			"     compression level is lowered when it is used up\n"
+			"  -Y file with a compression dictionary clients may use, besides\n"
+			"     the built-in one; can be given up to 8 times\n"
+			"  -H to allocate packet buffers from huge pages\n"
+			"  -M name=value[,...] to set sizes: users (max 512), queue\n"
+			"     (packets per user), dnscache, qmemping and qmemdata (answers\n"
+			"     and queries remembered per user) and fwcache (forwarded queries)\n"
 			"  -u name to drop privileges and run as user 'name'\n"
 			"  -t dir to chroot to directory dir\n"
 			"  -d device to set tunnel device name\n"
@@ -2312,7 +4595,9 @@ static void help(FILE *stream)
 			"  -b port to forward normal DNS queries to (on localhost)\n"
 			"  -P password used for authentication (max 32 chars will be used)\n"
 			"  -F pidfile to write pid to a file\n"
-			"  -i maximum idle time before shutting down\n\n"
+			"  -i maximum idle time before shutting down\n"
+			"  -e io engine to use: select, epoll (Linux, default) or\n"
+			"     uring (Linux, if built with liburing)\n\n"
 			"tunnel_ip is the IP number of the local tunnel interface.\n"
 			"   /netmask sets the size of the tunnel network.\n"
 			"topdomain is the FQDN that is delegated to this server.\n");
@@ -2320,6 +4605,99 @@ static void help(FILE *stream)
 	exit(0);
 }
 
+static int fwq_size = FW_QUERY_CACHE_SIZE;
+
+static struct {
+	const char *name;
+	int *var;
+	int min;
+	int max;
+} sizes[] = {
+	{ "users", &max_users, 1, USERS_MAX },
+#ifdef OUTPACKETQ_LEN
+	{ "queue", &outpacketq_len, 0, OUTPACKETQ_MAX },
+#endif
+#ifdef DNSCACHE_LEN
+	{ "dnscache", &dnscache_len, 1, DNSCACHE_MAX },
+#endif
+	{ "qmemping", &qmemping_len, 1, QMEMPING_MAX },
+	{ "qmemdata", &qmemdata_len, 1, QMEMDATA_MAX },
+	{ "held", &qheld_len, 1, QHELD_MAX },
+	{ "fwcache", &fwq_size, 1, FW_QUERY_CACHE_MAX },
+};
+
+static int
+parse_sizes(char *arg)
+/* Parse -M name=value[,name=value...]. Returns 0 on success. */
+{
+	char *opt;
+	char *val;
+	char *end;
+	long n;
+	int i;
+
+	for (opt = strtok(arg, ","); opt; opt = strtok(NULL, ",")) {
+		val = strchr(opt, '=');
+		if (!val) {
+			warnx("Missing value for -M %s", opt);
+			return -1;
+		}
+		*val++ = 0;
+
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			if (!strcmp(opt, sizes[i].name))
+				break;
+		}
+		if (i == sizeof(sizes) / sizeof(sizes[0])) {
+			warnx("Unknown size -M %s", opt);
+			return -1;
+		}
+
+		errno = 0;
+		n = strtol(val, &end, 10);
+		if (end == val || *end) {
+			warnx("-M %s needs a number, not '%s'", opt, val);
+			return -1;
+		}
+		if (errno || n < sizes[i].min || n > sizes[i].max) {
+			warnx("-M %s must be between %d and %d", opt,
+				sizes[i].min, sizes[i].max);
+			return -1;
+		}
+		*sizes[i].var = n;
+	}
+	return 0;
+}
+
+static void
+print_sizes(int created_users)
+/* Startup summary of the sizes in use and the memory they take */
+{
+	size_t users_mem;
+	size_t fwq_mem;
+	size_t pkt_mem;
+	int i;
+
+	fprintf(stderr, "Sizes:");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		fprintf(stderr, " %s=%d", sizes[i].name, *sizes[i].var);
+	fprintf(stderr, "\n");
+
+	users_mem = users_memsize();
+	fwq_mem = fwq_size * sizeof(struct fw_query);
+	/* Worst case, in- and outpacket and a full queue of 64 KB packets */
+	pkt_mem = 2;
+#ifdef OUTPACKETQ_LEN
+	pkt_mem += outpacketq_len;
+#endif
+	pkt_mem *= (size_t) created_users * PKTBUF_MAX;
+
+	fprintf(stderr, "Using %lu KB for %d users and %lu KB for forwarded "
+		"queries, packet buffers up to %lu KB\n",
+		(unsigned long) users_mem / 1024, created_users,
+		(unsigned long) fwq_mem / 1024, (unsigned long) pkt_mem / 1024);
+}
+
 static void version(void)
 {
 	fprintf(stderr, "iodine IP over DNS tunneling server\n"
@@ -2362,6 +4740,7 @@ main(int argc, char **argv)
 	char *pidfile;
 	int addrfamily;
 	struct dnsfd dns_fds;
+	struct dnsfd worker_fds[WORKERS_MAX];
 	int tun_fd;
 
 	/* settings for forwarding normal DNS to
@@ -2377,13 +4756,16 @@ main(int argc, char **argv)
 	int ns_get_externalip;
 	int retval;
 	int max_idle_time = 0;
+	int nworkers = 0;
+	int hugepages = 0;
+	const struct compress_dict *dict;
+	enum io_engine engine = IO_ENGINE_DEFAULT;
 	struct sockaddr_storage dns4addr;
 	int dns4addr_len;
 	struct sockaddr_storage dns6addr;
 	int dns6addr_len;
-#ifdef HAVE_SYSTEMD
-	int nb_fds;
-#endif
+	int nb_fds = 0;
+	int i;
 
 #ifndef WINDOWS32
 	pw = NULL;
@@ -2425,9 +4807,10 @@ main(int argc, char **argv)
 #endif
 
 	srand(time(NULL));
-	fw_query_init();
+	clock_update();
+	timers_init(clock_ms());
 
-	while ((choice = getopt(argc, argv, "46vcsfhDu:t:d:m:l:L:p:n:b:P:z:F:i:")) != -1) {
+	while ((choice = getopt(argc, argv, "46vcsfhDHu:t:d:m:l:L:p:n:b:P:z:F:i:e:M:C:Y:w:")) != -1) {
 		switch(choice) {
 		case '4':
 			addrfamily = AF_INET;
@@ -2453,6 +4836,40 @@ main(int argc, char **argv)
 		case 'D':
 			debug++;
 			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 1 || nworkers > WORKERS_MAX)
+				usage();
+			break;
+		case 'H':
+			hugepages = 1;
+			break;
+		case 'M':
+			if (parse_sizes(optarg))
+				usage();
+			break;
+		case 'C':
+			compress_budget = atoi(optarg);
+			if (compress_budget < 1 || compress_budget > 100)
+				usage();
+			break;
+		case 'Y':
+			dict = compress_dict_load(optarg);
+			if (!dict)
+				usage();
+			fprintf(stderr, "Loaded dictionary %s, %lu bytes, id %08x\n",
+				optarg, dict->len, dict->id);
+			break;
+		case 'e':
+			if (!strcmp(optarg, "select"))
+				engine = IO_ENGINE_SELECT;
+			else if (!strcmp(optarg, "epoll"))
+				engine = IO_ENGINE_EPOLL;
+			else if (!strcmp(optarg, "uring"))
+				engine = IO_ENGINE_URING;
+			else
+				usage();
+			break;
 		case 'u':
 			username = optarg;
 			break;
@@ -2511,6 +4928,9 @@ main(int argc, char **argv)
 	argv += optind;
 
 	check_superuser();
+	pktbuf_init(hugepages);
+	if (fw_query_init(fwq_size))
+		err(1, "allocating forward query cache");
 
 	if (argc != 2)
 		usage();
@@ -2628,6 +5048,8 @@ main(int argc, char **argv)
 	/* Mark both file descriptors as unused */
 	dns_fds.v4fd = -1;
 	dns_fds.v6fd = -1;
+	for (i = 0; i < WORKERS_MAX; i++)
+		worker_fds[i] = dns_fds;
 
 	created_users = init_users(my_ip, netmask);
 
@@ -2695,6 +5117,32 @@ main(int argc, char **argv)
 	if (dns_fds.v6fd >= 0)
 		prepare_dns_fd(dns_fds.v6fd);
 
+	/* Each worker has sockets of its own on the same address, sockets
+	   from systemd are shared */
+	worker_fds[0] = dns_fds;
+	for (i = 1; i < nworkers; i++) {
+		if (nb_fds > 0) {
+			worker_fds[i] = dns_fds;
+			continue;
+		}
+		if (dns_fds.v4fd >= 0 &&
+			(worker_fds[i].v4fd = open_dns(&dns4addr, dns4addr_len)) < 0) {
+
+			retval = 1;
+			goto cleanup;
+		}
+		if (dns_fds.v6fd >= 0 &&
+			(worker_fds[i].v6fd = open_dns_opt(&dns6addr, dns6addr_len, 1)) < 0) {
+
+			retval = 1;
+			goto cleanup;
+		}
+		if (worker_fds[i].v4fd >= 0)
+			prepare_dns_fd(worker_fds[i].v4fd);
+		if (worker_fds[i].v6fd >= 0)
+			prepare_dns_fd(worker_fds[i].v6fd);
+	}
+
 	if (bind_enable) {
 		if ((bind_fd = open_dns_from_host(NULL, 0, AF_INET, 0)) < 0) {
 			retval = 1;
@@ -2704,10 +5152,11 @@ main(int argc, char **argv)
 
 	my_mtu = mtu;
 
-	if (created_users < USERS) {
+	if (created_users < max_users) {
 		fprintf(stderr, "Limiting to %d simultaneous users because of netmask /%d\n",
 			created_users, netmask);
 	}
+	print_sizes(created_users);
 	fprintf(stderr, "Listening to dns for domain %s\n", topdomain);
 
 	if (foreground == 0)
@@ -2743,11 +5192,17 @@ main(int argc, char **argv)
 
 	syslog(LOG_INFO, "started, listening on port %d", port);
 
-	tunnel(tun_fd, &dns_fds, bind_fd, max_idle_time);
+	tunnel(tun_fd, worker_fds, bind_fd, max_idle_time, nworkers, engine);
 
 	syslog(LOG_INFO, "stopping");
 	close_dns(bind_fd);
 cleanup:
+	for (i = 1; i < nworkers && nb_fds == 0; i++) {
+		if (worker_fds[i].v6fd >= 0)
+			close_dns(worker_fds[i].v6fd);
+		if (worker_fds[i].v4fd >= 0)
+			close_dns(worker_fds[i].v4fd);
+	}
 	if (dns_fds.v6fd >= 0)
 		close_dns(dns_fds.v6fd);
 	if (dns_fds.v4fd >= 0)
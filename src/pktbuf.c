@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef LINUX
+#include <sys/mman.h>
+#endif
+
+#include "common.h"
+#include "pktbuf.h"
+
+/* Most compressed packets fit the smaller classes, only big upstream
+   packets or jumbo MTUs need the largest one. */
+static const size_t class_size[] = { 512, 2048, 8192, PKTBUF_MAX };
+#define CLASSES (sizeof(class_size) / sizeof(class_size[0]))
+
+#define SLAB_SIZE (256*1024)
+#define HUGE_SLAB_SIZE (2*1024*1024)
+#define IDLE_SLABS 1	/* empty slabs kept per class, the rest is freed */
+
+/* Each slab starts with this header, followed by its buffers */
+struct slab {
+	struct slab *next;	/* in avail list, while it has free buffers */
+	struct slab *prev;
+	struct pktbuf *free;
+	int used;		/* buffers handed out */
+	int class;
+	size_t len;
+	int huge;
+};
+
+struct pktbuf {
+	struct pktbuf *next;	/* free list link */
+	struct slab *slab;
+	int refs;
+};
+
+#define HDR(data) ((struct pktbuf *) ((data) - sizeof(struct pktbuf)))
+#define DATA(buf) ((char *) (buf) + sizeof(struct pktbuf))
+
+/* Slabs with free buffers, partly used ones first so that the others
+   can empty out. Each thread has a pool of its own. */
+static __thread struct slab *avail[CLASSES];
+static __thread struct slab *avail_last[CLASSES];
+static __thread int idle[CLASSES];
+static int use_hugepages;
+static __thread size_t reserved;
+
+void
+pktbuf_init(int hugepages)
+{
+	use_hugepages = hugepages;
+}
+
+static struct slab *
+slab_alloc(void)
+{
+	struct slab *slab;
+
+#if defined(LINUX) && defined(MAP_HUGETLB)
+	if (use_hugepages) {
+		slab = mmap(NULL, HUGE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab != MAP_FAILED) {
+			slab->len = HUGE_SLAB_SIZE;
+			slab->huge = 1;
+			return slab;
+		}
+		warn("mmap hugepage slab, using normal pages");
+		use_hugepages = 0;
+	}
+#endif
+	slab = malloc(SLAB_SIZE);
+	if (!slab)
+		return NULL;
+	slab->len = SLAB_SIZE;
+	slab->huge = 0;
+	return slab;
+}
+
+static void
+slab_free(struct slab *slab)
+{
+	reserved -= slab->len;
+#if defined(LINUX) && defined(MAP_HUGETLB)
+	if (slab->huge) {
+		munmap(slab, slab->len);
+		return;
+	}
+#endif
+	free(slab);
+}
+
+static void
+avail_remove(struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		avail[slab->class] = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	else
+		avail_last[slab->class] = slab->prev;
+}
+
+static void
+avail_add(struct slab *slab, int last)
+{
+	int class = slab->class;
+
+	if (last) {
+		slab->next = NULL;
+		slab->prev = avail_last[class];
+		if (slab->prev)
+			slab->prev->next = slab;
+		else
+			avail[class] = slab;
+		avail_last[class] = slab;
+	} else {
+		slab->prev = NULL;
+		slab->next = avail[class];
+		if (slab->next)
+			slab->next->prev = slab;
+		else
+			avail_last[class] = slab;
+		avail[class] = slab;
+	}
+}
+
+static int
+slab_add(int class)
+/* Carve a new slab into free buffers of class */
+{
+	struct slab *slab;
+	size_t stride;
+	size_t off;
+
+	stride = sizeof(struct pktbuf) + class_size[class];
+	slab = slab_alloc();
+	if (!slab)
+		return -1;
+
+	reserved += slab->len;
+	slab->class = class;
+	slab->used = 0;
+	slab->free = NULL;
+	for (off = sizeof(struct slab); off + stride <= slab->len; off += stride) {
+		struct pktbuf *buf = (struct pktbuf *) ((char *) slab + off);
+		buf->slab = slab;
+		buf->refs = 0;
+		buf->next = slab->free;
+		slab->free = buf;
+	}
+	avail_add(slab, 0);
+	idle[class]++;
+	return 0;
+}
+
+char *
+pktbuf_get(size_t len)
+/* Returns buffer of at least len bytes, or NULL */
+{
+	struct pktbuf *buf;
+	struct slab *slab;
+	int class;
+
+	for (class = 0; class < CLASSES; class++) {
+		if (len <= class_size[class])
+			break;
+	}
+	if (class == CLASSES)
+		return NULL;
+
+	if (!avail[class] && slab_add(class))
+		return NULL;
+
+	slab = avail[class];
+	buf = slab->free;
+	slab->free = buf->next;
+	if (slab->used++ == 0)
+		idle[class]--;
+	if (!slab->free)
+		avail_remove(slab);
+
+	buf->next = NULL;
+	buf->refs = 1;
+	return DATA(buf);
+}
+
+char *
+pktbuf_ref(char *data)
+{
+	if (data)
+		HDR(data)->refs++;
+	return data;
+}
+
+void
+pktbuf_put(char *data)
+{
+	struct pktbuf *buf;
+	struct slab *slab;
+
+	if (!data)
+		return;
+
+	buf = HDR(data);
+	if (--buf->refs > 0)
+		return;
+
+	slab = buf->slab;
+	if (!slab->free)
+		avail_add(slab, 0);
+	buf->next = slab->free;
+	slab->free = buf;
+	if (--slab->used > 0)
+		return;
+
+	/* Empty: keep a few for the next burst, behind the partly used
+	   ones, and give the rest back */
+	avail_remove(slab);
+	if (idle[slab->class] < IDLE_SLABS) {
+		idle[slab->class]++;
+		avail_add(slab, 1);
+	} else {
+		slab_free(slab);
+	}
+}
+
+char *
+pktbuf_grow(char *data, size_t used, size_t len)
+/* Make sure buffer holds len bytes, keeping the first used bytes.
+   May return a new buffer, the old one is then released.
+   Returns NULL if len is too large; data is still valid then. */
+{
+	char *bigger;
+
+	if (data && pktbuf_size(data) >= len)
+		return data;
+
+	bigger = pktbuf_get(len);
+	if (!bigger)
+		return NULL;
+	if (data) {
+		memcpy(bigger, data, used);
+		pktbuf_put(data);
+	}
+	return bigger;
+}
+
+size_t
+pktbuf_size(const char *data)
+{
+	return class_size[HDR(data)->slab->class];
+}
+
+size_t
+pktbuf_reserved(void)
+/* Bytes taken from the system for buffers of this thread */
+{
+	return reserved;
+}
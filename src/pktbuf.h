@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __PKTBUF_H__
+#define __PKTBUF_H__
+
+#include <stddef.h>
+
+/* Pool of reference counted packet buffers in a few size classes.
+   Buffers are carved from larger slabs. Slabs that empty out are given
+   back to the system, except one per size class kept for reuse.
+   pktbuf_get() returns a buffer with one reference, pktbuf_put()
+   drops one. All functions take and return the data pointer.
+   Each thread has a pool of its own: a buffer may be read and written
+   anywhere, but only the thread that got it may take or drop
+   references. */
+
+#define PKTBUF_MAX (64*1024)
+
+void pktbuf_init(int hugepages);
+char *pktbuf_get(size_t len);
+char *pktbuf_ref(char *data);
+void pktbuf_put(char *data);
+char *pktbuf_grow(char *data, size_t used, size_t len);
+size_t pktbuf_size(const char *data);
+size_t pktbuf_reserved(void);
+
+#endif /* __PKTBUF_H__ */
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "resolver.h"
+
+#define SLOT(id) ((id) & (RESOLVER_IDS - 1))
+
+static void
+resolver_miss(struct resolver *res)
+{
+	res->missed++;
+	res->health -= res->health / 8;
+}
+
+static int
+resolver_weight(const struct resolver *res, unsigned long fastest_us)
+{
+	unsigned long w = res->health;
+
+	if (fastest_us && res->srtt_us > fastest_us)
+		w = w * fastest_us / res->srtt_us;
+	if (w < RESOLVER_WEIGHT_MIN)
+		w = RESOLVER_WEIGHT_MIN;
+	return w;
+}
+
+static unsigned long
+resolver_fastest(const struct resolvers *r)
+/* Shortest RTT of any resolver, 0 if none is known yet */
+{
+	unsigned long fastest = 0;
+	int i;
+
+	for (i = 0; i < r->count; i++) {
+		if (r->r[i].srtt_us &&
+		    (fastest == 0 || r->r[i].srtt_us < fastest))
+			fastest = r->r[i].srtt_us;
+	}
+	return fastest;
+}
+
+void
+resolver_init(struct resolvers *r, int count)
+{
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	if (count > RESOLVER_MAX)
+		count = RESOLVER_MAX;
+	r->count = count;
+	for (i = 0; i < count; i++)
+		r->r[i].health = RESOLVER_ONE;
+}
+
+void
+resolver_forget(struct resolvers *r)
+/* Forget the queries sent so far, keeping what was learned about the
+   resolvers */
+{
+	memset(r->ids, 0, sizeof(r->ids));
+}
+
+int
+resolver_pick(struct resolvers *r)
+/* The resolver to send the next query to */
+{
+	unsigned long fastest;
+	int total = 0;
+	int best = 0;
+	int w;
+	int i;
+
+	if (r->count <= 1)
+		return 0;
+
+	fastest = resolver_fastest(r);
+	for (i = 0; i < r->count; i++) {
+		w = resolver_weight(&r->r[i], fastest);
+		r->r[i].credit += w;
+		total += w;
+		if (r->r[i].credit > r->r[best].credit)
+			best = i;
+	}
+	r->r[best].credit -= total;
+	return best;
+}
+
+int
+resolver_other(const struct resolvers *r, int which)
+/* The best resolver besides which, to send a query to again. Returns
+   which if there is no other. */
+{
+	unsigned long fastest;
+	int best = which;
+	int w;
+	int i;
+
+	fastest = resolver_fastest(r);
+	for (i = 0; i < r->count; i++) {
+		if (i == which)
+			continue;
+		w = resolver_weight(&r->r[i], fastest);
+		if (best == which || w > resolver_weight(&r->r[best], fastest))
+			best = i;
+	}
+	return best;
+}
+
+void
+resolver_sent(struct resolvers *r, int which, uint16_t id, uint64_t now)
+{
+	if (which < 0 || which >= r->count)
+		return;
+
+	if (r->ids[SLOT(id)].pending)
+		resolver_miss(&r->r[(int) r->ids[SLOT(id)].which]);
+	r->ids[SLOT(id)].id = id;
+	r->ids[SLOT(id)].pending = 1;
+	r->ids[SLOT(id)].which = which;
+	r->ids[SLOT(id)].sent = now;
+	r->r[which].sent++;
+}
+
+void
+resolver_answered(struct resolvers *r, uint16_t id, uint64_t now, int timed)
+/* timed: the server answered id as soon as it got it, so the time
+   since it was sent is a round trip */
+{
+	struct resolver *res;
+	unsigned long sample_us;
+
+	if (!r->ids[SLOT(id)].pending || r->ids[SLOT(id)].id != id)
+		return;
+	r->ids[SLOT(id)].pending = 0;
+	res = &r->r[(int) r->ids[SLOT(id)].which];
+
+	res->answered++;
+	res->health += (RESOLVER_ONE - res->health + 7) / 8;
+	if (!timed)
+		return;
+
+	/* Weight 1/8, like the smoothed RTT of the congestion control */
+	sample_us = (now - r->ids[SLOT(id)].sent) * 1000;
+	if (sample_us == 0)
+		sample_us = 1;
+	if (res->srtt_us == 0)
+		res->srtt_us = sample_us;
+	else
+		res->srtt_us = res->srtt_us - res->srtt_us / 8 + sample_us / 8;
+}
+
+void
+resolver_servfail(struct resolvers *r, uint16_t id)
+/* The resolver gave up on a query or refused it */
+{
+	if (!r->ids[SLOT(id)].pending || r->ids[SLOT(id)].id != id)
+		return;
+	r->ids[SLOT(id)].pending = 0;
+	resolver_miss(&r->r[(int) r->ids[SLOT(id)].which]);
+}
+
+void
+resolver_expire(struct resolvers *r, uint64_t now, int ms)
+/* Count queries pending for more than ms as missed. Scans the queries
+   at most every RESOLVER_EXPIRE_EVERY ms. */
+{
+	int i;
+
+	if (r->count <= 1 || now - r->expired < RESOLVER_EXPIRE_EVERY)
+		return;
+	r->expired = now;
+
+	for (i = 0; i < RESOLVER_IDS; i++) {
+		if (r->ids[i].pending && now - r->ids[i].sent > (uint64_t) ms) {
+			r->ids[i].pending = 0;
+			resolver_miss(&r->r[(int) r->ids[i].which]);
+		}
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <stdint.h>
+
+/* Striping of the client's queries over several resolvers, which the
+   caller keeps the addresses of, by number. Each resolver gets queries
+   in proportion to its weight, in smooth weighted round robin order.
+   The weight is its health, the share of its queries answered, smoothed
+   over about 8 of them, scaled down by how much longer its round trip
+   is than the fastest one's. Resolvers that stopped answering keep a
+   small weight, so that they are tried now and then and can recover.
+
+   A query is missed when it gets a SERVFAIL, when nothing came back
+   before resolver_expire() gives up on it, or when it is still pending
+   as its slot is taken by a new one. */
+
+#define RESOLVER_MAX 8
+#define RESOLVER_ONE 256	/* fixed point unit of health */
+#define RESOLVER_WEIGHT_MIN (RESOLVER_ONE / 16)
+#define RESOLVER_IDS 1024	/* queries remembered, a power of 2 */
+#define RESOLVER_EXPIRE_EVERY 100	/* ms between expiry scans */
+
+struct resolver {
+	int health;		/* answered share, * RESOLVER_ONE */
+	unsigned long srtt_us;	/* smoothed RTT, 0: no sample yet */
+	int credit;		/* round robin position */
+	/* Totals, for inspection */
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long missed;
+};
+
+struct resolvers {
+	int count;
+	struct resolver r[RESOLVER_MAX];
+	uint64_t expired;	/* ms, last expiry scan */
+	struct {
+		uint16_t id;
+		char pending;
+		signed char which;
+		uint64_t sent;	/* ms */
+	} ids[RESOLVER_IDS];	/* sent queries, by id % RESOLVER_IDS */
+};
+
+void resolver_init(struct resolvers *r, int count);
+void resolver_forget(struct resolvers *r);
+int resolver_pick(struct resolvers *r);
+int resolver_other(const struct resolvers *r, int which);
+void resolver_sent(struct resolvers *r, int which, uint16_t id, uint64_t now);
+void resolver_answered(struct resolvers *r, uint16_t id, uint64_t now, int timed);
+void resolver_servfail(struct resolvers *r, uint16_t id);
+void resolver_expire(struct resolvers *r, uint64_t now, int ms);
+
+#endif /* __RESOLVER_H__ */
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* for clock_gettime() with -std=c99 */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WINDOWS32
+#include "windows.h"
+#endif
+
+#include "timer.h"
+
+/* 4 levels of 64 slots: level 0 has 1 ms slots covering 64 ms, level 1
+   covers 4 s, level 2 about 4 minutes and level 3 about 4.6 hours.
+   Timers further away are parked in the last level and placed again
+   when that slot is cascaded. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/* Each thread has a wheel and clock of its own */
+static __thread struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static __thread uint64_t wheel_tick;	/* last processed tick */
+static __thread int wheel_pending;	/* number of pending timers */
+
+static __thread uint64_t now_ms;
+
+void
+clock_update(void)
+{
+#ifdef WINDOWS32
+	now_ms = GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t
+clock_ms(void)
+{
+	return now_ms;
+}
+
+uint64_t
+clock_us(void)
+{
+#ifdef WINDOWS32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t) count.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void
+timers_init(uint64_t now)
+{
+	memset(wheel, 0, sizeof(wheel));
+	wheel_tick = now;
+	wheel_pending = 0;
+}
+
+void
+timer_init(struct timer *timer, void (*fn)(void *), void *arg)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->fn = fn;
+	timer->arg = arg;
+}
+
+static void
+wheel_add(struct timer *timer, uint64_t first)
+/* first is the earliest tick that will still be processed */
+{
+	struct timer **slot;
+	uint64_t expires;
+	uint64_t delta;
+	int level;
+
+	/* Already expired: fire as soon as possible */
+	expires = timer->expires;
+	if (expires < first)
+		expires = first;
+
+	delta = expires - wheel_tick;
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+			break;
+	}
+	if (delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)))
+		expires = wheel_tick + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void
+wheel_unlink(struct timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void
+timer_set(struct timer *timer, uint64_t expires)
+{
+	if (timer->pprev)
+		wheel_unlink(timer);
+	else
+		wheel_pending++;
+
+	timer->expires = expires;
+	wheel_add(timer, wheel_tick + 1);
+}
+
+void
+timer_del(struct timer *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	wheel_unlink(timer);
+	wheel_pending--;
+}
+
+int
+timer_pending(const struct timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+static int
+cascade(int level)
+/* Move timers of the current slot on level down to lower levels.
+   Returns the slot index, 0 means next level must cascade too. */
+{
+	struct timer *timer;
+	struct timer *next;
+	int index;
+
+	index = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer = wheel[level][index];
+	wheel[level][index] = NULL;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		timer->pprev = NULL;
+		/* current tick is processed after cascading */
+		wheel_add(timer, wheel_tick);
+	}
+	return index;
+}
+
+void
+timers_run(uint64_t now)
+/* Fire all timers that expire at or before now */
+{
+	struct timer *timer;
+	int level;
+	int index;
+
+	while (wheel_tick < now) {
+		if (!wheel_pending) {
+			wheel_tick = now;
+			break;
+		}
+
+		wheel_tick++;
+		index = wheel_tick & WHEEL_MASK;
+		if (index == 0) {
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				if (cascade(level) != 0)
+					break;
+			}
+		}
+
+		/* Callbacks may add or remove timers in this slot too */
+		while ((timer = wheel[0][index]) != NULL) {
+			wheel_unlink(timer);
+			wheel_pending--;
+			timer->fn(timer->arg);
+		}
+	}
+}
+
+int
+timers_next(uint64_t now, int max)
+/* Milliseconds until timers_run() has something to do, at most max.
+   For timers on higher levels this is when their slot is cascaded,
+   which is never later than when they expire. */
+{
+	uint64_t when;
+	uint64_t base;
+	int level;
+	int i;
+
+	if (!wheel_pending)
+		return max;
+
+	when = now + max;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		int shift = WHEEL_BITS * level;
+
+		base = wheel_tick >> shift;
+		for (i = 1; i <= WHEEL_SLOTS; i++) {
+			if (wheel[level][(base + i) & WHEEL_MASK]) {
+				if (((base + i) << shift) < when)
+					when = (base + i) << shift;
+				break;
+			}
+		}
+	}
+
+	if (when <= now)
+		return 0;
+	return when - now;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/* Cached monotonic clock in milliseconds. Updated once per main loop
+   iteration by clock_update(), so reading it is free. Each thread has
+   its own, to be updated before it is first read. */
+void clock_update(void);
+uint64_t clock_ms(void);
+/* Uncached microseconds for timing work, safe from any thread */
+uint64_t clock_us(void);
+
+/* Hierarchical timer wheel with millisecond ticks.
+   Timers are embedded in their owners and never allocated. Each thread
+   has its own wheel, set up with timers_init(); a timer belongs to the
+   wheel of the thread that sets it, and must only be set, deleted and
+   run by that thread. */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;		/* NULL when not pending */
+	uint64_t expires;		/* clock_ms() value to fire at */
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+void timers_init(uint64_t now);
+void timer_init(struct timer *timer, void (*fn)(void *), void *arg);
+void timer_set(struct timer *timer, uint64_t expires);
+void timer_del(struct timer *timer);
+int timer_pending(const struct timer *timer);
+void timers_run(uint64_t now);
+int timers_next(uint64_t now, int max);
+
+#endif /* __TIMER_H__ */
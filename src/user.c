@@ -31,17 +31,90 @@
 #endif
 
 #include "common.h"
+#include "compress.h"
 #include "encoding.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "user.h"
+#include "vj.h"
+#include "window.h"
 
 struct tun_user *users;
 unsigned usercount;
 
+int max_users = USERS;
+#ifdef OUTPACKETQ_LEN
+int outpacketq_len = OUTPACKETQ_LEN;
+#endif
+#ifdef DNSCACHE_LEN
+int dnscache_len = DNSCACHE_LEN;
+#endif
+int qmemping_len = QMEMPING_LEN;
+int qmemdata_len = QMEMDATA_LEN;
+int qheld_len = QHELD_LEN;
+
+static size_t memsize;
+
+/* Host order addresses for mapping tunnel IP to user, see find_user_by_ip() */
+static uint32_t net_start;
+static uint32_t server_ip;
+/* Users counted as open and pending, see all_users_waiting_to_send().
+   Per thread, as the users of a thread are only changed by it. */
+static __thread int users_open;
+static __thread int users_pending;
+
+static void *
+users_alloc(size_t n, size_t size)
+/* calloc() for the per-user arrays, keeping track of the total */
+{
+	void *p;
+
+	if (n == 0)
+		return NULL;
+
+	p = calloc(n, size);
+	if (!p)
+		err(1, "allocating %lu bytes for users",
+		    (unsigned long) (n * size));
+	memsize += n * size;
+	return p;
+}
+
+static void user_expire(void *arg)
+{
+	struct tun_user *user = arg;
+
+	/* Timer is only moved when it fires, not on every packet */
+	if (user->last_pkt + USER_TIMEOUT > user->expire.expires) {
+		timer_set(&user->expire, user->last_pkt + USER_TIMEOUT);
+		return;
+	}
+	user->active = 0;
+	user_release_packets(user - users);
+}
+
 int init_users(in_addr_t my_ip, int netbits)
 {
+	unsigned char *qmemping_cmc;
+	unsigned short *qmemping_type;
+	unsigned char *qmemdata_cmc;
+	unsigned short *qmemdata_type;
+#ifdef OUTPACKETQ_LEN
+	struct user_packet *outpacketq;
+#endif
+#ifdef DNSCACHE_LEN
+	struct query *dnscache_q;
+	char (*dnscache_answer)[4096];
+	int *dnscache_answerlen;
+#endif
+	struct vj_comp *vjdown;
+	struct vj_decomp *vjup;
+	struct window_out *downwin;
+	struct window_in *upwin;
+	char *upfrags;
+	struct held_query *qheld;
 	int i;
 	int skip = 0;
-	char newip[16];
 
 	int maxusers;
 
@@ -55,21 +128,67 @@ int init_users(in_addr_t my_ip, int netbits)
 	netmask <<= (32 - netbits);
 	net.s_addr = htonl(netmask);
 	ipstart.s_addr = my_ip & net.s_addr;
+	net_start = ntohl(ipstart.s_addr);
+	server_ip = ntohl(my_ip);
 
 	maxusers = (1 << (32-netbits)) - 3; /* 3: Net addr, broadcast addr, iodined addr */
-	usercount = MIN(maxusers, USERS);
+	users_open = 0;
+	users_pending = 0;
+	usercount = MIN(maxusers, max_users);
 
-	users = calloc(usercount, sizeof(struct tun_user));
+	memsize = 0;
+	users = users_alloc(usercount, sizeof(struct tun_user));
+	qmemping_cmc = users_alloc(usercount * qmemping_len, 4);
+	qmemping_type = users_alloc(usercount * qmemping_len, sizeof(unsigned short));
+	qmemdata_cmc = users_alloc(usercount * qmemdata_len, 4);
+	qmemdata_type = users_alloc(usercount * qmemdata_len, sizeof(unsigned short));
+#ifdef OUTPACKETQ_LEN
+	outpacketq = users_alloc(usercount * outpacketq_len, sizeof(struct user_packet));
+#endif
+#ifdef DNSCACHE_LEN
+	dnscache_q = users_alloc(usercount * dnscache_len, sizeof(struct query));
+	dnscache_answer = users_alloc(usercount * dnscache_len, 4096);
+	dnscache_answerlen = users_alloc(usercount * dnscache_len, sizeof(int));
+#endif
+	vjdown = users_alloc(usercount, sizeof(struct vj_comp));
+	vjup = users_alloc(usercount, sizeof(struct vj_decomp));
+	downwin = users_alloc(usercount, sizeof(struct window_out));
+	upwin = users_alloc(usercount, sizeof(struct window_in));
+	upfrags = users_alloc(usercount, WINDOW_IN_SIZE(WINDOW_UPFRAG_MAX));
+	qheld = users_alloc(usercount * qheld_len, sizeof(struct held_query));
 	for (i = 0; i < usercount; i++) {
 		in_addr_t ip;
 		users[i].id = i;
-		snprintf(newip, sizeof(newip), "0.0.0.%d", i + skip + 1);
-		ip = ipstart.s_addr + inet_addr(newip);
+		users[i].qmemping_cmc = qmemping_cmc + i * qmemping_len * 4;
+		users[i].qmemping_type = qmemping_type + i * qmemping_len;
+		users[i].qmemdata_cmc = qmemdata_cmc + i * qmemdata_len * 4;
+		users[i].qmemdata_type = qmemdata_type + i * qmemdata_len;
+#ifdef OUTPACKETQ_LEN
+		users[i].outpacketq = outpacketq + i * outpacketq_len;
+#endif
+#ifdef DNSCACHE_LEN
+		users[i].dnscache_q = dnscache_q + i * dnscache_len;
+		users[i].dnscache_answer = dnscache_answer + i * dnscache_len;
+		users[i].dnscache_answerlen = dnscache_answerlen + i * dnscache_len;
+#endif
+		users[i].vjdown = vjdown + i;
+		users[i].vjup = vjup + i;
+		vj_comp_init(users[i].vjdown, 0);
+		vj_decomp_init(users[i].vjup);
+		users[i].downwin = downwin + i;
+		window_out_init(users[i].downwin, 0);
+		users[i].upwin = upwin + i;
+		window_in_init(users[i].upwin,
+			       upfrags + i * WINDOW_IN_SIZE(WINDOW_UPFRAG_MAX),
+			       WINDOW_UPFRAG_MAX);
+		users[i].qheld = qheld + i * qheld_len;
+		users[i].qheld_first = 0;
+		users[i].qheld_count = 0;
+		ip = htonl(ntohl(ipstart.s_addr) + i + skip + 1);
 		if (ip == my_ip && skip == 0) {
 			/* This IP was taken by iodined */
 			skip++;
-			snprintf(newip, sizeof(newip), "0.0.0.%d", i + skip + 1);
-			ip = ipstart.s_addr + inet_addr(newip);
+			ip = htonl(ntohl(ipstart.s_addr) + i + skip + 1);
 		}
 		users[i].tun_ip = ip;
 		net.s_addr = ip;
@@ -77,83 +196,119 @@ int init_users(in_addr_t my_ip, int netbits)
 		users[i].authenticated = 0;
 		users[i].authenticated_raw = 0;
 		users[i].active = 0;
+		users[i].open = 0;
+		users[i].pending = 0;
+		user_switch_compression(i, &zlib_ops, &zlib_ops, zlib_ops.default_level);
+		timer_init(&users[i].expire, user_expire, &users[i]);
  		/* Rest is reset on login ('V' packet) */
 	}
 
 	return usercount;
 }
 
+size_t users_memsize(void)
+/* Bytes allocated by init_users(), not counting packet buffers */
+{
+	return memsize;
+}
+
 const char *users_get_first_ip(void)
 {
 	struct in_addr ip;
+	char *first;
+
 	ip.s_addr = users[0].tun_ip;
-	return strdup(inet_ntoa(ip));
+	first = strdup(inet_ntoa(ip));
+	if (!first)
+		err(1, "strdup");
+	return first;
+}
+
+int user_slot_by_ip(uint32_t ip)
+/* Index in users[] for tunnel IP, whether in use or not. Only reads
+   what init_users() set up, so it is safe from the tun thread. */
+{
+	uint32_t host;
+	uint32_t i;
+
+	/* Users get consecutive addresses after the network address,
+	   skipping the one taken by iodined, so the index can be
+	   computed from the address. */
+	host = ntohl(ip);
+	if (host == server_ip)
+		return -1;
+	i = host - net_start - 1;
+	if (server_ip > net_start && host > server_ip)
+		i--;
+	if (i >= usercount || users[i].tun_ip != ip)
+		return -1;
+	return i;
 }
 
 int find_user_by_ip(uint32_t ip)
 {
-	int ret;
 	int i;
 
-	ret = -1;
-	for (i = 0; i < usercount; i++) {
-		if (users[i].active &&
-			users[i].authenticated &&
-			!users[i].disabled &&
-			users[i].last_pkt + 60 > time(NULL) &&
-			ip == users[i].tun_ip) {
-			ret = i;
-			break;
-		}
-	}
-	return ret;
+	i = user_slot_by_ip(ip);
+	if (i < 0)
+		return -1;
+
+	if (users[i].active &&
+		users[i].authenticated &&
+		!users[i].disabled)
+		return i;
+	return -1;
+}
+
+void user_update_pending(int userid)
+/* Count userid again after a change to its active or disabled flags,
+   connection type or queued packets */
+{
+	struct tun_user *u = &users[userid];
+	int open;
+	int pending;
+
+	open = u->active && !u->disabled;
+	pending = open && u->conn == CONN_DNS_NULL &&
+#ifdef OUTPACKETQ_LEN
+		u->outpacketq_filled >= 1;
+#else
+		u->outpacket.len != 0;
+#endif
+	users_open += open - u->open;
+	users_pending += pending - u->pending;
+	u->open = open;
+	u->pending = pending;
 }
 
 /* If this returns true, then reading from tun device is blocked.
    So only return true when all clients have at least one packet in
    the outpacket-queue, so that sending back-to-back is possible
    without going through another select loop.
+   Only counts the users handled by the calling thread.
 */
 int all_users_waiting_to_send(void)
 {
-	time_t now;
-	int ret;
-	int i;
-
-	ret = 1;
-	now = time(NULL);
-	for (i = 0; i < usercount; i++) {
-		if (users[i].active && !users[i].disabled &&
-			users[i].last_pkt + 60 > now &&
-			((users[i].conn == CONN_RAW_UDP) ||
-			((users[i].conn == CONN_DNS_NULL)
-#ifdef OUTPACKETQ_LEN
-				&& users[i].outpacketq_filled < 1
-#else
-				&& users[i].outpacket.len == 0
-#endif
-			))) {
-
-			ret = 0;
-			break;
-		}
-	}
-	return ret;
+	return users_pending == users_open;
 }
 
-int find_available_user(void)
+int find_available_user(int first, int step)
+/* Takes the first free one of every step'th user from first, so that
+   threads each owning such a share of the users only take their own */
 {
 	int ret = -1;
 	int i;
-	for (i = 0; i < usercount; i++) {
-		/* Not used at all or not used in one minute */
-		if ((!users[i].active || users[i].last_pkt + 60 < time(NULL)) && !users[i].disabled) {
+	for (i = first; i < usercount; i += step) {
+		/* Not used at all or expired */
+		if (!users[i].active && !users[i].disabled) {
 			users[i].active = 1;
 			users[i].authenticated = 0;
 			users[i].authenticated_raw = 0;
-			users[i].last_pkt = time(NULL);
+			users[i].last_pkt = clock_ms();
+			timer_set(&users[i].expire, users[i].last_pkt + USER_TIMEOUT);
 			users[i].fragsize = 4096;
 			users[i].conn = CONN_DNS_NULL;
+			user_update_pending(i);
 			ret = i;
 			break;
 		}
@@ -169,6 +324,167 @@ void user_switch_codec(int userid, const struct encoder *enc)
 	users[userid].encoder = enc;
 }
 
+void user_switch_compression(int userid, const struct compressor *up,
+			     const struct compressor *down, int downlevel)
+{
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	users[userid].upcomp = up;
+	/* A new stream in both directions, the client starts over too */
+	compress_stream_free(users[userid].zstream);
+	users[userid].zstream = NULL;
+	if (up->stream || down->stream) {
+		users[userid].zstream = compress_stream_new();
+		if (!users[userid].zstream)
+			err(1, "allocating compression stream");
+	}
+	compress_ctl_init(&users[userid].downctl, down, downlevel, clock_ms());
+	/* The tun thread compresses without taking part in the main loop */
+	__atomic_store_n(&users[userid].downlevel, downlevel, __ATOMIC_RELAXED);
+	__atomic_store_n(&users[userid].downcomp, down, __ATOMIC_RELEASE);
+}
+
+void user_switch_dict(int userid, const struct compress_dict *dict)
+{
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	__atomic_store_n(&users[userid].dict, dict, __ATOMIC_RELEASE);
+	/* Streams start with the dictionary, so start them over */
+	if (users[userid].zstream) {
+		compress_stream_free(users[userid].zstream);
+		users[userid].zstream = compress_stream_new();
+		if (!users[userid].zstream)
+			err(1, "allocating compression stream");
+	}
+}
+
+void user_switch_hdrcomp(int userid, int on)
+{
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	/* Both ends start without any flows */
+	vj_decomp_init(users[userid].vjup);
+	user_reset_hdrcomp(userid);
+	__atomic_store_n(&users[userid].hdrcomp, on, __ATOMIC_RELEASE);
+}
+
+void user_reset_hdrcomp(int userid)
+/* Forget the flows sent towards userid, so that the next packet of
+   each goes with full headers */
+{
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	/* vjdown belongs to the thread reading tun, which notices this */
+	__atomic_add_fetch(&users[userid].vjgen, 1, __ATOMIC_RELEASE);
+}
+
+static void
+window_release(struct window_out *w)
+/* Give back the fragments still in the window */
+{
+	struct window_frag frag;
+
+	while (window_out_drop(w, &frag))
+		pktbuf_put(frag.data);
+}
+
+void user_switch_window(int userid, int down, int up)
+{
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	window_release(users[userid].downwin);
+	window_out_init(users[userid].downwin, down);
+	window_in_clear(users[userid].upwin);
+	users[userid].upwindow = up;
+}
+
+int user_switch_fec(int userid, int fec)
+/* Parity fragments both ways, one per fec data fragments or 0 for none.
+   Returns -1 if the windows are too small for them. */
+{
+	if (userid < 0 || userid >= usercount)
+		return -1;
+
+	if (fec && (users[userid].downwin->size < 2 || users[userid].upwindow < 2))
+		return -1;
+
+	window_release(users[userid].downwin);
+	window_out_init(users[userid].downwin, users[userid].downwin->size);
+	window_out_fec(users[userid].downwin, fec);
+	window_in_fec(users[userid].upwin, fec > 0);
+	return 0;
+}
+
+int user_held_max(int userid)
+/* How many older queries may be held besides users[].q. The client
+   never has more than its window outstanding, nor needs to. */
+{
+	if (userid < 0 || userid >= usercount)
+		return 0;
+
+	if (!users[userid].lazy || users[userid].downwin->size < 2)
+		return 0;
+	return MIN(qheld_len, users[userid].downwin->size - 1);
+}
+
+int user_hold_query(int userid, struct query *q, uint64_t expires)
+/* Keep q until user_next_held() returns it, at the latest by expires.
+   Returns -1 if user_held_max() queries are held already. */
+{
+	struct tun_user *u;
+	int i;
+
+	if (userid < 0 || userid >= usercount)
+		return -1;
+
+	u = &users[userid];
+	if (u->qheld_count >= user_held_max(userid))
+		return -1;
+
+	i = (u->qheld_first + u->qheld_count) % qheld_len;
+	memcpy(&u->qheld[i].q, q, sizeof(struct query));
+	u->qheld[i].expires = expires;
+	u->qheld_count++;
+	return 0;
+}
+
+int user_next_held(int userid, struct query *q)
+/* Oldest held query into q. Returns 0 if none is held. */
+{
+	struct tun_user *u;
+
+	if (userid < 0 || userid >= usercount)
+		return 0;
+
+	u = &users[userid];
+	if (u->qheld_count == 0)
+		return 0;
+
+	memcpy(q, &u->qheld[u->qheld_first].q, sizeof(struct query));
+	u->qheld_first = (u->qheld_first + 1) % qheld_len;
+	u->qheld_count--;
+	return 1;
+}
+
+uint64_t user_held_expires(int userid)
+/* When the oldest held query must be answered, 0 if none is held */
+{
+	struct tun_user *u;
+
+	if (userid < 0 || userid >= usercount)
+		return 0;
+
+	u = &users[userid];
+	if (u->qheld_count == 0)
+		return 0;
+	return u->qheld[u->qheld_first].expires;
+}
+
 void user_set_conn_type(int userid, enum connection c)
 {
 	if (userid < 0 || userid >= usercount)
@@ -178,5 +494,45 @@ void user_set_conn_type(int userid, enum connection c)
 		return;
 
 	users[userid].conn = c;
+	user_update_pending(userid);
 }
 
+
+void user_packet_release(struct user_packet *p)
+/* Drop the packet and give its buffer back to the pool */
+{
+	pktbuf_put(p->data);
+	p->data = NULL;
+	p->len = 0;
+	p->sentlen = 0;
+	p->offset = 0;
+	p->dropped = 0;
+}
+
+void user_release_packets(int userid)
+{
+	int fec;
+#ifdef OUTPACKETQ_LEN
+	int i;
+#endif
+
+	if (userid < 0 || userid >= usercount)
+		return;
+
+	user_packet_release(&users[userid].inpacket);
+	user_packet_release(&users[userid].outpacket);
+	fec = users[userid].downwin->fec;
+	window_release(users[userid].downwin);
+	window_out_init(users[userid].downwin, users[userid].downwin->size);
+	window_out_fec(users[userid].downwin, fec);
+	window_in_clear(users[userid].upwin);
+	users[userid].qheld_first = 0;
+	users[userid].qheld_count = 0;
+#ifdef OUTPACKETQ_LEN
+	for (i = 0; i < outpacketq_len; i++)
+		user_packet_release(&users[userid].outpacketq[i]);
+	users[userid].outpacketq_nexttouse = 0;
+	users[userid].outpacketq_filled = 0;
+#endif
+	user_update_pending(userid);
+}
@@ -18,73 +18,167 @@
 #ifndef __USER_H__
 #define __USER_H__
 
+/* The defines below are the defaults, iodined can change the sizes at
+   startup by setting the variables below before calling init_users(). */
+
 #define USERS 16
+#define USERS_MAX 512
+/* The user id is sent as a hex char and a Base32 char, 9 bits */
 
-#define OUTPACKETQ_LEN 4		/* Note: 16 users * 1 packet = 1MB */
+#define OUTPACKETQ_LEN 4		/* Buffers come from the pktbuf pool */
+#define OUTPACKETQ_MAX 1024
 /* Undefine to have no queue for packets coming in from tun device, which may
    lead to massive dropping in multi-user situations with high traffic. */
 
 #define DNSCACHE_LEN 4
+#define DNSCACHE_MAX 18
 /* Undefine to disable. Should be less than 18; also see comments in iodined.c */
 
 
 #define QMEMPING_LEN 30
-/* Max advisable: 64k/2 = 32000. Total mem usage: QMEMPING_LEN * USERS * 6 bytes */
+#define QMEMPING_MAX 32000
+/* Max advisable: 64k/2 = 32000. Total mem usage: qmemping_len * users * 6 bytes */
 
 #define QMEMDATA_LEN 15
-/* Max advisable: 36/2 = 18. Total mem usage: QMEMDATA_LEN * USERS * 6 bytes */
+#define QMEMDATA_MAX 18
+/* Max advisable: 36/2 = 18. Total mem usage: qmemdata_len * users * 6 bytes */
+
+#define QHELD_LEN 8
+#define QHELD_MAX 15
+/* Older lazy mode queries held per user besides q, for clients with a
+   downstream window. At most the window size less one are used. */
+
+#define USER_TIMEOUT 60000
+/* Milliseconds without packets before a user is considered gone */
+
+/* Like struct packet, but data is a pktbuf that is only held while
+   the packet is in use. */
+struct user_packet {
+	int len;		/* Total packet length */
+	int sentlen;		/* Length of chunk currently transmitted */
+	int offset;		/* Current offset */
+	char *data;		/* pktbuf or NULL, at most USER_PACKET_LEN */
+	char seqno;		/* The packet sequence number */
+	char fragment;		/* Fragment index */
+	char compressed;	/* data is compressed with the user's compressor */
+	char dropped;		/* lost data, discarded when complete */
+};
+
+#define USER_PACKET_LEN (64*1024)
+
+/* Lazy mode query waiting for data, answered without after expires */
+struct held_query {
+	struct query q;
+	uint64_t expires;		/* clock_ms() */
+};
 
 struct tun_user {
-	char id;
+	/* Fields used when looping over all users first, so that a scan
+	   only touches the start of each entry. Packet data lives in
+	   the pktbuf pool, the DNS cache is allocated by init_users(). */
 	int active;
+	int disabled;
 	int authenticated;
+	enum connection conn;
+	in_addr_t tun_ip;
+#ifdef OUTPACKETQ_LEN
+	int outpacketq_filled;
+#endif
+	char open;			/* active and not disabled */
+	char pending;			/* open, and no room for tun packets */
+	uint64_t last_pkt;		/* clock_ms() of last packet */
+	struct user_packet outpacket;
+
+	int id;
 	int authenticated_raw;
-	int disabled;
-	time_t last_pkt;
+	struct timer expire;		/* sets active = 0 after USER_TIMEOUT */
+	struct timer idle;		/* pending while not idle, with -i */
 	int seed;
-	in_addr_t tun_ip;
 	struct sockaddr_storage host;
 	socklen_t hostlen;
 	struct query q;
+	struct timer q_timer;		/* lazy mode hold deadline for q */
 	struct query q_sendrealsoon;
-	int q_sendrealsoon_new;
-	struct packet inpacket;
-	struct packet outpacket;
+	struct timer realsoon_timer;	/* when to answer q_sendrealsoon */
+	struct held_query *qheld;	/* [qheld_len] ring, oldest first */
+	int qheld_first;
+	int qheld_count;
+	struct timer qheld_timer;	/* deadline of the oldest one */
+	struct user_packet inpacket;
 	int outfragresent;
 	const struct encoder *encoder;
 	char downenc;
+	const struct compressor *upcomp;
+	const struct compressor *downcomp;	/* also read by tun thread */
+	int downlevel;				/* downctl.level, for tun thread */
+	struct compress_ctl downctl;
+	struct compress_stream *zstream;	/* with stream compressors, DNS only */
+	const struct compress_dict *dict;	/* also read by tun thread */
+	int hdrcomp;				/* also read by tun thread */
+	unsigned vjgen;				/* bumped to reset vjdown */
+	struct vj_comp *vjdown;			/* used by whoever reads tun */
+	struct vj_decomp *vjup;
+	int bundle;				/* takes several packets in one */
+	struct window_out *downwin;		/* size 0 unless the client asked */
+	struct window_in *upwin;
+	int upwindow;				/* client sends with a window */
 	int out_acked_seqno;
 	int out_acked_fragment;
 	int fragsize;
-	enum connection conn;
 	int lazy;
-	unsigned char qmemping_cmc[QMEMPING_LEN * 4];
-	unsigned short qmemping_type[QMEMPING_LEN];
+	unsigned char *qmemping_cmc;		/* [qmemping_len * 4] */
+	unsigned short *qmemping_type;		/* [qmemping_len] */
 	int qmemping_lastfilled;
-	unsigned char qmemdata_cmc[QMEMDATA_LEN * 4];
-	unsigned short qmemdata_type[QMEMDATA_LEN];
+	unsigned char *qmemdata_cmc;		/* [qmemdata_len * 4] */
+	unsigned short *qmemdata_type;		/* [qmemdata_len] */
 	int qmemdata_lastfilled;
 #ifdef OUTPACKETQ_LEN
-	struct packet outpacketq[OUTPACKETQ_LEN];
+	struct user_packet *outpacketq;		/* [outpacketq_len] */
 	int outpacketq_nexttouse;
-	int outpacketq_filled;
 #endif
 #ifdef DNSCACHE_LEN
-	struct query dnscache_q[DNSCACHE_LEN];
-	char dnscache_answer[DNSCACHE_LEN][4096];
-	int dnscache_answerlen[DNSCACHE_LEN];
+	struct query *dnscache_q;		/* [dnscache_len] */
+	char (*dnscache_answer)[4096];		/* [dnscache_len] */
+	int *dnscache_answerlen;		/* [dnscache_len] */
 	int dnscache_lastfilled;
 #endif
 };
 
 extern struct tun_user *users;
 
+extern int max_users;
+#ifdef OUTPACKETQ_LEN
+extern int outpacketq_len;
+#endif
+#ifdef DNSCACHE_LEN
+extern int dnscache_len;
+#endif
+extern int qmemping_len;
+extern int qmemdata_len;
+extern int qheld_len;
+
 int init_users(in_addr_t, int);
+size_t users_memsize(void);
 const char* users_get_first_ip(void);
+int user_slot_by_ip(uint32_t);
 int find_user_by_ip(uint32_t);
+void user_update_pending(int userid);
 int all_users_waiting_to_send(void);
-int find_available_user(void);
+int find_available_user(int first, int step);
 void user_switch_codec(int userid, const struct encoder *enc);
+void user_switch_compression(int userid, const struct compressor *up,
+			     const struct compressor *down, int downlevel);
+void user_switch_dict(int userid, const struct compress_dict *dict);
+void user_switch_hdrcomp(int userid, int on);
+void user_reset_hdrcomp(int userid);
+void user_switch_window(int userid, int down, int up);
+int user_switch_fec(int userid, int fec);
+int user_held_max(int userid);
+int user_hold_query(int userid, struct query *q, uint64_t expires);
+int user_next_held(int userid, struct query *q);
+uint64_t user_held_expires(int userid);
 void user_set_conn_type(int userid, enum connection c);
+void user_packet_release(struct user_packet *p);
+void user_release_packets(int userid);
 
 #endif
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vj.h"
+
+#define TUN_HDR 4
+
+/* Offsets in the IPv4 and TCP headers */
+#define IP_LEN 2
+#define IP_ID 4
+#define IP_FRAG 6
+#define IP_PROTO 9
+#define IP_SUM 10
+#define IP_SRC 12
+#define TCP_SEQ 4
+#define TCP_ACK 8
+#define TCP_OFF 12
+#define TCP_FLAGS 13
+#define TCP_WIN 14
+#define TCP_SUM 16
+
+#define TH_FIN 0x01
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_PUSH 0x08
+#define TH_ACK 0x10
+#define TH_URG 0x20
+
+#define VARINT_MAX 0x200000
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned
+get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void
+put16(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static uint32_t
+sum16(uint32_t sum, const unsigned char *p, int len)
+{
+	while (len > 1) {
+		sum += get16(p);
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += p[0] << 8;
+	return sum;
+}
+
+static unsigned
+fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static int
+put_varint(unsigned char *p, uint32_t v)
+/* 7, 14 or 21 bits, the top bits of the first byte give the length */
+{
+	if (v < 0x80) {
+		p[0] = v;
+		return 1;
+	}
+	if (v < 0x4000) {
+		p[0] = 0x80 | (v >> 8);
+		p[1] = v;
+		return 2;
+	}
+	p[0] = 0xc0 | (v >> 16);
+	p[1] = v >> 8;
+	p[2] = v;
+	return 3;
+}
+
+static int
+get_varint(const unsigned char **p, const unsigned char *end, uint32_t *v)
+{
+	const unsigned char *q = *p;
+
+	if (q >= end)
+		return -1;
+	if (q[0] < 0x80) {
+		*v = q[0];
+		*p = q + 1;
+	} else if (q[0] < 0xc0) {
+		if (q + 2 > end)
+			return -1;
+		*v = ((q[0] & 0x3f) << 8) | q[1];
+		*p = q + 2;
+	} else {
+		if (q + 3 > end || q[0] >= 0xe0)
+			return -1;
+		*v = ((q[0] & 0x1f) << 16) | (q[1] << 8) | q[2];
+		*p = q + 3;
+	}
+	return 0;
+}
+
+static int
+parse_tcp(const unsigned char *ip, unsigned long len, int *iplen, int *hdrlen,
+	  int *tsoff)
+/* Headers of an unfragmented IPv4 TCP packet carrying only data and acks,
+   -1 for anything else */
+{
+	const unsigned char *tcp;
+	int ihl;
+	int i;
+
+	if (len < 40 || (ip[0] >> 4) != 4 || ip[IP_PROTO] != 6)
+		return -1;
+	ihl = (ip[0] & 0x0f) * 4;
+	if (ihl < 20 || get16(ip + IP_LEN) != len ||
+	    (get16(ip + IP_FRAG) & 0x3fff))
+		return -1;
+	if ((unsigned long) ihl + 20 > len)
+		return -1;
+	tcp = ip + ihl;
+	if ((tcp[TCP_FLAGS] & (TH_FIN | TH_SYN | TH_RST | TH_URG | TH_ACK))
+	    != TH_ACK)
+		return -1;
+	*iplen = ihl;
+	*hdrlen = ihl + (tcp[TCP_OFF] >> 4) * 4;
+	if (*hdrlen < ihl + 20 || (unsigned long) *hdrlen > len || *hdrlen > VJ_MAX_HDR)
+		return -1;
+
+	/* Timestamps change in every packet, find them */
+	*tsoff = 0;
+	for (i = ihl + 20; i < *hdrlen; ) {
+		if (ip[i] == 0)
+			break;
+		if (ip[i] == 1) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= *hdrlen || ip[i + 1] < 2 || i + ip[i + 1] > *hdrlen)
+			break;
+		if (ip[i] == 8 && ip[i + 1] == 10) {
+			*tsoff = i + 2;
+			break;
+		}
+		i += ip[i + 1];
+	}
+	return 0;
+}
+
+static int
+same_flow(const struct vj_slot *s, const unsigned char *ip, int iplen)
+{
+	return s->hdrlen && s->iplen == iplen &&
+		memcmp(s->hdr + IP_SRC, ip + IP_SRC, 8) == 0 &&
+		memcmp(s->hdr + s->iplen, ip + iplen, 4) == 0;
+}
+
+static int
+same_fields(const struct vj_slot *s, const unsigned char *ip, int hdrlen,
+	    int tsoff)
+/* Whether the header matches the last one except for what a delta
+   packet can carry */
+{
+	const unsigned char *old = s->hdr;
+	int tcp = s->iplen;
+
+	if (s->hdrlen != hdrlen || s->tsoff != tsoff)
+		return 0;
+	/* Version to TOS, fragment field to protocol, addresses, options */
+	if (memcmp(old, ip, 2) || memcmp(old + IP_FRAG, ip + IP_FRAG, 4) ||
+	    memcmp(old + IP_SRC, ip + IP_SRC, s->iplen - IP_SRC))
+		return 0;
+	/* Ports, data offset, flags besides push, urgent pointer */
+	if (memcmp(old + tcp, ip + tcp, 4) ||
+	    old[tcp + TCP_OFF] != ip[tcp + TCP_OFF] ||
+	    (old[tcp + TCP_FLAGS] & ~TH_PUSH) != (ip[tcp + TCP_FLAGS] & ~TH_PUSH) ||
+	    memcmp(old + tcp + 18, ip + tcp + 18, 2))
+		return 0;
+	if (tsoff) {
+		if (memcmp(old + tcp + 20, ip + tcp + 20, tsoff - tcp - 20) ||
+		    memcmp(old + tsoff + 8, ip + tsoff + 8, hdrlen - tsoff - 8))
+			return 0;
+	} else if (memcmp(old + tcp + 20, ip + tcp + 20, hdrlen - tcp - 20)) {
+		return 0;
+	}
+	return 1;
+}
+
+void
+vj_comp_init(struct vj_comp *c, unsigned gen)
+{
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < VJ_SLOTS; i++)
+		c->lru[i] = i;
+	c->last = -1;
+	c->gen = gen;
+}
+
+void
+vj_decomp_init(struct vj_decomp *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->last = -1;
+}
+
+static void
+lru_touch(struct vj_comp *c, int pos)
+{
+	unsigned char n = c->lru[pos];
+
+	memmove(c->lru + 1, c->lru, pos);
+	c->lru[0] = n;
+}
+
+int
+vj_compress(struct vj_comp *c, char *out, unsigned long *outlen,
+	    const char *in, unsigned long inlen)
+/* Tun packet in, packet for the peer's vj_uncompress() out. Returns 1 if
+   out was filled, 0 if in should be sent as it is. */
+{
+	const unsigned char *ip = (const unsigned char *) in + TUN_HDR;
+	unsigned char *o = (unsigned char *) out;
+	struct vj_slot *s;
+	unsigned long len;
+	uint32_t dseq, dack, dts, dtsecr;
+	unsigned dwin, did;
+	int iplen, hdrlen, tsoff;
+	int tcp;
+	int pos;
+	int n;
+
+	if (inlen <= TUN_HDR || in[0] != VJ_TYPE_PLAIN)
+		return 0;
+	len = inlen - TUN_HDR;
+	if (parse_tcp(ip, len, &iplen, &hdrlen, &tsoff) < 0)
+		return 0;
+
+	for (pos = 0; pos < VJ_SLOTS; pos++) {
+		if (same_flow(&c->slot[c->lru[pos]], ip, iplen))
+			break;
+	}
+	if (pos == VJ_SLOTS)
+		pos = VJ_SLOTS - 1;	/* new flow, reuse the oldest */
+	lru_touch(c, pos);
+	n = c->lru[0];
+	s = &c->slot[n];
+	tcp = iplen;
+
+	if (!same_flow(s, ip, iplen) || !same_fields(s, ip, hdrlen, tsoff))
+		goto full;
+
+	dseq = get32(ip + tcp + TCP_SEQ) - get32(s->hdr + tcp + TCP_SEQ);
+	dack = get32(ip + tcp + TCP_ACK) - get32(s->hdr + tcp + TCP_ACK);
+	dwin = (get16(ip + tcp + TCP_WIN) - get16(s->hdr + tcp + TCP_WIN)) & 0xffff;
+	did = (get16(ip + IP_ID) - get16(s->hdr + IP_ID)) & 0xffff;
+	dts = dtsecr = 0;
+	if (tsoff) {
+		dts = get32(ip + tsoff) - get32(s->hdr + tsoff);
+		dtsecr = get32(ip + tsoff + 4) - get32(s->hdr + tsoff + 4);
+	}
+	if (dseq >= VARINT_MAX || dack >= VARINT_MAX ||
+	    dts >= VARINT_MAX || dtsecr >= VARINT_MAX)
+		goto full;
+	/* Retransmits and duplicate acks are sent in full, so a peer that
+	   lost a packet gets back in sync as soon as TCP notices */
+	if (dseq == 0 && (len > (unsigned long) hdrlen || dack == 0))
+		goto full;
+	/* Worst case: flags, slot, checksum and 7 deltas of 3 bytes */
+	if (*outlen < 4 + 21 + len - hdrlen)
+		return 0;
+
+	o[0] = VJ_TYPE_DELTA;
+	pos = 1;
+	if (n != c->last) {
+		o[0] |= VJ_NEW_SLOT;
+		o[pos++] = n;
+	}
+	o[pos++] = ip[tcp + TCP_SUM];
+	o[pos++] = ip[tcp + TCP_SUM + 1];
+	if (ip[tcp + TCP_FLAGS] & TH_PUSH)
+		o[0] |= VJ_PUSH;
+	if (dwin) {
+		o[0] |= VJ_WIN;
+		pos += put_varint(o + pos, dwin);
+	}
+	if (dack) {
+		o[0] |= VJ_ACK;
+		pos += put_varint(o + pos, dack);
+	}
+	if (dseq) {
+		o[0] |= VJ_SEQ;
+		pos += put_varint(o + pos, dseq);
+	}
+	if (did != 1) {
+		o[0] |= VJ_IPID;
+		pos += put_varint(o + pos, did);
+	}
+	if (dts || dtsecr) {
+		o[0] |= VJ_TSTAMP;
+		pos += put_varint(o + pos, dts);
+		pos += put_varint(o + pos, dtsecr);
+	}
+	memcpy(o + pos, ip + hdrlen, len - hdrlen);
+	*outlen = pos + len - hdrlen;
+	memcpy(s->hdr, ip, hdrlen);
+	c->last = n;
+	return 1;
+
+full:
+	if (*outlen < 2 + len)
+		return 0;
+	o[0] = VJ_TYPE_FULL;
+	o[1] = n;
+	memcpy(o + 2, ip, len);
+	*outlen = 2 + len;
+	memcpy(s->hdr, ip, hdrlen);
+	s->hdrlen = hdrlen;
+	s->iplen = iplen;
+	s->tsoff = tsoff;
+	c->last = n;
+	return 1;
+}
+
+static int
+tcp_sum_ok(const unsigned char *ip, int iplen, unsigned long len)
+{
+	unsigned char pseudo[12];
+
+	memcpy(pseudo, ip + IP_SRC, 8);
+	pseudo[8] = 0;
+	pseudo[9] = 6;
+	put16(pseudo + 10, len - iplen);
+	return fold(sum16(sum16(0, pseudo, 12), ip + iplen, len - iplen))
+		== 0xffff;
+}
+
+int
+vj_uncompress(struct vj_decomp *d, char *out, unsigned long *outlen,
+	      const char *in, unsigned long inlen)
+/* Packet from vj_compress() in, tun packet out. Returns 1 if out was
+   filled, 0 if in is a tun packet already and -1 if it has to be dropped. */
+{
+	const unsigned char *p = (const unsigned char *) in;
+	const unsigned char *end = p + inlen;
+	unsigned char *ip = (unsigned char *) out + TUN_HDR;
+	struct vj_slot *s;
+	uint32_t v;
+	uint32_t ts;
+	unsigned long len;
+	unsigned flags;
+	int iplen, hdrlen, tsoff;
+	int tcp;
+	int n;
+
+	if (inlen == 0)
+		return -1;
+	if (p[0] == VJ_TYPE_PLAIN)
+		return 0;
+
+	if (p[0] == VJ_TYPE_FULL) {
+		if (inlen < 2 || p[1] >= VJ_SLOTS)
+			return -1;
+		len = inlen - 2;
+		if (*outlen < TUN_HDR + len ||
+		    parse_tcp(p + 2, len, &iplen, &hdrlen, &tsoff) < 0)
+			return -1;
+		s = &d->slot[p[1]];
+		memcpy(s->hdr, p + 2, hdrlen);
+		s->hdrlen = hdrlen;
+		s->iplen = iplen;
+		s->tsoff = tsoff;
+		d->last = p[1];
+		memset(out, 0, TUN_HDR);
+		memcpy(ip, p + 2, len);
+		*outlen = TUN_HDR + len;
+		return 1;
+	}
+
+	flags = *p++;
+	if (!(flags & VJ_TYPE_DELTA))
+		return -1;
+	n = d->last;
+	if (flags & VJ_NEW_SLOT) {
+		if (p >= end)
+			return -1;
+		n = *p++;
+	}
+	if (n < 0 || n >= VJ_SLOTS || !d->slot[n].hdrlen || p + 2 > end ||
+	    *outlen < (unsigned long) TUN_HDR + d->slot[n].hdrlen)
+		return -1;
+	s = &d->slot[n];
+	tcp = s->iplen;
+	hdrlen = s->hdrlen;
+	memcpy(ip, s->hdr, hdrlen);
+	ip[tcp + TCP_SUM] = *p++;
+	ip[tcp + TCP_SUM + 1] = *p++;
+	if (flags & VJ_PUSH)
+		ip[tcp + TCP_FLAGS] |= TH_PUSH;
+	else
+		ip[tcp + TCP_FLAGS] &= ~TH_PUSH;
+	if (flags & VJ_WIN) {
+		if (get_varint(&p, end, &v) < 0)
+			return -1;
+		put16(ip + tcp + TCP_WIN, get16(ip + tcp + TCP_WIN) + v);
+	}
+	if (flags & VJ_ACK) {
+		if (get_varint(&p, end, &v) < 0)
+			return -1;
+		put32(ip + tcp + TCP_ACK, get32(ip + tcp + TCP_ACK) + v);
+	}
+	if (flags & VJ_SEQ) {
+		if (get_varint(&p, end, &v) < 0)
+			return -1;
+		put32(ip + tcp + TCP_SEQ, get32(ip + tcp + TCP_SEQ) + v);
+	}
+	v = 1;
+	if ((flags & VJ_IPID) && get_varint(&p, end, &v) < 0)
+		return -1;
+	put16(ip + IP_ID, get16(ip + IP_ID) + v);
+	if (flags & VJ_TSTAMP) {
+		if (!s->tsoff || get_varint(&p, end, &ts) < 0 ||
+		    get_varint(&p, end, &v) < 0)
+			return -1;
+		put32(ip + s->tsoff, get32(ip + s->tsoff) + ts);
+		put32(ip + s->tsoff + 4, get32(ip + s->tsoff + 4) + v);
+	}
+
+	len = hdrlen + (end - p);
+	if (*outlen < TUN_HDR + len || len > 0xffff)
+		return -1;
+	memcpy(ip + hdrlen, p, end - p);
+	put16(ip + IP_LEN, len);
+	ip[IP_SUM] = ip[IP_SUM + 1] = 0;
+	put16(ip + IP_SUM, ~fold(sum16(0, ip, tcp)) & 0xffff);
+
+	/* A lost packet leaves the deltas applied to the wrong base */
+	if (!tcp_sum_ok(ip, tcp, len))
+		return -1;
+
+	memcpy(s->hdr, ip, hdrlen);
+	d->last = n;
+	memset(out, 0, TUN_HDR);
+	*outlen = TUN_HDR + len;
+	return 1;
+}
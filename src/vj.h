@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __VJ_H__
+#define __VJ_H__
+
+/* TCP/IP header compression in the style of Van Jacobson (RFC 1144),
+   done on tun packets before they are compressed. Each end remembers
+   the last headers of up to VJ_SLOTS TCP connections and sends only
+   what changed, see doc/proto_00000503.txt.
+
+   A lost packet leaves the receiver with stale headers. Rebuilt packets
+   are checked against the TCP checksum and dropped if wrong; TCP then
+   retransmits, which is always sent with full headers. */
+
+#define VJ_SLOTS 16
+#define VJ_MAX_HDR 120		/* IPv4 and TCP headers with options */
+
+/* First byte of a packet; plain packets keep the tun header, which
+   always starts with a zero byte */
+#define VJ_TYPE_PLAIN 0x00
+#define VJ_TYPE_FULL 0x01	/* then slot number and IP packet */
+#define VJ_TYPE_DELTA 0x80	/* with the change flags below */
+
+#define VJ_NEW_SLOT 0x40
+#define VJ_IPID 0x20
+#define VJ_PUSH 0x10
+#define VJ_SEQ 0x08
+#define VJ_ACK 0x04
+#define VJ_WIN 0x02
+#define VJ_TSTAMP 0x01
+
+struct vj_slot {
+	unsigned char hdr[VJ_MAX_HDR];
+	int hdrlen;		/* 0 if unused */
+	int iplen;		/* IP header part of hdr */
+	int tsoff;		/* offset of TSval in hdr, 0 if none */
+};
+
+struct vj_comp {
+	struct vj_slot slot[VJ_SLOTS];
+	unsigned char lru[VJ_SLOTS];	/* slot numbers, most recent first */
+	int last;			/* slot of the previous packet */
+	unsigned gen;			/* owner's reset counter */
+};
+
+struct vj_decomp {
+	struct vj_slot slot[VJ_SLOTS];
+	int last;
+};
+
+void vj_comp_init(struct vj_comp *c, unsigned gen);
+void vj_decomp_init(struct vj_decomp *d);
+int vj_compress(struct vj_comp *c, char *out, unsigned long *outlen,
+		const char *in, unsigned long inlen);
+int vj_uncompress(struct vj_decomp *d, char *out, unsigned long *outlen,
+		  const char *in, unsigned long inlen);
+
+#endif /* __VJ_H__ */
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "window.h"
+
+#define SLOT(seq) ((seq) & (WINDOW_MAX - 1))
+#define SEQ(seq) ((seq) & (WINDOW_SEQ - 1))
+#define KEEP(seq) ((seq) & (WINDOW_KEEP - 1))
+
+/* FEC byte in front of each fragment: parity flag and group size, or
+   for data whether the parity of its group follows */
+#define FEC_PARITY 0x80
+#define FEC_CLOSES 0x40
+#define FEC_GROUP 0x1f
+
+void
+window_out_init(struct window_out *w, int size)
+{
+	memset(w, 0, sizeof(*w));
+	if (size > WINDOW_MAX)
+		size = WINDOW_MAX;
+	w->size = size;
+}
+
+void
+window_out_fec(struct window_out *w, int fec)
+/* Follow every fec data fragments, and the last of each packet longer
+   than one fragment, with a parity fragment. 0 for none; FEC needs a
+   window of at least 2. */
+{
+	if (fec > WINDOW_MAX)
+		fec = WINDOW_MAX;
+	if (fec < 0 || w->size < 2)
+		fec = 0;
+	w->fec = fec;
+	w->group = 0;
+	w->group_len = 0;
+	memset(w->acc, 0, sizeof(w->acc));
+}
+
+int
+window_out_space(const struct window_out *w)
+/* Whether another data fragment can be added. With FEC, one slot stays
+   free for the parity of the open group, which must go in first. */
+{
+	if (w->fec)
+		return !window_out_parity(w) && w->count < w->size - 1;
+	return w->count < w->size;
+}
+
+static void
+group_add(struct window_out *w, const char *data, int len,
+	  int compressed, int last)
+/* Add a data fragment to the parity of the open group */
+{
+	int i;
+
+	w->acc[0] ^= (len >> 8) & 0xff;
+	w->acc[1] ^= len & 0xff;
+	for (i = 0; i < len; i++)
+		w->acc[2 + i] ^= data[i];
+	if (len > w->group_len)
+		w->group_len = len;
+	w->group++;
+	w->group_compressed = compressed;
+	w->group_last = last;
+}
+
+int
+window_out_add(struct window_out *w, char *data, int offset, int len,
+	       int compressed, int last)
+/* Put a new fragment at the end of the window. Returns its number,
+   or -1 if the window is full. */
+{
+	struct window_frag *f;
+	int seq;
+
+	if (!window_out_space(w))
+		return -1;
+
+	seq = SEQ(w->base + w->count);
+	f = &w->frag[SLOT(seq)];
+	memset(f, 0, sizeof(*f));
+	f->data = data;
+	f->offset = offset;
+	f->len = len;
+	f->compressed = compressed;
+	f->last = last;
+	/* A packet of one fragment gets no parity, that would be a copy */
+	if (w->fec && (w->group || !last)) {
+		group_add(w, data + offset, len, compressed, last);
+		f->closes = (w->group == w->fec || last);
+	}
+	w->count++;
+	return seq;
+}
+
+static struct window_frag *
+due(const struct window_out *w, uint64_t now, int resend_ms, int *seq)
+/* The fragment to send next: one that got lost, one not acked in
+   resend_ms, or else a new one */
+{
+	const struct window_frag *f;
+	int i;
+
+	for (i = 0; i < w->count; i++) {
+		f = &w->frag[SLOT(w->base + i)];
+		if (!f->acked && f->lost)
+			goto found;
+	}
+	for (i = 0; i < w->count; i++) {
+		f = &w->frag[SLOT(w->base + i)];
+		if (!f->acked && f->sent && now - f->sent_ms >= resend_ms)
+			goto found;
+	}
+	for (i = 0; i < w->count; i++) {
+		f = &w->frag[SLOT(w->base + i)];
+		if (!f->sent)
+			goto found;
+	}
+	return NULL;
+
+found:
+	if (seq)
+		*seq = SEQ(w->base + i);
+	return (struct window_frag *) f;
+}
+
+struct window_frag *
+window_out_next(struct window_out *w, uint64_t now, int resend_ms, int *seq)
+/* Fragment to send now and its number, or NULL if none is due */
+{
+	struct window_frag *f;
+
+	f = due(w, now, resend_ms, seq);
+	if (!f)
+		return NULL;
+	f->sent++;
+	f->sent_ms = now;
+	f->order = ++w->sends;
+	f->lost = 0;
+	return f;
+}
+
+int
+window_out_pending(const struct window_out *w, uint64_t now, int resend_ms)
+/* Whether window_out_next() would return a fragment */
+{
+	return due(w, now, resend_ms, NULL) != NULL;
+}
+
+static void
+ack_one(struct window_out *w, int i)
+{
+	struct window_frag *f = &w->frag[SLOT(w->base + i)];
+
+	if (f->acked || !f->sent)
+		return;
+	f->acked = 1;
+	/* Wrapping is fine, orders only get compared within a window */
+	if ((int) (f->order - w->acked_order) > 0)
+		w->acked_order = f->order;
+}
+
+void
+window_out_ack(struct window_out *w, int next, unsigned bitmap)
+/* The receiver has everything before next, and bit n of bitmap set
+   if it has fragment next + 1 + n. Acks that do not fit the window
+   are old and ignored. */
+{
+	struct window_frag *f;
+	int end;
+	int i;
+
+	end = SEQ(next - w->base);
+	if (end > w->count)
+		return;
+
+	for (i = 0; i < end; i++) {
+		f = &w->frag[SLOT(w->base + i)];
+		/* A parity the receiver passed over is not needed anymore */
+		if (f->parity && !f->sent)
+			f->acked = 1;
+		ack_one(w, i);
+	}
+	for (i = end + 1; i < w->count && bitmap; i++, bitmap >>= 1) {
+		if (bitmap & 1)
+			ack_one(w, i);
+	}
+
+	/* Whatever was sent before an acked fragment was lost */
+	for (i = 0; i < w->count; i++) {
+		f = &w->frag[SLOT(w->base + i)];
+		if (!f->acked && f->sent &&
+		    (int) (f->order - w->acked_order) < 0)
+			f->lost = 1;
+	}
+}
+
+int
+window_out_pop(struct window_out *w, struct window_frag *frag)
+/* Take the oldest fragment out of the window if it was acked.
+   Returns 1 if frag was filled. */
+{
+	struct window_frag *f;
+
+	if (w->count == 0)
+		return 0;
+	f = &w->frag[SLOT(w->base)];
+	if (!f->acked)
+		return 0;
+	*frag = *f;
+	f->data = NULL;
+	w->base = SEQ(w->base + 1);
+	w->count--;
+	return 1;
+}
+
+int
+window_out_drop(struct window_out *w, struct window_frag *frag)
+/* Take the oldest fragment out of the window, acked or not.
+   Returns 1 if frag was filled. */
+{
+	if (w->count == 0)
+		return 0;
+	w->frag[SLOT(w->base)].acked = 1;
+	return window_out_pop(w, frag);
+}
+
+int
+window_out_seq(const struct window_out *w)
+/* Number the next new fragment will get */
+{
+	return SEQ(w->base + w->count);
+}
+
+int
+window_out_parity(const struct window_out *w)
+/* Length of the parity fragment due for the group just completed, or 0.
+   It goes in with window_out_add_parity(). */
+{
+	if (!w->fec || !w->group)
+		return 0;
+	if (w->group < w->fec && !w->group_last)
+		return 0;
+	return 2 + w->group_len;
+}
+
+int
+window_out_add_parity(struct window_out *w, char *data)
+/* Put the parity fragment that is due at the end of the window, built in
+   data, which has room for window_out_parity() bytes. Returns its number,
+   or -1 if none is due. */
+{
+	struct window_frag *f;
+	int len;
+	int seq;
+
+	len = window_out_parity(w);
+	if (!len || w->count >= w->size)
+		return -1;
+
+	memcpy(data, w->acc, len);
+	seq = SEQ(w->base + w->count);
+	f = &w->frag[SLOT(seq)];
+	memset(f, 0, sizeof(*f));
+	f->data = data;
+	f->len = len;
+	f->compressed = w->group_compressed;
+	f->last = w->group_last;
+	f->parity = w->group;
+	w->count++;
+
+	memset(w->acc, 0, len);
+	w->group = 0;
+	w->group_len = 0;
+	return seq;
+}
+
+int
+window_out_copy(const struct window_out *w, const struct window_frag *f,
+		char *buf)
+/* Put f in buf as it is sent after the header, returns its length */
+{
+	int n = 0;
+
+	if (w->fec) {
+		if (f->parity)
+			buf[n++] = FEC_PARITY | f->parity;
+		else
+			buf[n++] = f->closes ? FEC_CLOSES : 0;
+	}
+	memcpy(buf + n, f->data + f->offset, f->len);
+	return n + f->len;
+}
+
+static char *
+slot_data(const struct window_in *w, int seq)
+{
+	/* Parity fragments are 2 bytes longer than data */
+	return w->data + KEEP(seq) * (w->fragmax + 2);
+}
+
+static int
+has(const struct window_in *w, int seq)
+/* Whether fragment seq has arrived and is not delivered yet */
+{
+	int slot = KEEP(seq);
+
+	return w->frag[slot].len && !w->frag[slot].done &&
+		w->frag[slot].seq == seq;
+}
+
+static int
+kept(const struct window_in *w, int seq)
+/* Whether fragment seq was delivered and its data is still there */
+{
+	int slot = KEEP(seq);
+
+	return w->frag[slot].len && w->frag[slot].done &&
+		w->frag[slot].seq == seq;
+}
+
+static void
+rebuild_one(struct window_in *w, int parity, int missing)
+/* Rebuild fragment missing from the parity fragment of its group */
+{
+	int group = w->frag[KEEP(parity)].parity;
+	const char *in = slot_data(w, parity);
+	char *out = slot_data(w, missing);
+	int datalen;
+	int len;
+	int seq;
+	int i;
+	int j;
+
+	len = ((in[0] & 0xff) << 8) | (in[1] & 0xff);
+	datalen = w->frag[KEEP(parity)].len - 2;
+	memcpy(out, in + 2, datalen);
+	for (i = 1; i <= group; i++) {
+		seq = SEQ(parity - i);
+		if (seq == missing)
+			continue;
+		if (w->frag[KEEP(seq)].len > datalen)
+			return;
+		len ^= w->frag[KEEP(seq)].len;
+		in = slot_data(w, seq);
+		for (j = 0; j < w->frag[KEEP(seq)].len; j++)
+			out[j] ^= in[j];
+	}
+	if (len <= 0 || len > datalen || len > w->fragmax)
+		return;
+
+	w->frag[KEEP(missing)].len = len;
+	w->frag[KEEP(missing)].seq = missing;
+	w->frag[KEEP(missing)].compressed = w->frag[KEEP(parity)].compressed;
+	w->frag[KEEP(missing)].parity = 0;
+	w->frag[KEEP(missing)].closes = (missing == SEQ(parity - 1));
+	w->frag[KEEP(missing)].last = (missing == SEQ(parity - 1)) &&
+		w->frag[KEEP(parity)].last;
+	w->frag[KEEP(missing)].done = 0;
+	w->rebuilt++;
+}
+
+static void
+rebuild(struct window_in *w)
+/* Rebuild the fragments that are the only ones missing from a group
+   whose parity fragment has arrived */
+{
+	int missing;
+	int parity;
+	int seq;
+	int i;
+	int j;
+
+	for (i = 0; i < WINDOW_MAX; i++) {
+		parity = SEQ(w->next + i);
+		if (!has(w, parity) || !w->frag[KEEP(parity)].parity)
+			continue;
+
+		missing = -1;
+		for (j = 1; j <= w->frag[KEEP(parity)].parity; j++) {
+			seq = SEQ(parity - j);
+			if (SEQ(seq - w->next) >= WINDOW_MAX) {
+				/* Delivered already */
+				if (!kept(w, seq))
+					break;
+			} else if (!has(w, seq)) {
+				if (missing >= 0)
+					break;
+				missing = seq;
+			}
+		}
+		if (j > w->frag[KEEP(parity)].parity && missing >= 0)
+			rebuild_one(w, parity, missing);
+	}
+}
+
+void
+window_in_init(struct window_in *w, char *data, int fragmax)
+/* data has WINDOW_IN_SIZE(fragmax) bytes */
+{
+	w->data = data;
+	w->fragmax = fragmax;
+	w->fec = 0;
+	w->rebuilt = 0;
+	window_in_clear(w);
+}
+
+void
+window_in_clear(struct window_in *w)
+/* Forget all fragments and start over from number 0 */
+{
+	memset(w->frag, 0, sizeof(w->frag));
+	w->next = 0;
+	w->skip_parity = 0;
+}
+
+void
+window_in_fec(struct window_in *w, int on)
+/* Whether fragments come with FEC, see window_out_copy() */
+{
+	w->fec = on;
+	window_in_clear(w);
+}
+
+int
+window_in_put(struct window_in *w, int seq, const char *data, int len,
+	      int compressed, int last)
+/* Store a received fragment, as sent by window_out_copy(). Returns 1 if
+   it is new, 0 if it is a duplicate or outside the window. */
+{
+	int parity = 0;
+	int closes = 0;
+	int slot;
+
+	seq = SEQ(seq);
+	if (w->fec) {
+		if (len < 1)
+			return 0;
+		if (*data & FEC_PARITY) {
+			parity = *data & FEC_GROUP;
+			if (!parity)
+				return 0;
+		} else {
+			closes = (*data & FEC_CLOSES) != 0;
+		}
+		data++;
+		len--;
+	}
+	if (len <= 0 || len > w->fragmax + (parity ? 2 : 0) ||
+	    (parity && len < 3) || SEQ(seq - w->next) >= WINDOW_MAX)
+		return 0;
+	if (has(w, seq))
+		return 0;
+
+	slot = KEEP(seq);
+	memcpy(slot_data(w, seq), data, len);
+	w->frag[slot].len = len;
+	w->frag[slot].seq = seq;
+	w->frag[slot].compressed = compressed;
+	w->frag[slot].last = last;
+	w->frag[slot].parity = parity;
+	w->frag[slot].closes = closes;
+	w->frag[slot].done = 0;
+	if (w->fec)
+		rebuild(w);
+	return 1;
+}
+
+int
+window_in_get(struct window_in *w, char **data, int *len,
+	      int *compressed, int *last)
+/* Take the next data fragment in order, if it has arrived. The data stays
+   valid until the next window_in_put(). */
+{
+	int slot;
+
+	for (;;) {
+		slot = KEEP(w->next);
+		if (has(w, w->next)) {
+			if (!w->frag[slot].parity)
+				break;
+			w->frag[slot].done = 1;
+		} else if (!w->skip_parity) {
+			return 0;
+		}
+		/* Parity fragments are passed over, and not waited for
+		   once their whole group is here */
+		w->skip_parity = 0;
+		w->next = SEQ(w->next + 1);
+	}
+
+	*data = slot_data(w, w->next);
+	*len = w->frag[slot].len;
+	*compressed = w->frag[slot].compressed;
+	*last = w->frag[slot].last;
+	w->frag[slot].done = 1;
+	w->skip_parity = w->frag[slot].closes;
+	w->next = SEQ(w->next + 1);
+	return 1;
+}
+
+unsigned
+window_in_bitmap(const struct window_in *w)
+/* Bit n set if fragment next + 1 + n has arrived */
+{
+	unsigned bitmap = 0;
+	int i;
+
+	for (i = WINDOW_MAX - 1; i > 0; i--) {
+		bitmap <<= 1;
+		if (has(w, SEQ(w->next + i)))
+			bitmap |= 1;
+	}
+	return bitmap;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __WINDOW_H__
+#define __WINDOW_H__
+
+#include <stdint.h>
+
+/* Sliding window of numbered fragments with selective repeat, used for
+   data in both directions when the client asks for it, see
+   doc/proto_00000503.txt. Fragments are numbered modulo WINDOW_SEQ;
+   the receiver acks the next number it needs and a bitmap of the ones
+   after it that it already has.
+
+   With FEC, the sender follows each group of up to fec data fragments
+   of a packet with a parity fragment, the XOR of their lengths and
+   data, which lets the receiver rebuild any one of them that got lost.
+   Every fragment then starts with one byte saying which kind it is. */
+
+#define WINDOW_MAX 16		/* power of 2, below WINDOW_SEQ / 2 */
+#define WINDOW_SEQ 128		/* 7 bit fragment numbers */
+#define WINDOW_FRAG_MAX 4096	/* downstream, one DNS answer */
+#define WINDOW_UPFRAG_MAX 256	/* upstream, one hostname */
+#define WINDOW_KEEP (2 * WINDOW_MAX)	/* fragments kept by the receiver */
+#define WINDOW_FEC_OVERHEAD 3	/* FEC byte and parity length bytes */
+
+/* Receiver storage for fragments of up to fragmax bytes */
+#define WINDOW_IN_SIZE(fragmax) (WINDOW_KEEP * ((fragmax) + 2))
+
+struct window_frag {
+	char *data;		/* owned by the caller */
+	int offset;
+	int len;
+	char compressed;
+	char last;		/* last fragment of its packet */
+	char parity;		/* parity of this many before it, 0: data */
+	char closes;		/* the parity of its group follows */
+	char acked;
+	char lost;		/* something sent after it arrived first */
+	int sent;		/* times sent, 0 for new */
+	uint64_t sent_ms;
+	unsigned order;		/* when it was last sent, in sends */
+};
+
+struct window_out {
+	struct window_frag frag[WINDOW_MAX];	/* by number % WINDOW_MAX */
+	int size;		/* 0: window not in use */
+	int base;		/* number of the oldest fragment */
+	int count;		/* fragments in the window */
+	unsigned sends;
+	unsigned acked_order;	/* newest send known to have arrived */
+	int fec;		/* data fragments per parity fragment, 0: none */
+	int group;		/* data fragments in the open group */
+	int group_len;		/* longest of them */
+	char group_compressed;
+	char group_last;
+	char acc[2 + WINDOW_FRAG_MAX];	/* their lengths and data XORed */
+};
+
+struct window_in {
+	struct {
+		int len;	/* 0 if not received */
+		int seq;
+		char compressed;
+		char last;
+		char parity;
+		char closes;
+		char done;	/* delivered, data kept for parity */
+	} frag[WINDOW_KEEP];
+	char *data;		/* see WINDOW_IN_SIZE() */
+	int fragmax;
+	int next;		/* number of the next fragment to deliver */
+	int fec;		/* fragments start with the FEC byte */
+	int skip_parity;	/* the one at next is a parity not needed */
+	unsigned rebuilt;	/* fragments rebuilt from parity */
+};
+
+void window_out_init(struct window_out *w, int size);
+void window_out_fec(struct window_out *w, int fec);
+int window_out_space(const struct window_out *w);
+int window_out_add(struct window_out *w, char *data, int offset, int len,
+		   int compressed, int last);
+struct window_frag *window_out_next(struct window_out *w, uint64_t now,
+				    int resend_ms, int *seq);
+int window_out_pending(const struct window_out *w, uint64_t now, int resend_ms);
+void window_out_ack(struct window_out *w, int next, unsigned bitmap);
+int window_out_pop(struct window_out *w, struct window_frag *frag);
+int window_out_drop(struct window_out *w, struct window_frag *frag);
+int window_out_seq(const struct window_out *w);
+int window_out_parity(const struct window_out *w);
+int window_out_add_parity(struct window_out *w, char *data);
+int window_out_copy(const struct window_out *w, const struct window_frag *f,
+		    char *buf);
+
+void window_in_init(struct window_in *w, char *data, int fragmax);
+void window_in_clear(struct window_in *w);
+void window_in_fec(struct window_in *w, int on);
+int window_in_put(struct window_in *w, int seq, const char *data, int len,
+		  int compressed, int last);
+int window_in_get(struct window_in *w, char **data, int *len,
+		  int *compressed, int *last);
+unsigned window_in_bitmap(const struct window_in *w);
+
+#endif /* __WINDOW_H__ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "test.h"
+
+START_TEST(test_bundle_parts)
+{
+	char buf[64];
+	char *part;
+	unsigned long partlen;
+	unsigned long len;
+	unsigned long off;
+	int compressed;
+
+	len = 0;
+	fail_unless(bundle_add(buf, &len, sizeof(buf), "\0\0\x08\0abc", 7, 0) == 0);
+	fail_unless(bundle_add(buf, &len, sizeof(buf), "zlib", 4, 1) == 0);
+	fail_unless(len == 1 + 2 + 7 + 2 + 4);
+	fail_unless(bundle_is(buf, len));
+	fail_if(bundle_is("\0\0\x08\0", 4));
+
+	off = 0;
+	fail_unless(bundle_next(buf, len, &off, &part, &partlen, &compressed) == 1);
+	fail_unless(partlen == 7 && !compressed);
+	fail_unless(memcmp(part, "\0\0\x08\0abc", 7) == 0);
+	fail_unless(bundle_next(buf, len, &off, &part, &partlen, &compressed) == 1);
+	fail_unless(partlen == 4 && compressed);
+	fail_unless(memcmp(part, "zlib", 4) == 0);
+	fail_unless(bundle_next(buf, len, &off, &part, &partlen, &compressed) == 0);
+}
+END_TEST
+
+START_TEST(test_bundle_limits)
+{
+	char buf[16];
+	char *part;
+	unsigned long partlen;
+	unsigned long len;
+	unsigned long off;
+	int compressed;
+
+	len = 0;
+	fail_unless(bundle_add(buf, &len, sizeof(buf), "", 0, 0) == -1);
+	fail_unless(bundle_add(buf, &len, sizeof(buf), "0123456789", 10, 0) == 0);
+	fail_unless(bundle_add(buf, &len, sizeof(buf), "0123", 4, 0) == -1);
+	fail_unless(len == 13);
+
+	/* Cut short */
+	off = 0;
+	fail_unless(bundle_next(buf, 12, &off, &part, &partlen, &compressed) == -1);
+	off = 0;
+	fail_unless(bundle_next(buf, 2, &off, &part, &partlen, &compressed) == -1);
+}
+END_TEST
+
+TCase *
+test_bundle_create_tests(void)
+{
+	TCase *tc;
+
+	tc = tcase_create("Bundle");
+	tcase_add_test(tc, test_bundle_parts);
+	tcase_add_test(tc, test_bundle_limits);
+
+	return tc;
+}
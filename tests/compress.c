@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <check.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "test.h"
+
+static const char *names[] = { "none", "zlib", "zstream", "lz4", "zstd" };
+
+START_TEST(test_compress_roundtrip)
+{
+	const struct compressor *comp;
+	char in[2000];
+	char out[4000];
+	char back[2000];
+	unsigned long outlen;
+	unsigned long backlen;
+	int level;
+
+	comp = compressor_by_name(names[_i]);
+	if (!comp)
+		return; /* not built in */
+
+	memset(in, 'a', sizeof(in));
+	memcpy(in, "iodine", 6);
+
+	for (level = comp->min_level; level <= comp->max_level; level++) {
+		outlen = sizeof(out);
+		fail_unless(comp->compress(out, &outlen, in, sizeof(in), level, NULL) == 0);
+		if (comp != &nocompress_ops)
+			fail_unless(outlen < sizeof(in));
+
+		backlen = sizeof(back);
+		fail_unless(comp->uncompress(back, &backlen, out, outlen, NULL) == 0);
+		fail_unless(backlen == sizeof(in));
+		fail_unless(memcmp(back, in, sizeof(in)) == 0);
+
+		/* Output that does not fit must fail */
+		backlen = sizeof(in) - 1;
+		fail_unless(comp->uncompress(back, &backlen, out, outlen, NULL) != 0);
+	}
+}
+END_TEST
+
+START_TEST(test_compress_lookup)
+{
+	const struct compressor *comp;
+	int level;
+
+	fail_unless(compressor_by_name("ZLIB") == &zlib_ops);
+	fail_unless(compressor_by_id('n') == &nocompress_ops);
+	fail_unless(compressor_by_id('Z') == &zlib_ops);
+	fail_unless(compressor_by_name("gzip") == NULL);
+	fail_unless(compressor_by_id('x') == NULL);
+
+	fail_unless(compressor_parse("zlib", &comp, &level) == 0);
+	fail_unless(comp == &zlib_ops);
+	fail_unless(level == 9);
+	fail_unless(compressor_parse("zlib:3", &comp, &level) == 0);
+	fail_unless(level == 3);
+	fail_unless(compressor_parse("zlib:-5", &comp, &level) == 0);
+	fail_unless(level == 1);
+
+	fail_unless(compressor_parse("zlib:", &comp, &level) != 0);
+	fail_unless(compressor_parse("zlib:9x", &comp, &level) != 0);
+	fail_unless(compressor_parse("zlib:99", &comp, &level) != 0);
+	fail_unless(compressor_parse("bzip2:3", &comp, &level) != 0);
+}
+END_TEST
+
+START_TEST(test_compress_packet)
+{
+	char in[1500];
+	char out[1500];
+	unsigned long outlen;
+	unsigned int seed = 1;
+	int i;
+
+	/* Text is compressed */
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = "iodine tunnels IPv4 over DNS "[i % 29];
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zlib_ops, NULL, NULL, 9, out, &outlen, in, sizeof(in)) == 1);
+	fail_unless(outlen < sizeof(in));
+
+	/* Not with the none compressor */
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&nocompress_ops, NULL, NULL, 0, out, &outlen, in, sizeof(in)) == 0);
+	fail_unless(outlen == sizeof(in));
+
+	/* Random bytes are sent as is */
+	for (i = 0; i < sizeof(in); i++) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = seed >> 16;
+	}
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zlib_ops, NULL, NULL, 9, out, &outlen, in, sizeof(in)) == 0);
+	fail_unless(outlen == sizeof(in));
+	fail_unless(memcmp(out, in, sizeof(in)) == 0);
+
+	/* Too short to sample, and compression does not help */
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zlib_ops, NULL, NULL, 9, out, &outlen, in, 40) == 0);
+	fail_unless(outlen == 40);
+
+	outlen = 10;
+	fail_unless(compress_packet(&zlib_ops, NULL, NULL, 9, out, &outlen, in, 40) == -1);
+}
+END_TEST
+
+START_TEST(test_compress_dict)
+{
+	const struct compress_dict *dict;
+	const struct compressor *comp;
+	/* tun header and IPv4/TCP ACK with timestamps */
+	const char ack[] = "\x00\x00\x08\x00\x45\x00\x00\x34\x12\x34\x40\x00\x40\x06\xab\xcd"
+		"\x0a\x00\x00\x01\x0a\x00\x00\x02\x00\x16\xc3\x50\x11\x22\x33\x44"
+		"\x55\x66\x77\x88\x80\x10\x01\xf5\x9a\xbc\x00\x00\x01\x01\x08\x0a"
+		"\x01\x02\x03\x04\x05\x06\x07\x08";
+	char out[200];
+	char back[200];
+	unsigned long outlen;
+	unsigned long plainlen;
+	unsigned long backlen;
+	int i;
+
+	dict = compress_dict_builtin();
+	fail_unless(compress_dict_by_id(dict->id) == dict);
+	fail_unless(compress_dict_by_id(dict->id + 1) == NULL);
+
+	comp = compressor_by_name(names[_i]);
+	if (!comp || comp == &nocompress_ops)
+		return; /* not built in */
+
+	plainlen = sizeof(out);
+	fail_unless(comp->compress(out, &plainlen, ack, sizeof(ack) - 1, comp->default_level, NULL) == 0);
+	outlen = sizeof(out);
+	fail_unless(comp->compress(out, &outlen, ack, sizeof(ack) - 1, comp->default_level, dict) == 0);
+	fail_unless(outlen < plainlen, "%s: %lu with dictionary, %lu without", comp->name, outlen, plainlen);
+
+	backlen = sizeof(back);
+	fail_unless(comp->uncompress(back, &backlen, out, outlen, dict) == 0);
+	fail_unless(backlen == sizeof(ack) - 1);
+	fail_unless(memcmp(back, ack, backlen) == 0);
+
+	/* Again at the highest level, twice, with the primed state kept */
+	for (i = 0; i < 2; i++) {
+		outlen = sizeof(out);
+		fail_unless(comp->compress(out, &outlen, ack, sizeof(ack) - 1, comp->max_level, dict) == 0);
+		backlen = sizeof(back);
+		fail_unless(comp->uncompress(back, &backlen, out, outlen, dict) == 0);
+		fail_unless(backlen == sizeof(ack) - 1);
+		fail_unless(memcmp(back, ack, backlen) == 0);
+	}
+}
+END_TEST
+
+START_TEST(test_compress_dict_load)
+{
+	const struct compress_dict *dict;
+	char file[] = "/tmp/iodine-dict-XXXXXX";
+	char out[200];
+	char back[200];
+	unsigned long outlen;
+	unsigned long backlen;
+	int fd;
+
+	fd = mkstemp(file);
+	fail_if(fd < 0);
+	fail_unless(write(fd, "iodine IP over DNS tunnel", 25) == 25);
+	close(fd);
+
+	dict = compress_dict_load(file);
+	unlink(file);
+	fail_if(dict == NULL);
+	fail_unless(dict->len == 25);
+	fail_unless(compress_dict_by_id(dict->id) == dict);
+	fail_unless(compress_dict_load(file) == NULL);
+
+	/* zlib checks that the dictionary is the right one */
+	outlen = sizeof(out);
+	fail_unless(zlib_ops.compress(out, &outlen, "IP over DNS", 11, 9, dict) == 0);
+	backlen = sizeof(back);
+	fail_unless(zlib_ops.uncompress(back, &backlen, out, outlen, compress_dict_builtin()) != 0);
+	backlen = sizeof(back);
+	fail_unless(zlib_ops.uncompress(back, &backlen, out, outlen, dict) == 0);
+	fail_unless(backlen == 11);
+}
+END_TEST
+
+START_TEST(test_compress_stream)
+{
+	struct compress_stream *tx;
+	struct compress_stream *rx;
+	char in[300];
+	char out[600];
+	char back[600];
+	unsigned long outlen;
+	unsigned long backlen;
+	unsigned long first;
+	int i;
+
+	tx = compress_stream_new();
+	rx = compress_stream_new();
+	fail_if(!tx || !rx);
+
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = "iodine IP over DNS "[i % 19] + i / 19;
+
+	/* The same packet again compresses to a fraction */
+	for (i = 0; i < 3; i++) {
+		outlen = sizeof(out);
+		fail_unless(compress_packet(&zstream_ops, tx, NULL, 6, out, &outlen, in, sizeof(in)) == 1);
+		fail_unless(((unsigned char) out[0] & COMPRESS_STREAM_RESTART) == (i == 0 ? COMPRESS_STREAM_RESTART : 0));
+		if (i == 0)
+			first = outlen;
+		else
+			fail_unless(outlen < first / 4, "%lu vs %lu", outlen, first);
+
+		backlen = sizeof(back);
+		fail_unless(uncompress_packet(&zstream_ops, rx, NULL, back, &backlen, out, outlen) == 0);
+		fail_unless(backlen == sizeof(in));
+		fail_unless(memcmp(back, in, sizeof(in)) == 0);
+	}
+
+	/* Level changes keep the stream going */
+	in[0] = 'X';
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zstream_ops, tx, NULL, 1, out, &outlen, in, sizeof(in)) == 1);
+	backlen = sizeof(back);
+	fail_unless(uncompress_packet(&zstream_ops, rx, NULL, back, &backlen, out, outlen) == 0);
+	fail_unless(memcmp(back, in, sizeof(in)) == 0);
+
+	/* A lost packet breaks the receiver until the sender restarts */
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zstream_ops, tx, NULL, 6, out, &outlen, in, sizeof(in)) == 1);
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zstream_ops, tx, NULL, 6, out, &outlen, in, sizeof(in)) == 1);
+	backlen = sizeof(back);
+	fail_unless(uncompress_packet(&zstream_ops, rx, NULL, back, &backlen, out, outlen) != 0);
+	fail_unless(compress_stream_broken(rx));
+
+	compress_stream_restart(tx);
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zstream_ops, tx, NULL, 6, out, &outlen, in, sizeof(in)) == 1);
+	backlen = sizeof(back);
+	fail_unless(uncompress_packet(&zstream_ops, rx, NULL, back, &backlen, out, outlen) == 0);
+	fail_unless(memcmp(back, in, sizeof(in)) == 0);
+	fail_if(compress_stream_broken(rx));
+
+	/* Without a stream, packets are compressed one by one */
+	outlen = sizeof(out);
+	fail_unless(compress_packet(&zstream_ops, NULL, NULL, 6, out, &outlen, in, sizeof(in)) == 1);
+	backlen = sizeof(back);
+	fail_unless(zlib_ops.uncompress(back, &backlen, out, outlen, NULL) == 0);
+
+	compress_stream_free(tx);
+	compress_stream_free(rx);
+}
+END_TEST
+
+START_TEST(test_compress_ctl)
+{
+	struct compress_ctl ctl;
+	uint64_t now = 1000;
+
+	compress_ctl_init(&ctl, &zlib_ops, 6, now);
+	fail_unless(ctl.level == 6);
+
+	/* Nothing changes within an interval */
+	compress_ctl_compressed(&ctl, 1000, 500, 10, 3);
+	fail_unless(compress_ctl_update(&ctl, now + 100, 50, 0) == 0);
+
+	/* Never above the selected level, even with a backlog */
+	now += COMPRESS_CTL_INTERVAL;
+	fail_unless(compress_ctl_update(&ctl, now, 50, 0) == 0);
+	fail_unless(ctl.level == 6);
+
+	/* Down when the CPU budget is used up */
+	now += COMPRESS_CTL_INTERVAL;
+	compress_ctl_compressed(&ctl, 1000, 500, 10, 3);
+	fail_unless(compress_ctl_update(&ctl, now, 50, 80) == 1);
+	fail_unless(ctl.level == 5);
+
+	/* Up again with packets queued and CPU to spare */
+	now += COMPRESS_CTL_INTERVAL;
+	compress_ctl_compressed(&ctl, 1000, 500, 10, 3);
+	compress_ctl_acked(&ctl, 500);
+	fail_unless(compress_ctl_update(&ctl, now, 50, 10) == 1);
+	fail_unless(ctl.level == 6);
+
+	/* Stays without a backlog */
+	now += COMPRESS_CTL_INTERVAL;
+	compress_ctl_compressed(&ctl, 1000, 500, 10, 0);
+	fail_unless(compress_ctl_update(&ctl, now, 50, 10) == 0);
+
+	/* Down when keeping up with the link would need too much CPU.
+	   Rates start from 0 and are smoothed, so this is 100 KB/s at
+	   1:1 with 500 KB/s compression: 20% */
+	compress_ctl_init(&ctl, &zlib_ops, 6, now);
+	now += COMPRESS_CTL_INTERVAL;
+	compress_ctl_compressed(&ctl, 10000, 5000, 10000, 3);
+	compress_ctl_acked(&ctl, 100000);
+	fail_unless(compress_ctl_update(&ctl, now, 10, 0) == 1);
+	fail_unless(ctl.level == 5);
+	fail_unless(compress_ctl_need(&ctl) > 10);
+
+	/* Not below the minimum level */
+	compress_ctl_init(&ctl, &zlib_ops, 1, now);
+	now += COMPRESS_CTL_INTERVAL;
+	fail_unless(compress_ctl_update(&ctl, now, 50, 80) == 0);
+	fail_unless(ctl.level == 1);
+}
+END_TEST
+
+TCase *
+test_compress_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Compress");
+	tcase_add_loop_test(tc, test_compress_roundtrip, 0, sizeof(names) / sizeof(names[0]));
+	tcase_add_test(tc, test_compress_lookup);
+	tcase_add_test(tc, test_compress_packet);
+	tcase_add_loop_test(tc, test_compress_dict, 0, sizeof(names) / sizeof(names[0]));
+	tcase_add_test(tc, test_compress_dict_load);
+	tcase_add_test(tc, test_compress_stream);
+	tcase_add_test(tc, test_compress_ctl);
+
+	return tc;
+}
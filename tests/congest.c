@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+
+#include "congest.h"
+#include "test.h"
+
+START_TEST(test_congest_aimd)
+{
+	struct congest c;
+	int i;
+
+	congest_init(&c, 0);
+	fail_unless(congest_room(&c) == CONGEST_INIT);
+	for (i = 0; i < CONGEST_INIT; i++)
+		congest_sent(&c, i, 0);
+	fail_unless(congest_room(&c) == 0);
+
+	/* Slow start: one more per answer */
+	for (i = 0; i < CONGEST_INIT; i++)
+		congest_answered(&c, i, 10, 0);
+	fail_unless(c.cwnd == 2 * CONGEST_INIT * CONGEST_ONE);
+	fail_unless(congest_room(&c) == 2 * CONGEST_INIT);
+
+	/* SERVFAIL halves it, but only once per window */
+	congest_servfail(&c);
+	fail_unless(c.cwnd == CONGEST_INIT * CONGEST_ONE);
+	fail_unless(c.ssthresh == c.cwnd);
+	congest_servfail(&c);
+	fail_unless(c.cwnd == CONGEST_INIT * CONGEST_ONE);
+	fail_unless(c.servfail == 2);
+
+	/* Then one per window of answers */
+	for (i = 0; i < CONGEST_INIT; i++)
+		congest_answered(&c, i, 20, 0);
+	fail_unless(c.cwnd / CONGEST_ONE == CONGEST_INIT);
+	congest_answered(&c, 0, 20, 0);
+	fail_unless(c.cwnd / CONGEST_ONE == CONGEST_INIT + 1);
+
+	/* Held queries are not lost */
+	for (i = 0; i < 3; i++)
+		congest_sent(&c, i, 30);
+	congest_timeout(&c, 3);
+	fail_unless(c.lost == 0 && c.inflight == 0);
+	fail_unless(c.cwnd / CONGEST_ONE == CONGEST_INIT + 1);
+	for (i = 0; i < 3; i++)
+		congest_sent(&c, i, 30);
+	congest_timeout(&c, 1);
+	fail_unless(c.lost == 2);
+	fail_unless(c.cwnd / CONGEST_ONE == (CONGEST_INIT + 1) / 2);
+}
+END_TEST
+
+START_TEST(test_congest_pace)
+{
+	struct congest c;
+	int i;
+
+	congest_init(&c, 1000);
+	congest_sent(&c, 0, 1000);
+	fail_unless(congest_wait(&c, 1000) == 0);
+
+	/* 100 answers/s, half of it smoothed from nothing. No pacing
+	   without trouble. */
+	for (i = 1; i <= 50; i++)
+		congest_answered(&c, i, 1000 + i * 10, 0);
+	fail_unless(c.rate == 50);
+	fail_unless(c.pace_us == 0);
+
+	/* SERVFAIL paces at the answer rate, the next one at half that */
+	c.rate = 100;
+	congest_servfail(&c);
+	fail_unless(c.pace_us == 10000);
+	congest_servfail(&c);
+	fail_unless(c.pace_us == 20000);
+
+	congest_sent(&c, 0, 3000);
+	congest_sent(&c, 0, 3000);
+	fail_unless(congest_wait(&c, 3000) == 40);
+	fail_unless(congest_wait(&c, 3030) == 10);
+	fail_unless(congest_wait(&c, 3040) == 0);
+
+	/* Backoff doubles with failures, within limits */
+	fail_unless(congest_backoff(&c) == 4 * CONGEST_BACKOFF_MIN);
+	for (i = 0; i < 10; i++)
+		congest_servfail(&c);
+	fail_unless(c.pace_us == CONGEST_PACE_MAX);
+	fail_unless(congest_backoff(&c) == CONGEST_BACKOFF_MAX);
+
+	/* Answers bring it back */
+	congest_answered(&c, 0, 3100, 0);
+	fail_unless(c.pace_us == CONGEST_PACE_MAX / 8 * 7);
+	fail_unless(congest_backoff(&c) == CONGEST_PACE_MAX / 8 * 7 / 1000);
+	for (i = 0; i < 50; i++)
+		congest_answered(&c, i, 3100, 0);
+	fail_unless(c.pace_us == 0);
+	fail_unless(congest_backoff(&c) == CONGEST_BACKOFF_MIN);
+
+	/* An idle interval leaves the rate alone */
+	congest_answered(&c, 0, 9000, 0);
+	fail_unless(c.rate == 100);
+}
+END_TEST
+
+START_TEST(test_congest_rtt)
+{
+	struct congest c;
+	int i;
+
+	congest_init(&c, 0);
+	fail_unless(congest_rto(&c) == CONGEST_RTO_INIT);
+
+	/* The first sample sets it, with half of it as deviation */
+	congest_sent(&c, 1, 0);
+	congest_sent(&c, 2, 0);
+	congest_answered(&c, 1, 300, 1);
+	fail_unless(c.srtt_us == 300000 && c.rttvar_us == 150000);
+	fail_unless(congest_rto(&c) == 900);
+
+	/* Untimed answers, duplicates and unknown ids are no samples */
+	congest_answered(&c, 2, 310, 0);
+	congest_answered(&c, 1, 320, 1);
+	congest_answered(&c, 3, 330, 1);
+	fail_unless(c.srtt_us == 300000 && congest_rto(&c) == 900);
+
+	/* A steady RTT brings the timeout down, but not below the minimum */
+	for (i = 0; i < 10; i++) {
+		congest_sent(&c, 100 + i, 1000 + i * 100);
+		congest_answered(&c, 100 + i, 1000 + i * 100 + 100, 1);
+	}
+	fail_unless(c.srtt_us / 1000 < 200);
+	fail_unless(congest_rto(&c) < 900);
+	for (i = 0; i < 50; i++) {
+		congest_sent(&c, i, 3000 + i * 100);
+		congest_answered(&c, i, 3000 + i * 100 + 20, 1);
+	}
+	fail_unless(congest_rto(&c) == CONGEST_RTO_MIN);
+	fail_unless(congest_backoff(&c) == CONGEST_BACKOFF_MIN);
+
+	/* Losses double it, and a sample sets it again */
+	congest_sent(&c, 7, 9000);
+	congest_timeout(&c, 0);
+	fail_unless(congest_rto(&c) == 2 * CONGEST_RTO_MIN);
+	for (i = 0; i < 10; i++) {
+		congest_sent(&c, 7, 9000);
+		congest_timeout(&c, 0);
+	}
+	fail_unless(congest_rto(&c) == CONGEST_RTO_MAX);
+
+	/* Answers later than the timeout were probably held */
+	c.rto = CONGEST_RTO_MIN;
+	congest_sent(&c, 8, 10000);
+	congest_answered(&c, 8, 10000 + CONGEST_RTO_MIN + 1, 1);
+	fail_unless(congest_rto(&c) == CONGEST_RTO_MIN);
+	fail_unless(c.srtt_us / 1000 < 30);
+
+	/* A slow path backs off polls too */
+	c.srtt_us = 4 * CONGEST_BACKOFF_MIN * 1000;
+	fail_unless(congest_backoff(&c) == 4 * CONGEST_BACKOFF_MIN);
+}
+END_TEST
+
+START_TEST(test_congest_hedge)
+{
+	struct congest c;
+	int i;
+
+	/* The retransmit timeout until there are a few samples */
+	congest_init(&c, 0);
+	congest_sent(&c, 1, 0);
+	congest_answered(&c, 1, 100, 1);
+	fail_unless(congest_hedge(&c) == congest_rto(&c));
+
+	/* Then the time 90% of them took */
+	for (i = 0; i < 9; i++) {
+		congest_sent(&c, 10 + i, 1000);
+		congest_answered(&c, 10 + i, 1000 + 50 + i * 10, 1);
+	}
+	fail_unless(c.nsamples == 10);
+	fail_unless(congest_hedge(&c) == 120);
+
+	/* Only the last ones count, and never less than the minimum */
+	for (i = 0; i < CONGEST_SAMPLES; i++) {
+		congest_sent(&c, 30 + i, 2000);
+		congest_answered(&c, 30 + i, 2000 + 1, 1);
+	}
+	fail_unless(c.nsamples == CONGEST_SAMPLES);
+	fail_unless(c.p90_us == 1000);
+	fail_unless(congest_hedge(&c) == CONGEST_HEDGE_MIN);
+
+	/* Nor more than the retransmit timeout */
+	c.p90_us = 10 * 1000 * 1000;
+	fail_unless(congest_hedge(&c) == congest_rto(&c));
+}
+END_TEST
+
+TCase *
+test_congest_create_tests(void)
+{
+	TCase *tc;
+
+	tc = tcase_create("Congest");
+	tcase_add_test(tc, test_congest_aimd);
+	tcase_add_test(tc, test_congest_pace);
+	tcase_add_test(tc, test_congest_rtt);
+	tcase_add_test(tc, test_congest_hedge);
+
+	return tc;
+}
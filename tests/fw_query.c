@@ -27,7 +27,7 @@ START_TEST(test_fw_query_simple)
 	q.addrlen = 33;
 	q.id = 0x848A;
 
-	fw_query_init();
+	fw_query_init(FW_QUERY_CACHE_SIZE);
 
 	/* Test empty cache */
 	fw_query_get(0x848A, &qp);
@@ -48,7 +48,7 @@ START_TEST(test_fw_query_edge)
 	struct fw_query *qp;
 	int i;
 
-	fw_query_init();
+	fw_query_init(FW_QUERY_CACHE_SIZE);
 
 	q.addrlen = 33;
 	q.id = 0x848A;
@@ -75,6 +75,31 @@ START_TEST(test_fw_query_edge)
 }
 END_TEST
 
+START_TEST(test_fw_query_size)
+{
+	struct fw_query q;
+	struct fw_query *qp;
+
+	fail_unless(fw_query_init(2) == 0);
+
+	q.addrlen = 33;
+	q.id = 1;
+	fw_query_put(&q);
+	q.id = 2;
+	fw_query_put(&q);
+
+	fw_query_get(1, &qp);
+	fail_if(qp == NULL);
+
+	q.id = 3;
+	fw_query_put(&q);
+	fw_query_get(1, &qp);
+	fail_unless(qp == NULL);
+	fw_query_get(3, &qp);
+	fail_if(qp == NULL);
+}
+END_TEST
+
 TCase *
 test_fw_query_create_tests()
 {
@@ -83,6 +108,7 @@ test_fw_query_create_tests()
 	tc = tcase_create("Forwarded query");
 	tcase_add_test(tc, test_fw_query_simple);
 	tcase_add_test(tc, test_fw_query_edge);
+	tcase_add_test(tc, test_fw_query_size);
 
 	return tc;
 }
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+
+#include "pktbuf.h"
+#include "test.h"
+
+START_TEST(test_pktbuf_classes)
+{
+	char *small;
+	char *big;
+
+	small = pktbuf_get(100);
+	big = pktbuf_get(3000);
+	fail_if(small == NULL);
+	fail_if(big == NULL);
+	fail_unless(pktbuf_size(small) >= 100);
+	fail_unless(pktbuf_size(small) < 3000);
+	fail_unless(pktbuf_size(big) >= 3000);
+
+	fail_unless(pktbuf_get(PKTBUF_MAX + 1) == NULL);
+	fail_if(pktbuf_reserved() == 0);
+
+	pktbuf_put(small);
+	pktbuf_put(big);
+	pktbuf_put(NULL);
+}
+END_TEST
+
+START_TEST(test_pktbuf_refs)
+{
+	char *buf;
+
+	buf = pktbuf_get(1000);
+	fail_if(buf == NULL);
+	fail_unless(pktbuf_ref(buf) == buf);
+
+	/* Still referenced, must not be handed out again */
+	pktbuf_put(buf);
+	fail_if(pktbuf_get(1000) == buf);
+
+	/* Last reference gone, buffer is reused first */
+	pktbuf_put(buf);
+	fail_unless(pktbuf_get(1000) == buf);
+	pktbuf_put(buf);
+}
+END_TEST
+
+START_TEST(test_pktbuf_grow)
+{
+	char *buf;
+	char *bigger;
+
+	buf = pktbuf_get(10);
+	memcpy(buf, "0123456789", 10);
+
+	fail_unless(pktbuf_grow(buf, 10, pktbuf_size(buf)) == buf);
+
+	bigger = pktbuf_grow(buf, 10, 5000);
+	fail_if(bigger == NULL);
+	fail_unless(pktbuf_size(bigger) >= 5000);
+	fail_unless(memcmp(bigger, "0123456789", 10) == 0);
+
+	fail_unless(pktbuf_grow(bigger, 10, PKTBUF_MAX + 1) == NULL);
+	pktbuf_put(bigger);
+
+	bigger = pktbuf_grow(NULL, 0, 100);
+	fail_if(bigger == NULL);
+	pktbuf_put(bigger);
+}
+END_TEST
+
+START_TEST(test_pktbuf_release)
+{
+	char *bufs[100];
+	size_t before;
+	size_t peak;
+	int i;
+
+	/* Several slabs worth, then all back */
+	before = pktbuf_reserved();
+	for (i = 0; i < 100; i++) {
+		bufs[i] = pktbuf_get(8000);
+		fail_if(bufs[i] == NULL);
+	}
+	peak = pktbuf_reserved();
+	fail_unless(peak > before);
+	for (i = 0; i < 100; i++)
+		pktbuf_put(bufs[i]);
+
+	/* Only one empty slab is kept */
+	fail_unless(pktbuf_reserved() <= before + (peak - before) / 3);
+
+	/* and reused */
+	bufs[0] = pktbuf_get(8000);
+	fail_if(bufs[0] == NULL);
+	fail_unless(pktbuf_reserved() <= before + (peak - before) / 3);
+	pktbuf_put(bufs[0]);
+}
+END_TEST
+
+TCase *
+test_pktbuf_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Pktbuf");
+	tcase_add_test(tc, test_pktbuf_classes);
+	tcase_add_test(tc, test_pktbuf_refs);
+	tcase_add_test(tc, test_pktbuf_grow);
+	tcase_add_test(tc, test_pktbuf_release);
+
+	return tc;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2006-2014 Erik Ekman <yarrick@kryo.se>,
+ * 2006-2009 Bjorn Andersson <flex@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+
+#include "resolver.h"
+#include "test.h"
+
+static struct resolvers r;
+
+START_TEST(test_resolver_stripe)
+{
+	int picks[3] = { 0, 0, 0 };
+	int i;
+
+	resolver_init(&r, 1);
+	for (i = 0; i < 10; i++)
+		fail_unless(resolver_pick(&r) == 0);
+	fail_unless(resolver_other(&r, 0) == 0);
+
+	/* Healthy ones take turns */
+	resolver_init(&r, 3);
+	for (i = 0; i < 30; i++)
+		picks[resolver_pick(&r)]++;
+	fail_unless(picks[0] == 10 && picks[1] == 10 && picks[2] == 10);
+
+	r.r[2].health = RESOLVER_ONE / 2;
+	fail_unless(resolver_other(&r, 0) == 1);
+	fail_unless(resolver_other(&r, 1) == 0);
+}
+END_TEST
+
+START_TEST(test_resolver_health)
+{
+	int picks[2] = { 0, 0 };
+	int which;
+	int i;
+
+	/* The second one answers nothing */
+	resolver_init(&r, 2);
+	for (i = 0; i < 200; i++) {
+		which = resolver_pick(&r);
+		resolver_sent(&r, which, i, i);
+		if (which == 0)
+			resolver_answered(&r, i, i + 10, 1);
+		else if (i % 2)
+			resolver_servfail(&r, i);
+	}
+	resolver_expire(&r, 1000, 100);
+	fail_unless(r.r[0].health == RESOLVER_ONE);
+	fail_unless(r.r[0].missed == 0 && r.r[0].srtt_us == 10000);
+	fail_unless(r.r[1].missed == r.r[1].sent);
+	fail_unless(r.r[1].health < RESOLVER_ONE / 8);
+
+	/* It still gets the odd query, to find out when it is back */
+	for (i = 0; i < 170; i++)
+		picks[resolver_pick(&r)]++;
+	fail_unless(picks[1] >= 5 && picks[1] <= 15);
+
+	/* Answers bring it back */
+	for (i = 0; i < 50; i++) {
+		resolver_sent(&r, 1, 1000 + i, 2000);
+		resolver_answered(&r, 1000 + i, 2010, 0);
+	}
+	fail_unless(r.r[1].health > RESOLVER_ONE * 15 / 16);
+	fail_unless(r.r[1].srtt_us == 0);
+
+	/* Duplicates and unknown ids count for nothing */
+	resolver_answered(&r, 1000, 2020, 1);
+	resolver_servfail(&r, 1001);
+	resolver_answered(&r, 5, 2020, 1);
+	fail_unless(r.r[1].answered == 50 && r.r[1].missed == r.r[1].sent - 50);
+}
+END_TEST
+
+START_TEST(test_resolver_rtt)
+{
+	int picks[2] = { 0, 0 };
+	int i;
+
+	/* Half the weight at twice the round trip time */
+	resolver_init(&r, 2);
+	resolver_sent(&r, 0, 1, 0);
+	resolver_answered(&r, 1, 20, 1);
+	resolver_sent(&r, 1, 2, 0);
+	resolver_answered(&r, 2, 40, 1);
+	for (i = 0; i < 30; i++)
+		picks[resolver_pick(&r)]++;
+	fail_unless(picks[0] == 20 && picks[1] == 10);
+
+	/* Queries sent again go to the best of the others */
+	fail_unless(resolver_other(&r, 0) == 1);
+	fail_unless(resolver_other(&r, 1) == 0);
+
+	/* Held queries are not missed until they expire */
+	resolver_sent(&r, 0, 3, 100);
+	resolver_expire(&r, 1000, 1000);
+	fail_unless(r.r[0].missed == 0);
+	resolver_expire(&r, 1050, 900);
+	fail_unless(r.r[0].missed == 0);
+	resolver_expire(&r, 1101, 1000);
+	fail_unless(r.r[0].missed == 1);
+
+	/* Nor are forgotten ones */
+	resolver_sent(&r, 1, 4, 2000);
+	resolver_forget(&r);
+	resolver_expire(&r, 9000, 1000);
+	resolver_answered(&r, 4, 9000, 1);
+	fail_unless(r.r[1].missed == 0 && r.r[1].answered == 1);
+}
+END_TEST
+
+TCase *
+test_resolver_create_tests(void)
+{
+	TCase *tc;
+
+	tc = tcase_create("Resolver");
+	tcase_add_test(tc, test_resolver_stripe);
+	tcase_add_test(tc, test_resolver_health);
+	tcase_add_test(tc, test_resolver_rtt);
+
+	return tc;
+}
@@ -60,6 +60,30 @@ main()
  	test = test_fw_query_create_tests();
 	suite_add_tcase(iodine, test);
 
+ 	test = test_timer_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_pktbuf_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_compress_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_vj_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_bundle_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_window_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_congest_create_tests();
+	suite_add_tcase(iodine, test);
+
+ 	test = test_resolver_create_tests();
+	suite_add_tcase(iodine, test);
+
 	runner = srunner_create(iodine);
 	srunner_run_all(runner, CK_NORMAL);
 	failed = srunner_ntests_failed(runner);
@@ -27,6 +27,14 @@ TCase *test_read_create_tests();
 TCase *test_login_create_tests();
 TCase *test_user_create_tests();
 TCase *test_fw_query_create_tests();
+TCase *test_timer_create_tests();
+TCase *test_pktbuf_create_tests();
+TCase *test_compress_create_tests();
+TCase *test_vj_create_tests();
+TCase *test_bundle_create_tests();
+TCase *test_window_create_tests();
+TCase *test_congest_create_tests();
+TCase *test_resolver_create_tests();
 
 char *va_str(const char *, ...);
 
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <check.h>
+#include <stdint.h>
+
+#include "timer.h"
+#include "test.h"
+
+static int fired[4];
+static uint64_t fired_at[4];
+static uint64_t fake_now;
+
+static void
+count_fire(void *arg)
+{
+	int *n = arg;
+
+	fired[n - fired]++;
+	fired_at[n - fired] = fake_now;
+}
+
+static void
+run_until(uint64_t end)
+{
+	while (fake_now < end) {
+		fake_now++;
+		timers_run(fake_now);
+	}
+}
+
+START_TEST(test_timer_expiry)
+{
+	struct timer t[4];
+	int i;
+
+	fake_now = 1000;
+	timers_init(fake_now);
+	for (i = 0; i < 4; i++) {
+		fired[i] = 0;
+		timer_init(&t[i], count_fire, &fired[i]);
+	}
+
+	/* One timer on each wheel level */
+	timer_set(&t[0], fake_now + 20);
+	timer_set(&t[1], fake_now + 700);
+	timer_set(&t[2], fake_now + 60000);
+	timer_set(&t[3], fake_now + 300000);
+	fail_unless(timer_pending(&t[3]));
+
+	run_until(1000 + 400000);
+
+	fail_unless(fired_at[0] == 1000 + 20);
+	fail_unless(fired_at[1] == 1000 + 700);
+	fail_unless(fired_at[2] == 1000 + 60000);
+	fail_unless(fired_at[3] == 1000 + 300000);
+	for (i = 0; i < 4; i++) {
+		fail_unless(fired[i] == 1);
+		fail_if(timer_pending(&t[i]));
+	}
+}
+END_TEST
+
+START_TEST(test_timer_jump)
+{
+	struct timer t[2];
+
+	fake_now = 5;
+	timers_init(fake_now);
+	fired[0] = fired[1] = 0;
+	timer_init(&t[0], count_fire, &fired[0]);
+	timer_init(&t[1], count_fire, &fired[1]);
+
+	timer_set(&t[0], 100);
+	timer_set(&t[1], 70000);
+
+	/* Long sleep in one step fires everything due */
+	fake_now = 80000;
+	timers_run(fake_now);
+	fail_unless(fired[0] == 1);
+	fail_unless(fired[1] == 1);
+
+	/* Timer in the past fires on next run */
+	timer_set(&t[0], 10);
+	fake_now++;
+	timers_run(fake_now);
+	fail_unless(fired[0] == 2);
+}
+END_TEST
+
+START_TEST(test_timer_del_and_reset)
+{
+	struct timer t;
+
+	fake_now = 0;
+	timers_init(fake_now);
+	fired[0] = 0;
+	timer_init(&t, count_fire, &fired[0]);
+
+	timer_set(&t, 50);
+	timer_del(&t);
+	fail_if(timer_pending(&t));
+	run_until(100);
+	fail_unless(fired[0] == 0);
+
+	/* Moving a pending timer only fires it once, at the new time */
+	timer_set(&t, 150);
+	timer_set(&t, 5000);
+	run_until(6000);
+	fail_unless(fired[0] == 1);
+	fail_unless(fired_at[0] == 5000);
+}
+END_TEST
+
+START_TEST(test_timer_next)
+{
+	struct timer t[2];
+
+	fake_now = 0;
+	timers_init(fake_now);
+	timer_init(&t[0], count_fire, &fired[0]);
+	timer_init(&t[1], count_fire, &fired[1]);
+
+	fail_unless(timers_next(fake_now, 10000) == 10000);
+
+	timer_set(&t[0], 30);
+	fail_unless(timers_next(fake_now, 10000) == 30);
+	fail_unless(timers_next(fake_now, 10) == 10);
+
+	/* Timers on higher levels are not waited for too long */
+	timer_set(&t[0], 3000);
+	fail_unless(timers_next(fake_now, 10000) <= 3000);
+
+	fake_now = 2990;
+	timers_run(fake_now);
+	fail_unless(timers_next(fake_now, 10000) == 10);
+
+	/* Already expired, runs on next tick */
+	timer_set(&t[1], 20);
+	fail_unless(timers_next(fake_now, 10000) <= 1);
+}
+END_TEST
+
+TCase *
+test_timer_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Timer");
+	tcase_add_test(tc, test_timer_expiry);
+	tcase_add_test(tc, test_timer_jump);
+	tcase_add_test(tc, test_timer_del_and_reset);
+	tcase_add_test(tc, test_timer_next);
+
+	return tc;
+}
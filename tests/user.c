@@ -24,8 +24,11 @@
 #include <arpa/inet.h>
 
 #include "common.h"
+#include "compress.h"
 #include "encoding.h"
+#include "timer.h"
 #include "user.h"
+#include "window.h"
 #include "test.h"
 
 START_TEST(test_init_users)
@@ -48,6 +51,60 @@ START_TEST(test_init_users)
 }
 END_TEST
 
+START_TEST(test_init_users_sizes)
+{
+	in_addr_t ip;
+	size_t mem;
+	int count;
+
+	ip = inet_addr("127.0.0.1");
+	init_users(ip, 27);
+	mem = users_memsize();
+
+	max_users = 3;
+	qmemping_len = 100;
+#ifdef OUTPACKETQ_LEN
+	outpacketq_len = 32;
+#endif
+	count = init_users(ip, 27);
+	fail_unless(count == 3);
+	fail_unless(users_memsize() < mem);
+
+	/* Per-user arrays must not overlap */
+	fail_unless(users[1].qmemping_type == users[0].qmemping_type + 100);
+	fail_unless(users[2].qmemping_cmc == users[1].qmemping_cmc + 400);
+#ifdef OUTPACKETQ_LEN
+	fail_unless(users[2].outpacketq == users[1].outpacketq + 32);
+	fail_unless(users[2].outpacketq[31].data == NULL);
+#endif
+
+	max_users = USERS;
+	qmemping_len = QMEMPING_LEN;
+#ifdef OUTPACKETQ_LEN
+	outpacketq_len = OUTPACKETQ_LEN;
+#endif
+}
+END_TEST
+
+START_TEST(test_init_users_wide)
+{
+	in_addr_t ip;
+	int count;
+
+	max_users = USERS_MAX;
+	ip = inet_addr("10.0.0.1");
+	count = init_users(ip, 22);
+	fail_unless(count == USERS_MAX);
+	fail_unless(users[0].tun_ip == inet_addr("10.0.0.2"));
+	fail_unless(users[253].tun_ip == inet_addr("10.0.0.255"));
+	fail_unless(users[254].tun_ip == inet_addr("10.0.1.0"));
+	fail_unless(users[USERS_MAX - 1].id == USERS_MAX - 1);
+	fail_unless(users[USERS_MAX - 1].tun_ip == inet_addr("10.0.2.1"));
+
+	max_users = USERS;
+}
+END_TEST
+
 START_TEST(test_find_user_by_ip)
 {
 	in_addr_t ip;
@@ -68,7 +125,7 @@ START_TEST(test_find_user_by_ip)
 	testip = (unsigned int) inet_addr("127.0.0.2");
 	fail_unless(find_user_by_ip(testip) == -1);
 
-	users[0].last_pkt = time(NULL);
+	users[0].last_pkt = clock_ms();
 
 	testip = (unsigned int) inet_addr("127.0.0.2");
 	fail_unless(find_user_by_ip(testip) == -1);
@@ -80,10 +137,43 @@ START_TEST(test_find_user_by_ip)
 }
 END_TEST
 
+START_TEST(test_find_user_by_ip_all)
+{
+	in_addr_t ip;
+	int count;
+	int i;
+
+	max_users = USERS_MAX;
+	ip = inet_addr("10.0.0.5");
+	count = init_users(ip, 22);
+
+	for (i = 0; i < count; i++) {
+		users[i].active = 1;
+		users[i].authenticated = 1;
+	}
+	for (i = 0; i < count; i++)
+		fail_unless(find_user_by_ip(users[i].tun_ip) == i);
+
+	fail_unless(users[3].tun_ip == inet_addr("10.0.0.4"));
+	fail_unless(users[4].tun_ip == inet_addr("10.0.0.6"));
+	fail_unless(find_user_by_ip(ip) == -1);
+	fail_unless(find_user_by_ip(inet_addr("10.0.0.0")) == -1);
+	fail_unless(find_user_by_ip(inet_addr("10.0.3.255")) == -1);
+	fail_unless(find_user_by_ip(inet_addr("10.1.0.2")) == -1);
+
+	users[100].disabled = 1;
+	fail_unless(find_user_by_ip(users[100].tun_ip) == -1);
+
+	max_users = USERS;
+}
+END_TEST
+
 START_TEST(test_all_users_waiting_to_send)
 {
 	in_addr_t ip;
 
+	clock_update();
+	timers_init(clock_ms());
 	ip = inet_addr("127.0.0.1");
 	init_users(ip, 27);
 
@@ -91,11 +181,14 @@ START_TEST(test_all_users_waiting_to_send)
 
 	users[0].conn = CONN_DNS_NULL;
 	users[0].active = 1;
+	users[0].disabled = 1;
+	user_update_pending(0);
 
 	fail_unless(all_users_waiting_to_send() == 1);
 
-	users[0].last_pkt = time(NULL);
+	users[0].disabled = 0;
 	users[0].outpacket.len = 0;
+	user_update_pending(0);
 
 	fail_unless(all_users_waiting_to_send() == 0);
 
@@ -104,7 +197,21 @@ START_TEST(test_all_users_waiting_to_send)
 #else
 	users[0].outpacket.len = 44;
 #endif
+	user_update_pending(0);
+
+	fail_unless(all_users_waiting_to_send() == 1);
+
+	/* Raw UDP users take every packet */
+	user_set_conn_type(0, CONN_RAW_UDP);
+	fail_unless(all_users_waiting_to_send() == 0);
+	user_set_conn_type(0, CONN_DNS_NULL);
+	fail_unless(all_users_waiting_to_send() == 1);
 
+	/* A new user has room, until it expires */
+	fail_unless(find_available_user(0, 1) == 1);
+	fail_unless(all_users_waiting_to_send() == 0);
+	users[1].active = 0;
+	user_release_packets(1);
 	fail_unless(all_users_waiting_to_send() == 1);
 }
 END_TEST
@@ -114,30 +221,37 @@ START_TEST(test_find_available_user)
 	in_addr_t ip;
 	int i;
 
+	clock_update();
+	timers_init(clock_ms());
 	ip = inet_addr("127.0.0.1");
 	init_users(ip, 27);
 
 	for (i = 0; i < USERS; i++) {
 		users[i].authenticated = 1;
 		users[i].authenticated_raw = 1;
-		fail_unless(find_available_user() == i);
+		fail_unless(find_available_user(0, 1) == i);
 		fail_if(users[i].authenticated);
 		fail_if(users[i].authenticated_raw);
 	}
 
 	for (i = 0; i < USERS; i++) {
-		fail_unless(find_available_user() == -1);
+		fail_unless(find_available_user(0, 1) == -1);
 	}
 
 	users[3].active = 0;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0, 1) == 3);
+	fail_unless(find_available_user(0, 1) == -1);
 
-	users[3].last_pkt = 55;
+	/* Session expires when nothing was received for USER_TIMEOUT */
+	for (i = 0; i < USERS; i++) {
+		if (i != 3)
+			users[i].last_pkt = clock_ms() + 1000;
+	}
+	timers_run(clock_ms() + USER_TIMEOUT);
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0, 1) == 3);
+	fail_unless(find_available_user(0, 1) == -1);
 }
 END_TEST
 
@@ -146,26 +260,128 @@ START_TEST(test_find_available_user_small_net)
 	in_addr_t ip;
 	int i;
 
+	clock_update();
+	timers_init(clock_ms());
 	ip = inet_addr("127.0.0.1");
 	init_users(ip, 29); /* this should result in 5 enabled users */
 
 	for (i = 0; i < 5; i++) {
-		fail_unless(find_available_user() == i);
+		fail_unless(find_available_user(0, 1) == i);
 	}
 
 	for (i = 0; i < USERS; i++) {
-		fail_unless(find_available_user() == -1);
+		fail_unless(find_available_user(0, 1) == -1);
 	}
 
 	users[3].active = 0;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0, 1) == 3);
+	fail_unless(find_available_user(0, 1) == -1);
+
+	/* Session expires when nothing was received for USER_TIMEOUT */
+	for (i = 0; i < 5; i++) {
+		if (i != 3)
+			users[i].last_pkt = clock_ms() + 1000;
+	}
+	timers_run(clock_ms() + USER_TIMEOUT);
+
+	fail_unless(find_available_user(0, 1) == 3);
+	fail_unless(find_available_user(0, 1) == -1);
+}
+END_TEST
+
+START_TEST(test_find_available_user_share)
+{
+	in_addr_t ip;
+
+	clock_update();
+	timers_init(clock_ms());
+	ip = inet_addr("127.0.0.1");
+	init_users(ip, 29); /* 5 users */
+
+	/* Second of two workers takes only odd users */
+	fail_unless(find_available_user(1, 2) == 1);
+	fail_unless(find_available_user(1, 2) == 3);
+	fail_unless(find_available_user(1, 2) == -1);
+
+	fail_unless(find_available_user(0, 2) == 0);
+	fail_unless(find_available_user(0, 2) == 2);
+	fail_unless(find_available_user(0, 2) == 4);
+	fail_unless(find_available_user(0, 2) == -1);
+}
+END_TEST
+
+START_TEST(test_user_expire)
+{
+	in_addr_t ip;
+	uint64_t start;
 
-	users[3].last_pkt = 55;
+	clock_update();
+	start = clock_ms();
+	timers_init(start);
+	ip = inet_addr("127.0.0.1");
+	init_users(ip, 27);
+
+	fail_unless(find_available_user(0, 1) == 0);
+
+	timers_run(start + USER_TIMEOUT - 1);
+	fail_unless(users[0].active);
+
+	/* Packet received later keeps the session alive */
+	users[0].last_pkt = start + 30000;
+	timers_run(start + USER_TIMEOUT);
+	fail_unless(users[0].active);
+
+	timers_run(start + 30000 + USER_TIMEOUT - 1);
+	fail_unless(users[0].active);
+	timers_run(start + 30000 + USER_TIMEOUT);
+	fail_if(users[0].active);
+	fail_unless(find_user_by_ip(users[0].tun_ip) == -1);
+}
+END_TEST
+
+START_TEST(test_user_hold_query)
+{
+	struct query q;
+	in_addr_t ip;
+	int i;
+
+	ip = inet_addr("127.0.0.1");
+	init_users(ip, 27);
+	memset(&q, 0, sizeof(q));
+
+	/* Only in lazy mode with a window */
+	fail_unless(user_held_max(0) == 0);
+	fail_unless(user_hold_query(0, &q, 1000) == -1);
+	users[0].lazy = 1;
+	window_out_init(users[0].downwin, 4);
+	fail_unless(user_held_max(0) == 3);
+
+	for (i = 1; i <= 3; i++) {
+		q.id = i;
+		fail_unless(user_hold_query(0, &q, 1000 + i) == 0);
+	}
+	q.id = 4;
+	fail_unless(user_hold_query(0, &q, 1004) == -1);
+	fail_unless(user_held_expires(0) == 1001);
+
+	/* Oldest first, also around the end of the ring */
+	fail_unless(user_next_held(0, &q) == 1);
+	fail_unless(q.id == 1);
+	q.id = 4;
+	fail_unless(user_hold_query(0, &q, 1004) == 0);
+	for (i = 2; i <= 4; i++) {
+		fail_unless(user_held_expires(0) == 1000 + i);
+		fail_unless(user_next_held(0, &q) == 1);
+		fail_unless(q.id == i);
+	}
+	fail_unless(user_next_held(0, &q) == 0);
+	fail_unless(user_held_expires(0) == 0);
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	/* Released with the packets */
+	fail_unless(user_hold_query(0, &q, 1005) == 0);
+	user_release_packets(0);
+	fail_unless(user_next_held(0, &q) == 0);
 }
 END_TEST
 
@@ -176,10 +392,16 @@ test_user_create_tests()
 
 	tc = tcase_create("User");
 	tcase_add_test(tc, test_init_users);
+	tcase_add_test(tc, test_init_users_sizes);
+	tcase_add_test(tc, test_init_users_wide);
 	tcase_add_test(tc, test_find_user_by_ip);
+	tcase_add_test(tc, test_find_user_by_ip_all);
 	tcase_add_test(tc, test_all_users_waiting_to_send);
 	tcase_add_test(tc, test_find_available_user);
 	tcase_add_test(tc, test_find_available_user_small_net);
+	tcase_add_test(tc, test_find_available_user_share);
+	tcase_add_test(tc, test_user_expire);
+	tcase_add_test(tc, test_user_hold_query);
 
 	return tc;
 }
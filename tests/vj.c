@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vj.h"
+#include "test.h"
+
+static unsigned
+checksum(const unsigned char *p, int len, uint32_t sum)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+static int
+make_packet(char *buf, int proto, unsigned short ipid, uint32_t seq,
+	    uint32_t ack, uint32_t tsval, const char *data, int datalen)
+/* Tun packet with IPv4 and TCP headers with timestamps, 10.0.0.1:1000
+   to 10.0.0.2:22 */
+{
+	unsigned char *ip = (unsigned char *) buf + 4;
+	unsigned char *tcp = ip + 20;
+	unsigned char pseudo[12];
+	int len = 20 + 32 + datalen;
+	unsigned sum;
+
+	memset(buf, 0, 4 + 52);
+	buf[3] = 2;
+	ip[0] = 0x45;
+	ip[2] = len >> 8;
+	ip[3] = len;
+	ip[4] = ipid >> 8;
+	ip[5] = ipid;
+	ip[6] = 0x40;
+	ip[8] = 64;
+	ip[9] = proto;
+	memcpy(ip + 12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+	sum = checksum(ip, 20, 0);
+	ip[10] = sum >> 8;
+	ip[11] = sum;
+
+	tcp[0] = 1000 >> 8;
+	tcp[1] = 1000 & 0xff;
+	tcp[3] = 22;
+	tcp[4] = seq >> 24; tcp[5] = seq >> 16; tcp[6] = seq >> 8; tcp[7] = seq;
+	tcp[8] = ack >> 24; tcp[9] = ack >> 16; tcp[10] = ack >> 8; tcp[11] = ack;
+	tcp[12] = 8 << 4;
+	tcp[13] = 0x10 | (datalen ? 0x08 : 0);
+	tcp[14] = 0x01;
+	tcp[15] = 0xf5;
+	tcp[20] = 1;
+	tcp[21] = 1;
+	tcp[22] = 8;
+	tcp[23] = 10;
+	tcp[24] = tsval >> 24; tcp[25] = tsval >> 16; tcp[26] = tsval >> 8; tcp[27] = tsval;
+	tcp[31] = 0x42;
+	memcpy(tcp + 32, data, datalen);
+
+	memcpy(pseudo, ip + 12, 8);
+	pseudo[8] = 0;
+	pseudo[9] = proto;
+	pseudo[10] = (len - 20) >> 8;
+	pseudo[11] = (len - 20);
+	sum = checksum(pseudo, 12, 0xffff & ~checksum(tcp, len - 20, 0));
+	tcp[16] = sum >> 8;
+	tcp[17] = sum;
+	return 4 + len;
+}
+
+START_TEST(test_vj_roundtrip)
+{
+	struct vj_comp c;
+	struct vj_decomp d;
+	char in[200];
+	char out[200];
+	char back[300];
+	unsigned long outlen;
+	unsigned long backlen;
+	int inlen;
+	int i;
+
+	vj_comp_init(&c, 0);
+	vj_decomp_init(&d);
+
+	for (i = 0; i < 10; i++) {
+		inlen = make_packet(in, 6, 100 + i, 5000 + i * 3, 9000 + i,
+				    77 + i / 2, "ls\n", 3);
+		outlen = sizeof(out);
+		fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 1);
+		if (i == 0)
+			fail_unless(out[0] == VJ_TYPE_FULL);
+		else
+			/* flags, checksum, 3 deltas and the data */
+			fail_unless(outlen <= 1 + 2 + 4 + 3, "%lu bytes", outlen);
+
+		backlen = sizeof(back);
+		fail_unless(vj_uncompress(&d, back, &backlen, out, outlen) == 1);
+		fail_unless(backlen == inlen);
+		fail_unless(memcmp(back + 4, in + 4, inlen - 4) == 0);
+	}
+}
+END_TEST
+
+START_TEST(test_vj_plain)
+{
+	struct vj_comp c;
+	struct vj_decomp d;
+	char in[200];
+	char out[200];
+	unsigned long outlen;
+	int inlen;
+
+	vj_comp_init(&c, 0);
+	vj_decomp_init(&d);
+
+	/* UDP is left alone */
+	inlen = make_packet(in, 17, 1, 1, 1, 1, "x", 1);
+	outlen = sizeof(out);
+	fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 0);
+	fail_unless(vj_uncompress(&d, out, &outlen, in, inlen) == 0);
+
+	/* Short garbage is dropped */
+	outlen = sizeof(out);
+	fail_unless(vj_uncompress(&d, out, &outlen, "\x81", 1) == -1);
+	outlen = sizeof(out);
+	fail_unless(vj_uncompress(&d, out, &outlen, "\x01\x03", 2) == -1);
+}
+END_TEST
+
+START_TEST(test_vj_loss)
+{
+	struct vj_comp c;
+	struct vj_decomp d;
+	char in[200];
+	char out[200];
+	char back[300];
+	unsigned long outlen;
+	unsigned long backlen;
+	int inlen;
+
+	vj_comp_init(&c, 0);
+	vj_decomp_init(&d);
+
+	inlen = make_packet(in, 6, 1, 1000, 1, 1, "abcd", 4);
+	outlen = sizeof(out);
+	vj_compress(&c, out, &outlen, in, inlen);
+	backlen = sizeof(back);
+	fail_unless(vj_uncompress(&d, back, &backlen, out, outlen) == 1);
+
+	/* Lost on the way */
+	inlen = make_packet(in, 6, 2, 1004, 1, 2, "efgh", 4);
+	outlen = sizeof(out);
+	fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 1);
+
+	/* Next one is rebuilt on the wrong base and caught */
+	inlen = make_packet(in, 6, 3, 1008, 1, 3, "ijkl", 4);
+	outlen = sizeof(out);
+	fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 1);
+	fail_unless(out[0] & VJ_TYPE_DELTA);
+	backlen = sizeof(back);
+	fail_unless(vj_uncompress(&d, back, &backlen, out, outlen) == -1);
+
+	/* The retransmit goes in full and brings the receiver back */
+	inlen = make_packet(in, 6, 4, 1004, 1, 4, "efgh", 4);
+	outlen = sizeof(out);
+	fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 1);
+	fail_unless(out[0] == VJ_TYPE_FULL);
+	backlen = sizeof(back);
+	fail_unless(vj_uncompress(&d, back, &backlen, out, outlen) == 1);
+
+	inlen = make_packet(in, 6, 5, 1008, 1, 5, "ijkl", 4);
+	outlen = sizeof(out);
+	fail_unless(vj_compress(&c, out, &outlen, in, inlen) == 1);
+	fail_unless(out[0] & VJ_TYPE_DELTA);
+	backlen = sizeof(back);
+	fail_unless(vj_uncompress(&d, back, &backlen, out, outlen) == 1);
+	fail_unless(memcmp(back + 4, in + 4, inlen - 4) == 0);
+}
+END_TEST
+
+TCase *
+test_vj_create_tests(void)
+{
+	TCase *tc;
+
+	tc = tcase_create("VJ");
+	tcase_add_test(tc, test_vj_roundtrip);
+	tcase_add_test(tc, test_vj_plain);
+	tcase_add_test(tc, test_vj_loss);
+
+	return tc;
+}
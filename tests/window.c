@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2009-2014 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <string.h>
+
+#include "window.h"
+#include "test.h"
+
+static struct window_in in;
+static char inbuf[WINDOW_IN_SIZE(8)];
+
+START_TEST(test_window_in_order)
+{
+	struct window_out out;
+	struct window_frag *f;
+	struct window_frag popped;
+	char *data;
+	int len, compressed, last;
+	int seq;
+	int i;
+
+	window_out_init(&out, 4);
+	window_in_init(&in, inbuf, 8);
+	for (i = 0; i < 4; i++)
+		fail_unless(window_out_add(&out, "abcdef", i, 1, 0, i == 3) == i);
+	fail_unless(window_out_add(&out, "abcdef", 4, 1, 0, 0) == -1);
+
+	for (i = 0; i < 4; i++) {
+		f = window_out_next(&out, 0, 1000, &seq);
+		fail_unless(f != NULL && seq == i);
+		fail_unless(window_in_put(&in, seq, f->data + f->offset, f->len,
+					  f->compressed, f->last) == 1);
+	}
+	fail_unless(window_out_next(&out, 0, 1000, &seq) == NULL);
+
+	for (i = 0; i < 4; i++) {
+		fail_unless(window_in_get(&in, &data, &len, &compressed, &last));
+		fail_unless(len == 1 && *data == 'a' + i && last == (i == 3));
+	}
+	fail_if(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_unless(in.next == 4);
+
+	window_out_ack(&out, in.next, window_in_bitmap(&in));
+	for (i = 0; i < 4; i++)
+		fail_unless(window_out_pop(&out, &popped));
+	fail_if(window_out_pop(&out, &popped));
+	fail_unless(window_out_seq(&out) == 4);
+	fail_unless(window_out_space(&out));
+}
+END_TEST
+
+START_TEST(test_window_loss)
+{
+	struct window_out out;
+	struct window_frag *f;
+	struct window_frag popped;
+	char *data;
+	int len, compressed, last;
+	int seq;
+	int i;
+
+	window_out_init(&out, 4);
+	window_in_init(&in, inbuf, 8);
+	for (i = 0; i < 4; i++)
+		window_out_add(&out, "abcd", i, 1, 0, 0);
+	for (i = 0; i < 4; i++) {
+		f = window_out_next(&out, 0, 1000, &seq);
+		/* Fragment 1 gets lost */
+		if (seq != 1)
+			window_in_put(&in, seq, f->data + f->offset, 1, 0, 0);
+	}
+
+	fail_unless(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_if(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_unless(in.next == 1);
+	fail_unless(window_in_bitmap(&in) == 3);
+
+	window_out_ack(&out, in.next, window_in_bitmap(&in));
+	fail_unless(window_out_pop(&out, &popped));
+	fail_if(window_out_pop(&out, &popped));
+
+	/* Only the lost fragment is sent again, without waiting */
+	f = window_out_next(&out, 0, 1000, &seq);
+	fail_unless(f != NULL && seq == 1);
+	fail_unless(window_out_next(&out, 0, 1000, &seq) == NULL);
+	fail_unless(window_in_put(&in, seq, f->data + f->offset, 1, 0, 1) == 1);
+	fail_unless(window_in_put(&in, 2, "c", 1, 0, 0) == 0);
+	for (i = 1; i < 4; i++) {
+		fail_unless(window_in_get(&in, &data, &len, &compressed, &last));
+		fail_unless(*data == 'a' + i);
+	}
+
+	window_out_ack(&out, in.next, window_in_bitmap(&in));
+	for (i = 1; i < 4; i++)
+		fail_unless(window_out_pop(&out, &popped));
+	fail_unless(out.count == 0);
+}
+END_TEST
+
+START_TEST(test_window_resend)
+{
+	struct window_out out;
+	struct window_frag *f;
+	struct window_frag popped;
+	int seq;
+
+	window_out_init(&out, 2);
+	window_out_add(&out, "ab", 0, 1, 0, 0);
+	window_out_add(&out, "ab", 1, 1, 0, 1);
+	window_out_next(&out, 0, 1000, &seq);
+	window_out_next(&out, 10, 1000, &seq);
+	fail_if(window_out_pending(&out, 999, 1000));
+
+	/* Nothing acked in time, oldest first */
+	f = window_out_next(&out, 1000, 1000, &seq);
+	fail_unless(f != NULL && seq == 0 && f->sent == 2);
+	f = window_out_next(&out, 1010, 1000, &seq);
+	fail_unless(f != NULL && seq == 1 && f->sent == 2);
+
+	/* Old acks do not move the window */
+	window_out_ack(&out, 120, 0);
+	fail_if(window_out_pop(&out, &popped));
+	window_out_ack(&out, 0, 0);
+	fail_if(window_out_pop(&out, &popped));
+
+	window_out_ack(&out, 2, 0);
+	fail_unless(window_out_pop(&out, &popped));
+	fail_unless(window_out_pop(&out, &popped));
+	fail_unless(window_out_seq(&out) == 2);
+
+	/* Numbers wrap */
+	out.base = WINDOW_SEQ - 1;
+	fail_unless(window_out_add(&out, "ab", 0, 1, 0, 0) == WINDOW_SEQ - 1);
+	fail_unless(window_out_add(&out, "ab", 1, 1, 0, 0) == 0);
+	window_out_next(&out, 0, 1000, &seq);
+	window_out_next(&out, 0, 1000, &seq);
+	window_out_ack(&out, 1, 0);
+	fail_unless(window_out_pop(&out, &popped));
+	fail_unless(window_out_pop(&out, &popped));
+	fail_unless(window_out_seq(&out) == 1);
+
+	window_out_add(&out, "ab", 0, 1, 0, 0);
+	fail_unless(window_out_drop(&out, &popped));
+	fail_unless(out.count == 0);
+}
+END_TEST
+
+START_TEST(test_window_in_limits)
+{
+	char *data;
+	int len, compressed, last;
+
+	window_in_init(&in, inbuf, 8);
+	fail_if(window_in_put(&in, WINDOW_MAX, "x", 1, 0, 0));
+	fail_if(window_in_put(&in, WINDOW_SEQ - 1, "x", 1, 0, 0));
+	fail_if(window_in_put(&in, 0, "x", 0, 0, 0));
+	fail_if(window_in_put(&in, 0, "123456789", 9, 0, 0));
+	fail_unless(window_in_put(&in, WINDOW_MAX - 1, "x", 1, 1, 1));
+	fail_unless(window_in_bitmap(&in) == 1 << (WINDOW_MAX - 2));
+
+	window_in_clear(&in);
+	in.next = WINDOW_SEQ - 1;
+	fail_unless(window_in_put(&in, WINDOW_SEQ - 1, "y", 1, 0, 0));
+	fail_unless(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_unless(*data == 'y' && in.next == 0);
+}
+END_TEST
+
+START_TEST(test_window_fec)
+{
+	struct window_out out;
+	struct window_frag *f;
+	struct window_frag popped;
+	char parity[2][8 + 2];
+	char wire[8 + WINDOW_FEC_OVERHEAD];
+	char got[32];
+	char *data;
+	int len, compressed, last;
+	int gotlen = 0;
+	int wirelen;
+	int seq;
+	int i;
+
+	/* A packet of 5 fragments in groups of 3 */
+	window_out_init(&out, 8);
+	window_out_fec(&out, 3);
+	window_in_init(&in, inbuf, 8);
+	window_in_fec(&in, 1);
+	for (i = 0; i < 3; i++) {
+		fail_unless(window_out_space(&out));
+		window_out_add(&out, "abcdefghijklmnopqrstuvwxyz", i * 8, 8, 1, 0);
+	}
+	fail_if(window_out_space(&out));
+	fail_unless(window_out_parity(&out) == 10);
+	fail_unless(window_out_add_parity(&out, parity[0]) == 3);
+	fail_unless(window_out_space(&out));
+	window_out_add(&out, "abcdefghijklmnopqrstuvwxyz", 24, 1, 1, 0);
+	window_out_add(&out, "abcdefghijklmnopqrstuvwxyz", 25, 1, 1, 1);
+	fail_unless(window_out_parity(&out) == 3);
+	fail_unless(window_out_add_parity(&out, parity[1]) == 6);
+	fail_unless(window_out_parity(&out) == 0 && out.count == 7);
+
+	for (i = 0; i < 7; i++) {
+		f = window_out_next(&out, 0, 1000, &seq);
+		fail_unless(f != NULL && seq == i);
+		fail_unless(f->parity == (i == 3 ? 3 : i == 6 ? 2 : 0));
+		wirelen = window_out_copy(&out, f, wire);
+		fail_unless(wirelen == f->len + 1);
+		/* The second fragment and the last parity get lost */
+		if (seq == 1 || seq == 6)
+			continue;
+		fail_unless(window_in_put(&in, seq, wire, wirelen,
+					  f->compressed, f->last) == 1);
+		while (window_in_get(&in, &data, &len, &compressed, &last)) {
+			fail_unless(compressed == 1);
+			fail_unless(last == (gotlen + len == 26));
+			memcpy(got + gotlen, data, len);
+			gotlen += len;
+		}
+	}
+	fail_unless(in.rebuilt == 1);
+	fail_unless(gotlen == 26 && !memcmp(got, "abcdefghijklmnopqrstuvwxyz", 26));
+
+	/* The missing parity is not waited for, and all is acked */
+	fail_unless(in.next == 7 && window_in_bitmap(&in) == 0);
+	window_out_ack(&out, in.next, window_in_bitmap(&in));
+	for (i = 0; i < 7; i++)
+		fail_unless(window_out_pop(&out, &popped));
+	fail_unless(out.count == 0);
+
+	/* A packet of one fragment gets no parity */
+	window_out_add(&out, "abc", 0, 3, 0, 1);
+	fail_unless(window_out_parity(&out) == 0);
+	fail_unless(!out.frag[7].closes && window_out_space(&out));
+
+	/* Two lost in a group cannot be rebuilt */
+	window_in_clear(&in);
+	window_in_put(&in, 0, "\0a", 2, 0, 0);
+	window_in_put(&in, 3, "\x83\0\1xyz", 6, 0, 0);
+	fail_unless(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_if(window_in_get(&in, &data, &len, &compressed, &last));
+	fail_unless(in.rebuilt == 1);
+}
+END_TEST
+
+TCase *
+test_window_create_tests(void)
+{
+	TCase *tc;
+
+	tc = tcase_create("Window");
+	tcase_add_test(tc, test_window_in_order);
+	tcase_add_test(tc, test_window_loss);
+	tcase_add_test(tc, test_window_resend);
+	tcase_add_test(tc, test_window_in_limits);
+	tcase_add_test(tc, test_window_fec);
+
+	return tc;
+}